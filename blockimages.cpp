@@ -78,7 +78,10 @@ bool BlockImages::create(int B, const string& imgpath)
 		if (img.w == w && img.h == h && biversion == NUMBLOCKIMAGES)
 		{
 			retouchAlphas(B);
+			addWaterImages(B);
 			checkOpacityAndTransparency(B);
+			computeRowData(B);
+			setBlockInfos();
 			return true;
 		}
 		// if it's a previous version (and the correct size for that version), we'll
@@ -129,7 +132,10 @@ bool BlockImages::create(int B, const string& imgpath)
 	writeBlockImagesVersion(B, imgpath, NUMBLOCKIMAGES);
 
 	retouchAlphas(B);
+	addWaterImages(B);
 	checkOpacityAndTransparency(B);
+	computeRowData(B);
+	setBlockInfos();
 	return true;
 }
 
@@ -1449,15 +1455,15 @@ int offsetIdx(uint16_t blockID, uint8_t blockData)
 
 void setOffsetsForID(uint16_t blockID, int offset, BlockImages& bi)
 {
-	int start = blockID * 16;
-	int end = start + 16;
-	fill(bi.blockOffsets + start, bi.blockOffsets + end, offset);
+	for (int i = blockID * 16; i < blockID * 16 + 16; i++)
+		bi.blockInfos[i].offset = offset;
 }
 
 void BlockImages::setOffsets()
 {
 	// default is the dummy image
-	fill(blockOffsets, blockOffsets + 4096*16, 0);
+	for (int i = 0; i < 4096*16; i++)
+		blockInfos[i].offset = 0;
 
 	//!!!!!! might want to use darker redstone wire for lower strength, just for some visual variety?
 
@@ -1466,165 +1472,165 @@ void BlockImages::setOffsets()
 	setOffsetsForID(3, 3, *this);
 	setOffsetsForID(4, 4, *this);
 	setOffsetsForID(5, 5, *this);
-	blockOffsets[offsetIdx(5, 1)] = 435;
-	blockOffsets[offsetIdx(5, 2)] = 436;
-	blockOffsets[offsetIdx(5, 3)] = 437;
+	blockInfos[offsetIdx(5, 1)].offset = 435;
+	blockInfos[offsetIdx(5, 2)].offset = 436;
+	blockInfos[offsetIdx(5, 3)].offset = 437;
 	setOffsetsForID(6, 6, *this);
-	blockOffsets[offsetIdx(6, 1)] = 250;
-	blockOffsets[offsetIdx(6, 5)] = 250;
-	blockOffsets[offsetIdx(6, 9)] = 250;
-	blockOffsets[offsetIdx(6, 13)] = 250;
-	blockOffsets[offsetIdx(6, 2)] = 251;
-	blockOffsets[offsetIdx(6, 6)] = 251;
-	blockOffsets[offsetIdx(6, 10)] = 251;
-	blockOffsets[offsetIdx(6, 14)] = 251;
-	blockOffsets[offsetIdx(6, 3)] = 429;
-	blockOffsets[offsetIdx(6, 7)] = 429;
-	blockOffsets[offsetIdx(6, 11)] = 429;
-	blockOffsets[offsetIdx(6, 15)] = 429;
+	blockInfos[offsetIdx(6, 1)].offset = 250;
+	blockInfos[offsetIdx(6, 5)].offset = 250;
+	blockInfos[offsetIdx(6, 9)].offset = 250;
+	blockInfos[offsetIdx(6, 13)].offset = 250;
+	blockInfos[offsetIdx(6, 2)].offset = 251;
+	blockInfos[offsetIdx(6, 6)].offset = 251;
+	blockInfos[offsetIdx(6, 10)].offset = 251;
+	blockInfos[offsetIdx(6, 14)].offset = 251;
+	blockInfos[offsetIdx(6, 3)].offset = 429;
+	blockInfos[offsetIdx(6, 7)].offset = 429;
+	blockInfos[offsetIdx(6, 11)].offset = 429;
+	blockInfos[offsetIdx(6, 15)].offset = 429;
 	setOffsetsForID(7, 7, *this);
 	setOffsetsForID(8, 8, *this);
-	blockOffsets[offsetIdx(8, 1)] = 9;
-	blockOffsets[offsetIdx(8, 2)] = 10;
-	blockOffsets[offsetIdx(8, 3)] = 11;
-	blockOffsets[offsetIdx(8, 4)] = 12;
-	blockOffsets[offsetIdx(8, 5)] = 13;
-	blockOffsets[offsetIdx(8, 6)] = 14;
-	blockOffsets[offsetIdx(8, 7)] = 15;
+	blockInfos[offsetIdx(8, 1)].offset = 9;
+	blockInfos[offsetIdx(8, 2)].offset = 10;
+	blockInfos[offsetIdx(8, 3)].offset = 11;
+	blockInfos[offsetIdx(8, 4)].offset = 12;
+	blockInfos[offsetIdx(8, 5)].offset = 13;
+	blockInfos[offsetIdx(8, 6)].offset = 14;
+	blockInfos[offsetIdx(8, 7)].offset = 15;
 	setOffsetsForID(9, 8, *this);
-	blockOffsets[offsetIdx(9, 1)] = 9;
-	blockOffsets[offsetIdx(9, 2)] = 10;
-	blockOffsets[offsetIdx(9, 3)] = 11;
-	blockOffsets[offsetIdx(9, 4)] = 12;
-	blockOffsets[offsetIdx(9, 5)] = 13;
-	blockOffsets[offsetIdx(9, 6)] = 14;
-	blockOffsets[offsetIdx(9, 7)] = 15;
+	blockInfos[offsetIdx(9, 1)].offset = 9;
+	blockInfos[offsetIdx(9, 2)].offset = 10;
+	blockInfos[offsetIdx(9, 3)].offset = 11;
+	blockInfos[offsetIdx(9, 4)].offset = 12;
+	blockInfos[offsetIdx(9, 5)].offset = 13;
+	blockInfos[offsetIdx(9, 6)].offset = 14;
+	blockInfos[offsetIdx(9, 7)].offset = 15;
 	setOffsetsForID(10, 16, *this);
-	blockOffsets[offsetIdx(10, 6)] = 19;
-	blockOffsets[offsetIdx(10, 4)] = 18;
-	blockOffsets[offsetIdx(10, 2)] = 17;
+	blockInfos[offsetIdx(10, 6)].offset = 19;
+	blockInfos[offsetIdx(10, 4)].offset = 18;
+	blockInfos[offsetIdx(10, 2)].offset = 17;
 	setOffsetsForID(11, 16, *this);
-	blockOffsets[offsetIdx(11, 6)] = 19;
-	blockOffsets[offsetIdx(11, 4)] = 18;
-	blockOffsets[offsetIdx(11, 2)] = 17;
+	blockInfos[offsetIdx(11, 6)].offset = 19;
+	blockInfos[offsetIdx(11, 4)].offset = 18;
+	blockInfos[offsetIdx(11, 2)].offset = 17;
 	setOffsetsForID(12, 20, *this);
 	setOffsetsForID(13, 483, *this);
 	setOffsetsForID(14, 22, *this);
 	setOffsetsForID(15, 23, *this);
 	setOffsetsForID(16, 24, *this);
 	setOffsetsForID(17, 25, *this);
-	blockOffsets[offsetIdx(17, 1)] = 219;
-	blockOffsets[offsetIdx(17, 2)] = 220;
-	blockOffsets[offsetIdx(17, 3)] = 427;
-	blockOffsets[offsetIdx(17, 4)] = 532;
-	blockOffsets[offsetIdx(17, 5)] = 534;
-	blockOffsets[offsetIdx(17, 6)] = 536;
-	blockOffsets[offsetIdx(17, 7)] = 538;
-	blockOffsets[offsetIdx(17, 8)] = 531;
-	blockOffsets[offsetIdx(17, 9)] = 533;
-	blockOffsets[offsetIdx(17, 10)] = 535;
-	blockOffsets[offsetIdx(17, 11)] = 537;
+	blockInfos[offsetIdx(17, 1)].offset = 219;
+	blockInfos[offsetIdx(17, 2)].offset = 220;
+	blockInfos[offsetIdx(17, 3)].offset = 427;
+	blockInfos[offsetIdx(17, 4)].offset = 532;
+	blockInfos[offsetIdx(17, 5)].offset = 534;
+	blockInfos[offsetIdx(17, 6)].offset = 536;
+	blockInfos[offsetIdx(17, 7)].offset = 538;
+	blockInfos[offsetIdx(17, 8)].offset = 531;
+	blockInfos[offsetIdx(17, 9)].offset = 533;
+	blockInfos[offsetIdx(17, 10)].offset = 535;
+	blockInfos[offsetIdx(17, 11)].offset = 537;
 	setOffsetsForID(18, 26, *this);
-	blockOffsets[offsetIdx(18, 1)] = 248;
-	blockOffsets[offsetIdx(18, 5)] = 248;
-	blockOffsets[offsetIdx(18, 9)] = 248;
-	blockOffsets[offsetIdx(18, 13)] = 248;
-	blockOffsets[offsetIdx(18, 2)] = 249;
-	blockOffsets[offsetIdx(18, 6)] = 249;
-	blockOffsets[offsetIdx(18, 10)] = 249;
-	blockOffsets[offsetIdx(18, 14)] = 249;
-	blockOffsets[offsetIdx(18, 3)] = 428;
-	blockOffsets[offsetIdx(18, 7)] = 428;
-	blockOffsets[offsetIdx(18, 11)] = 428;
-	blockOffsets[offsetIdx(18, 15)] = 428;
+	blockInfos[offsetIdx(18, 1)].offset = 248;
+	blockInfos[offsetIdx(18, 5)].offset = 248;
+	blockInfos[offsetIdx(18, 9)].offset = 248;
+	blockInfos[offsetIdx(18, 13)].offset = 248;
+	blockInfos[offsetIdx(18, 2)].offset = 249;
+	blockInfos[offsetIdx(18, 6)].offset = 249;
+	blockInfos[offsetIdx(18, 10)].offset = 249;
+	blockInfos[offsetIdx(18, 14)].offset = 249;
+	blockInfos[offsetIdx(18, 3)].offset = 428;
+	blockInfos[offsetIdx(18, 7)].offset = 428;
+	blockInfos[offsetIdx(18, 11)].offset = 428;
+	blockInfos[offsetIdx(18, 15)].offset = 428;
 	setOffsetsForID(19, 27, *this);
 	setOffsetsForID(20, 28, *this);
 	setOffsetsForID(21, 221, *this);
 	setOffsetsForID(22, 222, *this);
 	setOffsetsForID(23, 223, *this);
-	blockOffsets[offsetIdx(23, 2)] = 225;
-	blockOffsets[offsetIdx(23, 4)] = 224;
-	blockOffsets[offsetIdx(23, 5)] = 225;
+	blockInfos[offsetIdx(23, 2)].offset = 225;
+	blockInfos[offsetIdx(23, 4)].offset = 224;
+	blockInfos[offsetIdx(23, 5)].offset = 225;
 	setOffsetsForID(24, 226, *this);
-	blockOffsets[offsetIdx(24, 1)] = 431;
-	blockOffsets[offsetIdx(24, 2)] = 432;
+	blockInfos[offsetIdx(24, 1)].offset = 431;
+	blockInfos[offsetIdx(24, 2)].offset = 432;
 	setOffsetsForID(25, 227, *this);
 	setOffsetsForID(26, 285, *this);
-	blockOffsets[offsetIdx(26, 1)] = 286;
-	blockOffsets[offsetIdx(26, 5)] = 286;
-	blockOffsets[offsetIdx(26, 2)] = 287;
-	blockOffsets[offsetIdx(26, 6)] = 287;
-	blockOffsets[offsetIdx(26, 3)] = 288;
-	blockOffsets[offsetIdx(26, 7)] = 288;
-	blockOffsets[offsetIdx(26, 8)] = 281;
-	blockOffsets[offsetIdx(26, 12)] = 281;
-	blockOffsets[offsetIdx(26, 9)] = 282;
-	blockOffsets[offsetIdx(26, 13)] = 282;
-	blockOffsets[offsetIdx(26, 10)] = 283;
-	blockOffsets[offsetIdx(26, 14)] = 283;
-	blockOffsets[offsetIdx(26, 11)] = 284;
-	blockOffsets[offsetIdx(26, 15)] = 284;
+	blockInfos[offsetIdx(26, 1)].offset = 286;
+	blockInfos[offsetIdx(26, 5)].offset = 286;
+	blockInfos[offsetIdx(26, 2)].offset = 287;
+	blockInfos[offsetIdx(26, 6)].offset = 287;
+	blockInfos[offsetIdx(26, 3)].offset = 288;
+	blockInfos[offsetIdx(26, 7)].offset = 288;
+	blockInfos[offsetIdx(26, 8)].offset = 281;
+	blockInfos[offsetIdx(26, 12)].offset = 281;
+	blockInfos[offsetIdx(26, 9)].offset = 282;
+	blockInfos[offsetIdx(26, 13)].offset = 282;
+	blockInfos[offsetIdx(26, 10)].offset = 283;
+	blockInfos[offsetIdx(26, 14)].offset = 283;
+	blockInfos[offsetIdx(26, 11)].offset = 284;
+	blockInfos[offsetIdx(26, 15)].offset = 284;
 	setOffsetsForID(27, 258, *this);
-	blockOffsets[offsetIdx(27, 1)] = 259;
-	blockOffsets[offsetIdx(27, 2)] = 260;
-	blockOffsets[offsetIdx(27, 3)] = 261;
-	blockOffsets[offsetIdx(27, 4)] = 262;
-	blockOffsets[offsetIdx(27, 5)] = 263;
-	blockOffsets[offsetIdx(27, 8)] = 252;
-	blockOffsets[offsetIdx(27, 9)] = 253;
-	blockOffsets[offsetIdx(27, 10)] = 254;
-	blockOffsets[offsetIdx(27, 11)] = 255;
-	blockOffsets[offsetIdx(27, 12)] = 256;
-	blockOffsets[offsetIdx(27, 13)] = 257;
+	blockInfos[offsetIdx(27, 1)].offset = 259;
+	blockInfos[offsetIdx(27, 2)].offset = 260;
+	blockInfos[offsetIdx(27, 3)].offset = 261;
+	blockInfos[offsetIdx(27, 4)].offset = 262;
+	blockInfos[offsetIdx(27, 5)].offset = 263;
+	blockInfos[offsetIdx(27, 8)].offset = 252;
+	blockInfos[offsetIdx(27, 9)].offset = 253;
+	blockInfos[offsetIdx(27, 10)].offset = 254;
+	blockInfos[offsetIdx(27, 11)].offset = 255;
+	blockInfos[offsetIdx(27, 12)].offset = 256;
+	blockInfos[offsetIdx(27, 13)].offset = 257;
 	setOffsetsForID(28, 264, *this);
-	blockOffsets[offsetIdx(28, 1)] = 265;
-	blockOffsets[offsetIdx(28, 2)] = 266;
-	blockOffsets[offsetIdx(28, 3)] = 267;
-	blockOffsets[offsetIdx(28, 4)] = 268;
-	blockOffsets[offsetIdx(28, 5)] = 269;
+	blockInfos[offsetIdx(28, 1)].offset = 265;
+	blockInfos[offsetIdx(28, 2)].offset = 266;
+	blockInfos[offsetIdx(28, 3)].offset = 267;
+	blockInfos[offsetIdx(28, 4)].offset = 268;
+	blockInfos[offsetIdx(28, 5)].offset = 269;
 	setOffsetsForID(29, 413, *this);
-	blockOffsets[offsetIdx(29, 1)] = 414;
-	blockOffsets[offsetIdx(29, 9)] = 414;
-	blockOffsets[offsetIdx(29, 4)] = 415;
-	blockOffsets[offsetIdx(29, 12)] = 415;
-	blockOffsets[offsetIdx(29, 5)] = 416;
-	blockOffsets[offsetIdx(29, 13)] = 416;
-	blockOffsets[offsetIdx(29, 3)] = 417;
-	blockOffsets[offsetIdx(29, 11)] = 417;
-	blockOffsets[offsetIdx(29, 2)] = 418;
-	blockOffsets[offsetIdx(29, 10)] = 418;
+	blockInfos[offsetIdx(29, 1)].offset = 414;
+	blockInfos[offsetIdx(29, 9)].offset = 414;
+	blockInfos[offsetIdx(29, 4)].offset = 415;
+	blockInfos[offsetIdx(29, 12)].offset = 415;
+	blockInfos[offsetIdx(29, 5)].offset = 416;
+	blockInfos[offsetIdx(29, 13)].offset = 416;
+	blockInfos[offsetIdx(29, 3)].offset = 417;
+	blockInfos[offsetIdx(29, 11)].offset = 417;
+	blockInfos[offsetIdx(29, 2)].offset = 418;
+	blockInfos[offsetIdx(29, 10)].offset = 418;
 	setOffsetsForID(30, 272, *this);
 	setOffsetsForID(31, 273, *this);
-	blockOffsets[offsetIdx(31, 0)] = 275;
-	blockOffsets[offsetIdx(31, 2)] = 274;
+	blockInfos[offsetIdx(31, 0)].offset = 275;
+	blockInfos[offsetIdx(31, 2)].offset = 274;
 	setOffsetsForID(32, 275, *this);
 	setOffsetsForID(33, 407, *this);
-	blockOffsets[offsetIdx(33, 1)] = 408;
-	blockOffsets[offsetIdx(33, 9)] = 408;
-	blockOffsets[offsetIdx(33, 4)] = 409;
-	blockOffsets[offsetIdx(33, 12)] = 409;
-	blockOffsets[offsetIdx(33, 5)] = 410;
-	blockOffsets[offsetIdx(33, 13)] = 410;
-	blockOffsets[offsetIdx(33, 3)] = 411;
-	blockOffsets[offsetIdx(33, 11)] = 411;
-	blockOffsets[offsetIdx(33, 2)] = 412;
-	blockOffsets[offsetIdx(33, 10)] = 412;
-	blockOffsets[offsetIdx(35, 0)] = 29;
-	blockOffsets[offsetIdx(35, 1)] = 204;
-	blockOffsets[offsetIdx(35, 2)] = 205;
-	blockOffsets[offsetIdx(35, 3)] = 206;
-	blockOffsets[offsetIdx(35, 4)] = 207;
-	blockOffsets[offsetIdx(35, 5)] = 208;
-	blockOffsets[offsetIdx(35, 6)] = 209;
-	blockOffsets[offsetIdx(35, 7)] = 210;
-	blockOffsets[offsetIdx(35, 8)] = 211;
-	blockOffsets[offsetIdx(35, 9)] = 212;
-	blockOffsets[offsetIdx(35, 10)] = 213;
-	blockOffsets[offsetIdx(35, 11)] = 214;
-	blockOffsets[offsetIdx(35, 12)] = 215;
-	blockOffsets[offsetIdx(35, 13)] = 216;
-	blockOffsets[offsetIdx(35, 14)] = 217;
-	blockOffsets[offsetIdx(35, 15)] = 218;
+	blockInfos[offsetIdx(33, 1)].offset = 408;
+	blockInfos[offsetIdx(33, 9)].offset = 408;
+	blockInfos[offsetIdx(33, 4)].offset = 409;
+	blockInfos[offsetIdx(33, 12)].offset = 409;
+	blockInfos[offsetIdx(33, 5)].offset = 410;
+	blockInfos[offsetIdx(33, 13)].offset = 410;
+	blockInfos[offsetIdx(33, 3)].offset = 411;
+	blockInfos[offsetIdx(33, 11)].offset = 411;
+	blockInfos[offsetIdx(33, 2)].offset = 412;
+	blockInfos[offsetIdx(33, 10)].offset = 412;
+	blockInfos[offsetIdx(35, 0)].offset = 29;
+	blockInfos[offsetIdx(35, 1)].offset = 204;
+	blockInfos[offsetIdx(35, 2)].offset = 205;
+	blockInfos[offsetIdx(35, 3)].offset = 206;
+	blockInfos[offsetIdx(35, 4)].offset = 207;
+	blockInfos[offsetIdx(35, 5)].offset = 208;
+	blockInfos[offsetIdx(35, 6)].offset = 209;
+	blockInfos[offsetIdx(35, 7)].offset = 210;
+	blockInfos[offsetIdx(35, 8)].offset = 211;
+	blockInfos[offsetIdx(35, 9)].offset = 212;
+	blockInfos[offsetIdx(35, 10)].offset = 213;
+	blockInfos[offsetIdx(35, 11)].offset = 214;
+	blockInfos[offsetIdx(35, 12)].offset = 215;
+	blockInfos[offsetIdx(35, 13)].offset = 216;
+	blockInfos[offsetIdx(35, 14)].offset = 217;
+	blockInfos[offsetIdx(35, 15)].offset = 218;
 	setOffsetsForID(37, 30, *this);
 	setOffsetsForID(38, 31, *this);
 	setOffsetsForID(39, 32, *this);
@@ -1632,141 +1638,141 @@ void BlockImages::setOffsets()
 	setOffsetsForID(41, 34, *this);
 	setOffsetsForID(42, 35, *this);
 	setOffsetsForID(43, 36, *this);
-	blockOffsets[offsetIdx(43, 1)] = 226;
-	blockOffsets[offsetIdx(43, 2)] = 5;
-	blockOffsets[offsetIdx(43, 3)] = 4;
-	blockOffsets[offsetIdx(43, 4)] = 38;
-	blockOffsets[offsetIdx(43, 5)] = 294;
+	blockInfos[offsetIdx(43, 1)].offset = 226;
+	blockInfos[offsetIdx(43, 2)].offset = 5;
+	blockInfos[offsetIdx(43, 3)].offset = 4;
+	blockInfos[offsetIdx(43, 4)].offset = 38;
+	blockInfos[offsetIdx(43, 5)].offset = 294;
 	setOffsetsForID(44, 37, *this);
-	blockOffsets[offsetIdx(44, 1)] = 229;
-	blockOffsets[offsetIdx(44, 2)] = 230;
-	blockOffsets[offsetIdx(44, 3)] = 231;
-	blockOffsets[offsetIdx(44, 4)] = 302;
-	blockOffsets[offsetIdx(44, 5)] = 303;
-	blockOffsets[offsetIdx(44, 8)] = 458;
-	blockOffsets[offsetIdx(44, 9)] = 459;
-	blockOffsets[offsetIdx(44, 10)] = 460;
-	blockOffsets[offsetIdx(44, 11)] = 461;
-	blockOffsets[offsetIdx(44, 12)] = 462;
-	blockOffsets[offsetIdx(44, 13)] = 463;
+	blockInfos[offsetIdx(44, 1)].offset = 229;
+	blockInfos[offsetIdx(44, 2)].offset = 230;
+	blockInfos[offsetIdx(44, 3)].offset = 231;
+	blockInfos[offsetIdx(44, 4)].offset = 302;
+	blockInfos[offsetIdx(44, 5)].offset = 303;
+	blockInfos[offsetIdx(44, 8)].offset = 458;
+	blockInfos[offsetIdx(44, 9)].offset = 459;
+	blockInfos[offsetIdx(44, 10)].offset = 460;
+	blockInfos[offsetIdx(44, 11)].offset = 461;
+	blockInfos[offsetIdx(44, 12)].offset = 462;
+	blockInfos[offsetIdx(44, 13)].offset = 463;
 	setOffsetsForID(45, 38, *this);
 	setOffsetsForID(46, 39, *this);
 	setOffsetsForID(47, 40, *this);
 	setOffsetsForID(48, 41, *this);
 	setOffsetsForID(49, 42, *this);
 	setOffsetsForID(50, 43, *this);
-	blockOffsets[offsetIdx(50, 1)] = 44;
-	blockOffsets[offsetIdx(50, 2)] = 45;
-	blockOffsets[offsetIdx(50, 3)] = 46;
-	blockOffsets[offsetIdx(50, 4)] = 47;
+	blockInfos[offsetIdx(50, 1)].offset = 44;
+	blockInfos[offsetIdx(50, 2)].offset = 45;
+	blockInfos[offsetIdx(50, 3)].offset = 46;
+	blockInfos[offsetIdx(50, 4)].offset = 47;
 	setOffsetsForID(51, 189, *this);
 	setOffsetsForID(52, 49, *this);
 	setOffsetsForID(53, 50, *this);
-	blockOffsets[offsetIdx(53, 1)] = 51;
-	blockOffsets[offsetIdx(53, 2)] = 52;
-	blockOffsets[offsetIdx(53, 3)] = 53;
-	blockOffsets[offsetIdx(53, 4)] = 438;
-	blockOffsets[offsetIdx(53, 5)] = 439;
-	blockOffsets[offsetIdx(53, 6)] = 440;
-	blockOffsets[offsetIdx(53, 7)] = 441;
+	blockInfos[offsetIdx(53, 1)].offset = 51;
+	blockInfos[offsetIdx(53, 2)].offset = 52;
+	blockInfos[offsetIdx(53, 3)].offset = 53;
+	blockInfos[offsetIdx(53, 4)].offset = 438;
+	blockInfos[offsetIdx(53, 5)].offset = 439;
+	blockInfos[offsetIdx(53, 6)].offset = 440;
+	blockInfos[offsetIdx(53, 7)].offset = 441;
 	setOffsetsForID(54, 484, *this);
-	blockOffsets[offsetIdx(54, 4)] = 485;
-	blockOffsets[offsetIdx(54, 2)] = 486;
-	blockOffsets[offsetIdx(54, 5)] = 486;
+	blockInfos[offsetIdx(54, 4)].offset = 485;
+	blockInfos[offsetIdx(54, 2)].offset = 486;
+	blockInfos[offsetIdx(54, 5)].offset = 486;
 	setOffsetsForID(55, 55, *this);
 	setOffsetsForID(56, 56, *this);
 	setOffsetsForID(57, 57, *this);
 	setOffsetsForID(58, 58, *this);
 	setOffsetsForID(59, 59, *this);
-	blockOffsets[offsetIdx(59, 6)] = 60;
-	blockOffsets[offsetIdx(59, 5)] = 61;
-	blockOffsets[offsetIdx(59, 4)] = 62;
-	blockOffsets[offsetIdx(59, 3)] = 63;
-	blockOffsets[offsetIdx(59, 2)] = 64;
-	blockOffsets[offsetIdx(59, 1)] = 65;
-	blockOffsets[offsetIdx(59, 0)] = 66;
+	blockInfos[offsetIdx(59, 6)].offset = 60;
+	blockInfos[offsetIdx(59, 5)].offset = 61;
+	blockInfos[offsetIdx(59, 4)].offset = 62;
+	blockInfos[offsetIdx(59, 3)].offset = 63;
+	blockInfos[offsetIdx(59, 2)].offset = 64;
+	blockInfos[offsetIdx(59, 1)].offset = 65;
+	blockInfos[offsetIdx(59, 0)].offset = 66;
 	setOffsetsForID(60, 67, *this);
 	setOffsetsForID(61, 183, *this);
-	blockOffsets[offsetIdx(61, 2)] = 185;
-	blockOffsets[offsetIdx(61, 4)] = 184;
-	blockOffsets[offsetIdx(61, 5)] = 185;
+	blockInfos[offsetIdx(61, 2)].offset = 185;
+	blockInfos[offsetIdx(61, 4)].offset = 184;
+	blockInfos[offsetIdx(61, 5)].offset = 185;
 	setOffsetsForID(62, 186, *this);
-	blockOffsets[offsetIdx(62, 2)] = 188;
-	blockOffsets[offsetIdx(62, 4)] = 187;
-	blockOffsets[offsetIdx(62, 5)] = 188;
+	blockInfos[offsetIdx(62, 2)].offset = 188;
+	blockInfos[offsetIdx(62, 4)].offset = 187;
+	blockInfos[offsetIdx(62, 5)].offset = 188;
 	setOffsetsForID(63, 73, *this);
-	blockOffsets[offsetIdx(63, 0)] = 72;
-	blockOffsets[offsetIdx(63, 1)] = 72;
-	blockOffsets[offsetIdx(63, 4)] = 70;
-	blockOffsets[offsetIdx(63, 5)] = 70;
-	blockOffsets[offsetIdx(63, 6)] = 71;
-	blockOffsets[offsetIdx(63, 7)] = 71;
-	blockOffsets[offsetIdx(63, 8)] = 72;
-	blockOffsets[offsetIdx(63, 9)] = 72;
-	blockOffsets[offsetIdx(63, 12)] = 70;
-	blockOffsets[offsetIdx(63, 13)] = 70;
-	blockOffsets[offsetIdx(63, 14)] = 71;
-	blockOffsets[offsetIdx(63, 15)] = 71;
+	blockInfos[offsetIdx(63, 0)].offset = 72;
+	blockInfos[offsetIdx(63, 1)].offset = 72;
+	blockInfos[offsetIdx(63, 4)].offset = 70;
+	blockInfos[offsetIdx(63, 5)].offset = 70;
+	blockInfos[offsetIdx(63, 6)].offset = 71;
+	blockInfos[offsetIdx(63, 7)].offset = 71;
+	blockInfos[offsetIdx(63, 8)].offset = 72;
+	blockInfos[offsetIdx(63, 9)].offset = 72;
+	blockInfos[offsetIdx(63, 12)].offset = 70;
+	blockInfos[offsetIdx(63, 13)].offset = 70;
+	blockInfos[offsetIdx(63, 14)].offset = 71;
+	blockInfos[offsetIdx(63, 15)].offset = 71;
 	setOffsetsForID(64, 74, *this);
 	setOffsetsForID(65, 82, *this);
-	blockOffsets[offsetIdx(65, 3)] = 83;
-	blockOffsets[offsetIdx(65, 4)] = 84;
-	blockOffsets[offsetIdx(65, 5)] = 85;
+	blockInfos[offsetIdx(65, 3)].offset = 83;
+	blockInfos[offsetIdx(65, 4)].offset = 84;
+	blockInfos[offsetIdx(65, 5)].offset = 85;
 	setOffsetsForID(66, 86, *this);
-	blockOffsets[offsetIdx(66, 1)] = 87;
-	blockOffsets[offsetIdx(66, 2)] = 200;
-	blockOffsets[offsetIdx(66, 3)] = 201;
-	blockOffsets[offsetIdx(66, 4)] = 202;
-	blockOffsets[offsetIdx(66, 5)] = 203;
-	blockOffsets[offsetIdx(66, 6)] = 92;
-	blockOffsets[offsetIdx(66, 7)] = 93;
-	blockOffsets[offsetIdx(66, 8)] = 94;
-	blockOffsets[offsetIdx(66, 9)] = 95;
+	blockInfos[offsetIdx(66, 1)].offset = 87;
+	blockInfos[offsetIdx(66, 2)].offset = 200;
+	blockInfos[offsetIdx(66, 3)].offset = 201;
+	blockInfos[offsetIdx(66, 4)].offset = 202;
+	blockInfos[offsetIdx(66, 5)].offset = 203;
+	blockInfos[offsetIdx(66, 6)].offset = 92;
+	blockInfos[offsetIdx(66, 7)].offset = 93;
+	blockInfos[offsetIdx(66, 8)].offset = 94;
+	blockInfos[offsetIdx(66, 9)].offset = 95;
 	setOffsetsForID(67, 96, *this);
-	blockOffsets[offsetIdx(67, 1)] = 97;
-	blockOffsets[offsetIdx(67, 2)] = 98;
-	blockOffsets[offsetIdx(67, 3)] = 99;
-	blockOffsets[offsetIdx(67, 4)] = 442;
-	blockOffsets[offsetIdx(67, 5)] = 443;
-	blockOffsets[offsetIdx(67, 6)] = 444;
-	blockOffsets[offsetIdx(67, 7)] = 445;
+	blockInfos[offsetIdx(67, 1)].offset = 97;
+	blockInfos[offsetIdx(67, 2)].offset = 98;
+	blockInfos[offsetIdx(67, 3)].offset = 99;
+	blockInfos[offsetIdx(67, 4)].offset = 442;
+	blockInfos[offsetIdx(67, 5)].offset = 443;
+	blockInfos[offsetIdx(67, 6)].offset = 444;
+	blockInfos[offsetIdx(67, 7)].offset = 445;
 	setOffsetsForID(68, 100, *this);
-	blockOffsets[offsetIdx(68, 3)] = 101;
-	blockOffsets[offsetIdx(68, 4)] = 102;
-	blockOffsets[offsetIdx(68, 5)] = 103;
+	blockInfos[offsetIdx(68, 3)].offset = 101;
+	blockInfos[offsetIdx(68, 4)].offset = 102;
+	blockInfos[offsetIdx(68, 5)].offset = 103;
 	setOffsetsForID(69, 194, *this);
-	blockOffsets[offsetIdx(69, 2)] = 195;
-	blockOffsets[offsetIdx(69, 3)] = 196;
-	blockOffsets[offsetIdx(69, 4)] = 197;
-	blockOffsets[offsetIdx(69, 5)] = 198;
-	blockOffsets[offsetIdx(69, 6)] = 199;
-	blockOffsets[offsetIdx(69, 10)] = 195;
-	blockOffsets[offsetIdx(69, 11)] = 196;
-	blockOffsets[offsetIdx(69, 12)] = 197;
-	blockOffsets[offsetIdx(69, 13)] = 198;
-	blockOffsets[offsetIdx(69, 14)] = 199;
+	blockInfos[offsetIdx(69, 2)].offset = 195;
+	blockInfos[offsetIdx(69, 3)].offset = 196;
+	blockInfos[offsetIdx(69, 4)].offset = 197;
+	blockInfos[offsetIdx(69, 5)].offset = 198;
+	blockInfos[offsetIdx(69, 6)].offset = 199;
+	blockInfos[offsetIdx(69, 10)].offset = 195;
+	blockInfos[offsetIdx(69, 11)].offset = 196;
+	blockInfos[offsetIdx(69, 12)].offset = 197;
+	blockInfos[offsetIdx(69, 13)].offset = 198;
+	blockInfos[offsetIdx(69, 14)].offset = 199;
 	setOffsetsForID(70, 110, *this);
 	setOffsetsForID(71, 111, *this);
 	setOffsetsForID(72, 119, *this);
 	setOffsetsForID(73, 120, *this);
 	setOffsetsForID(74, 120, *this);
 	setOffsetsForID(75, 121, *this);
-	blockOffsets[offsetIdx(75, 1)] = 145;
-	blockOffsets[offsetIdx(75, 2)] = 146;
-	blockOffsets[offsetIdx(75, 3)] = 147;
-	blockOffsets[offsetIdx(75, 4)] = 148;
+	blockInfos[offsetIdx(75, 1)].offset = 145;
+	blockInfos[offsetIdx(75, 2)].offset = 146;
+	blockInfos[offsetIdx(75, 3)].offset = 147;
+	blockInfos[offsetIdx(75, 4)].offset = 148;
 	setOffsetsForID(76, 122, *this);
-	blockOffsets[offsetIdx(76, 1)] = 141;
-	blockOffsets[offsetIdx(76, 2)] = 142;
-	blockOffsets[offsetIdx(76, 3)] = 143;
-	blockOffsets[offsetIdx(76, 4)] = 144;
+	blockInfos[offsetIdx(76, 1)].offset = 141;
+	blockInfos[offsetIdx(76, 2)].offset = 142;
+	blockInfos[offsetIdx(76, 3)].offset = 143;
+	blockInfos[offsetIdx(76, 4)].offset = 144;
 	setOffsetsForID(77, 190, *this);
-	blockOffsets[offsetIdx(77, 2)] = 191;
-	blockOffsets[offsetIdx(77, 3)] = 192;
-	blockOffsets[offsetIdx(77, 4)] = 193;
-	blockOffsets[offsetIdx(77, 10)] = 191;
-	blockOffsets[offsetIdx(77, 11)] = 192;
-	blockOffsets[offsetIdx(77, 12)] = 193;
+	blockInfos[offsetIdx(77, 2)].offset = 191;
+	blockInfos[offsetIdx(77, 3)].offset = 192;
+	blockInfos[offsetIdx(77, 4)].offset = 193;
+	blockInfos[offsetIdx(77, 10)].offset = 191;
+	blockInfos[offsetIdx(77, 11)].offset = 192;
+	blockInfos[offsetIdx(77, 12)].offset = 193;
 	setOffsetsForID(78, 127, *this);
 	setOffsetsForID(79, 128, *this);
 	setOffsetsForID(80, 129, *this);
@@ -1776,157 +1782,157 @@ void BlockImages::setOffsets()
 	setOffsetsForID(84, 133, *this);
 	setOffsetsForID(85, 134, *this);
 	setOffsetsForID(86, 153, *this);
-	blockOffsets[offsetIdx(86, 0)] = 135;
-	blockOffsets[offsetIdx(86, 1)] = 154;
-	blockOffsets[offsetIdx(86, 3)] = 153;
+	blockInfos[offsetIdx(86, 0)].offset = 135;
+	blockInfos[offsetIdx(86, 1)].offset = 154;
+	blockInfos[offsetIdx(86, 3)].offset = 153;
 	setOffsetsForID(87, 136, *this);
 	setOffsetsForID(88, 137, *this);
 	setOffsetsForID(89, 138, *this);
 	setOffsetsForID(90, 139, *this);
 	setOffsetsForID(91, 155, *this);
-	blockOffsets[offsetIdx(91, 0)] = 140;
-	blockOffsets[offsetIdx(91, 1)] = 156;
-	blockOffsets[offsetIdx(91, 3)] = 155;
+	blockInfos[offsetIdx(91, 0)].offset = 140;
+	blockInfos[offsetIdx(91, 1)].offset = 156;
+	blockInfos[offsetIdx(91, 3)].offset = 155;
 	setOffsetsForID(92, 289, *this);
 	setOffsetsForID(93, 247, *this);
-	blockOffsets[offsetIdx(93, 1)] = 244;
-	blockOffsets[offsetIdx(93, 5)] = 244;
-	blockOffsets[offsetIdx(93, 9)] = 244;
-	blockOffsets[offsetIdx(93, 13)] = 244;
-	blockOffsets[offsetIdx(93, 2)] = 246;
-	blockOffsets[offsetIdx(93, 6)] = 246;
-	blockOffsets[offsetIdx(93, 10)] = 246;
-	blockOffsets[offsetIdx(93, 14)] = 246;
-	blockOffsets[offsetIdx(93, 3)] = 245;
-	blockOffsets[offsetIdx(93, 7)] = 245;
-	blockOffsets[offsetIdx(93, 11)] = 245;
-	blockOffsets[offsetIdx(93, 15)] = 245;
+	blockInfos[offsetIdx(93, 1)].offset = 244;
+	blockInfos[offsetIdx(93, 5)].offset = 244;
+	blockInfos[offsetIdx(93, 9)].offset = 244;
+	blockInfos[offsetIdx(93, 13)].offset = 244;
+	blockInfos[offsetIdx(93, 2)].offset = 246;
+	blockInfos[offsetIdx(93, 6)].offset = 246;
+	blockInfos[offsetIdx(93, 10)].offset = 246;
+	blockInfos[offsetIdx(93, 14)].offset = 246;
+	blockInfos[offsetIdx(93, 3)].offset = 245;
+	blockInfos[offsetIdx(93, 7)].offset = 245;
+	blockInfos[offsetIdx(93, 11)].offset = 245;
+	blockInfos[offsetIdx(93, 15)].offset = 245;
 	setOffsetsForID(94, 243, *this);
-	blockOffsets[offsetIdx(94, 1)] = 240;
-	blockOffsets[offsetIdx(94, 5)] = 240;
-	blockOffsets[offsetIdx(94, 9)] = 240;
-	blockOffsets[offsetIdx(94, 13)] = 240;
-	blockOffsets[offsetIdx(94, 2)] = 242;
-	blockOffsets[offsetIdx(94, 6)] = 242;
-	blockOffsets[offsetIdx(94, 10)] = 242;
-	blockOffsets[offsetIdx(94, 14)] = 242;
-	blockOffsets[offsetIdx(94, 3)] = 241;
-	blockOffsets[offsetIdx(94, 7)] = 241;
-	blockOffsets[offsetIdx(94, 11)] = 241;
-	blockOffsets[offsetIdx(94, 15)] = 241;
+	blockInfos[offsetIdx(94, 1)].offset = 240;
+	blockInfos[offsetIdx(94, 5)].offset = 240;
+	blockInfos[offsetIdx(94, 9)].offset = 240;
+	blockInfos[offsetIdx(94, 13)].offset = 240;
+	blockInfos[offsetIdx(94, 2)].offset = 242;
+	blockInfos[offsetIdx(94, 6)].offset = 242;
+	blockInfos[offsetIdx(94, 10)].offset = 242;
+	blockInfos[offsetIdx(94, 14)].offset = 242;
+	blockInfos[offsetIdx(94, 3)].offset = 241;
+	blockInfos[offsetIdx(94, 7)].offset = 241;
+	blockInfos[offsetIdx(94, 11)].offset = 241;
+	blockInfos[offsetIdx(94, 15)].offset = 241;
 	setOffsetsForID(95, 270, *this);
 	setOffsetsForID(96, 276, *this);
-	blockOffsets[offsetIdx(96, 4)] = 277;
-	blockOffsets[offsetIdx(96, 5)] = 278;
-	blockOffsets[offsetIdx(96, 6)] = 279;
-	blockOffsets[offsetIdx(96, 7)] = 280;
+	blockInfos[offsetIdx(96, 4)].offset = 277;
+	blockInfos[offsetIdx(96, 5)].offset = 278;
+	blockInfos[offsetIdx(96, 6)].offset = 279;
+	blockInfos[offsetIdx(96, 7)].offset = 280;
 	setOffsetsForID(97, 1, *this);
-	blockOffsets[offsetIdx(96, 1)] = 4;
-	blockOffsets[offsetIdx(96, 2)] = 294;
+	blockInfos[offsetIdx(96, 1)].offset = 4;
+	blockInfos[offsetIdx(96, 2)].offset = 294;
 	setOffsetsForID(98, 294, *this);
-	blockOffsets[offsetIdx(98, 1)] = 295;
-	blockOffsets[offsetIdx(98, 2)] = 296;
-	blockOffsets[offsetIdx(98, 3)] = 430;
+	blockInfos[offsetIdx(98, 1)].offset = 295;
+	blockInfos[offsetIdx(98, 2)].offset = 296;
+	blockInfos[offsetIdx(98, 3)].offset = 430;
 	setOffsetsForID(99, 336, *this);
-	blockOffsets[offsetIdx(99, 1)] = 342;
-	blockOffsets[offsetIdx(99, 2)] = 341;
-	blockOffsets[offsetIdx(99, 3)] = 341;
-	blockOffsets[offsetIdx(99, 4)] = 342;
-	blockOffsets[offsetIdx(99, 5)] = 341;
-	blockOffsets[offsetIdx(99, 6)] = 341;
-	blockOffsets[offsetIdx(99, 7)] = 344;
-	blockOffsets[offsetIdx(99, 8)] = 343;
-	blockOffsets[offsetIdx(99, 9)] = 343;
-	blockOffsets[offsetIdx(99, 10)] = 345;
+	blockInfos[offsetIdx(99, 1)].offset = 342;
+	blockInfos[offsetIdx(99, 2)].offset = 341;
+	blockInfos[offsetIdx(99, 3)].offset = 341;
+	blockInfos[offsetIdx(99, 4)].offset = 342;
+	blockInfos[offsetIdx(99, 5)].offset = 341;
+	blockInfos[offsetIdx(99, 6)].offset = 341;
+	blockInfos[offsetIdx(99, 7)].offset = 344;
+	blockInfos[offsetIdx(99, 8)].offset = 343;
+	blockInfos[offsetIdx(99, 9)].offset = 343;
+	blockInfos[offsetIdx(99, 10)].offset = 345;
 	setOffsetsForID(100, 336, *this);
-	blockOffsets[offsetIdx(100, 1)] = 338;
-	blockOffsets[offsetIdx(100, 2)] = 337;
-	blockOffsets[offsetIdx(100, 3)] = 337;
-	blockOffsets[offsetIdx(100, 4)] = 338;
-	blockOffsets[offsetIdx(100, 5)] = 337;
-	blockOffsets[offsetIdx(100, 6)] = 337;
-	blockOffsets[offsetIdx(100, 7)] = 340;
-	blockOffsets[offsetIdx(100, 8)] = 339;
-	blockOffsets[offsetIdx(100, 9)] = 339;
-	blockOffsets[offsetIdx(100, 10)] = 345;
+	blockInfos[offsetIdx(100, 1)].offset = 338;
+	blockInfos[offsetIdx(100, 2)].offset = 337;
+	blockInfos[offsetIdx(100, 3)].offset = 337;
+	blockInfos[offsetIdx(100, 4)].offset = 338;
+	blockInfos[offsetIdx(100, 5)].offset = 337;
+	blockInfos[offsetIdx(100, 6)].offset = 337;
+	blockInfos[offsetIdx(100, 7)].offset = 340;
+	blockInfos[offsetIdx(100, 8)].offset = 339;
+	blockInfos[offsetIdx(100, 9)].offset = 339;
+	blockInfos[offsetIdx(100, 10)].offset = 345;
 	setOffsetsForID(101, 355, *this);
 	setOffsetsForID(102, 366, *this);
 	setOffsetsForID(103, 290, *this);
 	setOffsetsForID(104, 395, *this);
-	blockOffsets[offsetIdx(104, 1)] = 396;
-	blockOffsets[offsetIdx(104, 2)] = 397;
-	blockOffsets[offsetIdx(104, 3)] = 398;
-	blockOffsets[offsetIdx(104, 4)] = 399;
-	blockOffsets[offsetIdx(104, 5)] = 400;
-	blockOffsets[offsetIdx(104, 6)] = 401;
-	blockOffsets[offsetIdx(104, 7)] = 402;
+	blockInfos[offsetIdx(104, 1)].offset = 396;
+	blockInfos[offsetIdx(104, 2)].offset = 397;
+	blockInfos[offsetIdx(104, 3)].offset = 398;
+	blockInfos[offsetIdx(104, 4)].offset = 399;
+	blockInfos[offsetIdx(104, 5)].offset = 400;
+	blockInfos[offsetIdx(104, 6)].offset = 401;
+	blockInfos[offsetIdx(104, 7)].offset = 402;
 	setOffsetsForID(105, 395, *this);
-	blockOffsets[offsetIdx(105, 1)] = 396;
-	blockOffsets[offsetIdx(105, 2)] = 397;
-	blockOffsets[offsetIdx(105, 3)] = 398;
-	blockOffsets[offsetIdx(105, 4)] = 399;
-	blockOffsets[offsetIdx(105, 5)] = 400;
-	blockOffsets[offsetIdx(105, 6)] = 401;
-	blockOffsets[offsetIdx(105, 7)] = 402;
+	blockInfos[offsetIdx(105, 1)].offset = 396;
+	blockInfos[offsetIdx(105, 2)].offset = 397;
+	blockInfos[offsetIdx(105, 3)].offset = 398;
+	blockInfos[offsetIdx(105, 4)].offset = 399;
+	blockInfos[offsetIdx(105, 5)].offset = 400;
+	blockInfos[offsetIdx(105, 6)].offset = 401;
+	blockInfos[offsetIdx(105, 7)].offset = 402;
 	setOffsetsForID(106, 379, *this);
-	blockOffsets[offsetIdx(106, 2)] = 380;
-	blockOffsets[offsetIdx(106, 8)] = 381;
-	blockOffsets[offsetIdx(106, 10)] = 382;
-	blockOffsets[offsetIdx(106, 4)] = 383;
-	blockOffsets[offsetIdx(106, 6)] = 384;
-	blockOffsets[offsetIdx(106, 12)] = 385;
-	blockOffsets[offsetIdx(106, 14)] = 386;
-	blockOffsets[offsetIdx(106, 1)] = 387;
-	blockOffsets[offsetIdx(106, 3)] = 388;
-	blockOffsets[offsetIdx(106, 9)] = 389;
-	blockOffsets[offsetIdx(106, 11)] = 390;
-	blockOffsets[offsetIdx(106, 5)] = 391;
-	blockOffsets[offsetIdx(106, 7)] = 392;
-	blockOffsets[offsetIdx(106, 13)] = 393;
-	blockOffsets[offsetIdx(106, 15)] = 394;
+	blockInfos[offsetIdx(106, 2)].offset = 380;
+	blockInfos[offsetIdx(106, 8)].offset = 381;
+	blockInfos[offsetIdx(106, 10)].offset = 382;
+	blockInfos[offsetIdx(106, 4)].offset = 383;
+	blockInfos[offsetIdx(106, 6)].offset = 384;
+	blockInfos[offsetIdx(106, 12)].offset = 385;
+	blockInfos[offsetIdx(106, 14)].offset = 386;
+	blockInfos[offsetIdx(106, 1)].offset = 387;
+	blockInfos[offsetIdx(106, 3)].offset = 388;
+	blockInfos[offsetIdx(106, 9)].offset = 389;
+	blockInfos[offsetIdx(106, 11)].offset = 390;
+	blockInfos[offsetIdx(106, 5)].offset = 391;
+	blockInfos[offsetIdx(106, 7)].offset = 392;
+	blockInfos[offsetIdx(106, 13)].offset = 393;
+	blockInfos[offsetIdx(106, 15)].offset = 394;
 	setOffsetsForID(107, 347, *this);
-	blockOffsets[offsetIdx(107, 1)] = 346;
-	blockOffsets[offsetIdx(107, 3)] = 346;
-	blockOffsets[offsetIdx(107, 5)] = 346;
-	blockOffsets[offsetIdx(107, 7)] = 346;
+	blockInfos[offsetIdx(107, 1)].offset = 346;
+	blockInfos[offsetIdx(107, 3)].offset = 346;
+	blockInfos[offsetIdx(107, 5)].offset = 346;
+	blockInfos[offsetIdx(107, 7)].offset = 346;
 	setOffsetsForID(108, 304, *this);
-	blockOffsets[offsetIdx(108, 1)] = 305;
-	blockOffsets[offsetIdx(108, 2)] = 306;
-	blockOffsets[offsetIdx(108, 3)] = 307;
-	blockOffsets[offsetIdx(108, 4)] = 446;
-	blockOffsets[offsetIdx(108, 5)] = 447;
-	blockOffsets[offsetIdx(108, 6)] = 448;
-	blockOffsets[offsetIdx(108, 7)] = 449;
+	blockInfos[offsetIdx(108, 1)].offset = 305;
+	blockInfos[offsetIdx(108, 2)].offset = 306;
+	blockInfos[offsetIdx(108, 3)].offset = 307;
+	blockInfos[offsetIdx(108, 4)].offset = 446;
+	blockInfos[offsetIdx(108, 5)].offset = 447;
+	blockInfos[offsetIdx(108, 6)].offset = 448;
+	blockInfos[offsetIdx(108, 7)].offset = 449;
 	setOffsetsForID(109, 308, *this);
-	blockOffsets[offsetIdx(109, 1)] = 309;
-	blockOffsets[offsetIdx(109, 2)] = 310;
-	blockOffsets[offsetIdx(109, 3)] = 311;
-	blockOffsets[offsetIdx(109, 4)] = 450;
-	blockOffsets[offsetIdx(109, 5)] = 451;
-	blockOffsets[offsetIdx(109, 6)] = 452;
-	blockOffsets[offsetIdx(109, 7)] = 453;
+	blockInfos[offsetIdx(109, 1)].offset = 309;
+	blockInfos[offsetIdx(109, 2)].offset = 310;
+	blockInfos[offsetIdx(109, 3)].offset = 311;
+	blockInfos[offsetIdx(109, 4)].offset = 450;
+	blockInfos[offsetIdx(109, 5)].offset = 451;
+	blockInfos[offsetIdx(109, 6)].offset = 452;
+	blockInfos[offsetIdx(109, 7)].offset = 453;
 	setOffsetsForID(110, 291, *this);
 	setOffsetsForID(111, 316, *this);
 	setOffsetsForID(112, 292, *this);
 	setOffsetsForID(113, 332, *this);
 	setOffsetsForID(114, 312, *this);
-	blockOffsets[offsetIdx(114, 1)] = 313;
-	blockOffsets[offsetIdx(114, 2)] = 314;
-	blockOffsets[offsetIdx(114, 3)] = 315;
-	blockOffsets[offsetIdx(114, 4)] = 454;
-	blockOffsets[offsetIdx(114, 5)] = 455;
-	blockOffsets[offsetIdx(114, 6)] = 456;
-	blockOffsets[offsetIdx(114, 7)] = 457;
+	blockInfos[offsetIdx(114, 1)].offset = 313;
+	blockInfos[offsetIdx(114, 2)].offset = 314;
+	blockInfos[offsetIdx(114, 3)].offset = 315;
+	blockInfos[offsetIdx(114, 4)].offset = 454;
+	blockInfos[offsetIdx(114, 5)].offset = 455;
+	blockInfos[offsetIdx(114, 6)].offset = 456;
+	blockInfos[offsetIdx(114, 7)].offset = 457;
 	setOffsetsForID(115, 333, *this);
-	blockOffsets[offsetIdx(115, 1)] = 334;
-	blockOffsets[offsetIdx(115, 2)] = 334;
-	blockOffsets[offsetIdx(115, 3)] = 335;
+	blockInfos[offsetIdx(115, 1)].offset = 334;
+	blockInfos[offsetIdx(115, 2)].offset = 334;
+	blockInfos[offsetIdx(115, 3)].offset = 335;
 	setOffsetsForID(116, 348, *this);
 	setOffsetsForID(117, 350, *this);
 	setOffsetsForID(118, 351, *this);
-	blockOffsets[offsetIdx(118, 1)] = 352;
-	blockOffsets[offsetIdx(118, 2)] = 353;
-	blockOffsets[offsetIdx(118, 3)] = 354;
+	blockInfos[offsetIdx(118, 1)].offset = 352;
+	blockInfos[offsetIdx(118, 2)].offset = 353;
+	blockInfos[offsetIdx(118, 3)].offset = 354;
 	setOffsetsForID(119, 377, *this);
 	setOffsetsForID(120, 349, *this);
 	setOffsetsForID(121, 293, *this);
@@ -1934,94 +1940,142 @@ void BlockImages::setOffsets()
 	setOffsetsForID(123, 434, *this);
 	setOffsetsForID(124, 433, *this);
 	setOffsetsForID(125, 5, *this);
-	blockOffsets[offsetIdx(125, 1)] = 435;
-	blockOffsets[offsetIdx(125, 2)] = 436;
-	blockOffsets[offsetIdx(125, 3)] = 437;
+	blockInfos[offsetIdx(125, 1)].offset = 435;
+	blockInfos[offsetIdx(125, 2)].offset = 436;
+	blockInfos[offsetIdx(125, 3)].offset = 437;
 	setOffsetsForID(126, 230, *this);
-	blockOffsets[offsetIdx(126, 1)] = 464;
-	blockOffsets[offsetIdx(126, 2)] = 466;
-	blockOffsets[offsetIdx(126, 3)] = 468;
-	blockOffsets[offsetIdx(126, 8)] = 460;
-	blockOffsets[offsetIdx(126, 9)] = 465;
-	blockOffsets[offsetIdx(126, 10)] = 467;
-	blockOffsets[offsetIdx(126, 11)] = 469;
+	blockInfos[offsetIdx(126, 1)].offset = 464;
+	blockInfos[offsetIdx(126, 2)].offset = 466;
+	blockInfos[offsetIdx(126, 3)].offset = 468;
+	blockInfos[offsetIdx(126, 8)].offset = 460;
+	blockInfos[offsetIdx(126, 9)].offset = 465;
+	blockInfos[offsetIdx(126, 10)].offset = 467;
+	blockInfos[offsetIdx(126, 11)].offset = 469;
 	setOffsetsForID(127, 522, *this);
-	blockOffsets[offsetIdx(127, 1)] = 519;
-	blockOffsets[offsetIdx(127, 2)] = 521;
-	blockOffsets[offsetIdx(127, 3)] = 520;
-	blockOffsets[offsetIdx(127, 4)] = 526;
-	blockOffsets[offsetIdx(127, 5)] = 523;
-	blockOffsets[offsetIdx(127, 6)] = 525;
-	blockOffsets[offsetIdx(127, 7)] = 524;
-	blockOffsets[offsetIdx(127, 8)] = 530;
-	blockOffsets[offsetIdx(127, 9)] = 527;
-	blockOffsets[offsetIdx(127, 10)] = 529;
-	blockOffsets[offsetIdx(127, 11)] = 528;
+	blockInfos[offsetIdx(127, 1)].offset = 519;
+	blockInfos[offsetIdx(127, 2)].offset = 521;
+	blockInfos[offsetIdx(127, 3)].offset = 520;
+	blockInfos[offsetIdx(127, 4)].offset = 526;
+	blockInfos[offsetIdx(127, 5)].offset = 523;
+	blockInfos[offsetIdx(127, 6)].offset = 525;
+	blockInfos[offsetIdx(127, 7)].offset = 524;
+	blockInfos[offsetIdx(127, 8)].offset = 530;
+	blockInfos[offsetIdx(127, 9)].offset = 527;
+	blockInfos[offsetIdx(127, 10)].offset = 529;
+	blockInfos[offsetIdx(127, 11)].offset = 528;
 	setOffsetsForID(128, 470, *this);
-	blockOffsets[offsetIdx(128, 1)] = 471;
-	blockOffsets[offsetIdx(128, 2)] = 472;
-	blockOffsets[offsetIdx(128, 3)] = 473;
-	blockOffsets[offsetIdx(128, 4)] = 474;
-	blockOffsets[offsetIdx(128, 5)] = 475;
-	blockOffsets[offsetIdx(128, 6)] = 476;
-	blockOffsets[offsetIdx(128, 7)] = 477;
+	blockInfos[offsetIdx(128, 1)].offset = 471;
+	blockInfos[offsetIdx(128, 2)].offset = 472;
+	blockInfos[offsetIdx(128, 3)].offset = 473;
+	blockInfos[offsetIdx(128, 4)].offset = 474;
+	blockInfos[offsetIdx(128, 5)].offset = 475;
+	blockInfos[offsetIdx(128, 6)].offset = 476;
+	blockInfos[offsetIdx(128, 7)].offset = 477;
 	setOffsetsForID(129, 478, *this);
 	setOffsetsForID(130, 479, *this);
-	blockOffsets[offsetIdx(130, 4)] = 480;
-	blockOffsets[offsetIdx(130, 2)] = 481;
-	blockOffsets[offsetIdx(130, 5)] = 481;
-	blockOffsets[offsetIdx(131, 0)] = 542;
-	blockOffsets[offsetIdx(131, 4)] = 542;
-	blockOffsets[offsetIdx(131, 8)] = 542;
-	blockOffsets[offsetIdx(131, 12)] = 542;
-	blockOffsets[offsetIdx(131, 1)] = 539;
-	blockOffsets[offsetIdx(131, 5)] = 539;
-	blockOffsets[offsetIdx(131, 9)] = 539;
-	blockOffsets[offsetIdx(131, 13)] = 539;
-	blockOffsets[offsetIdx(131, 2)] = 541;
-	blockOffsets[offsetIdx(131, 6)] = 541;
-	blockOffsets[offsetIdx(131, 10)] = 541;
-	blockOffsets[offsetIdx(131, 14)] = 541;
-	blockOffsets[offsetIdx(131, 3)] = 540;
-	blockOffsets[offsetIdx(131, 7)] = 540;
-	blockOffsets[offsetIdx(131, 11)] = 540;
-	blockOffsets[offsetIdx(131, 15)] = 540;
+	blockInfos[offsetIdx(130, 4)].offset = 480;
+	blockInfos[offsetIdx(130, 2)].offset = 481;
+	blockInfos[offsetIdx(130, 5)].offset = 481;
+	blockInfos[offsetIdx(131, 0)].offset = 542;
+	blockInfos[offsetIdx(131, 4)].offset = 542;
+	blockInfos[offsetIdx(131, 8)].offset = 542;
+	blockInfos[offsetIdx(131, 12)].offset = 542;
+	blockInfos[offsetIdx(131, 1)].offset = 539;
+	blockInfos[offsetIdx(131, 5)].offset = 539;
+	blockInfos[offsetIdx(131, 9)].offset = 539;
+	blockInfos[offsetIdx(131, 13)].offset = 539;
+	blockInfos[offsetIdx(131, 2)].offset = 541;
+	blockInfos[offsetIdx(131, 6)].offset = 541;
+	blockInfos[offsetIdx(131, 10)].offset = 541;
+	blockInfos[offsetIdx(131, 14)].offset = 541;
+	blockInfos[offsetIdx(131, 3)].offset = 540;
+	blockInfos[offsetIdx(131, 7)].offset = 540;
+	blockInfos[offsetIdx(131, 11)].offset = 540;
+	blockInfos[offsetIdx(131, 15)].offset = 540;
 	setOffsetsForID(132, 543, *this);
 	setOffsetsForID(133, 482, *this);
 	setOffsetsForID(134, 495, *this);
-	blockOffsets[offsetIdx(134, 1)] = 496;
-	blockOffsets[offsetIdx(134, 2)] = 497;
-	blockOffsets[offsetIdx(134, 3)] = 498;
-	blockOffsets[offsetIdx(134, 4)] = 499;
-	blockOffsets[offsetIdx(134, 5)] = 500;
-	blockOffsets[offsetIdx(134, 6)] = 501;
-	blockOffsets[offsetIdx(134, 7)] = 502;
+	blockInfos[offsetIdx(134, 1)].offset = 496;
+	blockInfos[offsetIdx(134, 2)].offset = 497;
+	blockInfos[offsetIdx(134, 3)].offset = 498;
+	blockInfos[offsetIdx(134, 4)].offset = 499;
+	blockInfos[offsetIdx(134, 5)].offset = 500;
+	blockInfos[offsetIdx(134, 6)].offset = 501;
+	blockInfos[offsetIdx(134, 7)].offset = 502;
 	setOffsetsForID(135, 503, *this);
-	blockOffsets[offsetIdx(135, 1)] = 504;
-	blockOffsets[offsetIdx(135, 2)] = 505;
-	blockOffsets[offsetIdx(135, 3)] = 506;
-	blockOffsets[offsetIdx(135, 4)] = 507;
-	blockOffsets[offsetIdx(135, 5)] = 508;
-	blockOffsets[offsetIdx(135, 6)] = 509;
-	blockOffsets[offsetIdx(135, 7)] = 510;
+	blockInfos[offsetIdx(135, 1)].offset = 504;
+	blockInfos[offsetIdx(135, 2)].offset = 505;
+	blockInfos[offsetIdx(135, 3)].offset = 506;
+	blockInfos[offsetIdx(135, 4)].offset = 507;
+	blockInfos[offsetIdx(135, 5)].offset = 508;
+	blockInfos[offsetIdx(135, 6)].offset = 509;
+	blockInfos[offsetIdx(135, 7)].offset = 510;
 	setOffsetsForID(136, 511, *this);
-	blockOffsets[offsetIdx(136, 1)] = 512;
-	blockOffsets[offsetIdx(136, 2)] = 513;
-	blockOffsets[offsetIdx(136, 3)] = 514;
-	blockOffsets[offsetIdx(136, 4)] = 515;
-	blockOffsets[offsetIdx(136, 5)] = 516;
-	blockOffsets[offsetIdx(136, 6)] = 517;
-	blockOffsets[offsetIdx(136, 7)] = 518;
+	blockInfos[offsetIdx(136, 1)].offset = 512;
+	blockInfos[offsetIdx(136, 2)].offset = 513;
+	blockInfos[offsetIdx(136, 3)].offset = 514;
+	blockInfos[offsetIdx(136, 4)].offset = 515;
+	blockInfos[offsetIdx(136, 5)].offset = 516;
+	blockInfos[offsetIdx(136, 6)].offset = 517;
+	blockInfos[offsetIdx(136, 7)].offset = 518;
+}
+
+int BlockImages::getWaterOffset(int topoffset, int depth) const
+{
+	int variant = (topoffset == 8) ? 0 : ((topoffset == 157) ? 1 : ((topoffset == 178) ? 2 : 3));
+	return NUMBLOCKIMAGES + variant * (maxWaterDepth - 1) + depth - 2;
+}
+
+void BlockImages::addWaterImages(int B)
+{
+	// stacks[n] holds n interior water blocks composited together; keep adding blocks until the U face
+	//  is completely opaque (at which point more water underneath wouldn't show) or we hit the limit
+	ImageRect irect = getRect(157);
+	vector<RGBAImage> stacks(1);
+	stacks[0].create(rectsize, rectsize);
+	waterSaturates = false;
+	while (!waterSaturates && (int)stacks.size() <= MAXWATERDEPTH)
+	{
+		RGBAImage stack = stacks.back();
+		waterSaturates = true;
+		for (int y = 0; y < rectsize; y++)
+			for (int x = 0; x < rectsize; x++)
+			{
+				blend(stack(x, y), img(irect.x + x, irect.y + y));
+				if (ALPHA(stack(x, y)) > 0 && ALPHA(stack(x, y)) < 255)
+					waterSaturates = false;
+			}
+		stacks.push_back(stack);
+	}
+	maxWaterDepth = stacks.size() - 1;
+
+	// make room for the new images after the regular ones
+	numOffsets = NUMBLOCKIMAGES + 4 * (maxWaterDepth - 1);
+	RGBAImage oldimg = img;
+	img.create(rectsize * 16, (numOffsets/16 + 1) * rectsize);
+	blit(oldimg, ImageRect(0, 0, oldimg.w, oldimg.h), img, 0, 0);
+
+	// a run of depth n is the top block drawn over a stack of n-1 interior blocks
+	int tops[4] = {8, 157, 178, 179};
+	for (int i = 0; i < 4; i++)
+	{
+		ImageRect trect = getRect(tops[i]);
+		for (int depth = 2; depth <= maxWaterDepth; depth++)
+		{
+			ImageRect rect = getRect(getWaterOffset(tops[i], depth));
+			blit(stacks[depth - 1], ImageRect(0, 0, rectsize, rectsize), img, rect.x, rect.y);
+			for (int y = 0; y < rectsize; y++)
+				for (int x = 0; x < rectsize; x++)
+					blend(img(rect.x + x, rect.y + y), img(trect.x + x, trect.y + y));
+		}
+	}
 }
 
 void BlockImages::checkOpacityAndTransparency(int B)
 {
-	opacity.clear();
-	opacity.resize(NUMBLOCKIMAGES, true);
-	transparency.clear();
-	transparency.resize(NUMBLOCKIMAGES, true);
+	vector<bool> opacity(numOffsets, true), transparency(numOffsets, true);
 
-	for (int i = 0; i < NUMBLOCKIMAGES; i++)
+	for (int i = 0; i < numOffsets; i++)
 	{
 		ImageRect rect = getRect(i);
 		// use the face iterators to examine the N, W, and U faces; any non-100% alpha makes
@@ -2065,6 +2119,107 @@ void BlockImages::checkOpacityAndTransparency(int B)
 				break;
 		}
 	}
+
+	offsetFlags.clear();
+	offsetFlags.resize(numOffsets, 0);
+	for (int i = 0; i < numOffsets; i++)
+		offsetFlags[i] = (opacity[i] ? BLOCKOPAQUE : 0) | (transparency[i] ? BLOCKTRANSPARENT : 0);
+}
+
+void BlockImages::setBlockInfos()
+{
+	for (int i = 0; i < 4096*16; i++)
+	{
+		BlockInfo& info = blockInfos[i];
+		info.flags = offsetFlags[info.offset];
+		uint16_t blockID = i / 16;
+		uint8_t blockData = i % 16;
+		info.special = NORMAL;
+		if (info.offset == 8)  // solid water
+			info.special = WATER;
+		else if (blockID == 79)
+			info.special = ICE;
+		else if (blockID == 85)
+			info.special = FENCE;
+		else if (blockID == 113)
+			info.special = NETHERFENCE;
+		else if (blockID == 54)
+			info.special = CHEST;
+		else if (blockID == 95)
+			info.special = LOCKEDCHEST;
+		else if (blockID == 101)
+			info.special = IRONBARS;
+		else if (blockID == 102)
+			info.special = GLASSPANE;
+		else if (blockID == 132)
+			info.special = TRIPWIRE;
+		else if ((blockID == 104 || blockID == 105) && blockData == 7)  // full stem
+			info.special = STEM;
+		else if (blockID == 64)
+			info.special = WOODDOOR;
+		else if (blockID == 71)
+			info.special = IRONDOOR;
+	}
+}
+
+void BlockImages::computeRowData(int B)
+{
+	spans.clear();
+	rowSpans.clear();
+	opaqueRows.assign(numOffsets * rectsize, 0);
+	visibleRows.assign(numOffsets * rectsize, 0);
+
+	// get the pixels of the hexagon, using the face iterators on a block image at [0,0]
+	int tilesize = 2*B;
+	vector<uint64_t> hexagon(rectsize, 0);
+	for (FaceIterator it(0, B, 1, tilesize); !it.end; it.advance())
+		hexagon[it.y] |= (uint64_t)1 << it.x;
+	for (FaceIterator it(2*B, 2*B, -1, tilesize); !it.end; it.advance())
+		hexagon[it.y] |= (uint64_t)1 << it.x;
+	for (TopFaceIterator it(2*B-1, 0, tilesize); !it.end; it.advance())
+		hexagon[it.y] |= (uint64_t)1 << it.x;
+
+	for (int i = 0; i < numOffsets; i++)
+	{
+		ImageRect rect = getRect(i);
+		for (int y = 0; y < rectsize; y++)
+		{
+			rowSpans.push_back(spans.size());
+			// bit x is set if pixel x is opaque/not transparent (rectsize is at most 64)
+			uint64_t& opaque = opaqueRows[i * rectsize + y];
+			uint64_t& visible = visibleRows[i * rectsize + y];
+			for (int x = 0; x < rectsize; x++)
+			{
+				int a = ALPHA(img(rect.x + x, rect.y + y));
+				if (a == 255)
+					opaque |= (uint64_t)1 << x;
+				if (a > 0)
+					visible |= (uint64_t)1 << x;
+			}
+			if (visible & ~hexagon[y])
+				offsetFlags[i] |= BLOCKPROTRUDES;
+			if (visible == 0)
+				continue;
+			if (visible != opaque)
+			{
+				int start = __builtin_ctzll(visible), end = 64 - __builtin_clzll(visible);
+				end = min(rectsize, start + (end - start + 7) / 8 * 8);
+				start = max(0, end - (end - start + 7) / 8 * 8);
+				spans.push_back(Span(start, end, false));
+				continue;
+			}
+			for (int x = 0; x < rectsize; x++)
+				if (opaque & ((uint64_t)1 << x))
+				{
+					// extend the current run if it ends right here
+					if (spans.size() > (size_t)rowSpans.back() && spans.back().end == x)
+						spans.back().end++;
+					else
+						spans.push_back(Span(x, x + 1, true));
+				}
+		}
+	}
+	rowSpans.push_back(spans.size());
 }
 
 void BlockImages::retouchAlphas(int B)
@@ -19,6 +19,7 @@
 #define BLOCKIMAGES_H
 
 #include <stdint.h>
+#include <vector>
 
 #include "rgba.h"
 
@@ -73,6 +74,11 @@
 //                                        def          abc
 //                                          f          a
 
+// flags for block images
+#define BLOCKOPAQUE 0x1
+#define BLOCKTRANSPARENT 0x2
+#define BLOCKPROTRUDES 0x4
+
 struct BlockImages
 {
 	// this image holds all the block images, in rows of 16 (so its width is 4B*16; height depends on number of rows)
@@ -80,23 +86,77 @@ struct BlockImages
 	RGBAImage img;
 	int rectsize;  // size of block image bounding boxes
 
+	// opacity and transparency of a block image (this is a function of the block images computed from the terrain,
+	//  not of the actual block data; if a block image has 100% alpha everywhere, it's considered opaque, and
+	//  if it has 0% alpha everywhere, it's considered transparent)
+	std::vector<uint8_t> offsetFlags;  // size is numOffsets; indexed by offset
+	bool isOpaque(int offset) const {return offsetFlags[offset] & BLOCKOPAQUE;}
+	bool isTransparent(int offset) const {return offsetFlags[offset] & BLOCKTRANSPARENT;}
+	// ...also, whether a block image has non-transparent pixels outside the hexagon (the ascending rails do, for
+	//  example); see drawFrontToBack in render.cpp for why that matters
+	bool protrudes(int offset) const {return offsetFlags[offset] & BLOCKPROTRUDES;}
+
+	// which of the renderer's special cases applies to a block (see checkSpecial in render.cpp); these are the
+	//  blocks whose rendering doesn't depend solely on the blockID/blockData, like fences and double chests,
+	//  so the renderer has to look at their neighbors to pick the proper offsets
+	enum Special {NORMAL, WATER, ICE, FENCE, NETHERFENCE, CHEST, LOCKEDCHEST, IRONBARS, GLASSPANE, TRIPWIRE, STEM, WOODDOOR, IRONDOOR};
+
 	// for every possible 12-bit block id/4-bit block data combination, this holds the offset into the image
-	//  (unrecognized id/data values are pointed at the dummy block image)
-	// this doesn't handle some things like fences and double chests where the rendering doesn't depend solely
-	//  on the blockID/blockData; for those, the renderer just has to know the proper offsets on its own
-	int blockOffsets[4096 * 16];
-	int getOffset(uint16_t blockID, uint8_t blockData) const {return blockOffsets[blockID * 16 + blockData];}
+	//  (unrecognized id/data values are pointed at the dummy block image), plus that image's flags and the
+	//  block's special case, so the renderer can get everything it needs with one lookup
+	struct BlockInfo
+	{
+		uint16_t offset;
+		uint8_t flags;  // BLOCKOPAQUE, BLOCKTRANSPARENT, BLOCKPROTRUDES for the image at offset
+		uint8_t special;  // a Special
+	};
+	BlockInfo blockInfos[4096 * 16];
+	const BlockInfo& getInfo(uint16_t blockID, uint8_t blockData) const {return blockInfos[blockID * 16 + blockData];}
+	int getOffset(uint16_t blockID, uint8_t blockData) const {return blockInfos[blockID * 16 + blockData].offset;}
+	bool isOpaque(uint16_t blockID, uint8_t blockData) const {return blockInfos[blockID * 16 + blockData].flags & BLOCKOPAQUE;}
+	bool isTransparent(uint16_t blockID, uint8_t blockData) const {return blockInfos[blockID * 16 + blockData].flags & BLOCKTRANSPARENT;}
+
+	// ...and each row of each block image broken into runs that can simply be copied (opaque pixels) and runs that
+	//  must be blended, leaving out the transparent pixels, so that blitting doesn't have to look at every pixel
+	// ...a row with any translucent pixels gets a single blend run covering all of its non-transparent pixels,
+	//  widened into the transparent ones around it to a multiple of 8 pixels where possible; blendRow copies
+	//  opaque pixels and skips transparent ones itself, and it's much faster on a few long runs than on lots
+	//  of short ones
+	struct Span
+	{
+		uint8_t start, end;  // pixels [start,end) of the row
+		bool opaque;
 
-	// check whether a block image is opaque (this is a function of the block images computed from the terrain,
-	//  not of the actual block data; if a block image has 100% alpha everywhere, it's considered opaque)
-	std::vector<bool> opacity;  // size is NUMBLOCKIMAGES; indexed by offset
-	bool isOpaque(int offset) const {return opacity[offset];}
-	bool isOpaque(uint16_t blockID, uint8_t blockData) const {return opacity[getOffset(blockID, blockData)];}
+		Span(int s, int e, bool o) : start(s), end(e), opaque(o) {}
+	};
+	std::vector<Span> spans;
+	// size is numOffsets * rectsize + 1; the spans for a row are [rowSpans[offset * rectsize + row],
+	//  rowSpans[offset * rectsize + row + 1])
+	std::vector<int> rowSpans;
+	const int *getRowSpans(int offset) const {return &rowSpans[offset * rectsize];}
+	// ...and bitmasks of which pixels in each row are opaque and which are not transparent (bit x is pixel x;
+	//  rectsize is at most 64), for the front-to-back compositor's coverage tests
+	std::vector<uint64_t> opaqueRows, visibleRows;  // size is numOffsets * rectsize; indexed by offset * rectsize + row
+	const uint64_t *getOpaqueRows(int offset) const {return &opaqueRows[offset * rectsize];}
+	const uint64_t *getVisibleRows(int offset) const {return &visibleRows[offset * rectsize];}
 
-	// ...and the same thing for complete transparency (0% alpha everywhere)
-	std::vector<bool> transparency;  // size is NUMBLOCKIMAGES; indexed by offset
-	bool isTransparent(int offset) const {return transparency[offset];}
-	bool isTransparent(uint16_t blockID, uint8_t blockData) const {return transparency[getOffset(blockID, blockData)];}
+	// after the regular block images, img holds precomposited images of runs of water in a pseudocolumn, so the
+	//  renderer can draw a whole run with one node instead of one per block: a water block (any of the face-culled
+	//  variants 8, 157, 178, 179) with depth-1 interior water blocks (157, which is just the U face) beneath it
+	// ...these are built when the BlockImages is created, and aren't saved in blocks-B.png
+	// ...they come out very slightly different from drawing the blocks one at a time, since the blending
+	//  rounds differently; no channel should be off by more than a few levels, except around air pockets
+	//  in the water, where the shaded sides of neighboring water blocks may get blended in a different
+	//  order (a bit more, in the few pixels where that happens; see testWaterRuns in pigmap.cpp)
+	// ...so the renderer only uses them if asked to (RenderJob::waterruns)
+	// ...maxWaterDepth is the deepest run with its own image; if waterSaturates is set, the U face of that
+	//  image is fully opaque, so any more water beneath it can't be seen and needn't be drawn at all
+	int maxWaterDepth;
+	bool waterSaturates;
+	int numOffsets;  // NUMBLOCKIMAGES plus the water images
+	// get the offset of the image for a run of water, given the offset of the top block and the number of blocks
+	//  (at least 2, and no more than maxWaterDepth)
+	int getWaterOffset(int topoffset, int depth) const;
 
 	// get the rectangle in img corresponding to an offset
 	ImageRect getRect(int offset) const {return ImageRect((offset%16)*rectsize, (offset/16)*rectsize, rectsize, rectsize);}
@@ -109,9 +169,18 @@ struct BlockImages
 	// set the offsets
 	void setOffsets();
 
-	// fill in the opacity and transparency members
+	// build the water run images and set maxWaterDepth, waterSaturates, and numOffsets
+	void addWaterImages(int B);
+
+	// fill in the offsetFlags member (except for BLOCKPROTRUDES, which computeRowData adds)
 	void checkOpacityAndTransparency(int B);
 
+	// fill in the flags and special cases in blockInfos (the offsets are done by setOffsets)
+	void setBlockInfos();
+
+	// fill in the spans, rowSpans, opaqueRows, and visibleRows members, and the BLOCKPROTRUDES flags
+	void computeRowData(int B);
+
 	// scan the block images looking for not-quite-transparent or not-quite-opaque pixels; if they're close enough,
 	//  push them all the way
 	void retouchAlphas(int B);
@@ -289,6 +358,10 @@ struct BlockImages
 
 #define NUMBLOCKIMAGES 554
 
+// the deepest run of water that gets a precomposited image (unless the water stops letting any light
+//  through before that)
+#define MAXWATERDEPTH 16
+
 
 
 #endif // BLOCKIMAGES_H
\ No newline at end of file
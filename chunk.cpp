@@ -18,11 +18,13 @@
 #include <stdint.h>
 #include <iostream>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <memory>
 
 #include "chunk.h"
 #include "utils.h"
+#include "threads.h"
 
 using namespace std;
 
@@ -37,27 +39,49 @@ bool ChunkData::loadFromOldFile(const vector<uint8_t>& filebuf)
 	// the hell with parsing this whole godforsaken NBT format; just look for the arrays we need
 	uint8_t idsTag[13] = {7, 0, 6, 'B', 'l', 'o', 'c', 'k', 's', 0, 0, 128, 0};
 	uint8_t dataTag[11] = {7, 0, 4, 'D', 'a', 't', 'a', 0, 0, 64, 0};
-	bool foundIDs = false, foundData = false;
+	vector<uint8_t>::const_iterator oldIDs = filebuf.end(), oldData = filebuf.end();
 	for (vector<uint8_t>::const_iterator it = filebuf.begin(); it != filebuf.end(); it++)
 	{
 		if (*it != 7)
 			continue;
-		if (!foundIDs && it + 13 + 32768 <= filebuf.end() && equal(it, it + 13, idsTag))
+		if (oldIDs == filebuf.end() && it + 13 + 32768 <= filebuf.end() && equal(it, it + 13, idsTag))
 		{
-			copy(it + 13, it + 13 + 32768, blockIDs);
+			oldIDs = it + 13;
 			it += 13 + 32768 - 1;  // one less because of the loop we're in
-			foundIDs = true;
 		}
-		else if (!foundData && it + 11 + 16384 <= filebuf.end() && equal(it, it + 11, dataTag))
+		else if (oldData == filebuf.end() && it + 11 + 16384 <= filebuf.end() && equal(it, it + 11, dataTag))
 		{
-			copy(it + 11, it + 11 + 16384, blockData);
+			oldData = it + 11;
 			it += 11 + 16384 - 1;  // one less because of the loop we're in
-			foundData = true;
 		}
-		if (foundIDs && foundData)
-			return true;
+		if (oldIDs != filebuf.end() && oldData != filebuf.end())
+			break;
 	}
-	return false;
+	if (oldIDs == filebuf.end() || oldData == filebuf.end())
+		return false;
+
+	// old-style chunks are 128 blocks high, and indexed by (X*16 + Z)*128 + Y; rearrange them into eight
+	//  Anvil-style sections
+	vector<uint8_t> converted(8 * (4096 + 2048), 0);
+	const uint8_t *ids[16], *add[16], *data[16];
+	for (int s = 0; s < 16; s++)
+	{
+		ids[s] = (s < 8) ? &(converted[s * 4096]) : NULL;
+		data[s] = (s < 8) ? &(converted[8 * 4096 + s * 2048]) : NULL;
+		add[s] = NULL;
+	}
+	for (int x = 0; x < 16; x++)
+		for (int z = 0; z < 16; z++)
+			for (int y = 0; y < 128; y++)
+			{
+				int o = (x * 16 + z) * 128 + y;
+				int i = ((y & 0xf) * 16 + z) * 16 + x;
+				converted[(y >> 4) * 4096 + i] = oldIDs[o];
+				uint8_t d = ((o % 2) == 0) ? (oldData[o/2] & 0xf) : (oldData[o/2] >> 4);
+				converted[8 * 4096 + (y >> 4) * 2048 + i/2] |= ((i % 2) == 0) ? d : (d << 4);
+			}
+	setSections(ids, add, data);
+	return true;
 }
 
 
@@ -78,196 +102,427 @@ bool ChunkData::loadFromOldFile(const vector<uint8_t>& filebuf)
 #define TAG_LIST           9
 #define TAG_COMPOUND       10
 #define TAG_INT_ARRAY      11
+#define TAG_LONG_ARRAY     12
 
-// although tag names are UTF8, we'll just pretend they're ASCII--we don't really care about how the
-//  actual string data breaks down into characters, as long as we know where the end of the string is
-void parseTypeAndName(const uint8_t*& ptr, uint8_t& type, string& name)
-{
-	type = *ptr;
-	ptr++;
-	if (type != TAG_END)
-	{
-		uint16_t len = fromBigEndian(*((uint16_t*)ptr));
-		name.resize(len);
-		copy(ptr + 2, ptr + 2 + len, name.begin());
-		ptr += 2 + len;
-	}
-}
+// payload sizes of the fixed-size tags, and element sizes of the array tags (0 for the others)
+static const uint32_t nbtFixedSizes[13] = {0, 1, 2, 4, 8, 4, 8, 0, 0, 0, 0, 0, 0};
+static const uint32_t nbtElementSizes[13] = {0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 4, 8};
 
-// structure for locating the block data for a 16x16x16 section--the compound tags on the "Sections" list will pass
-//  this down to their immediate children, so they can fill in pointers to their payloads if appropriate
-// ...after the whole structure is parsed, the block data will be copied into the ChunkData
-// (note that we can't read the block data immediately upon finding it, because we have to know the Y value
-//  for the section first, and the tags may appear in any order)
-struct chunkSection
+// compound and list tags can't be nested deeper than this (so corrupt data can't blow the stack)
+#define NBT_MAX_DEPTH 512
+
+// walks through NBT data in a buffer without copying or allocating anything; tag names are compared
+//  in place, and the subtrees we don't care about (entities, tile entities, etc.) are skipped over
+//  using their lengths
+// ...every read is checked against the end of the buffer, and fails rather than running off the end
+struct nbtScanner
 {
-	int y;  // or -1 for "not found yet"
-	const uint8_t *blockIDs;  // pointer into the file buffer, or NULL for "not found yet"
-	const uint8_t *blockData;  // pointer into the file buffer, or NULL for "not found yet"
-	const uint8_t *blockAdd;  // pointer into the file buffer, or NULL for "not found" (this one may not be present at all)
+	const uint8_t *ptr, *end;
 
-	chunkSection() : y(-1), blockIDs(NULL), blockData(NULL), blockAdd(NULL) {}
-	bool complete() const {return y >= 0 && y < 16 && blockIDs != NULL && blockData != NULL;}
-	
-	void extract(ChunkData& chunkdata) const
+	nbtScanner(const uint8_t *p, const uint8_t *e) : ptr(p), end(e) {}
+
+	bool has(uint64_t n) const {return (uint64_t)(end - ptr) >= n;}
+	bool skip(uint64_t n) {if (!has(n)) return false; ptr += n; return true;}
+
+	bool readByte(uint8_t& b) {if (!has(1)) return false; b = *ptr++; return true;}
+	bool readShort(uint16_t& s) {if (!has(2)) return false; s = (ptr[0] << 8) | ptr[1]; ptr += 2; return true;}
+	bool readInt(uint32_t& i) {if (!has(4)) return false; i = ((uint32_t)ptr[0] << 24) | (ptr[1] << 16) | (ptr[2] << 8) | ptr[3]; ptr += 4; return true;}
+
+	// read a tag's type and name; the name is left in the buffer
+	// (although tag names are UTF8, we'll just pretend they're ASCII--we don't really care about how the
+	//  actual string data breaks down into characters, as long as we know where the end of the string is)
+	bool readTypeAndName(uint8_t& type, const uint8_t*& name, uint16_t& namelen)
 	{
-		copy(blockIDs, blockIDs + 4096, chunkdata.blockIDs + (y * 4096));
-		copy(blockData, blockData + 2048, chunkdata.blockData + (y * 2048));
-		if (blockAdd != NULL)
-			copy(blockAdd, blockAdd + 2048, chunkdata.blockAdd + (y * 2048));
+		type = TAG_END;
+		name = ptr;
+		namelen = 0;
+		if (!readByte(type))
+			return false;
+		if (type == TAG_END)
+			return true;
+		if (!readShort(namelen))
+			return false;
+		name = ptr;
+		return skip(namelen);
 	}
+
+	// skip over a payload of the given type
+	bool skipPayload(uint8_t type, int depth);
 };
 
-bool isSection(const vector<string>& names)
+// compare a tag name against a string constant
+template <int N> bool nameIs(const uint8_t *name, uint16_t namelen, const char (&pattern)[N])
 {
-	return names.size() == 4 &&
-	       names[3] == "" &&
-	       names[2] == "Sections" &&
-	       names[1] == "Level" &&
-	       names[0] == "";
+	return namelen == N - 1 && memcmp(name, pattern, N - 1) == 0;
+}
+
+bool unknownTag(uint8_t type)
+{
+	// since we have no idea how large it is, we must abort
+	cerr << "unknown NBT tag: type " << (int)type << endl;
+	return false;
 }
 
-// if section != NULL, then the immediate parent of this tag is one of the compound tags in the "Sections"
-//  list, so the block data tags will fill in their locations
-bool parsePayload(const uint8_t*& ptr, uint8_t type, vector<string>& names, chunkSection *section, vector<chunkSection>& completedSections)
+bool nbtScanner::skipPayload(uint8_t type, int depth)
 {
+	if (type > TAG_LONG_ARRAY)
+		return unknownTag(type);
+	if (nbtFixedSizes[type] != 0)
+		return skip(nbtFixedSizes[type]);
+	if (nbtElementSizes[type] != 0)
+	{
+		uint32_t len;
+		return readInt(len) && skip((uint64_t)len * nbtElementSizes[type]);
+	}
+	if (depth >= NBT_MAX_DEPTH)
+		return false;
 	switch (type)
 	{
 		case TAG_END:
-		{
-			return true;
-		}
-		case TAG_BYTE:
-		{
-			if (section != NULL && names.back() == "Y")
-				section->y = *ptr;
-			ptr++;
-			return true;
-		}
-		case TAG_SHORT:
-		{
-			ptr += 2;
 			return true;
-		}
-		case TAG_INT:
-		case TAG_FLOAT:
+		case TAG_STRING:
 		{
-			ptr += 4;
-			return true;
+			uint16_t len;
+			return readShort(len) && skip(len);
 		}
-		case TAG_LONG:
-		case TAG_DOUBLE:
+		case TAG_LIST:
 		{
-			ptr += 8;
+			uint8_t listtype;
+			uint32_t len;
+			if (!readByte(listtype) || !readInt(len))
+				return false;
+			if (listtype > TAG_LONG_ARRAY)
+				return unknownTag(listtype);
+			// lists of numbers can be skipped all at once
+			if (nbtFixedSizes[listtype] != 0 || listtype == TAG_END)
+				return skip((uint64_t)len * nbtFixedSizes[listtype]);
+			for (uint32_t i = 0; i < len; i++)
+				if (!skipPayload(listtype, depth + 1))
+					return false;
 			return true;
 		}
-		case TAG_BYTE_ARRAY:
+		case TAG_COMPOUND:
 		{
-			uint32_t len = fromBigEndian(*((uint32_t*)ptr));
-			ptr += 4;
-			if (section != NULL)
+			uint8_t nexttype;
+			const uint8_t *name;
+			uint16_t namelen;
+			while (true)
 			{
-				if (names.back() == "Blocks" && len == 4096)
-					section->blockIDs = ptr;
-				else if (names.back() == "Data" && len == 2048)
-					section->blockData = ptr;
-				else if (names.back() == "Add" && len == 2048)
-					section->blockAdd = ptr;
+				if (!readTypeAndName(nexttype, name, namelen))
+					return false;
+				if (nexttype == TAG_END)
+					return true;
+				if (!skipPayload(nexttype, depth + 1))
+					return false;
 			}
-			ptr += len;
-			return true;
 		}
-		case TAG_INT_ARRAY:
+	}
+	return false;  // shouldn't be able to reach here
+}
+
+// structure for locating the block data for a 16x16x16 section--the compound tags on the "Sections" list
+//  are scanned for these, and the block data is copied into the ChunkData once all the sections have
+//  been found
+// (note that we can't read the block data immediately upon finding it, because we have to know the Y value
+//  for the section first, and the tags may appear in any order)
+struct chunkSection
+{
+	int y;  // or -1 for "not found yet"
+	const uint8_t *blockIDs;  // pointer into the file buffer, or NULL for "not found yet"
+	const uint8_t *blockData;  // pointer into the file buffer, or NULL for "not found yet"
+	const uint8_t *blockAdd;  // pointer into the file buffer, or NULL for "not found" (this one may not be present at all)
+
+	chunkSection() : y(-1), blockIDs(NULL), blockData(NULL), blockAdd(NULL) {}
+	bool complete() const {return y >= 0 && y < 16 && blockIDs != NULL && blockData != NULL;}
+	
+};
+
+// scan the payload of one of the compound tags on the "Sections" list, and add it to the list of sections
+//  found so far (indexed by Y)
+bool scanSection(nbtScanner& nbt, chunkSection *found)
+{
+	chunkSection section;
+	uint8_t type;
+	const uint8_t *name;
+	uint16_t namelen;
+	while (true)
+	{
+		if (!nbt.readTypeAndName(type, name, namelen))
+			return false;
+		if (type == TAG_END)
+			break;
+		if (type == TAG_BYTE && nameIs(name, namelen, "Y"))
 		{
-			uint32_t len = fromBigEndian(*((uint32_t*)ptr));
-			ptr += 4 + len*4;
-			return true;
+			uint8_t y;
+			if (!nbt.readByte(y))
+				return false;
+			section.y = y;
 		}
-		case TAG_STRING:
+		else if (type == TAG_BYTE_ARRAY)
 		{
-			uint16_t len = fromBigEndian(*((uint16_t*)ptr));
-			ptr += 2 + len;
-			return true;
+			uint32_t len;
+			if (!nbt.readInt(len) || !nbt.has(len))
+				return false;
+			if (len == 4096 && nameIs(name, namelen, "Blocks"))
+				section.blockIDs = nbt.ptr;
+			else if (len == 2048 && nameIs(name, namelen, "Data"))
+				section.blockData = nbt.ptr;
+			else if (len == 2048 && nameIs(name, namelen, "Add"))
+				section.blockAdd = nbt.ptr;
+			nbt.skip(len);
 		}
-		case TAG_LIST:
-		{
-			uint8_t listtype = *ptr;
-			ptr++;
-			uint32_t len = fromBigEndian(*((uint32_t*)ptr));
-			ptr += 4;
-			stackPusher<string> sp(names, "");
-			for (uint32_t i = 0; i < len; i++)
-				if (!parsePayload(ptr, listtype, names, NULL, completedSections))
-					return false;
+		else if (!nbt.skipPayload(type, 3))
+			return false;
+	}
+
+	if (!section.complete())
+	{
+		cerr << "incomplete chunk section!" << endl;
+		return false;
+	}
+	found[section.y] = section;
+	return true;
+}
+
+// scan the payload of the "Level" compound tag, looking for the "Sections" list
+bool scanLevel(nbtScanner& nbt, chunkSection *found)
+{
+	uint8_t type;
+	const uint8_t *name;
+	uint16_t namelen;
+	while (true)
+	{
+		if (!nbt.readTypeAndName(type, name, namelen))
+			return false;
+		if (type == TAG_END)
 			return true;
-		}
-		case TAG_COMPOUND:
+		if (type == TAG_LIST && nameIs(name, namelen, "Sections"))
 		{
-			chunkSection section;
-			chunkSection *sectionPtr = isSection(names) ? &section : NULL;
-			
-			uint8_t nexttype;
-			string nextname;
-			parseTypeAndName(ptr, nexttype, nextname);
-			while (nexttype != TAG_END)
+			uint8_t listtype;
+			uint32_t len;
+			if (!nbt.readByte(listtype) || !nbt.readInt(len))
+				return false;
+			if (listtype == TAG_COMPOUND)
 			{
-				stackPusher<string> sp(names, nextname);
-				if (!parsePayload(ptr, nexttype, names, sectionPtr, completedSections))
-					return false;
-				parseTypeAndName(ptr, nexttype, nextname);
+				for (uint32_t i = 0; i < len; i++)
+					if (!scanSection(nbt, found))
+						return false;
 			}
-			
-			if (sectionPtr != NULL)
+			else
 			{
-				if (section.complete())
-					completedSections.push_back(section);
-				else
-				{
-					cerr << "incomplete chunk section!" << endl;
+				// not a list of sections after all; back up and skip it
+				nbt.ptr -= 5;
+				if (!nbt.skipPayload(type, 2))
 					return false;
-				}
 			}
-
-			return true;
 		}
-		default:
-		{
-			// unknown tag--since we have no idea how large it is, we must abort
-			cerr << "unknown NBT tag: type " << type << endl;
+		else if (!nbt.skipPayload(type, 2))
 			return false;
-		}
 	}
-	return false;  // shouldn't be able to reach here
 }
 
 bool ChunkData::loadFromAnvilFile(const vector<uint8_t>& filebuf)
 {
 	anvil = true;
-	fill(blockIDs, blockIDs + 65536, 0);
-	fill(blockAdd, blockAdd + 32768, 0);
-	fill(blockData, blockData + 32768, 0);
-
-	const uint8_t *ptr = &(filebuf[0]);
+	if (filebuf.empty())
+		return false;
+	nbtScanner nbt(&(filebuf[0]), &(filebuf[0]) + filebuf.size());
 	uint8_t type;
-	string name;
-	parseTypeAndName(ptr, type, name);
-	if (type != TAG_COMPOUND || !name.empty())
+	const uint8_t *name;
+	uint16_t namelen;
+	if (!nbt.readTypeAndName(type, name, namelen) || type != TAG_COMPOUND || namelen != 0)
 	{
-		cerr << "unrecognized NBT chunk file: top tag has type " << (int)type << " and name " << name << endl;
+		cerr << "unrecognized NBT chunk file: top tag has type " << (int)type << " and name " << string((const char*)name, namelen) << endl;
 		return false;
 	}
 
-	vector<string> names(1, name);
-	vector<chunkSection> completedSections;
-	if (!parsePayload(ptr, type, names, NULL, completedSections))
-		return false;
+	// the top compound tag holds the "Level" compound, which holds the "Sections" list
+	chunkSection found[16];
+	while (true)
+	{
+		if (!nbt.readTypeAndName(type, name, namelen))
+			return false;
+		if (type == TAG_END)
+		{
+			const uint8_t *ids[16], *add[16], *data[16];
+			for (int s = 0; s < 16; s++)
+			{
+				ids[s] = found[s].blockIDs;
+				add[s] = found[s].blockAdd;
+				data[s] = found[s].blockData;
+			}
+			setSections(ids, add, data);
+			return true;
+		}
+		if (type == TAG_COMPOUND && nameIs(name, namelen, "Level"))
+		{
+			if (!scanLevel(nbt, found))
+				return false;
+		}
+		else if (!nbt.skipPayload(type, 1))
+			return false;
+	}
+}
+
+// shared arrays for sections (or parts of sections) that hold the same value throughout: block IDs for each
+//  possible ID byte, and nibble arrays for each possible 4-bit value
+uint8_t uniformIDs[256][4096];
+uint8_t uniformNibbles[16][2048];
+pthread_once_t uniformOnce = PTHREAD_ONCE_INIT;
 
-	for (vector<chunkSection>::const_iterator it = completedSections.begin(); it != completedSections.end(); it++)
-		it->extract(*this);
+void initUniformArrays()
+{
+	for (int i = 0; i < 256; i++)
+		memset(uniformIDs[i], i, 4096);
+	for (int i = 0; i < 16; i++)
+		memset(uniformNibbles[i], i * 0x11, 2048);
+}
 
+// see whether an array holds the same byte throughout (and for nibble arrays, the same nibble); NULL
+//  counts as all zeros
+bool isUniform(const uint8_t *a, int n, bool nibbles, uint8_t& value)
+{
+	if (a == NULL)
+	{
+		value = 0;
+		return true;
+	}
+	value = a[0];
+	if (nibbles && value != (value & 0xf) * 0x11)
+		return false;
+	for (int i = 1; i < n; i++)
+		if (a[i] != value)
+			return false;
+	if (nibbles)
+		value &= 0xf;
 	return true;
 }
 
+void ChunkSurface::getPCol(const BlockOffset& bo, const Block*& begin, const Block*& end) const
+{
+	begin = end = NULL;
+	if (blocks.empty())
+		return;
+	int key = pcolKey(bo.x, bo.z, bo.y);
+	int lo = 0, hi = blocks.size();
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (blocks[mid].pcol() < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	begin = end = &blocks[0] + lo;
+	const Block *last = &blocks[0] + blocks.size();
+	while (end != last && end->pcol() == key)
+		end++;
+}
+
+ChunkData::ChunkData() : surface(NULL)
+{
+	pthread_once(&uniformOnce, initUniformArrays);
+	const uint8_t *none[16] = {NULL};
+	anvil = true;
+	setSections(none, none, none);
+}
+
+void ChunkData::setSections(const uint8_t *ids[16], const uint8_t *add[16], const uint8_t *data[16])
+{
+	// any surface we had was for the old data
+	delete surface;
+	surface = NULL;
+
+	// first see which arrays are uniform, and how much space we need for the rest
+	uint8_t idsval[16], addval[16], dataval[16];
+	bool idsuni[16], adduni[16], datauni[16];
+	size_t needed = 0;
+	for (int s = 0; s < 16; s++)
+	{
+		idsuni[s] = isUniform(ids[s], 4096, false, idsval[s]);
+		adduni[s] = isUniform(add[s], 2048, true, addval[s]);
+		datauni[s] = isUniform(data[s], 2048, true, dataval[s]);
+		needed += (idsuni[s] ? 0 : 4096) + (adduni[s] ? 0 : 2048) + (datauni[s] ? 0 : 2048);
+	}
+
+	// resize the storage, giving back the excess if we're holding on to a lot more than we need
+	if (storage.capacity() > 2 * needed)
+		vector<uint8_t>().swap(storage);
+	storage.resize(needed);
+
+	// now copy the arrays that vary, and point the rest at the shared ones
+	uint8_t *next = storage.empty() ? NULL : &(storage[0]);
+	sections = 0;
+	for (int s = 0; s < 16; s++)
+	{
+		if (idsuni[s])
+			blockIDs[s] = uniformIDs[idsval[s]];
+		else
+		{
+			copy(ids[s], ids[s] + 4096, next);
+			blockIDs[s] = next;
+			next += 4096;
+		}
+		if (adduni[s])
+			blockAdd[s] = uniformNibbles[addval[s]];
+		else
+		{
+			copy(add[s], add[s] + 2048, next);
+			blockAdd[s] = next;
+			next += 2048;
+		}
+		if (datauni[s])
+			blockData[s] = uniformNibbles[dataval[s]];
+		else
+		{
+			copy(data[s], data[s] + 2048, next);
+			blockData[s] = next;
+			next += 2048;
+		}
+		if (!idsuni[s] || idsval[s] != 0 || !adduni[s] || addval[s] != 0)
+			sections |= 1 << s;
+	}
+	computeTops();
+}
+
+void ChunkData::computeTops()
+{
+	maxtop = -1;
+	for (int z = 0; z < 16; z++)
+		for (int x = 0; x < 16; x++)
+		{
+			// look down from the top of the highest section that might have something in it
+			int16_t& t = tops[z*16 + x];
+			t = -1;
+			for (int s = 15; s >= 0 && t == -1; s--)
+			{
+				if (!(sections & (1 << s)))
+					continue;
+				for (int y = s*16 + 15; y >= s*16; y--)
+					if (id(BlockIdx(x, z, y)) != 0)
+					{
+						t = y;
+						break;
+					}
+			}
+			maxtop = max(maxtop, t);
+		}
+}
+
+void findChangedBlocks(const ChunkIdx& ci, const ChunkData& olddata, const ChunkData& newdata, vector<BlockIdx>& changed)
+{
+	BlockIdx base = ci.originBlock();
+	for (int64_t y = 0; y < 256; y++)
+		for (int64_t z = 0; z < 16; z++)
+			for (int64_t x = 0; x < 16; x++)
+			{
+				BlockIdx bi = base + BlockIdx(x, z, y);
+				BlockOffset bo(bi);
+				if (olddata.id(bo) != newdata.id(bo) || olddata.data(bo) != newdata.data(bo))
+					changed.push_back(bi);
+			}
+}
+
 
 //---------------------------------------------------------------------------------------------------
 
@@ -277,38 +532,181 @@ ChunkCacheStats& ChunkCacheStats::operator+=(const ChunkCacheStats& ccs)
 	hits += ccs.hits;
 	misses += ccs.misses;
 	read += ccs.read;
+	shared += ccs.shared;
+	waited += ccs.waited;
 	skipped += ccs.skipped;
 	missing += ccs.missing;
 	reqmissing += ccs.reqmissing;
 	corrupt += ccs.corrupt;
+	trimmed += ccs.trimmed;
+	evicted += ccs.evicted;
+	reread += ccs.reread;
+	conflicts += ccs.conflicts;
 	return *this;
 }
 
-ChunkData* ChunkCache::getData(const PosChunkIdx& ci)
+SharedChunkCache::SharedChunkCache(int64_t b, int w) : ways(w), budget(b), databytes(0), peakbytes(0), trimcursor(0)
 {
-	int e = getEntryNum(ci);
-	int state = chunktable.getDiskState(ci);
+	// use the biggest power-of-two number of sets that fits in the budget, splitting the bits between
+	//  X and Z (X gets the extra one, if there's an odd number)
+	int setbits = 0;
+	while (setbits < 20 && ((int64_t)ways << (setbits + 1)) * (int64_t)CHUNKDATAESTIMATE <= budget)
+		setbits++;
+	setbitsx = (setbits + 1) / 2;
+	setbitsz = setbits / 2;
+	sets = new ChunkCacheSet[1 << setbits];
+}
+
+ChunkCacheEntry* SharedChunkCache::acquire(const PosChunkIdx& ci, ChunkCache& reader, bool& loaded, bool& waited)
+{
+	loaded = waited = false;
+	ChunkCacheSet& set = sets[getSetNum(ci)];
+	ChunkCacheEntry *entry = NULL;
+	{
+		mutexLocker ml(&set.mutex);
+		while (true)
+		{
+			// look for the chunk
+			for (vector<ChunkCacheEntry*>::const_iterator it = set.entries.begin(); it != set.entries.end(); it++)
+				if ((*it)->ci == ci)
+				{
+					entry = *it;
+					break;
+				}
+			if (entry == NULL)
+				break;
+			// if some other thread is still reading it, wait for them to finish; once we're woken up, look
+			//  again, since it might have been loaded and then evicted while we were waiting
+			if (entry->state == ChunkSet::CHUNK_UNKNOWN)
+			{
+				waited = true;
+				pthread_cond_wait(&set.loaded, &set.mutex);
+				entry = NULL;
+				continue;
+			}
+			entry->refs++;
+			entry->lastuse = ++set.clock;
+			return entry;
+		}
 
-	if (state == ChunkSet::CHUNK_UNKNOWN)
-		stats.misses++;
+		// not present; if the set isn't full yet, make a new entry; otherwise, find the least-recently-used
+		//  entry that nobody is using (and that isn't being loaded), or make a new one if they're all busy
+		if ((int)set.entries.size() >= ways)
+			for (vector<ChunkCacheEntry*>::const_iterator it = set.entries.begin(); it != set.entries.end(); it++)
+				if ((*it)->refs == 0 && (entry == NULL || (*it)->lastuse < entry->lastuse))
+					entry = *it;
+		if (entry == NULL)
+		{
+			entry = new ChunkCacheEntry;
+			set.entries.push_back(entry);
+		}
+		// ...if this set has grown past its normal size and has some free entries again, shrink it back down
+		else if ((int)set.entries.size() > ways)
+		{
+			for (vector<ChunkCacheEntry*>::iterator it = set.entries.begin(); it != set.entries.end() && (int)set.entries.size() > ways;)
+			{
+				if (*it != entry && (*it)->refs == 0)
+				{
+					if ((*it)->data != NULL)
+						__sync_sub_and_fetch(&databytes, (int64_t)(sizeof(ChunkData) + (*it)->data->storageBytes()));
+					delete *it;
+					it = set.entries.erase(it);
+				}
+				else
+					it++;
+			}
+		}
+
+		// claim the entry, so nobody else will try to read this chunk while we do it
+		if (entry->ci.valid() && entry->state == ChunkSet::CHUNK_CACHED)
+			reader.stats.evicted++;
+		entry->ci = ci;
+		entry->state = ChunkSet::CHUNK_UNKNOWN;
+		entry->refs = 1;
+		entry->lastuse = ++set.clock;
+	}
+
+	// read the chunk without holding the lock
+	int64_t oldbytes = 0;
+	if (entry->data == NULL)
+		entry->data = new ChunkData;
 	else
-		stats.hits++;
+		oldbytes = sizeof(ChunkData) + entry->data->storageBytes();
+	int state = reader.readChunk(ci, *entry->data);
+	loaded = true;
+	int64_t newbytes = sizeof(ChunkData) + entry->data->storageBytes();
 
-	// if we've already tried and failed to read the chunk, don't try again
-	if (state == ChunkSet::CHUNK_CORRUPTED || state == ChunkSet::CHUNK_MISSING)
-		return &blankdata;
+	{
+		mutexLocker ml(&set.mutex);
+		entry->state = state;
+		pthread_cond_broadcast(&set.loaded);
+	}
 
-	// if the chunk is in the cache, return it
-	if (state == ChunkSet::CHUNK_CACHED)
+	// this chunk may have taken more memory than the one it replaced
+	int64_t bytes = __sync_add_and_fetch(&databytes, newbytes - oldbytes);
+	if (bytes > peakbytes)
+		peakbytes = bytes;
+	if (bytes > budget)
+		trim(reader.stats);
+	return entry;
+}
+
+void SharedChunkCache::trim(ChunkCacheStats& stats)
+{
+	// (the other threads change databytes without holding any of the set locks, so it has to be read
+	//  atomically, too)
+	int numsets = 1 << (setbitsx + setbitsz);
+	for (int i = 0; i < numsets && __sync_add_and_fetch(&databytes, 0) > budget; i++)
 	{
-		if (entries[e].ci != ci)
+		ChunkCacheSet& set = sets[__sync_fetch_and_add(&trimcursor, 1) % numsets];
+		if (0 != pthread_mutex_trylock(&set.mutex))
+			continue;
+		// drop the least-recently-used chunk that nobody is using, and give its entry back the memory
+		ChunkCacheEntry *entry = NULL;
+		for (vector<ChunkCacheEntry*>::const_iterator it = set.entries.begin(); it != set.entries.end(); it++)
+			if ((*it)->refs == 0 && (*it)->data != NULL && (entry == NULL || (*it)->lastuse < entry->lastuse))
+				entry = *it;
+		if (entry != NULL)
 		{
-			cerr << "grievous chunk cache failure!" << endl;
-			cerr << "[" << ci.x << "," << ci.z << "]   [" << entries[e].ci.x << "," << entries[e].ci.z << "]" << endl;
-			exit(-1);
+			__sync_sub_and_fetch(&databytes, (int64_t)(sizeof(ChunkData) + entry->data->storageBytes()));
+			delete entry->data;
+			entry->data = NULL;
+			entry->ci = PosChunkIdx(-1,-1);
+			entry->state = ChunkSet::CHUNK_UNKNOWN;
+			stats.trimmed++;
 		}
-		return &entries[e].data;
+		pthread_mutex_unlock(&set.mutex);
 	}
+}
+
+void SharedChunkCache::release(const PosChunkIdx& ci, ChunkCacheEntry *entry)
+{
+	ChunkCacheSet& set = sets[getSetNum(ci)];
+	mutexLocker ml(&set.mutex);
+	entry->refs--;
+}
+
+ChunkData* ChunkCache::getData(const PosChunkIdx& ci)
+{
+	// if we're already using the chunk, return it
+	LocalEntry *set = &entries[getLocalSetStart(ci)];
+	for (int i = 0; i < LOCALCACHEWAYS; i++)
+		if (set[i].ci == ci)
+		{
+			set[i].lastuse = ++localclock;
+			stats.hits++;
+			return set[i].data;
+		}
+
+	// if we've already tried and failed to read the chunk, don't try again
+	int state = chunktable.getDiskState(ci);
+	if (state == ChunkSet::CHUNK_CORRUPTED || state == ChunkSet::CHUNK_MISSING)
+	{
+		stats.hits++;
+		return &sharedcache.blankdata;
+	}
+
+	stats.misses++;
 
 	// if this is a full render and the chunk is not required, we already know it doesn't exist
 	bool req = chunktable.isRequired(ci);
@@ -316,96 +714,173 @@ ChunkData* ChunkCache::getData(const PosChunkIdx& ci)
 	{
 		stats.skipped++;
 		chunktable.setDiskState(ci, ChunkSet::CHUNK_MISSING);
-		return &blankdata;
+		return &sharedcache.blankdata;
 	}
 
-	// okay, we actually have to read the chunk from disk
-	if (regionformat)
-		readFromRegionCache(ci);
-	else
-		readChunkFile(ci);
+	// get the chunk from the shared cache (which will read it, if necessary)
+	bool loaded, waited;
+	ChunkCacheEntry *entry = sharedcache.acquire(ci, *this, loaded, waited);
+	state = entry->state;
+	if (state == ChunkSet::CHUNK_CACHED)
+	{
+		// (our ChunkTable remembers which chunks we've had, so we can tell when we have to read one again)
+		if (loaded && chunktable.getDiskState(ci) == ChunkSet::CHUNK_CACHED)
+			stats.reread++;
+		chunktable.setDiskState(ci, ChunkSet::CHUNK_CACHED);
+		if (loaded)
+			stats.read++;
+		else
+		{
+			stats.shared++;
+			if (waited)
+				stats.waited++;
+		}
+		pinned.push_back(make_pair(ci, entry));
+		addLocal(ci, entry->data);
+		return entry->data;
+	}
 
-	// check whether the read succeeded; return the data if so
-	state = chunktable.getDiskState(ci);
+	// the read failed; remember that, so we don't ask again
+	sharedcache.release(ci, entry);
+	chunktable.setDiskState(ci, state);
 	if (state == ChunkSet::CHUNK_CORRUPTED)
-	{
 		stats.corrupt++;
-		return &blankdata;
+	else if (req)
+		stats.reqmissing++;
+	else
+		stats.missing++;
+	return &sharedcache.blankdata;
+}
+
+ChunkSurface* ChunkCache::setSurface(ChunkData *data, ChunkSurface *surface)
+{
+	if (!__sync_bool_compare_and_swap(&data->surface, (ChunkSurface*)NULL, surface))
+	{
+		delete surface;
+		return data->surface;
 	}
-	if (state == ChunkSet::CHUNK_MISSING)
+	int64_t bytes = __sync_add_and_fetch(&sharedcache.databytes, (int64_t)surface->bytes());
+	if (bytes > sharedcache.peakbytes)
+		sharedcache.peakbytes = bytes;
+	if (bytes > sharedcache.budget)
+		sharedcache.trim(stats);
+	return surface;
+}
+
+void ChunkCache::releaseAll()
+{
+	for (vector<pair<PosChunkIdx, ChunkCacheEntry*> >::const_iterator it = pinned.begin(); it != pinned.end(); it++)
+		sharedcache.release(it->first, it->second);
+	pinned.clear();
+	entries.assign(entries.size(), LocalEntry());
+	windowclocks.clear();
+}
+
+void ChunkCache::releaseOld()
+{
+	windowclocks.push_back(localclock);
+	if (windowclocks.size() <= CHUNKREUSEWINDOW)
+		return;
+	uint64_t cutoff = windowclocks.front();
+	windowclocks.pop_front();
+
+	// anything that was last used before the start of the window goes back to the shared cache; so do
+	//  pinned entries that were pushed out of the local table, since we can't find them anymore anyway
+	vector<pair<PosChunkIdx, ChunkCacheEntry*> >::iterator keep = pinned.begin();
+	for (vector<pair<PosChunkIdx, ChunkCacheEntry*> >::iterator it = pinned.begin(); it != pinned.end(); it++)
 	{
-		if (req)
-			stats.reqmissing++;
-		else
-			stats.missing++;
-		return &blankdata;
+		LocalEntry *set = &entries[getLocalSetStart(it->first)];
+		LocalEntry *le = NULL;
+		for (int i = 0; i < LOCALCACHEWAYS; i++)
+			if (set[i].ci == it->first)
+				le = &set[i];
+		if (le != NULL && le->lastuse > cutoff)
+		{
+			*keep++ = *it;
+			continue;
+		}
+		if (le != NULL)
+			*le = LocalEntry();
+		sharedcache.release(it->first, it->second);
 	}
-	if (state != ChunkSet::CHUNK_CACHED || entries[e].ci != ci)
+	pinned.erase(keep, pinned.end());
+}
+
+void ChunkCache::addLocal(const PosChunkIdx& ci, ChunkData *data)
+{
+	// find the least-recently-used (or empty) entry in the chunk's set
+	LocalEntry *set = &entries[getLocalSetStart(ci)];
+	LocalEntry *le = set;
+	for (int i = 1; i < LOCALCACHEWAYS; i++)
+		if (set[i].lastuse < le->lastuse)
+			le = &set[i];
+
+	// if the set is full, double the size of the table and try again (or if it's as big as it gets, just
+	//  push out the old entry; we still have it pinned, so if we need it again, we'll find it in the
+	//  shared cache)
+	if (le->lastuse != 0)
 	{
-		cerr << "grievous chunk cache failure!" << endl;
-		cerr << "[" << ci.x << "," << ci.z << "]   [" << entries[e].ci.x << "," << entries[e].ci.z << "]" << endl;
-		exit(-1);
+		stats.conflicts++;
+		if (localbits < LOCALCACHEMAXBITS)
+		{
+			vector<LocalEntry> old(LOCALCACHEWAYS << ++localbits);
+			old.swap(entries);
+			for (vector<LocalEntry>::const_iterator it = old.begin(); it != old.end(); it++)
+				if (it->lastuse != 0)
+					addLocal(it->ci, it->data);
+			addLocal(ci, data);
+			return;
+		}
 	}
-	stats.read++;
-	return &entries[e].data;
+	le->ci = ci;
+	le->data = data;
+	le->lastuse = ++localclock;
+}
+
+int ChunkCache::readChunk(const PosChunkIdx& ci, ChunkData& data)
+{
+	if (regionformat)
+		return readFromRegionCache(ci, data);
+	return readChunkFile(ci, data);
 }
 
-void ChunkCache::readChunkFile(const PosChunkIdx& ci)
+int ChunkCache::readChunkFile(const PosChunkIdx& ci, ChunkData& data)
 {
 	// read the gzip file from disk, if it's there
 	string filename = inputpath + "/" + ci.toChunkIdx().toFilePath();
-	int result = readGzFile(filename, readbuf);
-	if (result == -1)
+	int result;
 	{
-		chunktable.setDiskState(ci, ChunkSet::CHUNK_MISSING);
-		return;
+		PhaseTimer pt(phases, PHASE_READ);
+		result = readGzFile(filename, readbuf);
+		if (result == 0 && phases != NULL)
+			phases->bytes[PHASE_READ] += readbuf.size();
 	}
+	if (result == -1)
+		return ChunkSet::CHUNK_MISSING;
 	if (result == -2)
-	{
-		chunktable.setDiskState(ci, ChunkSet::CHUNK_CORRUPTED);
-		return;
-	}
+		return ChunkSet::CHUNK_CORRUPTED;
 
 	// gzip read was successful; extract the data we need from the chunk
-	//  and put it in the cache
-	parseReadBuf(ci, false);
+	return parseReadBuf(data, false);
 }
 
-void ChunkCache::readFromRegionCache(const PosChunkIdx& ci)
+int ChunkCache::readFromRegionCache(const PosChunkIdx& ci, ChunkData& data)
 {
 	// try to decompress the chunk data
 	bool anvil;
-	int result = regioncache.getDecompressedChunk(ci, readbuf, anvil);
+	int result = regioncache.getDecompressedChunk(ci, compbuf, readbuf, anvil, regionstats, phases);
 	if (result == -1)
-	{
-		chunktable.setDiskState(ci, ChunkSet::CHUNK_MISSING);
-		return;
-	}
+		return ChunkSet::CHUNK_MISSING;
 	if (result == -2)
-	{
-		chunktable.setDiskState(ci, ChunkSet::CHUNK_CORRUPTED);
-		return;
-	}
+		return ChunkSet::CHUNK_CORRUPTED;
 	
 	// decompression was successful; extract the data we need from the chunk
-	//  and put it in the cache
-	parseReadBuf(ci, anvil);
+	return parseReadBuf(data, anvil);
 }
 
-void ChunkCache::parseReadBuf(const PosChunkIdx& ci, bool anvil)
+int ChunkCache::parseReadBuf(ChunkData& data, bool anvil)
 {
-	// evict current tenant of chunk's cache slot
-	int e = getEntryNum(ci);
-	if (entries[e].ci.valid())
-		chunktable.setDiskState(entries[e].ci, ChunkSet::CHUNK_UNKNOWN);
-	entries[e].ci = PosChunkIdx(-1,-1);
-	// ...and put this chunk's data into the slot, assuming the data can actually be parsed
-	bool result = anvil ? entries[e].data.loadFromAnvilFile(readbuf) : entries[e].data.loadFromOldFile(readbuf);
-	if (result)
-	{
-		entries[e].ci = ci;
-		chunktable.setDiskState(ci, ChunkSet::CHUNK_CACHED);
-	}
-	else
-		chunktable.setDiskState(ci, ChunkSet::CHUNK_CORRUPTED);
+	PhaseTimer pt(phases, PHASE_PARSE);
+	bool result = anvil ? data.loadFromAnvilFile(readbuf) : data.loadFromOldFile(readbuf);
+	return result ? ChunkSet::CHUNK_CACHED : ChunkSet::CHUNK_CORRUPTED;
 }
@@ -21,7 +21,9 @@
 #include <string.h>
 #include <string>
 #include <vector>
+#include <deque>
 #include <stdint.h>
+#include <pthread.h>
 
 #include "map.h"
 #include "tables.h"
@@ -42,44 +44,99 @@ struct BlockOffset
 	}
 };
 
-struct ChunkData
+// the blocks of a chunk that the renderer may have to draw, with their images already worked out; the renderer
+//  builds this the first time a tile needs the chunk, and it's kept with the chunk's data in the cache, so the
+//  other tiles that the chunk touches don't have to do it all again
+// ...the blocks are sorted by pseudocolumn, and within each pseudocolumn from top to bottom
+struct ChunkSurface
 {
-	uint8_t blockIDs[65536];  // one byte per block (only half of this space used for old-style chunks)
-	uint8_t blockAdd[32768];  // only in Anvil--extra bits for block ID (4 bits per block)
-	uint8_t blockData[32768];  // 4 bits per block (only half of this space used for old-style chunks)
+	struct Block
+	{
+		uint16_t offset;  // into the BlockImages
+		uint8_t xz;  // X in the low 4 bits, Z in the high 4
+		uint8_t y;
+		uint8_t flags;  // meaning is up to the renderer
+
+		Block(int x, int z, int yy, int off, int fl) : offset(off), xz((z << 4) | x), y(yy), flags(fl) {}
+
+		int x() const {return xz & 0xf;}
+		int z() const {return xz >> 4;}
+		// blocks in the same pseudocolumn (each one step SED of the last) have the same key
+		int pcol() const {return pcolKey(x(), z(), y);}
+	};
+	std::vector<Block> blocks;
+
+	static int pcolKey(int x, int z, int y) {return (x + y) * 512 + (z - y + 256);}
+
+	// get the blocks in the same pseudocolumn as a block offset (which may or may not be one of them)
+	void getPCol(const BlockOffset& bo, const Block*& begin, const Block*& end) const;
+
+	size_t bytes() const {return sizeof(ChunkSurface) + blocks.capacity() * sizeof(Block);}
+};
+
+// block data is kept by 16x16x16 section, in the Anvil layout (old-style chunks are converted to it); each section
+//  has 4096 bytes of block IDs, and 2048 bytes each of add bits and data bits (4 bits per block)
+// ...only the arrays that actually vary are stored in the chunk itself; missing sections, and any array that holds
+//  the same value throughout (all air, solid stone, no add bits, etc.), point at shared read-only arrays instead,
+//  so a typical chunk takes a few dozen KB rather than 128 KB
+struct ChunkData : private nocopy
+{
+	const uint8_t *blockIDs[16];  // one byte per block
+	const uint8_t *blockAdd[16];  // only in Anvil--extra bits for block ID (4 bits per block)
+	const uint8_t *blockData[16];  // 4 bits per block
+	std::vector<uint8_t> storage;  // holds the arrays that aren't shared
 	bool anvil;  // whether this data came from an Anvil chunk or an old-style one
+	// bit N is set if section N (blocks N*16 through N*16+15) may contain anything but air
+	uint16_t sections;
+	// Y of the highest non-air block in each column (indexed by Z*16 + X), or -1 for empty columns; and
+	//  the highest of those
+	int16_t tops[256];
+	int16_t maxtop;
+	// built by the renderer when first needed (see ChunkCache::setSurface), and dropped when the data changes
+	ChunkSurface *surface;
+
+	// starts out as all air
+	ChunkData();
+	~ChunkData() {delete surface;}
 
 	// these guys assume that the BlockIdx actually points to this chunk
 	//  (so they only look at the lower bits)
 	uint16_t id(const BlockOffset& bo) const
 	{
-		if (!anvil)
-			return (bo.y > 127) ? 0 : blockIDs[(bo.x * 16 + bo.z) * 128 + bo.y];
-		int i = (bo.y * 16 + bo.z) * 16 + bo.x;
+		int s = bo.y >> 4;
+		int i = ((bo.y & 0xf) * 16 + bo.z) * 16 + bo.x;
 		if ((i % 2) == 0)
-			return ((blockAdd[i/2] & 0xf) << 8) | blockIDs[i];
-		return ((blockAdd[i/2] & 0xf0) << 4) | blockIDs[i];
+			return ((blockAdd[s][i/2] & 0xf) << 8) | blockIDs[s][i];
+		return ((blockAdd[s][i/2] & 0xf0) << 4) | blockIDs[s][i];
 	}
 	uint8_t data(const BlockOffset& bo) const
 	{
-		int i;
-		if (!anvil)
-		{
-			if (bo.y > 127)
-				return 0;
-			i = (bo.x * 16 + bo.z) * 128 + bo.y;
-		}
-		else
-			i = (bo.y * 16 + bo.z) * 16 + bo.x;
+		int s = bo.y >> 4;
+		int i = ((bo.y & 0xf) * 16 + bo.z) * 16 + bo.x;
 		if ((i % 2) == 0)
-			return blockData[i/2] & 0xf;
-		return (blockData[i/2] & 0xf0) >> 4;
+			return blockData[s][i/2] & 0xf;
+		return (blockData[s][i/2] & 0xf0) >> 4;
 	}
 
+	int16_t top(const BlockOffset& bo) const {return tops[bo.z*16 + bo.x];}
+
 	bool loadFromOldFile(const std::vector<uint8_t>& filebuf);
 	bool loadFromAnvilFile(const std::vector<uint8_t>& filebuf);
+
+	// replace the block data with copies of the given arrays (for each section; NULL means all zeros), sharing
+	//  whatever can be shared, and fill in the sections bits and the tops
+	void setSections(const uint8_t *ids[16], const uint8_t *add[16], const uint8_t *data[16]);
+
+	// number of bytes of block data held by this chunk (not counting the shared arrays), plus the surface
+	size_t storageBytes() const {return storage.capacity() + (surface ? surface->bytes() : 0);}
+
+	// fill in the tops from the block IDs and the sections bits (the loaders do this themselves)
+	void computeTops();
 };
 
+// compare two versions of a chunk's data and append the blocks whose ID or data differ to a list
+void findChangedBlocks(const ChunkIdx& ci, const ChunkData& olddata, const ChunkData& newdata, std::vector<BlockIdx>& changed);
+
 
 
 struct ChunkCacheStats
@@ -87,10 +144,19 @@ struct ChunkCacheStats
 	int64_t hits, misses;
 	// types of misses:
 	int64_t read;  // successfully read from disk
+	int64_t shared;  // already read by another thread (or by us, for an earlier tile) and still in the shared cache
+	int64_t waited;  // (counted in shared, too) another thread was still reading it, so we had to wait for them
 	int64_t skipped;  // assumed not to exist because not required in a full render
 	int64_t missing;  // non-required chunk not present on disk
 	int64_t reqmissing;  // required chunk not present on disk
 	int64_t corrupt;  // found on disk, but failed to read
+	// not misses, but related:
+	int64_t trimmed;  // chunks dropped from other sets of the shared cache to keep its memory within budget
+	int64_t evicted;  // chunks pushed out of the shared cache by a miss in the same set
+	int64_t reread;  // (counted in read, too) chunks we'd had before, which had to be read again after being
+	                 //  dropped from the shared cache; if there are a lot of these, it's too small (see -M, -W)
+	int64_t conflicts;  // chunks that didn't fit in their set of our local table (which is made bigger each
+	                    //  time this happens, up to a point; see ChunkCache)
 
 	// when in region mode, the miss stats have slightly different meanings:
 	//  read: chunk was successfully read from region cache (which may or may not have triggered an
@@ -99,7 +165,7 @@ struct ChunkCacheStats
 	//  corrupt: region file itself is okay, but chunk data within it is corrupt
 	//  skipped/reqmissing: unused
 
-	ChunkCacheStats() : hits(0), misses(0), read(0), skipped(0), missing(0), reqmissing(0), corrupt(0) {}
+	ChunkCacheStats() : hits(0), misses(0), read(0), shared(0), waited(0), skipped(0), missing(0), reqmissing(0), corrupt(0), trimmed(0), evicted(0), reread(0), conflicts(0) {}
 
 	ChunkCacheStats& operator+=(const ChunkCacheStats& ccs);
 };
@@ -107,51 +173,165 @@ struct ChunkCacheStats
 struct ChunkCacheEntry
 {
 	PosChunkIdx ci;  // or [-1,-1] if this entry is empty
-	ChunkData data;
+	int state;  // one of the ChunkSet disk states: CACHED, MISSING, CORRUPTED, or UNKNOWN while being loaded
+	int refs;  // number of outstanding getData pointers into this entry; can't be evicted unless 0
+	uint64_t lastuse;  // for LRU replacement within the set
+	ChunkData *data;  // allocated the first time the entry is used (and freed if the entry is trimmed)
 
-	ChunkCacheEntry() : ci(-1,-1) {}
+	ChunkCacheEntry() : ci(-1,-1), state(ChunkSet::CHUNK_UNKNOWN), refs(0), lastuse(0), data(NULL) {}
+	~ChunkCacheEntry() {delete data;}
 };
 
-#define CACHEBITSX 5
-#define CACHEBITSZ 5
-#define CACHEXSIZE (1 << CACHEBITSX)
-#define CACHEZSIZE (1 << CACHEBITSZ)
-#define CACHESIZE (CACHEXSIZE * CACHEZSIZE)
-#define CACHEXMASK (CACHEXSIZE - 1)
-#define CACHEZMASK (CACHEZSIZE - 1)
+// the shared cache is set-associative: each set holds up to some number of chunks (CHUNKCACHEWAYS unless
+//  told otherwise; see -W), with LRU replacement within the set, and has its own lock; chunks map to sets by
+//  the lower bits of their X and Z, so any group of chunks that's small enough (in both dimensions) to fit
+//  gets spread over all the sets
+#define CHUNKCACHEWAYS 16
 
-struct ChunkCache : private nocopy
+// the number of sets is based on what we expect a typical chunk to take (the ChunkData itself, plus about
+//  four sections' worth of arrays that can't be shared); chunks vary a lot, though, so the cache also keeps
+//  track of what they actually take, and trims itself if it goes over the budget
+#define CHUNKDATAESTIMATE (sizeof(ChunkData) + 4 * 8192)
+
+struct ChunkCacheSet
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t loaded;  // signalled whenever an entry in this set finishes loading
+	// created as needed, up to the cache's number of ways; may grow past that if they're all in use
+	std::vector<ChunkCacheEntry*> entries;
+	uint64_t clock;  // incremented for each use of an entry
+
+	ChunkCacheSet() : clock(0)
+	{
+		pthread_mutex_init(&mutex, NULL);
+		pthread_cond_init(&loaded, NULL);
+	}
+	~ChunkCacheSet()
+	{
+		for (std::vector<ChunkCacheEntry*>::iterator it = entries.begin(); it != entries.end(); it++)
+			delete *it;
+		pthread_cond_destroy(&loaded);
+		pthread_mutex_destroy(&mutex);
+	}
+};
+
+struct ChunkCache;
+
+// the chunk data itself is kept here, in one cache shared by all threads, so that chunks on the borders
+//  between the threads' areas of the map are only read once, and memory use doesn't grow with thread count
+// ...threads don't use this directly; they each go through their own ChunkCache
+struct SharedChunkCache : private nocopy
 {
-	ChunkCacheEntry entries[CACHESIZE];
+	int setbitsx, setbitsz;
+	int ways;
+	ChunkCacheSet *sets;
 	ChunkData blankdata;  // for use with missing chunks
+	int64_t budget;
+	int64_t databytes;  // memory currently held by the ChunkDatas in the cache (updated atomically)
+	int64_t peakbytes;  // most that databytes has been (for the stats; updated without locking, so it may be a bit off)
+	uint32_t trimcursor;  // next set to look at when trimming (updated atomically)
+
+	// budget is in bytes; the cache will get as many sets of the given size as will fit (but at least one)
+	SharedChunkCache(int64_t budget, int ways = CHUNKCACHEWAYS);
+	~SharedChunkCache() {delete[] sets;}
+
+	int getSetNum(const PosChunkIdx& ci) const {return ((ci.x & ((1 << setbitsx) - 1)) << setbitsz) | (ci.z & ((1 << setbitsz) - 1));}
+
+	// find a chunk's entry and add a reference to it; if the chunk isn't present, the ChunkCache
+	//  is used to read it (and loaded is set to true); if another thread was in the middle of reading
+	//  it, we wait for them (and waited is set to true)
+	// ...the entry's state will be CACHED, MISSING, or CORRUPTED; in any case, it must be given back
+	//  with release() when no longer needed
+	ChunkCacheEntry* acquire(const PosChunkIdx& ci, ChunkCache& reader, bool& loaded, bool& waited);
+	void release(const PosChunkIdx& ci, ChunkCacheEntry *entry);
+
+	// while we're over budget, go around the sets dropping unused chunks (skipping any set whose lock
+	//  somebody else holds); stats are those of the calling thread
+	void trim(ChunkCacheStats& stats);
+};
+
+// the local tables start out with 2^LOCALCACHEBITS sets of LOCALCACHEWAYS entries, and may grow to
+//  2^LOCALCACHEMAXBITS sets
+#define LOCALCACHEWAYS 4
+#define LOCALCACHEBITS 8
+#define LOCALCACHEMAXBITS 12
+// chunks stay pinned until this many calls to releaseOld() have gone by without them being used, so that
+//  the next few tiles (which are mostly neighbors of this one) can find them in the local table again
+#define CHUNKREUSEWINDOW 4
 
-	ChunkTable& chunktable;
-	RegionTable& regiontable;
+// each thread's view of the SharedChunkCache: a small set-associative table of the chunks this thread is
+//  currently using, so that the (very frequent) lookups of chunks we already have don't need any locking
+// ...the entries we hand out pointers into stay pinned in the shared cache until they drop out of the reuse
+//  window in releaseOld(), or until releaseAll() is called
+// ...everything in the table is pinned (releasing a chunk also takes it out of the table), so if a chunk's
+//  set is ever full, the table is too small for what we're drawing, and it's doubled in size on the spot
+struct ChunkCache : private nocopy
+{
+	struct LocalEntry
+	{
+		PosChunkIdx ci;  // or [-1,-1] if this entry is empty
+		ChunkData *data;
+		uint64_t lastuse;  // for LRU replacement within the set (0 if empty)
+
+		LocalEntry() : ci(-1,-1), data(NULL), lastuse(0) {}
+	};
+	std::vector<LocalEntry> entries;  // each set's LOCALCACHEWAYS entries are together
+	int localbits;  // there are 2^localbits sets
+	uint64_t localclock;  // incremented for each use of an entry
+	std::vector<std::pair<PosChunkIdx, ChunkCacheEntry*> > pinned;  // shared entries we hold references to
+	std::deque<uint64_t> windowclocks;  // localclock as of each of the last CHUNKREUSEWINDOW calls to releaseOld()
+
+	SharedChunkCache& sharedcache;
+	ChunkTable& chunktable;  // our own copy; remembers which chunks we've found to be missing/corrupt
 	ChunkCacheStats& stats;
 	RegionCache& regioncache;
+	RegionCacheStats& regionstats;
+	PhaseTimes *phases;  // where to charge the time spent reading chunks (may be NULL)
 	std::string inputpath;
 	bool fullrender;
 	bool regionformat;
 	std::vector<uint8_t> readbuf;  // buffer for decompressing into when reading
-	ChunkCache(ChunkTable& ctable, RegionTable& rtable, RegionCache& rcache, const std::string& inpath, bool fullr, bool regform, ChunkCacheStats& st)
-		: chunktable(ctable), regiontable(rtable), regioncache(rcache), inputpath(inpath), fullrender(fullr), regionformat(regform), stats(st)
+	std::vector<uint8_t> compbuf;  // buffer for the compressed data of chunks read from region files
+	ChunkCache(SharedChunkCache& scache, ChunkTable& ctable, RegionCache& rcache, const std::string& inpath, bool fullr, bool regform, ChunkCacheStats& st, RegionCacheStats& rst, PhaseTimes *ph = NULL)
+		: entries(LOCALCACHEWAYS << LOCALCACHEBITS), localbits(LOCALCACHEBITS), localclock(0),
+		  sharedcache(scache), chunktable(ctable), regioncache(rcache), inputpath(inpath), fullrender(fullr), regionformat(regform), stats(st), regionstats(rst), phases(ph)
 	{
-		memset(blankdata.blockIDs, 0, 65536);
-		memset(blankdata.blockData, 0, 32768);
-		memset(blankdata.blockAdd, 0, 32768);
-		blankdata.anvil = true;
 		readbuf.reserve(262144);
 	}
+	~ChunkCache() {releaseAll();}
 
 	// look up a chunk and return a pointer to its data
 	// ...for missing/corrupt chunks, return a pointer to some blank data
+	// ...the pointer remains valid until the next call to releaseOld() or releaseAll()
 	ChunkData* getData(const PosChunkIdx& ci);
 
-	static int getEntryNum(const PosChunkIdx& ci) {return (ci.x & CACHEXMASK) * CACHEZSIZE + (ci.z & CACHEZMASK);}
+	// attach a surface to some data that came from getData (not the blank data), counting it against the
+	//  shared cache's budget; if another thread has already attached one, ours is deleted and theirs is
+	//  returned instead
+	ChunkSurface* setSurface(ChunkData *data, ChunkSurface *surface);
+
+	// give back our references to the chunks that haven't been used since CHUNKREUSEWINDOW calls ago
+	//  (call once per tile)
+	void releaseOld();
+	// give back all our references into the shared cache
+	void releaseAll();
+
+	// put a chunk in the local table
+	void addLocal(const PosChunkIdx& ci, ChunkData *data);
+
+	// first entry of a chunk's local set (the bits are split between X and Z, as in the shared cache)
+	int getLocalSetStart(const PosChunkIdx& ci) const
+	{
+		int zbits = localbits / 2;
+		return ((((ci.x & ((1 << (localbits - zbits)) - 1)) << zbits) | (ci.z & ((1 << zbits) - 1))) * LOCALCACHEWAYS);
+	}
 
-	void readChunkFile(const PosChunkIdx& ci);
-	void readFromRegionCache(const PosChunkIdx& ci);
-	void parseReadBuf(const PosChunkIdx& ci, bool anvil);
+	// read a chunk from disk into some ChunkData; returns the new disk state (CACHED, MISSING, or CORRUPTED)
+	// (used by the SharedChunkCache)
+	int readChunk(const PosChunkIdx& ci, ChunkData& data);
+	int readChunkFile(const PosChunkIdx& ci, ChunkData& data);
+	int readFromRegionCache(const PosChunkIdx& ci, ChunkData& data);
+	int parseReadBuf(ChunkData& data, bool anvil);
 };
 
 
@@ -72,6 +72,10 @@ bool MapParams::readFile(const string& outputpath)
 		return false;
 	userMinY = readParam(params, "userMinY", minY);
 	userMaxY = readParam(params, "userMaxY", maxY);
+	map<string, string>::const_iterator it = params.find("pngProfiles");
+	pngProfiles = (it == params.end()) ? "" : it->second;
+	int snapshots;
+	blockSnapshots = readParam(params, "blockSnapshots", snapshots) && snapshots != 0;
 	return valid() && validZoom();
 }
 
@@ -84,6 +88,10 @@ void MapParams::writeFile(const string& outputpath) const
 		outfile << "userMinY " << minY << endl;
 	if (userMaxY)
 		outfile << "userMaxY " << maxY << endl;
+	if (!pngProfiles.empty())
+		outfile << "pngProfiles " << pngProfiles << endl;
+	if (blockSnapshots)
+		outfile << "blockSnapshots 1" << endl;
 }
 
 
@@ -131,6 +139,19 @@ ChunkIdx BlockIdx::getChunkIdx() const
 	return ChunkIdx(floordiv16(x), floordiv16(z));
 }
 
+vector<TileIdx> BlockIdx::getTiles(const MapParams& mp) const
+{
+	// the block's image is much smaller than a tile, so the tiles of its top-left and bottom-right
+	//  pixels (the bottom-right edge isn't included) are the extremes
+	BBox bb = getBBox(mp);
+	TileIdx tl = bb.topLeft.getTile(mp), br = (bb.bottomRight - Pixel(1,1)).getTile(mp);
+	vector<TileIdx> tiles;
+	for (int64_t tx = tl.x; tx <= br.x; tx++)
+		for (int64_t ty = tl.y; ty <= br.y; ty++)
+			tiles.push_back(TileIdx(tx, ty));
+	return tiles;
+}
+
 BlockIdx BlockIdx::topBlock(const Pixel& p, const MapParams& mp)
 {
 	// x = 2Bbx + 2Bbz
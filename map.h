@@ -179,8 +179,16 @@ struct MapParams
 	//  in pigmap.params
 	bool userMinY, userMaxY;
 
-	MapParams(int b, int t, int bz) : B(b), T(t), baseZoom(bz), minY(0), maxY(255), userMinY(false), userMaxY(false) {}
-	MapParams() : B(0), T(0), baseZoom(0), minY(0), maxY(255), userMinY(false), userMaxY(false) {}
+	// PNG encoder profiles for the zoom levels, in the form accepted by PNGProfileSet; empty for defaults
+	//  (and then not stored in pigmap.params)
+	std::string pngProfiles;
+
+	// whether to keep snapshots of the region files, so incremental updates can find exactly which blocks
+	//  changed (stored in pigmap.params only when set)
+	bool blockSnapshots;
+
+	MapParams(int b, int t, int bz) : B(b), T(t), baseZoom(bz), minY(0), maxY(255), userMinY(false), userMaxY(false), blockSnapshots(false) {}
+	MapParams() : B(0), T(0), baseZoom(0), minY(0), maxY(255), userMinY(false), userMaxY(false), blockSnapshots(false) {}
 
 	int tileSize() const {return 64*B*T;}
 
@@ -233,11 +241,17 @@ struct BlockIdx
 
 	bool occludes(const BlockIdx& bi) const;
 	bool isOccludedBy(const BlockIdx& bi) const {return bi.occludes(*this);}
+	// distance towards the viewer (N, W, and U are towards us); a block is always strictly closer than any
+	//  block it occludes
+	int64_t depth() const {return -x + z + y;}
 
 	Pixel getCenter(const MapParams& mp) const {return Pixel(2*mp.B*(x+z), mp.B*(z-x-2*y));}
 	BBox getBBox(const MapParams& mp) const {Pixel c = getCenter(mp); return BBox(c - Pixel(2*mp.B,2*mp.B), c + Pixel(2*mp.B,2*mp.B));}
 	ChunkIdx getChunkIdx() const;
 
+	// get the tiles that the block's image touches (at most four of them)
+	std::vector<TileIdx> getTiles(const MapParams& mp) const;
+
 	// there are many blocks that project to each pixel on the map (one for each Y-value);
 	//  this returns the topmost, assuming that the pixel is properly aligned on the block-center grid
 	static BlockIdx topBlock(const Pixel& p, const MapParams& mp);
@@ -341,6 +355,9 @@ struct ZoomTileIdx
 
 	ZoomTileIdx(int64_t xx, int64_t yy, int z) : x(xx), y(yy), zoom(z) {}
 
+	bool operator==(const ZoomTileIdx& z) const {return z.x == x && z.y == y && z.zoom == zoom;}
+	bool operator!=(const ZoomTileIdx& z) const {return !operator==(z);}
+
 	bool valid() const;
 	std::string toFilePath() const;
 
@@ -27,7 +27,6 @@
 // -premultiply block image alphas?
 // -dump list of corrupted chunks at end, so they can be retried later
 // -keep some space around for PNG row pointers instead of allocating every time
-// -see if it's better to have threads work together and share a cache?
 // -for the love of god, clean up blockimages.cpp!
 //
 
@@ -40,6 +39,7 @@
 #include <limits>
 #include <fstream>
 #include <sstream>
+#include <iomanip>
 #include <time.h>
 #include <pthread.h>
 #include <unistd.h>
@@ -52,6 +52,8 @@
 #include "chunk.h"
 #include "render.h"
 #include "world.h"
+#include "region.h"
+#include "threads.h"
 
 using namespace std;
 
@@ -59,51 +61,134 @@ using namespace std;
 
 //-------------------------------------------------------------------------------------------------------------------
 
+// the phase times of all the threads, added up
+PhaseTimes allPhases(const RenderStats& stats)
+{
+	PhaseTimes all;
+	for (int i = 0; i < (int)stats.renderphases.size(); i++)
+		all += stats.renderphases[i];
+	for (int i = 0; i < (int)stats.prefetchphases.size(); i++)
+		all += stats.prefetchphases[i];
+	for (int i = 0; i < (int)stats.encoderphases.size(); i++)
+		all += stats.encoderphases[i];
+	return all;
+}
+
 void printStats(int seconds, const RenderStats& stats)
 {
 	cout << stats.reqchunkcount << " chunks    " << stats.reqregioncount << " regions   "
 	     << stats.reqtilecount << " base tiles    " << seconds << " seconds" << endl;
 	cout << "chunk cache: " << stats.chunkcache.hits << " hits   " << stats.chunkcache.misses << " misses" << endl;
-	cout << "             " << stats.chunkcache.read << " read   " << stats.chunkcache.skipped << " skipped   " << stats.chunkcache.missing << " missing   "
+	cout << "             " << stats.chunkcache.read << " read   " << stats.chunkcache.shared << " shared   " << stats.chunkcache.waited << " waited   " << stats.chunkcache.skipped << " skipped   " << stats.chunkcache.missing << " missing   "
 	     << stats.chunkcache.reqmissing << " reqmissing   " << stats.chunkcache.corrupt << " corrupt" << endl;
+	cout << "             " << stats.chunkcache.trimmed << " trimmed   " << stats.chunkcache.evicted << " evicted   " << stats.chunkcache.reread << " reread   "
+	     << stats.chunkcache.conflicts << " conflicts" << endl;
 	cout << "region cache: " << stats.regioncache.hits << " hits   " << stats.regioncache.misses << " misses" << endl;
 	cout << "              " << stats.regioncache.read << " read   " << stats.regioncache.skipped << " skipped   " << stats.regioncache.missing << " missing   "
-	     << stats.regioncache.reqmissing << " reqmissing   " << stats.regioncache.corrupt << " corrupt" << endl;
+	     << stats.regioncache.reqmissing << " reqmissing   " << stats.regioncache.corrupt << " corrupt   " << stats.regioncache.evicted << " evicted   "
+	     << stats.regioncache.reread << " reread" << endl;
+	cout << "prefetcher: " << stats.prefetchtiles << " tiles   " << stats.prefetchcache.read << " read   " << stats.prefetchcache.shared << " shared   "
+	     << stats.prefetchcache.trimmed << " trimmed" << endl;
+	cout << "tile writer: " << stats.tileswritten << " tiles written   " << stats.writestalls << " stalls" << endl;
+	cout << "scene graphs: " << stats.pcols << " pseudocolumns   " << stats.nodes << " nodes" << endl;
+	PhaseTimes all = allPhases(stats);
+	ostringstream phaseline;
+	phaseline << fixed << setprecision(2);
+	for (int i = 0; i < NUMPHASES; i++)
+		phaseline << "   " << all.ns[i] / 1e9 << " " << phaseName(i);
+	cout << "thread seconds:" << phaseline.str() << endl;
+	cout << "memory: " << stats.peakrss / 1048576 << " MB peak RSS   " << stats.chunkcachebytes / 1048576 << " MB chunks   "
+	     << stats.regioncachebytes / 1048576 << " MB regions   " << stats.tileimagebytes / 1048576 << " MB tile images" << endl;
 #if USE_MALLINFO
 	cout << "heap usage: " << stats.heapusage << " bytes" << endl;
 #endif
 }
 
+// for -b: the throughput of the whole render, and, for each phase, how much of the threads' time it took
+//  and how long it took per chunk/tile/etc.
+void printBenchStats(uint64_t elapsed, const RenderStats& stats)
+{
+	PhaseTimes all = allPhases(stats);
+	double seconds = elapsed / 1e9, mb = 1048576.0;
+	cout << fixed << setprecision(2);
+	// (the required base tiles include the ones that come out empty and are never written, so this can be
+	//  higher than the all-levels rate)
+	cout << "benchmark: " << seconds << " seconds   " << stats.reqtilecount / seconds << " required base tiles/s   "
+	     << stats.tileswritten / seconds << " tiles/s (all zoom levels)" << endl;
+	cout << "           " << all.bytes[PHASE_READ] / mb / seconds << " MB/s region files read   " << all.bytes[PHASE_INFLATE] / mb / seconds
+	     << " MB/s chunks inflated   " << all.bytes[PHASE_WRITE] / mb / seconds << " MB/s PNG written" << endl;
+	uint64_t total = all.total();
+	for (int i = 0; i < NUMPHASES; i++)
+	{
+		cout << "  " << setw(10) << left << phaseName(i) << right << setw(10) << all.ns[i] / 1e9 << " s  " << setw(6)
+		     << (total == 0 ? 0.0 : all.ns[i] * 100.0 / total) << "%  " << setw(10) << all.count[i] << " x  " << setw(10)
+		     << (all.count[i] == 0 ? 0.0 : all.ns[i] / 1e6 / all.count[i]) << " ms each" << endl;
+	}
+	cout.unsetf(ios::floatfield);
+	cout << setprecision(6);
+}
+
 void runSingleThread(RenderJob& rj)
 {
 	cout << "single thread will render " << rj.stats.reqtilecount << " base tiles" << endl;
 	// allocate storage/caches
-	rj.regioncache.reset(new RegionCache(*rj.chunktable, *rj.regiontable, rj.inputpath, rj.fullrender, rj.stats.regioncache));
-	rj.chunkcache.reset(new ChunkCache(*rj.chunktable, *rj.regiontable, *rj.regioncache, rj.inputpath, rj.fullrender, rj.regionformat, rj.stats.chunkcache));
+	rj.regioncache.reset(new RegionCache(*rj.regiontable, rj.inputpath, rj.fullrender, 1 + rj.prefetchers, rj.regionbudget));
+	rj.sharedchunkcache.reset(new SharedChunkCache(rj.cachebudget, rj.cacheways));
+	rj.chunkcache.reset(new ChunkCache(*rj.sharedchunkcache, *rj.chunktable, *rj.regioncache, rj.inputpath, rj.fullrender, rj.regionformat, rj.stats.chunkcache, rj.stats.regioncache, &rj.stats.phases));
 	rj.tilecache.reset(new TileCache(rj.mp));
 	rj.scenegraph.reset(new SceneGraph);
+	// if there are prefetch threads, they follow us through the whole map
+	if (rj.prefetchers > 0 && !rj.testmode)
+	{
+		rj.prefetcher = new ChunkPrefetcher(rj, 1, NULL);
+		rj.prefetcher->start(0, ZoomTileIdx(0,0,0));
+	}
 	RGBAImage topimg;
 	// render the tiles recursively (starting at the very top)
+	uint64_t start = getNanoseconds();
 	renderZoomTile(ZoomTileIdx(0,0,0), rj, topimg);
+	rj.stats.phases.elapsed = getNanoseconds() - start;
+	rj.stats.renderphases.push_back(rj.stats.phases);
+	if (rj.prefetcher != NULL)
+	{
+		rj.prefetcher->finish(rj.stats);
+		delete rj.prefetcher;
+		rj.prefetcher = NULL;
+	}
 	// get memory stats
 	rj.stats.heapusage = getHeapUsage();
+	rj.stats.tileimagebytes = rj.tilecache->bytes() + rj.supertile.data.capacity() * sizeof(RGBAPixel);
+	rj.stats.scenegraphbytes = rj.scenegraph->bytes();
+	vector<RGBAPixel>().swap(rj.supertile.data);
 }
 
 struct WorkerThreadParams
 {
 	RenderJob *rj;
 	ThreadOutputCache *tocache;
-	vector<ZoomTileIdx> zoomtiles;  // tiles that this thread is responsible for
+	ZoomTileScheduler *scheduler;  // where to get zoom tiles from
+	int thread;  // this thread's index in the scheduler
 };
 
 void *runWorkerThread(void *arg)
 {
 	WorkerThreadParams *wtp = (WorkerThreadParams*)arg;
-	for (vector<ZoomTileIdx>::const_iterator it = wtp->zoomtiles.begin(); it != wtp->zoomtiles.end(); it++)
+	TRACE_THREAD("render " + tostring(wtp->thread));
+	uint64_t start = getNanoseconds();
+	ZoomTileIdx zti(-1, -1, -1);
+	while (wtp->scheduler->next(wtp->thread, zti))
 	{
-		int idx = wtp->tocache->getIndex(*it);
-		wtp->tocache->used[idx] = renderZoomTile(*it, *wtp->rj, wtp->tocache->images[idx]);
+		if (wtp->rj->prefetcher != NULL)
+			wtp->rj->prefetcher->start(wtp->thread, zti);
+		int idx = wtp->tocache->getIndex(zti);
+		wtp->tocache->used[zti.zoom][idx] = renderZoomTile(zti, *wtp->rj, wtp->tocache->images[zti.zoom][idx]);
+		finishZoomTile(zti, *wtp->rj, *wtp->tocache);
 	}
+	wtp->rj->stats.phases.elapsed = getNanoseconds() - start;
+	// the super tile image can be big (tens of MB at -s 8), so give it back now instead of holding onto it
+	//  while the other threads finish; just remember how big it got, for the memory stats
+	wtp->rj->stats.tileimagebytes = wtp->rj->supertile.data.capacity() * sizeof(RGBAPixel);
+	vector<RGBAPixel>().swap(wtp->rj->supertile.data);
 	return 0;
 }
 
@@ -126,118 +211,130 @@ bool memoryAvailable(int tiles, const MapParams& mp)
 	return true;
 }
 
+// how many zoom tiles per thread to aim for when choosing the zoom level to partition at
+#define TASKS_PER_THREAD 16
+
 // returns zoom level chosen for partitioning
-int assignThreadTasks(vector<WorkerThreadParams>& wtps, const TileTable& ttable, const MapParams& mp, int threads)
+int assignThreadTasks(ZoomTileScheduler& scheduler, const TileTable& ttable, const MapParams& mp, int threads)
 {
-	vector<ZoomTileIdx> best_reqzoomtiles;
-	vector<int64_t> best_costs;
-	vector<int> best_assignments;
-	double best_error = 1.1;
-	// start with zoom level 1 and go up from there
+	// we want plenty of zoom tiles per thread, so that there's something left to steal near the end of
+	//  the render; the deeper the zoom level, the finer the pieces, but the bigger the ThreadOutputCache
+	vector<ZoomTileScheduler::Task> best_tasks;
+	vector<ZoomTileIdx> zoomtiles;
+	// start with zoom level 1 and go down from there
 	for (int zoom = 1; zoom <= mp.baseZoom; zoom++)
 	{
 		// find all zoom tiles at this level that need to be drawn (i.e. contain > 0 required base tiles),
-		//  and their costs (number of required base tiles)
-		vector<ZoomTileIdx> reqzoomtiles;
-		vector<int64_t> costs;
-		vector<int> assignments;
-		int64_t size = (1 << zoom);
-		ZoomTileIdx zti(-1, -1, zoom);
-		for (zti.x = 0; zti.x < size; zti.x++)
-			for (zti.y = 0; zti.y < size; zti.y++)
-			{
-				int numreq = ttable.getNumRequired(zti, mp);
-				if (numreq > 0)
-				{
-					reqzoomtiles.push_back(zti);
-					costs.push_back(numreq);
-				}
-			}
+		//  and their costs (number of required base tiles); go through them in Z-order, so that each
+		//  thread's initial run of tiles covers a compact area
+		ttable.getRequiredZoomTiles(zoom, mp, zoomtiles);
+		vector<ZoomTileScheduler::Task> tasks;
+		for (vector<ZoomTileIdx>::const_iterator it = zoomtiles.begin(); it != zoomtiles.end(); it++)
+			tasks.push_back(ZoomTileScheduler::Task(*it, ttable.getNumRequired(*it, mp)));
 		// if there are too many tiles at this zoom level (that is, if the ThreadOutputCache wouldn't
-		//  fit in memory), then forget it (and those above it, too)
-		if (!memoryAvailable(reqzoomtiles.size(), mp))
-			break;
-		// compute a good schedule for this level and get its "error" (difference between max thread
-		//  cost and min thread cost, as a fraction of max thread cost)
-		pair<int64_t, double> error = schedule(costs, assignments, threads);
-		// if the error is less than 5%, or under 50 tiles (for small worlds), that's good enough
-		bool stop = error.second < 0.05 || error.first < 50;
-		// if this error is the best so far, remember these tiles/assignments
-		if (error.second < best_error || stop)
+		//  fit in memory), then forget it (and those below it, too)
+		// ...the cache also holds the levels above this one as they're built; each has at most a quarter
+		//  as many tiles as the one below it (rounding up)
+		int images = tasks.size();
+		for (int z = zoom, n = tasks.size(); z > 0; z--)
 		{
-			best_reqzoomtiles = reqzoomtiles;
-			best_costs = costs;
-			best_assignments = assignments;
-			best_error = error.second;
+			n = (n + 3) / 4;
+			images += n;
 		}
-		if (stop)
+		if (!memoryAvailable(images, mp) && !best_tasks.empty())
+			break;
+		best_tasks.swap(tasks);
+		if (best_tasks.size() >= threads * TASKS_PER_THREAD)
 			break;
 	}
 
-	// perform actual assignments
-	for (int i = 0; i < best_assignments.size(); i++)
-	{
-		wtps[best_assignments[i]].zoomtiles.push_back(best_reqzoomtiles[i]);
-		wtps[best_assignments[i]].rj->stats.reqtilecount += best_costs[i];
-	}
-
-	return best_reqzoomtiles.front().zoom;
+	scheduler.assign(best_tasks);
+	return best_tasks.front().zti.zoom;
 }
 
 void runMultithreaded(RenderJob& rj, int threads)
 {
+	// the chunk and region caches are shared by all the threads
+	if (!rj.testmode)
+	{
+		rj.regioncache.reset(new RegionCache(*rj.regiontable, rj.inputpath, rj.fullrender, threads + rj.prefetchers, rj.regionbudget));
+		rj.sharedchunkcache.reset(new SharedChunkCache(rj.cachebudget, rj.cacheways));
+	}
+
 	// create a separate RenderJob for each thread; each one gets its own copy of the parameters,
-	//  plus its own storage (caches, scenegraph, etc.)
+	//  plus its own storage (scenegraph, tile images, etc.)
 	RenderJob *rjs = new RenderJob[threads];
 	arrayDeleter<RenderJob> adrj(rjs);
 	for (int i = 0; i < threads; i++)
 	{
 		rjs[i].testmode = rj.testmode;
+		rjs[i].supertiles = rj.supertiles;
+		rjs[i].waterruns = rj.waterruns;
+		rjs[i].fronttoback = rj.fronttoback;
 		rjs[i].fullrender = rj.fullrender;
 		rjs[i].regionformat = rj.regionformat;
 		rjs[i].mp = rj.mp;
+		rjs[i].pngprofiles = rj.pngprofiles;
 		rjs[i].inputpath = rj.inputpath;
 		rjs[i].outputpath = rj.outputpath;
 		rjs[i].blockimages = rj.blockimages;
+		rjs[i].tilewriter = rj.tilewriter;
 		rjs[i].chunktable.reset(new ChunkTable);
 		rjs[i].chunktable->copyFrom(*rj.chunktable);
 		rjs[i].tiletable.reset(new TileTable);
 		rjs[i].tiletable->copyFrom(*rj.tiletable);
-		rjs[i].regiontable.reset(new RegionTable);
-		rjs[i].regiontable->copyFrom(*rj.regiontable);
 		if (!rjs[i].testmode)
 		{
-			rjs[i].regioncache.reset(new RegionCache(*rjs[i].chunktable, *rjs[i].regiontable, rjs[i].inputpath, rjs[i].fullrender, rjs[i].stats.regioncache));
-			rjs[i].chunkcache.reset(new ChunkCache(*rjs[i].chunktable, *rjs[i].regiontable, *rjs[i].regioncache, rjs[i].inputpath, rjs[i].fullrender, rjs[i].regionformat, rjs[i].stats.chunkcache));
+			rjs[i].chunkcache.reset(new ChunkCache(*rj.sharedchunkcache, *rjs[i].chunktable, *rj.regioncache, rjs[i].inputpath, rjs[i].fullrender, rjs[i].regionformat, rjs[i].stats.chunkcache, rjs[i].stats.regioncache, &rjs[i].stats.phases));
 			rjs[i].scenegraph.reset(new SceneGraph);
 		}
 		rjs[i].tilecache.reset(new TileCache(rjs[i].mp));
 	}
 
-	// divide the required tiles evenly among the threads: find a zoom level that has enough tiles for us
-	//  to make a balanced assignment, then give each thread some tiles from that level
-	vector<WorkerThreadParams> wtps(threads);
-	for (int i = 0; i < threads; i++)
-		wtps[i].rj = &rjs[i];
-	int threadzoom = assignThreadTasks(wtps, *rj.tiletable, rj.mp, threads);
+	// cut the map into zoom tiles at some level, and give each thread a run of them to start with; after
+	//  that, the threads balance the load themselves by stealing from each other
+	ZoomTileScheduler scheduler(threads);
+	int threadzoom = assignThreadTasks(scheduler, *rj.tiletable, rj.mp, threads);
 	for (int i = 0; i < threads; i++)
-		cout << "thread " << i << " will render " << rjs[i].stats.reqtilecount << " base tiles" << endl;
+		cout << "thread " << i << " starts with " << scheduler.queues[i].tasks.size() << " zoom tiles ("
+		     << scheduler.queues[i].remaining << " base tiles)" << endl;
+
+	// start the prefetch threads (if any), with a lane for each render thread
+	ChunkPrefetcher *prefetcher = NULL;
+	if (rj.prefetchers > 0 && !rj.testmode)
+	{
+		prefetcher = new ChunkPrefetcher(rj, threads, &scheduler);
+		for (int i = 0; i < threads; i++)
+		{
+			rjs[i].prefetcher = prefetcher;
+			rjs[i].prefetchlane = i;
+		}
+	}
 
 	// allocate storage for the threads to store their rendered zoom tiles into
-	// (doesn't need to be synchronized, because threads only touch the images for their own
-	//  zoom tiles)
+	// (doesn't need to be synchronized, because only the thread that takes a zoom tile from the
+	//  scheduler touches its image, and only the last thread to finish a group of four touches
+	//  their parent's)
 	auto_ptr<ThreadOutputCache> tocache(new ThreadOutputCache(threadzoom));
 	for (int i = 0; i < threads; i++)
-	{
-		wtps[i].tocache = tocache.get();
-		for (vector<ZoomTileIdx>::const_iterator it = wtps[i].zoomtiles.begin(); it != wtps[i].zoomtiles.end(); it++)
+		for (deque<ZoomTileScheduler::Task>::const_iterator it = scheduler.queues[i].tasks.begin(); it != scheduler.queues[i].tasks.end(); it++)
 		{
-			int idx = tocache->getIndex(*it);
-			tocache->images[idx].create(rj.mp.tileSize(), rj.mp.tileSize());  // reserve the memory
+			int idx = tocache->getIndex(it->zti);
+			tocache->images[threadzoom][idx].create(rj.mp.tileSize(), rj.mp.tileSize());  // reserve the memory
+			tocache->expect(it->zti);
+			rj.stats.tileimagebytes += tocache->images[threadzoom][idx].data.capacity() * sizeof(RGBAPixel);
 		}
+	vector<WorkerThreadParams> wtps(threads);
+	for (int i = 0; i < threads; i++)
+	{
+		wtps[i].rj = &rjs[i];
+		wtps[i].tocache = tocache.get();
+		wtps[i].scheduler = &scheduler;
+		wtps[i].thread = i;
 	}
 
-	// run the threads; each one renders all the zoom tiles assigned to it
+	// run the threads; each one renders zoom tiles until the scheduler runs out, building the zoom
+	//  levels above them as it goes
 	cout << "running threads..." << endl;
 	vector<pthread_t> pthrs(threads);
 	for (int i = 0; i < threads; i++)
@@ -249,18 +346,29 @@ void runMultithreaded(RenderJob& rj, int threads)
 	{
 		pthread_join(pthrs[i], NULL);
 	}
-
-	// now that the threads are done, render the final zoom levels (the ones above the ThreadOutputCache level)
-	cout << "finishing top zoom levels..." << endl;
-	rj.tilecache.reset(new TileCache(rj.mp));
-	RGBAImage topimg;
-	renderZoomTile(ZoomTileIdx(0,0,0), rj, topimg, *tocache);
+	if (prefetcher != NULL)
+	{
+		prefetcher->finish(rj.stats);
+		delete prefetcher;
+	}
+	for (int i = 0; i < threads; i++)
+	{
+		rjs[i].stats.reqtilecount = scheduler.queues[i].taken;
+		cout << "thread " << i << " rendered " << rjs[i].stats.reqtilecount << " base tiles (stole "
+		     << scheduler.queues[i].stolen << " zoom tiles)" << endl;
+	}
 
 	// combine the thread stats
 	for (int i = 0; i < threads; i++)
 	{
 		rj.stats.chunkcache += rjs[i].stats.chunkcache;
 		rj.stats.regioncache += rjs[i].stats.regioncache;
+		rj.stats.pcols += rjs[i].stats.pcols;
+		rj.stats.nodes += rjs[i].stats.nodes;
+		rj.stats.renderphases.push_back(rjs[i].stats.phases);
+		rj.stats.tileimagebytes += rjs[i].tilecache->bytes() + rjs[i].stats.tileimagebytes;
+		if (rjs[i].scenegraph.get() != NULL)
+			rj.stats.scenegraphbytes += rjs[i].scenegraph->bytes();
 	}
 	rj.stats.heapusage = getHeapUsage();
 
@@ -316,6 +424,13 @@ bool expandMap(const string& outputpath)
 	renameFile(outputpath + "/2.png", outputpath + "/2/1.png");
 	renameFile(outputpath + "/3.png", outputpath + "/3/0.png");
 
+	// the new tiles get the PNG profiles for their zoom levels (as they will be once baseZoom has been
+	//  incremented)
+	PNGProfileSet pngprofiles;
+	pngprofiles.fromString(mp.pngProfiles);
+	const PNGProfile& profile1 = pngprofiles.get(1, mp.baseZoom + 1);
+	const PNGProfile& profile0 = pngprofiles.get(0, mp.baseZoom + 1);
+
 	// build the new zoom 1 tiles
 	RGBAImage old0img;
 	bool used0 = old0img.readPNG(outputpath + "/0/3.png");
@@ -324,7 +439,7 @@ bool expandMap(const string& outputpath)
 	if (used0)
 	{
 		reduceHalf(new0img, ImageRect(tileSize/2, tileSize/2, tileSize/2, tileSize/2), old0img);
-		new0img.writePNG(outputpath + "/0.png");
+		new0img.writePNG(outputpath + "/0.png", profile1);
 	}
 	RGBAImage old1img;
 	bool used1 = old1img.readPNG(outputpath + "/1/2.png");
@@ -333,7 +448,7 @@ bool expandMap(const string& outputpath)
 	if (used1)
 	{
 		reduceHalf(new1img, ImageRect(0, tileSize/2, tileSize/2, tileSize/2), old1img);
-		new1img.writePNG(outputpath + "/1.png");
+		new1img.writePNG(outputpath + "/1.png", profile1);
 	}
 	RGBAImage old2img;
 	bool used2 = old2img.readPNG(outputpath + "/2/1.png");
@@ -342,7 +457,7 @@ bool expandMap(const string& outputpath)
 	if (used2)
 	{
 		reduceHalf(new2img, ImageRect(tileSize/2, 0, tileSize/2, tileSize/2), old2img);
-		new2img.writePNG(outputpath + "/2.png");
+		new2img.writePNG(outputpath + "/2.png", profile1);
 	}
 	RGBAImage old3img;
 	bool used3 = old3img.readPNG(outputpath + "/3/0.png");
@@ -351,7 +466,7 @@ bool expandMap(const string& outputpath)
 	if (used3)
 	{
 		reduceHalf(new3img, ImageRect(0, 0, tileSize/2, tileSize/2), old3img);
-		new3img.writePNG(outputpath + "/3.png");
+		new3img.writePNG(outputpath + "/3.png", profile1);
 	}
 
 	// build the new base tile
@@ -365,7 +480,7 @@ bool expandMap(const string& outputpath)
 		reduceHalf(newbase, ImageRect(0, tileSize/2, tileSize/2, tileSize/2), new2img);
 	if (used3)
 		reduceHalf(newbase, ImageRect(tileSize/2, tileSize/2, tileSize/2, tileSize/2), new3img);
-	newbase.writePNG(outputpath + "/base.png");
+	newbase.writePNG(outputpath + "/base.png", profile0);
 
 	// write new params (with incremented baseZoom)
 	mp.baseZoom++;
@@ -405,18 +520,104 @@ void writeHTML(const RenderJob& rj, const string& htmlpath)
 	copyFile(htmlpath + "/style.css", rj.outputpath + "/style.css");
 }
 
-bool performRender(const string& inputpath, const string& outputpath, const string& imgpath, const MapParams& mp, const string& chunklist, const string& regionlist, int threads, int testworldsize, bool expand, const string& htmlpath)
+// the render report: everything printStats shows, plus the run parameters and a breakdown of where each
+//  thread's time went, as JSON (so that runs on different machines or with different versions can be compared
+//  by scripts)
+void writeJSONPhases(ostream& out, const PhaseTimes& pt)
+{
+	out << "{\"elapsed\": " << pt.elapsed / 1e9;
+	for (int i = 0; i < NUMPHASES; i++)
+		out << ", \"" << phaseName(i) << "\": {\"seconds\": " << pt.ns[i] / 1e9 << ", \"count\": " << pt.count[i] << ", \"bytes\": " << pt.bytes[i] << "}";
+	out << "}";
+}
+
+void writeJSONThreads(ostream& out, const char *role, const vector<PhaseTimes>& phases, bool& first)
+{
+	for (vector<PhaseTimes>::const_iterator it = phases.begin(); it != phases.end(); it++)
+	{
+		out << (first ? "\n" : ",\n") << "    {\"role\": \"" << role << "\", \"phases\": ";
+		writeJSONPhases(out, *it);
+		out << "}";
+		first = false;
+	}
+}
+
+void writeJSONChunkCache(ostream& out, const ChunkCacheStats& ccs)
+{
+	out << "{\"hits\": " << ccs.hits << ", \"misses\": " << ccs.misses << ", \"read\": " << ccs.read << ", \"shared\": " << ccs.shared
+	    << ", \"waited\": " << ccs.waited << ", \"skipped\": " << ccs.skipped << ", \"missing\": " << ccs.missing << ", \"reqmissing\": " << ccs.reqmissing
+	    << ", \"corrupt\": " << ccs.corrupt << ", \"trimmed\": " << ccs.trimmed << ", \"evicted\": " << ccs.evicted << ", \"reread\": " << ccs.reread
+	    << ", \"conflicts\": " << ccs.conflicts << "}";
+}
+
+bool writeReport(const RenderJob& rj, uint64_t elapsed, int threads, int encoders)
+{
+	const RenderStats& stats = rj.stats;
+	string filename = rj.outputpath + "/pigmap.report";
+	ofstream out(filename.c_str());
+	if (out.fail())
+		return false;
+	out << "{" << endl;
+	out << "  \"seconds\": " << elapsed / 1e9 << "," << endl;
+	out << "  \"params\": {\"B\": " << rj.mp.B << ", \"T\": " << rj.mp.T << ", \"baseZoom\": " << rj.mp.baseZoom
+	    << ", \"fullrender\": " << (rj.fullrender ? "true" : "false") << ", \"regionformat\": " << (rj.regionformat ? "true" : "false")
+	    << ", \"threads\": " << threads << ", \"encoders\": " << encoders << ", \"prefetchers\": " << rj.prefetchers
+	    << ", \"chunkcachebytes\": " << rj.cachebudget << ", \"chunkcacheways\": " << rj.cacheways << ", \"regioncachebytes\": " << rj.regionbudget
+	    << ", \"supertiles\": " << rj.supertiles << ", \"waterruns\": " << (rj.waterruns ? "true" : "false")
+	    << ", \"fronttoback\": " << (rj.fronttoback ? "true" : "false")
+	    << ", \"pngprofiles\": \"" << rj.mp.pngProfiles << "\"}," << endl;
+	out << "  \"counts\": {\"chunks\": " << stats.reqchunkcount << ", \"regions\": " << stats.reqregioncount << ", \"basetiles\": " << stats.reqtilecount
+	    << ", \"tileswritten\": " << stats.tileswritten << ", \"writestalls\": " << stats.writestalls << ", \"pcols\": " << stats.pcols
+	    << ", \"nodes\": " << stats.nodes << ", \"prefetchtiles\": " << stats.prefetchtiles << "}," << endl;
+	out << "  \"chunkcache\": ";
+	writeJSONChunkCache(out, stats.chunkcache);
+	out << "," << endl << "  \"prefetchcache\": ";
+	writeJSONChunkCache(out, stats.prefetchcache);
+	const RegionCacheStats& rcs = stats.regioncache;
+	out << "," << endl << "  \"regioncache\": {\"hits\": " << rcs.hits << ", \"misses\": " << rcs.misses << ", \"read\": " << rcs.read
+	    << ", \"skipped\": " << rcs.skipped << ", \"missing\": " << rcs.missing << ", \"reqmissing\": " << rcs.reqmissing << ", \"corrupt\": " << rcs.corrupt
+	    << ", \"evicted\": " << rcs.evicted << ", \"reread\": " << rcs.reread << "}," << endl;
+	out << "  \"memory\": {\"peakrss\": " << stats.peakrss << ", \"chunkcache\": " << stats.chunkcachebytes << ", \"regioncache\": " << stats.regioncachebytes
+	    << ", \"tileimages\": " << stats.tileimagebytes << ", \"scenegraphs\": " << stats.scenegraphbytes << ", \"blockimages\": " << stats.blockimagebytes
+	    << ", \"tilewriter\": " << stats.writerbytes << ", \"heap\": " << stats.heapusage << "}," << endl;
+	// (the totals are over all the threads; the phase times of each thread are its own, and its elapsed time is
+	//  how long it ran, so the difference is time spent waiting or doing something else)
+	PhaseTimes all = allPhases(stats);
+	out << "  \"phases\": ";
+	writeJSONPhases(out, all);
+	out << "," << endl << "  \"threads\": [";
+	bool first = true;
+	writeJSONThreads(out, "render", stats.renderphases, first);
+	writeJSONThreads(out, "prefetch", stats.prefetchphases, first);
+	writeJSONThreads(out, "encoder", stats.encoderphases, first);
+	out << endl << "  ]" << endl << "}" << endl;
+	return !out.fail();
+}
+
+bool performRender(const string& inputpath, const string& outputpath, const string& imgpath, const MapParams& mp, const string& chunklist, const string& regionlist, int threads, int testworldsize, bool expand, const string& htmlpath, int cachemb, int cacheways, int regionmb, int encoders, int supertiles, bool waterruns, bool fronttoback, int prefetchers, const string& tracefile, bool bench)
 {
-	time_t tstart = time(NULL);
+	uint64_t tstart = getNanoseconds();
+#if USE_TRACING
+	if (!tracefile.empty())
+		startTracing();
+#endif
+	TRACE_THREAD("main");
 
 	// prepare the rendering params and the chunk/tile tables
 	// ...note that mp.baseZoom might not be set yet if this is a full render; makeAllChunksRequired
 	//  will handle it
 	RenderJob rj;
 	rj.testmode = testworldsize != -1;
+	rj.supertiles = supertiles;
+	rj.waterruns = waterruns;
+	rj.fronttoback = fronttoback;
+	rj.prefetchers = prefetchers;
 	rj.mp = mp;
 	rj.inputpath = inputpath;
 	rj.outputpath = outputpath;
+	rj.cachebudget = (int64_t)cachemb * 1024 * 1024;
+	rj.cacheways = cacheways;
+	rj.regionbudget = (int64_t)regionmb * 1024 * 1024;
 	if (!rj.blockimages.create(rj.mp.B, imgpath))
 	{
 		cerr << "no block images available; aborting render" << endl;
@@ -430,6 +631,12 @@ bool performRender(const string& inputpath, const string& outputpath, const stri
 		cout << "region-format world detected" << endl;
 	else
 		cout << "no regions detected; assuming chunk-format world" << endl;
+	// the chunk index is kept for region-format worlds only; for an incremental update it tells us which
+	//  chunks we can skip
+	ChunkIndex chunkindex;
+	// ...and if block snapshots are on, they're kept alongside it
+	RegionSnapshots snapshots(rj.outputpath);
+	RegionSnapshots *snapshotsptr = (rj.regionformat && rj.mp.blockSnapshots) ? &snapshots : NULL;
 
 	// test world
 	if (testworldsize != -1)
@@ -445,7 +652,10 @@ bool performRender(const string& inputpath, const string& outputpath, const stri
 		cout << "scanning world data..." << endl;
 		if (rj.regionformat)
 		{
-			if (!makeAllRegionsRequired(rj.inputpath, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount))
+			// filling in the index means reading every region file in full, so a full render only does
+			//  that when it has to read them anyway, to take snapshots; otherwise the index starts out
+			//  empty, and regions get their entries as they show up in incremental updates
+			if (!makeAllRegionsRequired(rj.inputpath, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount, (snapshotsptr != NULL) ? &chunkindex : NULL, snapshotsptr))
 				return false;
 		}
 		else
@@ -462,7 +672,9 @@ bool performRender(const string& inputpath, const string& outputpath, const stri
 		if (rj.regionformat)
 		{
 			cout << "processing regionlist..." << endl;
-			rv = readRegionlist(regionlist, rj.inputpath, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount);
+			if (!chunkindex.readFile(rj.outputpath))
+				cout << "no usable chunk index; all chunks in listed regions will be redrawn" << endl;
+			rv = readRegionlist(regionlist, rj.inputpath, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount, &chunkindex, snapshotsptr);
 		}
 		else
 		{
@@ -483,7 +695,11 @@ bool performRender(const string& inputpath, const string& outputpath, const stri
 			rj.regiontable.reset(new RegionTable);
 			if (rj.regionformat)
 			{
-				if (0 != readRegionlist(regionlist, rj.inputpath, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount))
+				// the first attempt already updated the index, so start over from the one on disk
+				chunkindex = ChunkIndex();
+				chunkindex.readFile(rj.outputpath);
+				snapshots = RegionSnapshots(rj.outputpath);
+				if (0 != readRegionlist(regionlist, rj.inputpath, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount, &chunkindex, snapshotsptr))
 					return false;
 			}
 			else
@@ -494,6 +710,11 @@ bool performRender(const string& inputpath, const string& outputpath, const stri
 		}
 	}
 
+	if (!rj.fullrender && rj.regionformat)
+		cout << chunkindex.unchanged << " chunks unchanged since last render; skipping them" << endl;
+	if (!rj.fullrender && snapshotsptr != NULL)
+		cout << snapshots.chunksdiffed << " changed chunks compared with snapshots; " << snapshots.blocksdiffed << " changed blocks" << endl;
+
 	if (rj.stats.reqtilecount == 0)
 	{
 		cout << "nothing to do!  (no required tiles)" << endl;
@@ -501,11 +722,34 @@ bool performRender(const string& inputpath, const string& outputpath, const stri
 	}
 
 	// render stuff
+	rj.pngprofiles.fromString(rj.mp.pngProfiles);  // (already validated)
+	// ...the TileWriter must be finished before we write the map params, so that a map never claims
+	//  to be complete while tiles are still waiting to be written
 	cout << "rendering tiles..." << endl;
-	if (threads >= 2)
-		runMultithreaded(rj, threads);
-	else
-		runSingleThread(rj);
+	TileWriter tilewriter(rj.testmode ? 0 : encoders);
+	rj.tilewriter = &tilewriter;
+	{
+		TRACE_SCOPE("render");
+		if (threads >= 2)
+			runMultithreaded(rj, threads);
+		else
+			runSingleThread(rj);
+	}
+	{
+		TRACE_SCOPE("finishwriter");
+		tilewriter.finish();
+	}
+	rj.stats.tileswritten = tilewriter.written;
+	rj.stats.writestalls = tilewriter.stalls;
+	rj.stats.encoderphases = tilewriter.encoderphases;
+	for (vector<RGBAImage*>::const_iterator it = tilewriter.buffers.begin(); it != tilewriter.buffers.end(); it++)
+		rj.stats.writerbytes += (*it)->data.capacity() * sizeof(RGBAPixel);
+	rj.stats.peakrss = getPeakRSS();
+	rj.stats.blockimagebytes = rj.blockimages.img.data.capacity() * sizeof(RGBAPixel);
+	if (rj.sharedchunkcache.get() != NULL)
+		rj.stats.chunkcachebytes = rj.sharedchunkcache->peakbytes;
+	if (rj.regioncache.get() != NULL)
+		rj.stats.regioncachebytes = rj.regioncache->peakbytes;
 
 	// double-check that all the required tiles were drawn
 	cout << "performing double-check..." << endl;
@@ -520,11 +764,35 @@ bool performRender(const string& inputpath, const string& outputpath, const stri
 	{
 		rj.mp.writeFile(rj.outputpath);
 		writeHTML(rj, htmlpath);
+		// ...and the chunk index and snapshots, now that the chunks they describe have actually been drawn
+		// (the snapshots go first: if we die in between, the old index will just make us compare more
+		//  chunks than necessary next time)
+		if (rj.regionformat)
+		{
+			if (rj.fullrender)
+				snapshots.removeAll();
+			snapshots.commit();
+			if (!chunkindex.writeFile(rj.outputpath))
+				cerr << "failed to write pigmap.chunkindex; next incremental update will redraw everything it's given" << endl;
+		}
 	}
 
-	// done; print stats
-	time_t tfinish = time(NULL);
-	printStats(tfinish - tstart, rj.stats);
+	// done; print stats (and save them in the report)
+	uint64_t elapsed = getNanoseconds() - tstart;
+	printStats(elapsed / 1000000000, rj.stats);
+	if (!rj.testmode && !writeReport(rj, elapsed, threads, encoders))
+		cerr << "failed to write pigmap.report" << endl;
+	if (bench)
+		printBenchStats(elapsed, rj.stats);
+#if USE_TRACING
+	if (!tracefile.empty())
+	{
+		if (writeTrace(tracefile))
+			cout << "event trace written to " << tracefile << endl;
+		else
+			cerr << "failed to write event trace " << tracefile << endl;
+	}
+#endif
 	return true;
 }
 
@@ -778,6 +1046,274 @@ void testReqTileCount(const string& inputpath)
 	}
 }
 
+// check that blendRow gives the same results as blend for every pair of alpha values (and a few
+//  colors), using row lengths that exercise the leftover pixels at the end as well
+void testBlend()
+{
+	const int ROWSIZE = 29;
+	vector<RGBAPixel> source(ROWSIZE), dest(ROWSIZE), expected(ROWSIZE);
+	int failures = 0;
+	for (int sa = 0; sa < 256; sa++)
+		for (int da = 0; da < 256; da++)
+			for (int n = 1; n <= ROWSIZE; n += 7)
+			{
+				for (int i = 0; i < n; i++)
+				{
+					source[i] = makeRGBA(rand() % 256, rand() % 256, rand() % 256, (i % 3 == 0) ? sa : ((i % 3 == 1) ? 255 : 0));
+					dest[i] = expected[i] = makeRGBA(rand() % 256, rand() % 256, rand() % 256, da);
+					if (i % 5 == 0)
+						source[i] = makeRGBA(RED(source[i]), GREEN(source[i]), BLUE(source[i]), sa);
+					blend(expected[i], source[i]);
+				}
+				blendRow(&dest[0], &source[0], n);
+				for (int i = 0; i < n; i++)
+					if (dest[i] != expected[i] && failures++ < 20)
+						cout << "blend mismatch: source " << hex << source[i] << "  got " << dest[i] << "  expected " << expected[i] << dec << endl;
+			}
+	cout << "blend test: " << failures << " failures" << endl;
+}
+
+// benchmark the chunk decompression backends on all the chunks in a region-format world, and make sure
+//  they agree
+void testInflate(const string& inputpath)
+{
+	// gather up the compressed data
+	vector<vector<uint8_t> > corpus;
+	size_t compressedsize = 0;
+	vector<string> regionpaths;
+	listEntries(inputpath + "/region", regionpaths);
+	vector<uint8_t> readbuf;
+	for (vector<string>::const_iterator it = regionpaths.begin(); it != regionpaths.end(); it++)
+	{
+		RegionIdx ri(0,0);
+		RegionFileReader rfreader;
+		if (!RegionIdx::fromFilePath(*it, ri) || 0 != rfreader.loadFromFile(ri, inputpath))
+			continue;
+		for (RegionChunkIterator rcit(ri); !rcit.end; rcit.advance())
+		{
+			const uint8_t *data;
+			size_t size;
+			if (0 == rfreader.getCompressedChunk(rcit.current, readbuf, data, size))
+			{
+				corpus.push_back(vector<uint8_t>(data, data + size));
+				compressedsize += size;
+			}
+		}
+	}
+	if (corpus.empty())
+	{
+		cout << "no region chunks found" << endl;
+		return;
+	}
+
+	// decompress everything a few times with each backend
+	const int REPS = 5;
+	vector<uint8_t> buf, buf2;
+	size_t uncompressedsize = 0;
+	timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int rep = 0; rep < REPS; rep++)
+		for (vector<vector<uint8_t> >::iterator it = corpus.begin(); it != corpus.end(); it++)
+		{
+			if (!inflateWithZlib(&((*it)[0]), it->size(), buf))
+				cout << "zlib failed to decompress a chunk!" << endl;
+			uncompressedsize += buf.size();
+		}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double zlibsecs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	cout << corpus.size() << " chunks: " << compressedsize << " bytes compressed, " << uncompressedsize / REPS << " uncompressed" << endl;
+	cout << "zlib: " << zlibsecs * 1e6 / (corpus.size() * REPS) << " us/chunk   "
+	     << uncompressedsize / zlibsecs / 1048576 << " MB/s" << endl;
+#if USE_LIBDEFLATE
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int rep = 0; rep < REPS; rep++)
+		for (vector<vector<uint8_t> >::iterator it = corpus.begin(); it != corpus.end(); it++)
+			if (!inflateWithLibdeflate(&((*it)[0]), it->size(), buf))
+				cout << "libdeflate failed to decompress a chunk!" << endl;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double ldsecs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	cout << "libdeflate: " << ldsecs * 1e6 / (corpus.size() * REPS) << " us/chunk   "
+	     << uncompressedsize / ldsecs / 1048576 << " MB/s   (" << zlibsecs / ldsecs << "x)" << endl;
+
+	// check that the two agree
+	for (vector<vector<uint8_t> >::iterator it = corpus.begin(); it != corpus.end(); it++)
+	{
+		inflateWithZlib(&((*it)[0]), it->size(), buf);
+		inflateWithLibdeflate(&((*it)[0]), it->size(), buf2);
+		if (buf != buf2)
+		{
+			cout << "zlib and libdeflate disagree!" << endl;
+			return;
+		}
+	}
+#else
+	cout << "(libdeflate not enabled; see USE_LIBDEFLATE in utils.h)" << endl;
+#endif
+}
+
+// render every tile of a region-format world (at B=6, T=1) with and without water runs, and see how far
+//  apart the results are and how long each one takes
+void testWaterRuns(const string& inputpath, const string& imgpath)
+{
+	RenderJob rj;
+	rj.testmode = false;
+	rj.fullrender = true;
+	rj.regionformat = true;
+	rj.inputpath = inputpath;
+	rj.mp = MapParams(6,1,-1);
+	if (!rj.blockimages.create(rj.mp.B, imgpath))
+		return;
+	rj.chunktable.reset(new ChunkTable);
+	rj.tiletable.reset(new TileTable);
+	rj.regiontable.reset(new RegionTable);
+	if (!makeAllRegionsRequired(inputpath, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount, NULL, NULL))
+		return;
+	rj.regioncache.reset(new RegionCache(*rj.regiontable, rj.inputpath, rj.fullrender, 1));
+	rj.sharedchunkcache.reset(new SharedChunkCache(256 * 1024 * 1024));
+	rj.chunkcache.reset(new ChunkCache(*rj.sharedchunkcache, *rj.chunktable, *rj.regioncache, rj.inputpath, rj.fullrender, rj.regionformat, rj.stats.chunkcache, rj.stats.regioncache));
+	rj.scenegraph.reset(new SceneGraph);
+
+	// one untimed pass to get all the chunks into the cache, then a few timed passes each way
+	vector<TileIdx> tiles;
+	for (RequiredTileIterator it(*rj.tiletable); !it.end; it.advance())
+		tiles.push_back(it.current.toTileIdx());
+	RGBAImage img1, img2;
+	rj.waterruns = false;
+	for (vector<TileIdx>::const_iterator it = tiles.begin(); it != tiles.end(); it++)
+		drawTile(*it, rj, img1);
+	// (alternate between the two, and keep the best time for each, to filter out noise)
+	const int REPS = 5;
+	double secs[2] = {1e9, 1e9};
+	for (int rep = 0; rep < REPS; rep++)
+		for (int runs = 0; runs < 2; runs++)
+		{
+			rj.waterruns = runs == 1;
+			timespec t0, t1;
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			for (vector<TileIdx>::const_iterator it = tiles.begin(); it != tiles.end(); it++)
+				drawTile(*it, rj, img1);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			secs[runs] = min(secs[runs], (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+		}
+
+	// compare each pixel, channel by channel; count[d] is how many channel values are off by d
+	int64_t pixels = 0, diffpixels = 0, difftiles = 0;
+	vector<int64_t> count(256, 0);
+	for (vector<TileIdx>::const_iterator it = tiles.begin(); it != tiles.end(); it++)
+	{
+		img1.create(rj.mp.tileSize(), rj.mp.tileSize());
+		img2.create(rj.mp.tileSize(), rj.mp.tileSize());
+		rj.waterruns = false;
+		drawTile(*it, rj, img1);
+		rj.waterruns = true;
+		drawTile(*it, rj, img2);
+		bool diff = false;
+		for (size_t i = 0; i < img1.data.size(); i++)
+		{
+			RGBAPixel p1 = img1.data[i], p2 = img2.data[i];
+			pixels++;
+			if (p1 == p2)
+				continue;
+			diffpixels++;
+			diff = true;
+			for (int shift = 0; shift < 32; shift += 8)
+				count[abs((int)((p1 >> shift) & 0xff) - (int)((p2 >> shift) & 0xff))]++;
+		}
+		if (diff)
+			difftiles++;
+	}
+	int maxdiff = 0;
+	int64_t within3 = 0, diffchannels = 0;
+	for (int d = 1; d < 256; d++)
+		if (count[d] != 0)
+		{
+			maxdiff = d;
+			diffchannels += count[d];
+			if (d <= 3)
+				within3 += count[d];
+		}
+	cout << tiles.size() << " tiles, " << difftiles << " different; " << pixels << " pixels, " << diffpixels << " different" << endl;
+	cout << diffchannels << " channel values different, " << within3 << " of them by 3 or less; largest difference " << maxdiff << endl;
+	cout << "exact: " << secs[0] * 1000 / tiles.size() << " ms/tile" << endl;
+	cout << "water runs: " << secs[1] * 1000 / tiles.size() << " ms/tile   (" << secs[0] / secs[1] << "x)" << endl;
+}
+
+// render every tile of a region-format world (at B=6, T=1) with both compositing methods, make sure
+//  they agree, and see how long each one takes
+void testCompositing(const string& inputpath, const string& imgpath)
+{
+	RenderJob rj;
+	rj.testmode = false;
+	rj.fullrender = true;
+	rj.regionformat = true;
+	rj.inputpath = inputpath;
+	rj.mp = MapParams(6,1,-1);
+	if (!rj.blockimages.create(rj.mp.B, imgpath))
+		return;
+	rj.chunktable.reset(new ChunkTable);
+	rj.tiletable.reset(new TileTable);
+	rj.regiontable.reset(new RegionTable);
+	if (!makeAllRegionsRequired(inputpath, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount, NULL, NULL))
+		return;
+	rj.regioncache.reset(new RegionCache(*rj.regiontable, rj.inputpath, rj.fullrender, 1));
+	rj.sharedchunkcache.reset(new SharedChunkCache(256 * 1024 * 1024));
+	rj.chunkcache.reset(new ChunkCache(*rj.sharedchunkcache, *rj.chunktable, *rj.regioncache, rj.inputpath, rj.fullrender, rj.regionformat, rj.stats.chunkcache, rj.stats.regioncache));
+	rj.scenegraph.reset(new SceneGraph);
+
+	// one untimed pass to get all the chunks into the cache, then a few timed passes with each method
+	vector<TileIdx> tiles;
+	for (RequiredTileIterator it(*rj.tiletable); !it.end; it.advance())
+		tiles.push_back(it.current.toTileIdx());
+	RGBAImage img1, img2;
+	rj.fronttoback = false;
+	for (vector<TileIdx>::const_iterator it = tiles.begin(); it != tiles.end(); it++)
+		drawTile(*it, rj, img1);
+	// (alternate between the methods, and keep the best time for each, to filter out noise)
+	const int REPS = 5;
+	double secs[2] = {1e9, 1e9};
+	for (int rep = 0; rep < REPS; rep++)
+		for (int method = 0; method < 2; method++)
+		{
+			rj.fronttoback = method == 1;
+			timespec t0, t1;
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			for (vector<TileIdx>::const_iterator it = tiles.begin(); it != tiles.end(); it++)
+				drawTile(*it, rj, img1);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			secs[method] = min(secs[method], (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+		}
+
+	// compare the tiles, and count the ones that fell back to the scene graph (and, for the rest, how many
+	//  nodes the coverage mask let us skip)
+	int mismatches = 0, fallbacks = 0;
+	int64_t nodes = 0, drawn = 0;
+	for (vector<TileIdx>::const_iterator it = tiles.begin(); it != tiles.end(); it++)
+	{
+		rj.fronttoback = false;
+		bool drawn1 = drawTile(*it, rj, img1);
+		rj.fronttoback = true;
+		bool drawn2 = drawTile(*it, rj, img2);
+		if (drawn1 != drawn2 || (drawn1 && img1.data != img2.data))
+			mismatches++;
+		const SceneGraph& sg = *rj.scenegraph;
+		bool protrudes = false;
+		for (vector<SceneGraphNode>::const_iterator node = sg.nodes.begin(); node != sg.nodes.end(); node++)
+			if (rj.blockimages.protrudes(node->bimgoffset))
+				protrudes = true;
+		if (protrudes)
+			fallbacks++;
+		else if (drawn2)
+		{
+			nodes += sg.nodes.size();
+			drawn += sg.drawlist.size();
+		}
+	}
+	cout << tiles.size() << " tiles, " << mismatches << " mismatches, " << fallbacks << " drawn with the scene graph anyway" << endl;
+	cout << "front-to-back drew " << drawn << " of " << nodes << " nodes" << endl;
+	cout << "scene graph: " << secs[0] * 1000 / tiles.size() << " ms/tile" << endl;
+	cout << "front-to-back: " << secs[1] * 1000 / tiles.size() << " ms/tile   (" << secs[0] / secs[1] << "x)" << endl;
+}
+
 void testResize()
 {
 	int sourceSize = 16;
@@ -795,7 +1331,7 @@ void testResize()
 
 //-------------------------------------------------------------------------------------------------------------------
 
-bool validateParamsFull(const string& inputpath, const string& outputpath, const string& imgpath, const MapParams& mp, int threads, const string& chunklist, const string& regionlist, bool expand, const string& htmlpath)
+bool validateParamsFull(const string& inputpath, const string& outputpath, const string& imgpath, const MapParams& mp, int threads, const string& chunklist, const string& regionlist, bool expand, const string& htmlpath, int cachemb, int cacheways, int regionmb, int encoders, int supertiles, int prefetchers)
 {
 	// -c and -x are not allowed for full renders
 	if (!chunklist.empty() || !regionlist.empty() || expand)
@@ -834,6 +1370,53 @@ bool validateParamsFull(const string& inputpath, const string& outputpath, const
 		return false;
 	}
 
+	// the chunk cache needs room for at least a handful of chunks
+	if (cachemb < 16)
+	{
+		cerr << "-M must be at least 16" << endl;
+		return false;
+	}
+	if (cacheways < 1 || cacheways > 256)
+	{
+		cerr << "-W must be in range 1-256" << endl;
+		return false;
+	}
+	if (regionmb < 0)
+	{
+		cerr << "-R must be at least 0" << endl;
+		return false;
+	}
+
+	// encoder threads: 0 means the render threads write their own tiles
+	if (encoders < 0 || encoders > 64)
+	{
+		cerr << "-e must be in range 0-64" << endl;
+		return false;
+	}
+
+	// super tiles must be a power of two, and not so big that the images get out of hand
+	if (supertiles != 1 && supertiles != 2 && supertiles != 4 && supertiles != 8)
+	{
+		cerr << "-s must be 1, 2, 4, or 8" << endl;
+		return false;
+	}
+
+	// prefetch threads: 0 means the render threads read all their own chunks
+	if (prefetchers < 0 || prefetchers > 64)
+	{
+		cerr << "-a must be in range 0-64" << endl;
+		return false;
+	}
+
+	// PNG profiles must make sense
+	PNGProfileSet pngprofiles;
+	if (!pngprofiles.fromString(mp.pngProfiles))
+	{
+		cerr << "-p must be a comma-separated list of [zoom:]profile, where profile is fast, default, or max" << endl;
+		cerr << "  (optionally followed by +palette), and zoom is a zoom level, a range like 0-3, or \"base\"" << endl;
+		return false;
+	}
+
 	// the various paths must be non-empty
 	if (inputpath.empty() || outputpath.empty())
 	{
@@ -851,11 +1434,18 @@ bool validateParamsFull(const string& inputpath, const string& outputpath, const
 		return false;
 	}
 
+	// block snapshots only work with region files
+	if (mp.blockSnapshots && !detectRegionFormat(inputpath))
+	{
+		cerr << "-d requires a region-format world" << endl;
+		return false;
+	}
+
 	return true;
 }
 
 // also sets MapParams to values from existing map
-bool validateParamsIncremental(const string& inputpath, const string& outputpath, const string& imgpath, MapParams& mp, int threads, const string& chunklist, const string& regionlist, bool expand, const string& htmlpath)
+bool validateParamsIncremental(const string& inputpath, const string& outputpath, const string& imgpath, MapParams& mp, int threads, const string& chunklist, const string& regionlist, bool expand, const string& htmlpath, int cachemb, int cacheways, int regionmb, int encoders, int supertiles, int prefetchers)
 {
 	// -B, -T, -Z, -y, -Y are not allowed
 	if (mp.B != -1 || mp.T != -1 || mp.baseZoom != -1 || mp.userMinY || mp.userMaxY)
@@ -895,12 +1485,34 @@ bool validateParamsIncremental(const string& inputpath, const string& outputpath
 		return false;
 	}
 
+	// block snapshots only work with region files
+	if (mp.blockSnapshots && !detectRegionFormat(inputpath))
+	{
+		cerr << "-d requires a region-format world" << endl;
+		return false;
+	}
+
 	// pigmap.params must be present in output path; read it now
+	// ...PNG profiles given on the command line replace the ones stored there, and -d turns on block
+	//  snapshots if they weren't already
+	string pngProfiles = mp.pngProfiles;
+	bool blockSnapshots = mp.blockSnapshots;
 	if (!mp.readFile(outputpath))
 	{
 		cerr << "can't find pigmap.params in output path" << endl;
 		return false;
 	}
+	if (!pngProfiles.empty())
+		mp.pngProfiles = pngProfiles;
+	if (blockSnapshots)
+		mp.blockSnapshots = true;
+	PNGProfileSet pngprofiles;
+	if (!pngprofiles.fromString(mp.pngProfiles))
+	{
+		cerr << "-p must be a comma-separated list of [zoom:]profile, where profile is fast, default, or max" << endl;
+		cerr << "  (optionally followed by +palette), and zoom is a zoom level, a range like 0-3, or \"base\"" << endl;
+		return false;
+	}
 
 	// must have a sensible number of threads (upper limit is arbitrary, but you'd need a truly
 	//  insanely large map to see any benefit to having that many...)
@@ -910,6 +1522,76 @@ bool validateParamsIncremental(const string& inputpath, const string& outputpath
 		return false;
 	}
 
+	// the chunk cache needs room for at least a handful of chunks
+	if (cachemb < 16)
+	{
+		cerr << "-M must be at least 16" << endl;
+		return false;
+	}
+	if (cacheways < 1 || cacheways > 256)
+	{
+		cerr << "-W must be in range 1-256" << endl;
+		return false;
+	}
+	if (regionmb < 0)
+	{
+		cerr << "-R must be at least 0" << endl;
+		return false;
+	}
+
+	// encoder threads: 0 means the render threads write their own tiles
+	if (encoders < 0 || encoders > 64)
+	{
+		cerr << "-e must be in range 0-64" << endl;
+		return false;
+	}
+
+	// super tiles must be a power of two, and not so big that the images get out of hand
+	if (supertiles != 1 && supertiles != 2 && supertiles != 4 && supertiles != 8)
+	{
+		cerr << "-s must be 1, 2, 4, or 8" << endl;
+		return false;
+	}
+
+	// prefetch threads: 0 means the render threads read all their own chunks
+	if (prefetchers < 0 || prefetchers > 64)
+	{
+		cerr << "-a must be in range 0-64" << endl;
+		return false;
+	}
+
+	return true;
+}
+
+bool validateParamsBench(const string& inputpath, const MapParams& mp, int testworldsize, const string& benchprofile, TerrainProfile& profile)
+{
+	// the world size is given with -w, as for test worlds
+	if (testworldsize < 1)
+	{
+		cerr << "-b requires a world size (-w), which must be positive" << endl;
+		return false;
+	}
+
+	if (!profile.fromString(benchprofile))
+	{
+		cerr << "-b must be flat, ocean, mountains, caves, or builds" << endl;
+		return false;
+	}
+
+	// the world is brand new, so there's nothing to take snapshots for
+	if (mp.blockSnapshots)
+	{
+		cerr << "-d not allowed for benchmarks" << endl;
+		return false;
+	}
+
+	// the generated world goes in the input path
+	if (inputpath.empty())
+	{
+		cerr << "must provide both input (-i) and output (-o) paths" << endl;
+		return false;
+	}
+
 	return true;
 }
 
@@ -984,15 +1666,27 @@ int main(int argc, char **argv)
 	//testTileIdxs();
 	//testReqTileCount(inputpath);
 	//testResize();
+	//testBlend();
+	//testInflate(inputpath);
+	//testWaterRuns(inputpath, imgpath);
+	//testCompositing(inputpath, imgpath);
 
-	string inputpath, outputpath, imgpath = ".", chunklist, regionlist, htmlpath = ".";
+	string inputpath, outputpath, imgpath = ".", chunklist, regionlist, htmlpath = ".", tracefile, benchprofile;
 	MapParams mp(-1,-1,-1);
 	int threads = 1;
+	int cachemb = -1;
+	int cacheways = CHUNKCACHEWAYS;
+	int regionmb = -1;
+	int encoders = -1;
 	int testworldsize = -1;
 	bool expand = false;
+	int supertiles = 1;
+	bool waterruns = false;
+	bool fronttoback = false;
+	int prefetchers = -1;
 
 	int c;
-	while ((c = getopt(argc, argv, "i:o:g:c:B:T:Z:h:w:xm:r:y:Y:")) != -1)
+	while ((c = getopt(argc, argv, "i:o:g:c:B:T:Z:h:M:W:R:e:a:p:s:w:xdqfm:r:y:Y:t:b:")) != -1)
 	{
 		switch (c)
 		{
@@ -1031,6 +1725,36 @@ int main(int argc, char **argv)
 			case 'h':
 				threads = atoi(optarg);
 				break;
+			case 'M':
+				cachemb = atoi(optarg);
+				break;
+			case 'W':
+				cacheways = atoi(optarg);
+				break;
+			case 'R':
+				regionmb = atoi(optarg);
+				break;
+			case 'e':
+				encoders = atoi(optarg);
+				break;
+			case 'a':
+				prefetchers = atoi(optarg);
+				break;
+			case 'p':
+				mp.pngProfiles = optarg;
+				break;
+			case 's':
+				supertiles = atoi(optarg);
+				break;
+			case 'd':
+				mp.blockSnapshots = true;
+				break;
+			case 'q':
+				waterruns = true;
+				break;
+			case 'f':
+				fronttoback = true;
+				break;
 			case 'x':
 				expand = true;
 				break;
@@ -1040,6 +1764,12 @@ int main(int argc, char **argv)
 			case 'w':
 				testworldsize = atoi(optarg);
 				break;
+			case 't':
+				tracefile = optarg;
+				break;
+			case 'b':
+				benchprofile = optarg;
+				break;
 			case '?':
 				cerr << "-" << (char)optopt << ": unrecognized option or missing argument" << endl;
 				return 1;
@@ -1049,23 +1779,57 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if (testworldsize != -1)
+	// if the chunk cache size wasn't specified, give it 64 MB per thread, plus another 64 MB
+	if (cachemb == -1)
+		cachemb = 64 * (threads + 1);
+	// ...and the region cache 32 MB per thread, plus another 32 MB
+	if (regionmb == -1)
+		regionmb = 32 * (threads + 1);
+	// ...and if the number of PNG encoder threads wasn't specified, use one per render thread
+	if (encoders == -1)
+		encoders = threads;
+	// ...and no prefetch threads unless asked for
+	if (prefetchers == -1)
+		prefetchers = 0;
+
+	// the event trace is only available if it was compiled in
+	if (!tracefile.empty() && !USE_TRACING)
+	{
+		cerr << "-t requires tracing to be compiled in (set USE_TRACING to 1 in utils.h)" << endl;
+		return 1;
+	}
+
+	bool bench = !benchprofile.empty();
+	if (bench)
+	{
+		// generate the world, then render all of it like any other
+		TerrainProfile profile;
+		if (!validateParamsBench(inputpath, mp, testworldsize, benchprofile, profile))
+			return 1;
+		if (!validateParamsFull(inputpath, outputpath, imgpath, mp, threads, chunklist, regionlist, expand, htmlpath, cachemb, cacheways, regionmb, encoders, supertiles, prefetchers))
+			return 1;
+		int64_t worldbytes;
+		if (!makeSyntheticWorld(inputpath, testworldsize, profile, worldbytes))
+			return 1;
+		testworldsize = -1;
+	}
+	else if (testworldsize != -1)
 	{
 		if (!validateParamsTest(inputpath, outputpath, imgpath, mp, threads, chunklist, regionlist, expand, htmlpath, testworldsize))
 			return 1;
 	}
 	else if (chunklist.empty() && regionlist.empty())
 	{
-		if (!validateParamsFull(inputpath, outputpath, imgpath, mp, threads, chunklist, regionlist, expand, htmlpath))
+		if (!validateParamsFull(inputpath, outputpath, imgpath, mp, threads, chunklist, regionlist, expand, htmlpath, cachemb, cacheways, regionmb, encoders, supertiles, prefetchers))
 			return 1;
 	}
 	else
 	{
-		if (!validateParamsIncremental(inputpath, outputpath, imgpath, mp, threads, chunklist, regionlist, expand, htmlpath))
+		if (!validateParamsIncremental(inputpath, outputpath, imgpath, mp, threads, chunklist, regionlist, expand, htmlpath, cachemb, cacheways, regionmb, encoders, supertiles, prefetchers))
 			return 1;
 	}
 
-	if (!performRender(inputpath, outputpath, imgpath, mp, chunklist, regionlist, threads, testworldsize, expand, htmlpath))
+	if (!performRender(inputpath, outputpath, imgpath, mp, chunklist, regionlist, threads, testworldsize, expand, htmlpath, cachemb, cacheways, regionmb, encoders, supertiles, waterruns, fronttoback, prefetchers, tracefile, bench))
 		return 1;
 
 	return 0;
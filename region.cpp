@@ -18,9 +18,14 @@
 #include <stdio.h>
 #include <iostream>
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <errno.h>
+#include <unistd.h>
 
 #include "region.h"
 #include "utils.h"
+#include "threads.h"
 
 using namespace std;
 
@@ -47,8 +52,35 @@ FILE* openRegionFile(const RegionIdx& ri, const string& inputpath, bool& anvil)
 	return fopen(filename.c_str(), "rb");
 }
 
+// read as much as we can (up to size bytes) from some offset in a file; returns the number of bytes read,
+//  which is less than size if the file ends first (or there's an error)
+size_t preadFully(int fd, uint8_t *buf, size_t size, size_t offset)
+{
+	size_t done = 0;
+	while (done < size)
+	{
+		ssize_t count = pread(fd, buf + done, size - done, offset + done);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count <= 0)
+			break;
+		done += count;
+	}
+	return done;
+}
+
+void RegionFileReader::unload()
+{
+	if (fd != -1)
+		close(fd);
+	fd = -1;
+	filelength = 0;
+}
+
 int RegionFileReader::loadFromFile(const RegionIdx& ri, const string& inputpath)
 {
+	unload();
+
 	// open file
 	FILE *f = openRegionFile(ri, inputpath, anvil);
 	if (f == NULL)
@@ -58,23 +90,29 @@ int RegionFileReader::loadFromFile(const RegionIdx& ri, const string& inputpath)
 	// get file length
 	fseek(f, 0, SEEK_END);
 	size_t length = (size_t)ftell(f);
-	fseek(f, 0, SEEK_SET);
 	if (length < 4096)
 		return -2;
 
-	// read the header
-	size_t count = fread(&(offsets[0]), 4096, 1, f);
-	if (count < 1)
+	// keep our own descriptor for reading the chunks later (the FILE gets closed on the way out)
+	int rfd = dup(fileno(f));
+	if (rfd == -1)
 		return -2;
 
-	// read the rest of the file
-	chunkdata.resize(length - 4096);
-	if (length > 4096)
+	// read the header: the offsets, and the timestamps if they're there
+	uint8_t header[8192];
+	size_t count = preadFully(rfd, header, 8192, 0);
+	if (count < 4096)
 	{
-		count = fread(&(chunkdata[0]), length - 4096, 1, f);
-		if (count < 1)
-			return -2;
+		close(rfd);
+		return -2;
 	}
+	memcpy(&(offsets[0]), header, 4096);
+	if (count == 8192)
+		memcpy(&(timestamps[0]), header + 4096, 4096);
+	else
+		fill(timestamps.begin(), timestamps.end(), 0);
+	fd = rfd;
+	filelength = length;
 	return 0;
 }
 
@@ -94,25 +132,78 @@ int RegionFileReader::loadHeaderOnly(const RegionIdx& ri, const string& inputpat
 	return 0;
 }
 
-int RegionFileReader::decompressChunk(const ChunkOffset& co, vector<uint8_t>& buf)
+int RegionFileReader::getCompressedChunk(const ChunkOffset& co, vector<uint8_t>& readbuf, const uint8_t*& data, size_t& size) const
 {
 	// see if chunk is present
-	if (!containsChunk(co))
+	int idx = getIdx(co);
+	if (offsets[idx] == 0)
 		return -1;
 
-	// attempt to decompress chunk data into buffer
-	int idx = getIdx(co);
-	uint32_t sector = getSectorOffset(idx);
-	if ((sector - 1) * 4096 >= chunkdata.size())
+	// make sure the chunk's length field is actually inside the file (and not in the header)
+	size_t start = (size_t)getSectorOffset(idx) * 4096;
+	if (fd == -1 || start < 4096 || start + 5 > filelength)
+		return -2;
+
+	// read the sectors the header gives the chunk, which should hold all of it; if the file has been
+	//  cut short since we loaded it, this will come up short, and we'll call the chunk corrupt
+	size_t want = min((size_t)max(getSizeSectors(idx), (uint32_t)1) * 4096, filelength - start);
+	if (readbuf.size() < want)
+		readbuf.resize(want);
+	size_t got = preadFully(fd, &(readbuf[0]), want, start);
+	if (got < 5)
 		return -2;
-	uint8_t *chunkstart = &(chunkdata[(sector - 1) * 4096]);
-	uint32_t datasize = fromBigEndian(*((uint32_t*)chunkstart));
-	bool okay = readGzOrZlib(chunkstart + 5, datasize - 1, buf);
+	uint32_t datasize;
+	memcpy(&datasize, &(readbuf[0]), 4);
+	datasize = fromBigEndian(datasize);
+	if (datasize < 1 || datasize > filelength - start - 4)
+		return -2;
+
+	// if the length field says the data goes on past those sectors, go back for the rest
+	if (datasize + 4 > got)
+	{
+		if (got < want)
+			return -2;
+		if (readbuf.size() < datasize + 4)
+			readbuf.resize(datasize + 4);
+		if (preadFully(fd, &(readbuf[got]), datasize + 4 - got, start + got) < datasize + 4 - got)
+			return -2;
+	}
+
+	data = &(readbuf[5]);
+	size = datasize - 1;
+	return 0;
+}
+
+int RegionFileReader::decompressChunk(const ChunkOffset& co, vector<uint8_t>& readbuf, vector<uint8_t>& buf) const
+{
+	const uint8_t *data;
+	size_t size;
+	int result = getCompressedChunk(co, readbuf, data, size);
+	if (result != 0)
+		return result;
+
+	// attempt to decompress chunk data into buffer
+	// (zlib doesn't write to its input, so casting away the const is okay)
+	bool okay = readGzOrZlib(const_cast<uint8_t*>(data), size, buf);
 	if (!okay)
 		return -2;
 	return 0;
 }
 
+bool RegionFileReader::copyTo(FILE *f) const
+{
+	if (fd == -1)
+		return false;
+	vector<uint8_t> buf(1048576);
+	for (size_t offset = 0; offset < filelength; offset += buf.size())
+	{
+		size_t size = min(buf.size(), filelength - offset);
+		if (preadFully(fd, &(buf[0]), size, offset) < size || fwrite(&(buf[0]), size, 1, f) < 1)
+			return false;
+	}
+	return true;
+}
+
 int RegionFileReader::getContainedChunks(const RegionIdx& ri, const string84& inputpath, vector<ChunkIdx>& chunks)
 {
 	chunks.clear();
@@ -148,6 +239,216 @@ void RegionChunkIterator::advance()
 
 
 
+// 64-bit FNV-1a; the result is never 0, since that means "no chunk"
+uint64_t hashChunkData(const uint8_t *data, size_t size)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (const uint8_t *end = data + size; data != end; data++)
+		h = (h ^ *data) * 0x100000001b3ULL;
+	return (h == 0) ? 1 : h;
+}
+
+// the index file is a magic number and version, a region count, and then for each region: its x and z
+//  (8 bytes each), the number of chunks recorded, and the chunks themselves (2-byte position in the region,
+//  4-byte timestamp, 8-byte hash); everything is big-endian
+#define CHUNKINDEXMAGIC 0x504d4349
+#define CHUNKINDEXVERSION 1
+
+void putBigEndian(vector<uint8_t>& buf, uint64_t i, int bytes)
+{
+	for (int b = bytes - 1; b >= 0; b--)
+		buf.push_back((i >> (b*8)) & 0xff);
+}
+
+// reads big-endian ints out of a buffer; once anything runs past the end, it stays failed and returns 0s
+struct bigEndianReader
+{
+	const uint8_t *ptr, *end;
+	bool failed;
+
+	bigEndianReader(const vector<uint8_t>& buf) : ptr(buf.empty() ? NULL : &(buf[0])), end(ptr + buf.size()), failed(false) {}
+
+	uint64_t get(int bytes)
+	{
+		if (failed || end - ptr < bytes)
+		{
+			failed = true;
+			return 0;
+		}
+		uint64_t i = 0;
+		for (int b = 0; b < bytes; b++)
+			i = (i << 8) | *ptr++;
+		return i;
+	}
+};
+
+bool ChunkIndex::readFile(const string& outputpath)
+{
+	regions.clear();
+	string filename = outputpath + "/pigmap.chunkindex";
+	FILE *f = fopen(filename.c_str(), "rb");
+	if (f == NULL)
+		return false;
+	vector<uint8_t> buf;
+	{
+		fcloser fc(f);
+		fseek(f, 0, SEEK_END);
+		buf.resize((size_t)ftell(f));
+		fseek(f, 0, SEEK_SET);
+		if (!buf.empty() && fread(&(buf[0]), buf.size(), 1, f) < 1)
+		{
+			cerr << "couldn't read pigmap.chunkindex; ignoring it" << endl;
+			return false;
+		}
+	}
+
+	bigEndianReader rd(buf);
+	if (rd.get(4) != CHUNKINDEXMAGIC || rd.get(4) != CHUNKINDEXVERSION)
+	{
+		cerr << "pigmap.chunkindex has unknown format; ignoring it" << endl;
+		return false;
+	}
+	uint64_t count = rd.get(4);
+	for (uint64_t r = 0; r < count && !rd.failed; r++)
+	{
+		int64_t rx = (int64_t)rd.get(8), rz = (int64_t)rd.get(8);
+		vector<Entry>& entries = regions[make_pair(rx, rz)];
+		entries.resize(32 * 32);
+		uint64_t n = rd.get(2);
+		for (uint64_t i = 0; i < n && !rd.failed; i++)
+		{
+			uint64_t idx = rd.get(2);
+			Entry e;
+			e.timestamp = rd.get(4);
+			e.hash = rd.get(8);
+			if (idx >= 32 * 32)
+				rd.failed = true;
+			else
+				entries[idx] = e;
+		}
+	}
+	if (rd.failed || rd.ptr != rd.end)
+	{
+		cerr << "pigmap.chunkindex is corrupt; ignoring it" << endl;
+		regions.clear();
+		return false;
+	}
+	return true;
+}
+
+bool ChunkIndex::writeFile(const string& outputpath) const
+{
+	vector<uint8_t> buf;
+	putBigEndian(buf, CHUNKINDEXMAGIC, 4);
+	putBigEndian(buf, CHUNKINDEXVERSION, 4);
+	putBigEndian(buf, regions.size(), 4);
+	for (RegionMap::const_iterator it = regions.begin(); it != regions.end(); it++)
+	{
+		putBigEndian(buf, it->first.first, 8);
+		putBigEndian(buf, it->first.second, 8);
+		int n = 0;
+		for (vector<Entry>::const_iterator e = it->second.begin(); e != it->second.end(); e++)
+			if (e->hash != 0)
+				n++;
+		putBigEndian(buf, n, 2);
+		for (int idx = 0; idx < (int)it->second.size(); idx++)
+			if (it->second[idx].hash != 0)
+			{
+				putBigEndian(buf, idx, 2);
+				putBigEndian(buf, it->second[idx].timestamp, 4);
+				putBigEndian(buf, it->second[idx].hash, 8);
+			}
+	}
+
+	// write to a temporary file and rename it, so a crash can't leave a half-written index behind
+	string filename = outputpath + "/pigmap.chunkindex";
+	string tmpname = filename + ".tmp";
+	FILE *f = fopen(tmpname.c_str(), "wb");
+	if (f == NULL)
+		return false;
+	size_t count = fwrite(&(buf[0]), buf.size(), 1, f);
+	if (0 != fclose(f) || count < 1)
+		return false;
+	return 0 == rename(tmpname.c_str(), filename.c_str());
+}
+
+int ChunkIndex::update(const RegionIdx& ri, const string& inputpath, RegionFileReader& rfreader, vector<ChunkIdx>& changed)
+{
+	changed.clear();
+	int result = rfreader.loadFromFile(ri, inputpath);
+	if (0 != result)
+		return result;
+
+	// a region we've never seen before gets an empty record, so every chunk in it counts as changed
+	vector<Entry>& entries = regions[make_pair(ri.x, ri.z)];
+	vector<uint8_t> readbuf;
+	entries.resize(32 * 32);
+	for (RegionChunkIterator it(ri); !it.end; it.advance())
+	{
+		ChunkOffset co(it.current);
+		int idx = RegionFileReader::getIdx(co);
+		Entry e;
+		if (rfreader.containsChunk(co))
+		{
+			// if the data can't be found, leave the hash at 0, so the chunk will count as changed
+			//  again next time
+			const uint8_t *data;
+			size_t size;
+			e.timestamp = rfreader.getTimestamp(idx);
+			if (0 == rfreader.getCompressedChunk(co, readbuf, data, size))
+				e.hash = hashChunkData(data, size);
+			if (e.hash != 0 && e == entries[idx])
+				unchanged++;
+			else
+				changed.push_back(it.current);
+		}
+		entries[idx] = e;
+	}
+	return 0;
+}
+
+bool RegionSnapshots::stage(const RegionIdx& ri, const RegionFileReader& rfreader)
+{
+	string filename = rfreader.anvil ? ri.toAnvilFileName() : ri.toOldFileName();
+	string stagingpath = outputpath + "/snapshot/staging";
+	makePath(stagingpath);
+	FILE *f = fopen((stagingpath + "/" + filename).c_str(), "wb");
+	if (f == NULL)
+		return false;
+	// (if the region file has been cut short since we loaded it, we don't have a consistent copy of it)
+	bool copied = rfreader.copyTo(f);
+	if (0 != fclose(f) || !copied)
+		return false;
+	staged.push_back(filename);
+	return true;
+}
+
+void RegionSnapshots::commit()
+{
+	string regionpath = outputpath + "/snapshot/region";
+	makePath(regionpath);
+	for (vector<string>::const_iterator it = staged.begin(); it != staged.end(); it++)
+	{
+		// get rid of any snapshot in the other format, which would otherwise hide (or be hidden by) this one
+		RegionIdx ri(0,0);
+		RegionIdx::fromFilePath(*it, ri);
+		string other = (*it == ri.toAnvilFileName()) ? ri.toOldFileName() : ri.toAnvilFileName();
+		remove((regionpath + "/" + other).c_str());
+		renameFile(outputpath + "/snapshot/staging/" + *it, regionpath + "/" + *it);
+	}
+	staged.clear();
+}
+
+void RegionSnapshots::removeAll()
+{
+	vector<string> entries;
+	listEntries(outputpath + "/snapshot/region", entries);
+	for (vector<string>::const_iterator it = entries.begin(); it != entries.end(); it++)
+		remove(it->c_str());
+}
+
+
+
 RegionCacheStats& RegionCacheStats::operator+=(const RegionCacheStats& rcs)
 {
 	hits += rcs.hits;
@@ -157,120 +458,197 @@ RegionCacheStats& RegionCacheStats::operator+=(const RegionCacheStats& rcs)
 	missing += rcs.missing;
 	reqmissing += rcs.reqmissing;
 	corrupt += rcs.corrupt;
+	evicted += rcs.evicted;
+	reread += rcs.reread;
 	return *this;
 }
 
 
-int RegionCache::getDecompressedChunk(const PosChunkIdx& ci, vector<uint8_t>& buf, bool& anvil)
+RegionCache::RegionCache(RegionTable& rtable, const string& inpath, bool fullr, int threads, int64_t b)
+	: clock(0), minentries(4 + threads), budget(b), filebytes(0), peakbytes(0), regiontable(rtable), inputpath(inpath), fullrender(fullr)
+{
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&loaded, NULL);
+}
+
+RegionCache::~RegionCache()
+{
+	for (vector<RegionCacheEntry*>::iterator it = entries.begin(); it != entries.end(); it++)
+		delete *it;
+	pthread_cond_destroy(&loaded);
+	pthread_mutex_destroy(&mutex);
+}
+
+int RegionCache::getDecompressedChunk(const PosChunkIdx& ci, vector<uint8_t>& readbuf, vector<uint8_t>& buf, bool& anvil, RegionCacheStats& stats, PhaseTimes *phases)
 {
 	PosRegionIdx ri = ci.toChunkIdx().getRegionIdx();
-	int e = getEntryNum(ri);
-	int state = regiontable.getDiskState(ri);
-	
-	if (state == RegionSet::REGION_UNKNOWN)
-		stats.misses++;
-	else
-		stats.hits++;
-	
-	// if we already tried and failed to read this region, don't try again
-	if (state == RegionSet::REGION_CORRUPTED || state == RegionSet::REGION_MISSING)
-	{
-		// actually, it shouldn't even be possible to get here, since the disk state
-		//  flags for all chunks in the region should have been set the first time we failed
-		cerr << "cache invariant failure!  tried to read already-failed region" << endl;
-		return -1;
-	}
-	
-	// if the region is in the cache, try to extract the chunk from it
-	if (state == RegionSet::REGION_CACHED)
+	RegionCacheEntry *entry = NULL;
 	{
-		// try the "real" cache entry, then the extra readbuf
-		if (entries[e].ri == ri)
+		mutexLocker ml(&mutex);
+		int state = regiontable.getDiskState(ri);
+
+		if (state == RegionSet::REGION_UNKNOWN)
+			stats.misses++;
+		else
+			stats.hits++;
+
+		// if we already tried and failed to read this region, don't try again
+		if (state == RegionSet::REGION_CORRUPTED || state == RegionSet::REGION_MISSING)
+			return -1;
+
+		// if the region is in the cache (or some other thread is reading it), find its entry
+		if (state == RegionSet::REGION_CACHED)
 		{
-			anvil = entries[e].regionfile.anvil;
-			return entries[e].regionfile.decompressChunk(ci.toChunkIdx(), buf);
+			while (true)
+			{
+				for (vector<RegionCacheEntry*>::const_iterator it = entries.begin(); it != entries.end(); it++)
+					if ((*it)->ri == ri)
+					{
+						entry = *it;
+						break;
+					}
+				if (entry == NULL)
+				{
+					cerr << "grievous region cache failure!" << endl;
+					cerr << "[" << ri.x << "," << ri.z << "]" << endl;
+					exit(-1);
+				}
+				if (!entry->loading)
+					break;
+				// wait for the other thread to finish, then look again (the read might have failed)
+				pthread_cond_wait(&loaded, &mutex);
+				entry = NULL;
+				state = regiontable.getDiskState(ri);
+				if (state != RegionSet::REGION_CACHED)
+					return -1;
+			}
+			entry->refs++;
+			entry->lastuse = ++clock;
 		}
-		else if (readbuf.ri == ri)
+		else
 		{
-			anvil = readbuf.regionfile.anvil;
-			return readbuf.regionfile.decompressChunk(ci.toChunkIdx(), buf);
+			// if this is a full render and the region is not required, we already know it doesn't exist
+			bool req = regiontable.isRequired(ri);
+			if (fullrender && !req)
+			{
+				stats.skipped++;
+				regiontable.setDiskState(ri, RegionSet::REGION_MISSING);
+				return -1;
+			}
+
+			// okay, we actually have to read the region from disk, if it's there; use an empty entry if there
+			//  is one, or make a new one if we're under the budget, or else find the least-recently-used entry
+			//  that nobody is using and evict its tenant
+			for (vector<RegionCacheEntry*>::const_iterator it = entries.begin(); it != entries.end(); it++)
+				if ((*it)->refs == 0 && !(*it)->ri.valid())
+				{
+					entry = *it;
+					break;
+				}
+			if (entry == NULL && entries.size() >= minentries && filebytes >= budget)
+				for (vector<RegionCacheEntry*>::const_iterator it = entries.begin(); it != entries.end(); it++)
+					if ((*it)->refs == 0 && (entry == NULL || (*it)->lastuse < entry->lastuse))
+						entry = *it;
+			if (entry == NULL)
+			{
+				entry = new RegionCacheEntry;
+				entries.push_back(entry);
+			}
+			if (entry->ri.valid())
+				evict(entry, stats);
+			entry->ri = ri;
+			entry->loading = true;
+			entry->refs = 1;
+			entry->lastuse = ++clock;
+			regiontable.setDiskState(ri, RegionSet::REGION_CACHED);
+
+			// do the read without holding the lock
+			pthread_mutex_unlock(&mutex);
+			int result;
+			{
+				PhaseTimer pt(phases, PHASE_READ);
+				TRACE_SCOPE("regionload", "x,z", ri.x, ri.z);
+				result = entry->regionfile.loadFromFile(ri.toRegionIdx(), inputpath);
+			}
+			pthread_mutex_lock(&mutex);
+
+			entry->loading = false;
+			pthread_cond_broadcast(&loaded);
+			if (result != 0)
+			{
+				if (result == -1)
+				{
+					regiontable.setDiskState(ri, RegionSet::REGION_MISSING);
+					if (req)
+						stats.reqmissing++;
+					else
+						stats.missing++;
+				}
+				else
+				{
+					regiontable.setDiskState(ri, RegionSet::REGION_CORRUPTED);
+					stats.corrupt++;
+				}
+				entry->ri = PosRegionIdx(-1,-1);
+				entry->refs = 0;
+				entry->regionfile.unload();
+				return -1;
+			}
+			stats.read++;
+			if (dropped.count(make_pair(ri.x, ri.z)))
+				stats.reread++;
+
+			// if this region put us over the budget, drop the least-recently-used ones that nobody is using
+			//  (but keep the minimum number)
+			filebytes += entry->regionfile.filelength;
+			peakbytes = max(peakbytes, filebytes);
+			while (filebytes > budget && entries.size() > minentries)
+			{
+				vector<RegionCacheEntry*>::iterator victim = entries.end();
+				for (vector<RegionCacheEntry*>::iterator it = entries.begin(); it != entries.end(); it++)
+					if ((*it)->refs == 0 && (victim == entries.end() || (*it)->lastuse < (*victim)->lastuse))
+						victim = it;
+				if (victim == entries.end())
+					break;
+				if ((*victim)->ri.valid())
+					evict(*victim, stats);
+				delete *victim;
+				entries.erase(victim);
+			}
 		}
-		// if it wasn't in one of those two places, it shouldn't have been marked as cached
-		cerr << "grievous region cache failure!" << endl;
-		cerr << "[" << ri.x << "," << ri.z << "]   [" << entries[e].ri.x << "," << entries[e].ri.z << "]   [" << readbuf.ri.x << "," << readbuf.ri.z << "]" << endl;
-		exit(-1);
 	}
 
-	// if this is a full render and the region is not required, we already know it doesn't exist
-	bool req = regiontable.isRequired(ri);
-	if (fullrender && !req)
+	// try to read and decompress the chunk; the entry can't go anywhere while we hold a reference to it
+	anvil = entry->regionfile.anvil;
+	int result;
+	const uint8_t *data;
+	size_t size;
 	{
-		stats.skipped++;
-		regiontable.setDiskState(ri, RegionSet::REGION_MISSING);
-		for (RegionChunkIterator it(ri.toRegionIdx()); !it.end; it.advance())
-			chunktable.setDiskState(it.current, ChunkSet::CHUNK_MISSING);
-		return -1;
+		PhaseTimer pt(phases, PHASE_READ);
+		result = entry->regionfile.getCompressedChunk(ci.toChunkIdx(), readbuf, data, size);
+		if (result == 0 && phases != NULL)
+			phases->bytes[PHASE_READ] += size;
 	}
-	
-	// okay, we actually have to read the region from disk, if it's there
-	readRegionFile(ri);
-	
-	// check whether the read succeeded; try to extract the chunk if so
-	state = regiontable.getDiskState(ri);
-	if (state == RegionSet::REGION_CORRUPTED)
+	if (result == 0)
 	{
-		stats.corrupt++;
-		return -1;
+		PhaseTimer pt(phases, PHASE_INFLATE);
+		// (zlib doesn't write to its input, so casting away the const is okay)
+		if (!readGzOrZlib(const_cast<uint8_t*>(data), size, buf))
+			result = -2;
+		else if (phases != NULL)
+			phases->bytes[PHASE_INFLATE] += buf.size();
 	}
-	if (state == RegionSet::REGION_MISSING)
-	{
-		if (req)
-			stats.reqmissing++;
-		else
-			stats.missing++;
-		return -1;
-	}
-	// since we've actually just done a read, the region should now be in a real cache entry, not the readbuf
-	if (state != RegionSet::REGION_CACHED || entries[e].ri != ri)
-	{
-		cerr << "grievous region cache failure!" << endl;
-		cerr << "[" << ri.x << "," << ri.z << "]   [" << entries[e].ri.x << "," << entries[e].ri.z << "]" << endl;
-		exit(-1);
-	}
-	stats.read++;
-	anvil = entries[e].regionfile.anvil;
-	return entries[e].regionfile.decompressChunk(ci.toChunkIdx(), buf);
+	mutexLocker ml(&mutex);
+	entry->refs--;
+	return result;
 }
 
-void RegionCache::readRegionFile(const PosRegionIdx& ri)
+void RegionCache::evict(RegionCacheEntry *entry, RegionCacheStats& stats)
 {
-	// forget the data in the readbuf
-	if (readbuf.ri.valid())
-		regiontable.setDiskState(readbuf.ri, RegionSet::REGION_UNKNOWN);
-	readbuf.ri = PosRegionIdx(-1,-1);
-	
-	// read the region file from disk, if it's there
-	int result = readbuf.regionfile.loadFromFile(ri.toRegionIdx(), inputpath);
-	if (result == -1)
-	{
-		regiontable.setDiskState(ri, RegionSet::REGION_MISSING);
-		for (RegionChunkIterator it(ri.toRegionIdx()); !it.end; it.advance())
-			chunktable.setDiskState(it.current, ChunkSet::CHUNK_MISSING);
-		return;
-	}
-	if (result == -2)
-	{
-		regiontable.setDiskState(ri, RegionSet::REGION_CORRUPTED);
-		for (RegionChunkIterator it(ri.toRegionIdx()); !it.end; it.advance())
-			chunktable.setDiskState(it.current, ChunkSet::CHUNK_MISSING);
-		return;
-	}
-	
-	// read was successful; evict current tenant of chunk's cache slot (swap it into the readbuf)
-	int e = getEntryNum(ri);
-	entries[e].regionfile.swap(readbuf.regionfile);
-	swap(entries[e].ri, readbuf.ri);
-	// mark the entry as vaild and the region as cached
-	entries[e].ri = ri;
-	regiontable.setDiskState(ri, RegionSet::REGION_CACHED);
+	regiontable.setDiskState(entry->ri, RegionSet::REGION_UNKNOWN);
+	dropped.insert(make_pair(entry->ri.x, entry->ri.z));
+	filebytes -= entry->regionfile.filelength;
+	entry->regionfile.unload();
+	entry->ri = PosRegionIdx(-1,-1);
+	stats.evicted++;
 }
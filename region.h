@@ -19,9 +19,14 @@
 #define REGION_H
 
 #include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <map>
+#include <set>
 
 #include "map.h"
 #include "tables.h"
+#include "utils.h"
 
 
 // offset into a region of a chunk
@@ -42,52 +47,68 @@ struct string84
 	explicit string84(const std::string& sss) : s(sss) {}
 };
 
-struct RegionFileReader
+struct RegionFileReader : private nocopy
 {
 	// region file is broken into 4096-byte sectors; first sector is the header that holds the
 	//  chunk offsets, remaining sectors are chunk data
 
 	// chunk offsets are big-endian; lower (that is, 4th) byte is size in sectors, upper 3 bytes are
-	//  sector offset *in region file* (one more than the offset into chunkdata)
+	//  sector offset in region file
 	// offsets are indexed by Z*32 + X
 	std::vector<uint32_t> offsets;
 	// each set of chunk data contains:
 	//  -a 4-byte big-endian data length (not including the length field itself)
 	//  -a single-byte version: 1 for gzip, 2 for zlib (this byte *is* included in the length)
 	//  -length - 1 bytes of actual compressed data
-	std::vector<uint8_t> chunkdata;
+	// ...only the header is read up front; the file is kept open, and each chunk's sectors are read
+	//  with pread when it's wanted (into a buffer supplied by the caller, so that several threads can
+	//  read chunks from the same file at once)
+	// ...Minecraft may rewrite or truncate the file while we have it open; that just makes a read come
+	//  up short, and the chunk counts as corrupt
+	int fd;  // the open file (or -1 if nothing is loaded)
+	size_t filelength;  // the file's size when it was loaded
+	std::vector<uint32_t> timestamps;  // the second header sector, if there is one (otherwise all 0)
 	// whether this data was read from an Anvil region file or an old-style one
 	bool anvil;
 
-	RegionFileReader()
+	RegionFileReader() : fd(-1), filelength(0)
 	{
 		offsets.resize(32 * 32);
-		chunkdata.reserve(8388608);
-	}
-	
-	void swap(RegionFileReader& rfr)
-	{
-		offsets.swap(rfr.offsets);
-		chunkdata.swap(rfr.chunkdata);
-		std::swap(anvil, rfr.anvil);
+		timestamps.resize(32 * 32);
 	}
+	~RegionFileReader() {unload();}
+
+	// close the file (if any)
+	void unload();
 
 	// extract values from the offsets
 	static int getIdx(const ChunkOffset& co) {return co.z*32 + co.x;}
 	uint32_t getSizeSectors(int idx) const {return fromBigEndian(offsets[idx]) & 0xff;}
 	uint32_t getSectorOffset(int idx) const {return fromBigEndian(offsets[idx]) >> 8;}
-	bool containsChunk(const ChunkOffset& co) {return offsets[getIdx(co)] != 0;}
+	bool containsChunk(const ChunkOffset& co) const {return offsets[getIdx(co)] != 0;}
+
+	// the second header sector holds a big-endian timestamp for each chunk (the last time it was saved),
+	//  indexed like the offsets; only available after loadFromFile, and returns 0 if the file is too short
+	uint32_t getTimestamp(int idx) const {return fromBigEndian(timestamps[idx]);}
 
 
-	// attempt to read a region file; return 0 for success, -1 for file not found, -2 for
-	//  other errors
+	// attempt to open a region file and read its header, replacing any previously loaded one; return 0
+	//  for success, -1 for file not found, -2 for other errors
 	// looks for an Anvil region file (.mca) first, then an old-style one (.mcr)
 	int loadFromFile(const RegionIdx& ri, const std::string& inputpath);
 
-	// attempt to decompress a chunk into a buffer; return 0 for success, -1 for missing chunk,
-	//  -2 for other errors
-	// (this is not const only because zlib won't take const pointers for input)
-	int decompressChunk(const ChunkOffset& co, std::vector<uint8_t>& buf);
+	// read a chunk's sectors into readbuf (which is only ever grown, never shrunk) and find its compressed
+	//  data there (the part after the length and version fields); return 0 for success, -1 for missing
+	//  chunk, -2 for other errors
+	int getCompressedChunk(const ChunkOffset& co, std::vector<uint8_t>& readbuf, const uint8_t*& data, size_t& size) const;
+
+	// attempt to read and decompress a chunk into a buffer (using readbuf for the compressed data); return
+	//  0 for success, -1 for missing chunk, -2 for other errors
+	int decompressChunk(const ChunkOffset& co, std::vector<uint8_t>& readbuf, std::vector<uint8_t>& buf) const;
+
+	// copy the whole file, as it is now, to another one; returns false on failure (including if the file
+	//  has been cut short since it was loaded)
+	bool copyTo(FILE *f) const;
 
 	// attempt to read only the header (i.e. the chunk offsets) from a region file; return 0
 	//  for success, -1 for file not found, -2 for other errors
@@ -116,6 +137,71 @@ struct RegionChunkIterator
 };
 
 
+// remembers what each chunk looked like (its timestamp, plus a hash of its compressed data) the last time
+//  it was rendered, so incremental updates can skip the chunks in a region that haven't actually changed
+// ...kept in the output path as "pigmap.chunkindex"; if it's missing, every chunk counts as changed
+struct ChunkIndex
+{
+	struct Entry
+	{
+		uint32_t timestamp;
+		uint64_t hash;  // 0 if the chunk is absent (or its data is unreadable)
+
+		Entry() : timestamp(0), hash(0) {}
+		bool operator==(const Entry& e) const {return timestamp == e.timestamp && hash == e.hash;}
+	};
+
+	// entries for each region we know about, indexed like the region header
+	typedef std::map<std::pair<int64_t, int64_t>, std::vector<Entry> > RegionMap;
+	RegionMap regions;
+
+	int64_t unchanged;  // stats: chunks that update() found to be the same as last time
+
+	ChunkIndex() : unchanged(0) {}
+
+	// read the index from the output path, replacing whatever we had; returns false (and leaves the index
+	//  empty) if the file is missing or corrupt
+	bool readFile(const std::string& outputpath);
+
+	// write the index to the output path; returns false on failure
+	bool writeFile(const std::string& outputpath) const;
+
+	// read a region file, record the current state of its chunks, and return the chunks that exist now and
+	//  have changed since the last time the region was recorded (so all of them, if it never was); returns
+	//  0 for success, -1 for file not found, -2 for other errors
+	// ...on success, the region is left loaded in rfreader
+	int update(const RegionIdx& ri, const std::string& inputpath, RegionFileReader& rfreader, std::vector<ChunkIdx>& changed);
+};
+
+
+// copies of the region files as they were at the last render, kept in the output path under "snapshot/region"
+//  so that incremental updates can compare changed chunks block by block
+// ...new copies go into "snapshot/staging" first, and are only moved into place by commit() once the render
+//  that used them is finished, so that a failed render can't leave us comparing against data that was
+//  never drawn
+struct RegionSnapshots
+{
+	std::string outputpath;
+	std::vector<std::string> staged;  // filenames waiting in the staging directory
+
+	int64_t chunksdiffed, blocksdiffed;  // stats: chunks compared against their snapshots, changed blocks found
+
+	RegionSnapshots(const std::string& opath) : outputpath(opath), chunksdiffed(0), blocksdiffed(0) {}
+
+	// load the snapshot of a region; return 0 for success, -1 if there isn't one, -2 for other errors
+	int load(const RegionIdx& ri, RegionFileReader& rfreader) const {return rfreader.loadFromFile(ri, outputpath + "/snapshot");}
+
+	// copy a region that's loaded in rfreader into the staging directory; returns false on failure
+	bool stage(const RegionIdx& ri, const RegionFileReader& rfreader);
+
+	// move all the staged copies into place
+	void commit();
+
+	// delete all the snapshots that are in place (for full renders, which start over from scratch)
+	void removeAll();
+};
+
+
 struct RegionCacheStats
 {
 	int64_t hits, misses;
@@ -125,8 +211,11 @@ struct RegionCacheStats
 	int64_t missing;  // non-required region not present on disk
 	int64_t reqmissing;  // required region not present on disk
 	int64_t corrupt;  // found on disk, but failed to read
+	// not misses, but related:
+	int64_t evicted;  // regions dropped from the cache to make room for others
+	int64_t reread;  // (counted in read, too) regions that had to be read again after being dropped (see -R)
 
-	RegionCacheStats() : hits(0), misses(0), read(0), skipped(0), missing(0), reqmissing(0), corrupt(0) {}
+	RegionCacheStats() : hits(0), misses(0), read(0), skipped(0), missing(0), reqmissing(0), corrupt(0), evicted(0), reread(0) {}
 
 	RegionCacheStats& operator+=(const RegionCacheStats& rs);
 };
@@ -134,45 +223,45 @@ struct RegionCacheStats
 struct RegionCacheEntry
 {
 	PosRegionIdx ri;  // or [-1, -1] if this entry is empty
+	bool loading;  // whether some thread is still reading the file
+	int refs;  // number of threads currently decompressing chunks from this entry; can't be evicted unless 0
+	uint64_t lastuse;  // for LRU replacement
 	RegionFileReader regionfile;
 	
-	RegionCacheEntry() : ri(-1,-1) {}
+	RegionCacheEntry() : ri(-1,-1), loading(false), refs(0), lastuse(0) {}
 };
 
-#define RCACHEBITSX 1
-#define RCACHEBITSZ 1
-#define RCACHEXSIZE (1 << RCACHEBITSX)
-#define RCACHEZSIZE (1 << RCACHEBITSZ)
-#define RCACHESIZE (RCACHEXSIZE * RCACHEZSIZE)
-#define RCACHEXMASK (RCACHEXSIZE - 1)
-#define RCACHEZMASK (RCACHEZSIZE - 1)
-
+// a single region cache is shared by all threads; decompression happens outside the lock, so it's only
+//  held while looking up entries (or waiting for another thread to finish reading the region we want)
+// ...it's fully associative, with LRU replacement; it always holds enough regions for a 2x2 block of them
+//  (which is all a single thread needs when working near a region corner), plus one for each thread, and
+//  beyond that keeps as many as fit in its budget (counting the whole size of each region file), so that
+//  regions on the borders between the threads' areas don't have to be read again
 struct RegionCache : private nocopy
 {
-	RegionCacheEntry entries[RCACHESIZE];
-
-	ChunkTable& chunktable;
-	RegionTable& regiontable;
-	RegionCacheStats& stats;
+	pthread_mutex_t mutex;
+	pthread_cond_t loaded;  // signalled whenever an entry finishes loading
+	std::vector<RegionCacheEntry*> entries;  // created as needed
+	uint64_t clock;  // incremented for each use of an entry
+	size_t minentries;  // keep at least this many regions, regardless of the budget
+	int64_t budget;  // in bytes
+	int64_t filebytes;  // total size of the region files currently in the cache
+	int64_t peakbytes;  // most that filebytes has been
+	std::set<std::pair<int64_t, int64_t> > dropped;  // regions that have been evicted (to count rereads)
+
+	RegionTable& regiontable;  // only accessed while holding the mutex
 	std::string inputpath;
 	bool fullrender;
-	// readbuf is an extra less-important cache entry--when a new region is read, it's this entry which will be trashed
-	//  and its storage used for the read (which might fail), but if the read succeeds, the new region is swapped
-	//  into its proper place in the cache, and the previous tenant there moves here
-	RegionCacheEntry readbuf;
-	RegionCache(ChunkTable& ctable, RegionTable& rtable, const std::string& inpath, bool fullr, RegionCacheStats& st)
-		: chunktable(ctable), regiontable(rtable), inputpath(inpath), fullrender(fullr), stats(st)
-	{
-	}
-
-	// attempt to decompress a chunk into a buffer; return 0 for success, -1 for missing chunk,
-	//  -2 for other errors
-	// (this is not const only because zlib won't take const pointers for input)
-	int getDecompressedChunk(const PosChunkIdx& ci, std::vector<uint8_t>& buf, bool& anvil);
+	RegionCache(RegionTable& rtable, const std::string& inpath, bool fullr, int threads, int64_t budget = 0);
+	~RegionCache();
 
-	static int getEntryNum(const PosRegionIdx& ri) {return (ri.x & RCACHEXMASK) * RCACHEZSIZE + (ri.z & RCACHEZMASK);}
+	// attempt to decompress a chunk into a buffer (reading the compressed data into readbuf); return 0 for
+	//  success, -1 for missing chunk, -2 for other errors
+	// ...buffers, stats, and phase times (which may be NULL) are those of the calling thread
+	int getDecompressedChunk(const PosChunkIdx& ci, std::vector<uint8_t>& readbuf, std::vector<uint8_t>& buf, bool& anvil, RegionCacheStats& stats, PhaseTimes *phases);
 
-	void readRegionFile(const PosRegionIdx& ri);
+	// let go of an entry's region (must be holding the mutex, and nobody must be using the entry)
+	void evict(RegionCacheEntry *entry, RegionCacheStats& stats);
 };
 
 
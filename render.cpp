@@ -17,19 +17,44 @@
 
 #include <memory>
 #include <iostream>
+#include <stdlib.h>
+#include <algorithm>
 
 #include "render.h"
+#include "threads.h"
 #include "utils.h"
 
 using namespace std;
 
 
 
+ThreadOutputCache::ThreadOutputCache(int z) : zoom(z), images(z + 1), used(z + 1), pending(z + 1)
+{
+	for (int i = 0; i <= zoom; i++)
+	{
+		images[i].resize((1 << i) * (1 << i));
+		used[i].resize((1 << i) * (1 << i), false);
+		pending[i].resize((1 << i) * (1 << i), 0);
+	}
+}
+
 int ThreadOutputCache::getIndex(const ZoomTileIdx& zti) const
 {
-	if (zti.zoom != zoom)
+	if (zti.zoom < 0 || zti.zoom > zoom)
 		return -1;
-	return zti.y * (1 << zoom) + zti.x;
+	return zti.y * (1 << zti.zoom) + zti.x;
+}
+
+void ThreadOutputCache::expect(const ZoomTileIdx& zti)
+{
+	// the parent has one more child to wait for; if it wasn't waiting for any before, then it will
+	//  now be finished itself, so its parent needs to know about it, and so on
+	for (ZoomTileIdx child = zti; child.zoom > 0; child = child.toZoom(child.zoom - 1))
+	{
+		ZoomTileIdx parent = child.toZoom(child.zoom - 1);
+		if (pending[parent.zoom][getIndex(parent)]++ > 0)
+			break;
+	}
 }
 
 
@@ -44,9 +69,20 @@ int64_t topPixelY(int64_t x, int64_t bboxTop, int B)
 }
 
 TileBlockIterator::TileBlockIterator(const TileIdx& ti, const MapParams& mp)
-	: tile(ti), mparams(mp), current(0,0), expandedBBox(Pixel(0,0), Pixel(0,0))
+	: mparams(mp), current(0,0), expandedBBox(Pixel(0,0), Pixel(0,0))
 {
-	expandedBBox = ti.getBBox(mparams);
+	start(ti.getBBox(mparams));
+}
+
+TileBlockIterator::TileBlockIterator(const BBox& bbox, const MapParams& mp)
+	: mparams(mp), current(0,0), expandedBBox(Pixel(0,0), Pixel(0,0))
+{
+	start(bbox);
+}
+
+void TileBlockIterator::start(const BBox& bbox)
+{
+	expandedBBox = bbox;
 	expandedBBox.topLeft -= Pixel(2*mparams.B - 1, 2*mparams.B - 1);
 	expandedBBox.bottomRight += Pixel(2*mparams.B - 1, 2*mparams.B - 1);
 
@@ -130,6 +166,13 @@ void PseudocolumnIterator::advance()
 		end = true;
 }
 
+void PseudocolumnIterator::advance(int64_t steps)
+{
+	current += BlockIdx(steps,-steps,-steps);
+	if (current.y < mparams.minY)
+		end = true;
+}
+
 
 
 // travel down two neighboring pseudocolumns, setting occlusion edges between their nodes
@@ -212,21 +255,41 @@ void buildDependencies(SceneGraph& sg, int pcol1, int pcol2, int which)
 	} \
 }
 
+// ...and the same again for when only the neighbor's blockID is needed
+#define GETNEIGHBORID(gnid, gnoff) \
+{ \
+	BlockIdx bin = bi + gnoff; \
+	PosChunkIdx cin = bin.getChunkIdx(); \
+	if (cin == ci) \
+		gnid = chunkdata->id(bin); \
+	else \
+		gnid = rj.chunkcache->getData(cin)->id(bin); \
+}
+
+#define GETNEIGHBORIDUD(gnid, gnoff) \
+{ \
+	BlockIdx bin = bi + gnoff; \
+	if (bin.y >= 0 && bin.y <= 255) \
+		gnid = chunkdata->id(bin); \
+	else \
+		gnid = 0; \
+}
+
 #define CONNECTFENCE(cfid, cfdata) (rj.blockimages.isOpaque(cfid, cfdata) || cfid == 85 || cfid == 107)
 #define CONNECTNETHERFENCE(cfid, cfdata) (rj.blockimages.isOpaque(cfid, cfdata) || cfid == 113 || cfid == 107)
 
-// given a node that must be drawn, see if we need to do anything special to it--that is, anything that
-//  doesn't depend purely on its blockID/blockData
-// examples: for nodes with no E/S neighbors, we add a little darkness on the EU/SU edge to indicate drop-off;
-//  for chests, we may need to draw half of a double chest instead if there's another chest next door; etc.
-void checkSpecial(SceneGraphNode& node, uint16_t blockID, uint8_t blockData, const PosChunkIdx& ci, ChunkData *chunkdata, RenderJob& rj)
+// given a node for one of the blocks that BlockImages marks as special, see if we need to use a different
+//  image for it--one that doesn't depend purely on its blockID/blockData
+// examples: for chests, we may need to draw half of a double chest instead if there's another chest next door;
+//  for water, we leave out the faces that are against other water; etc.
+void checkSpecial(SceneGraphNode& node, int special, uint16_t blockID, uint8_t blockData, const PosChunkIdx& ci, ChunkData *chunkdata, RenderJob& rj)
 {
 	const BlockIdx& bi = node.bi;
 	
 	uint16_t blockIDN, blockIDS, blockIDE, blockIDW, blockIDU, blockIDD;
 	uint8_t blockDataN, blockDataS, blockDataE, blockDataW, blockDataU, blockDataD;
 
-	if (node.bimgoffset == 8)  // solid water
+	if (special == BlockImages::WATER)
 	{
 		// if there's water to the W or N, we don't draw those faces
 		GETNEIGHBOR(blockIDN, blockDataN, BlockIdx(-1,0,0))
@@ -240,7 +303,7 @@ void checkSpecial(SceneGraphNode& node, uint16_t blockID, uint8_t blockData, con
 		else if (waterN)
 			node.bimgoffset = 179;
 	}
-	else if (blockID == 79)  // ice
+	else if (special == BlockImages::ICE)
 	{
 		// if there's ice to the W or N, we don't draw those faces
 		GETNEIGHBOR(blockIDN, blockDataN, BlockIdx(-1,0,0))
@@ -254,7 +317,7 @@ void checkSpecial(SceneGraphNode& node, uint16_t blockID, uint8_t blockData, con
 		else if (iceN)
 			node.bimgoffset = 182;
 	}
-	else if (blockID == 85)  // fence
+	else if (special == BlockImages::FENCE)
 	{
 		GETNEIGHBOR(blockIDN, blockDataN, BlockIdx(-1,0,0))
 		GETNEIGHBOR(blockIDS, blockDataS, BlockIdx(1,0,0))
@@ -267,7 +330,7 @@ void checkSpecial(SceneGraphNode& node, uint16_t blockID, uint8_t blockData, con
 		if (bits != 0)
 			node.bimgoffset = 157 + bits;
 	}
-	else if (blockID == 113)  // nether fence
+	else if (special == BlockImages::NETHERFENCE)
 	{
 		GETNEIGHBOR(blockIDN, blockDataN, BlockIdx(-1,0,0))
 		GETNEIGHBOR(blockIDS, blockDataS, BlockIdx(1,0,0))
@@ -280,7 +343,7 @@ void checkSpecial(SceneGraphNode& node, uint16_t blockID, uint8_t blockData, con
 		if (bits != 0)
 			node.bimgoffset = 316 + bits;
 	}
-	else if (blockID == 54)  // chest
+	else if (special == BlockImages::CHEST)
 	{
 		GETNEIGHBOR(blockIDN, blockDataN, BlockIdx(-1,0,0))
 		GETNEIGHBOR(blockIDS, blockDataS, BlockIdx(1,0,0))
@@ -298,14 +361,14 @@ void checkSpecial(SceneGraphNode& node, uint16_t blockID, uint8_t blockData, con
 		else if (blockIDE == 54)
 			node.bimgoffset = (blockDataE == 4) ? 490 : 494;
 	}
-	else if (blockID == 95)  // locked chest
+	else if (special == BlockImages::LOCKEDCHEST)
 	{
 		GETNEIGHBOR(blockIDW, blockDataW, BlockIdx(0,1,0))
 		// if there's an opaque block to the W, we should face N instead
 		if (rj.blockimages.isOpaque(blockIDW, blockDataW))
 			node.bimgoffset = 271;
 	}
-	else if (blockID == 101)  // iron bars
+	else if (special == BlockImages::IRONBARS)
 	{
 		GETNEIGHBOR(blockIDN, blockDataN, BlockIdx(-1,0,0))
 		GETNEIGHBOR(blockIDS, blockDataS, BlockIdx(1,0,0))
@@ -316,7 +379,7 @@ void checkSpecial(SceneGraphNode& node, uint16_t blockID, uint8_t blockData, con
 		static const int ironBarOffsets[16] = {355, 419, 420, 356, 421, 357, 359, 365, 422, 358, 360, 364, 361, 363, 362, 355};
 		node.bimgoffset = ironBarOffsets[bits];
 	}
-	else if (blockID == 102)  // glass pane
+	else if (special == BlockImages::GLASSPANE)
 	{
 		GETNEIGHBOR(blockIDN, blockDataN, BlockIdx(-1,0,0))
 		GETNEIGHBOR(blockIDS, blockDataS, BlockIdx(1,0,0))
@@ -327,7 +390,7 @@ void checkSpecial(SceneGraphNode& node, uint16_t blockID, uint8_t blockData, con
 		static const int glassPaneOffsets[16] = {366, 423, 424, 367, 425, 368, 370, 376, 426, 369, 371, 375, 372, 374, 373, 366};
 		node.bimgoffset = glassPaneOffsets[bits];
 	}
-	else if (blockID == 132)  // tripwire
+	else if (special == BlockImages::TRIPWIRE)
 	{
 		GETNEIGHBOR(blockIDN, blockDataN, BlockIdx(-1,0,0))
 		GETNEIGHBOR(blockIDS, blockDataS, BlockIdx(1,0,0))
@@ -338,7 +401,7 @@ void checkSpecial(SceneGraphNode& node, uint16_t blockID, uint8_t blockData, con
 		static const int tripwireOffsets[16] = {549, 544, 544, 544, 549, 545, 547, 553, 549, 546, 548, 552, 549, 551, 550, 543};
 		node.bimgoffset = tripwireOffsets[bits];
 	}
-	else if ((blockID == 104 || blockID == 105) && blockData == 7)  // full stem
+	else if (special == BlockImages::STEM)
 	{
 		GETNEIGHBOR(blockIDN, blockDataN, BlockIdx(-1,0,0))
 		GETNEIGHBOR(blockIDS, blockDataS, BlockIdx(1,0,0))
@@ -354,7 +417,7 @@ void checkSpecial(SceneGraphNode& node, uint16_t blockID, uint8_t blockData, con
 		else if (blockIDW == target)
 			node.bimgoffset = 406;
 	}
-	else if (blockID == 64)  // wooden door
+	else if (special == BlockImages::WOODDOOR)
 	{
 		GETNEIGHBORUD(blockIDU, blockDataU, BlockIdx(0,0,1))
 		GETNEIGHBORUD(blockIDD, blockDataD, BlockIdx(0,0,-1))
@@ -368,7 +431,7 @@ void checkSpecial(SceneGraphNode& node, uint16_t blockID, uint8_t blockData, con
 		static const int bottomImages[4] = {77, 74, 76, 75};
 		node.bimgoffset = isTop ? topImages[dir] : bottomImages[dir];
 	}
-	else if (blockID == 71)  // iron door
+	else if (special == BlockImages::IRONDOOR)
 	{
 		GETNEIGHBORUD(blockIDU, blockDataU, BlockIdx(0,0,1))
 		GETNEIGHBORUD(blockIDD, blockDataD, BlockIdx(0,0,-1))
@@ -382,30 +445,165 @@ void checkSpecial(SceneGraphNode& node, uint16_t blockID, uint8_t blockData, con
 		static const int bottomImages[4] = {114, 111, 113, 112};
 		node.bimgoffset = isTop ? topImages[dir] : bottomImages[dir];
 	}
+}
 
-	//!!!!!!!! for now, only fully opaque blocks can have drop-off shadows, but some others like snow could
-	//          probably use them, too
-	if (rj.blockimages.isOpaque(node.bimgoffset))
+// see whether an interior water block (offset 157) can be folded into the run of water above it in its
+//  pseudocolumn, so that the whole run gets drawn as one of BlockImages' precomposited water images
+// ...the run's node is at the top block, which occludes everything the lower blocks do, so anything behind the
+//  run still gets drawn first; but a block in front of one of the lower blocks (and behind the top one) would
+//  end up underneath water that should be behind it, so only take this block if all of its neighbors that
+//  could be in front of it are water or air (N and W are already known to be water, or it wouldn't be 157,
+//  and NWU is the block above it in the run)--then the worst that can happen is that some layers of water
+//  get blended in a different order
+#define WATERORAIR(woaid, woadata) (woaid == 0 || rj.blockimages.getInfo(woaid, woadata).special == BlockImages::WATER)
+
+bool continuesWaterRun(const BlockIdx& bi, const PosChunkIdx& ci, ChunkData *chunkdata, RenderJob& rj)
+{
+	uint16_t blockID;
+	uint8_t blockData;
+	GETNEIGHBORUD(blockID, blockData, BlockIdx(0,0,1))
+	if (!WATERORAIR(blockID, blockData))
+		return false;
+	GETNEIGHBOR(blockID, blockData, BlockIdx(-1,1,0))
+	if (!WATERORAIR(blockID, blockData))
+		return false;
+	GETNEIGHBOR(blockID, blockData, BlockIdx(-1,0,1))
+	if (!WATERORAIR(blockID, blockData))
+		return false;
+	GETNEIGHBOR(blockID, blockData, BlockIdx(0,1,1))
+	if (!WATERORAIR(blockID, blockData))
+		return false;
+	return true;
+}
+
+// for nodes with no E/S/D neighbors, we add a little darkness on the EU/SU/ND/WD edges to indicate drop-off
+//!!!!!!!! for now, only fully opaque blocks can have drop-off shadows, but some others like snow could
+//          probably use them, too
+void checkDropOff(SceneGraphNode& node, const PosChunkIdx& ci, ChunkData *chunkdata, RenderJob& rj)
+{
+	const BlockIdx& bi = node.bi;
+
+	uint16_t blockIDS, blockIDE, blockIDD;
+	GETNEIGHBORID(blockIDS, BlockIdx(1,0,0))
+	GETNEIGHBORID(blockIDE, BlockIdx(0,-1,0))
+	GETNEIGHBORIDUD(blockIDD, BlockIdx(0,0,-1))
+
+	//!!!!!! neighboring blocks that aren't full height like snow and half-steps should probably produce
+	//        the drop-off effect, too
+	//!!!!!!! not to mention fully-transparent block images
+	if (blockIDS == 0)  // air
+		node.darkenSU = true;
+	if (blockIDE == 0)  // air
+		node.darkenEU = true;
+	if (blockIDD == 0)  // air
 	{
-		GETNEIGHBOR(blockIDS, blockDataS, BlockIdx(1,0,0))
-		GETNEIGHBOR(blockIDE, blockDataE, BlockIdx(0,-1,0))
-		GETNEIGHBOR(blockIDD, blockDataD, BlockIdx(0,0,-1))
-
-		//!!!!!! neighboring blocks that aren't full height like snow and half-steps should probably produce
-		//        the drop-off effect, too
-		//!!!!!!! not to mention fully-transparent block images
-		if (blockIDS == 0)  // air
-			node.darkenSU = true;
-		if (blockIDE == 0)  // air
-			node.darkenEU = true;
-		if (blockIDD == 0)  // air
-		{
-			node.darkenND = true;
-			node.darkenWD = true;
-		}
+		node.darkenND = true;
+		node.darkenWD = true;
 	}
 }
 
+bool surfaceBlockLess(const ChunkSurface::Block& b1, const ChunkSurface::Block& b2) {return b1.pcol() < b2.pcol();}
+
+// flags for the blocks in a ChunkSurface
+#define SURFACEDARKENEU 0x1
+#define SURFACEDARKENSU 0x2
+#define SURFACEDARKENND 0x4
+#define SURFACEDARKENWD 0x8
+#define SURFACEWATERTOP 0x10  // water that can be the top of a run (one of the images that has run images)
+#define SURFACEWATERRUN 0x20  // interior water that can be folded into a run above it (see continuesWaterRun)
+
+// find the blocks in a chunk that a tile might have to draw, and work out their images and drop-off edges
+// ...a block is left out if its image is transparent, or if it's behind an opaque block in its pseudocolumn;
+//  the pseudocolumns cross chunk boundaries, though, and we only look outside the chunk for the block just
+//  in front of one on the edge, so some hidden blocks do get in (and the renderer still has to stop at the
+//  first opaque one)
+ChunkSurface* buildChunkSurface(const PosChunkIdx& ci, ChunkData *chunkdata, RenderJob& rj)
+{
+	const BlockImages& blockimages = rj.blockimages;
+	ChunkSurface *surface = new ChunkSurface;
+	BlockIdx base = ci.toChunkIdx().originBlock();
+
+	// whether each block in the layer above the current one (indexed by Z*16 + X) is opaque or hidden, and
+	//  the same for the current layer; the block in front of [X,Z,Y] in its pseudocolumn is [X-1,Z+1,Y+1]
+	bool hiddenabove[256], hidden[256];
+	fill(hiddenabove, hiddenabove + 256, false);
+	int ytop = min((int)chunkdata->maxtop, rj.mp.maxY);
+	for (int y = ytop; y >= rj.mp.minY; y--)
+	{
+		for (int z = 0; z < 16; z++)
+			for (int x = 0; x < 16; x++)
+			{
+				bool& h = hidden[z*16 + x];
+				if (x > 0 && z < 15)
+					h = hiddenabove[(z+1)*16 + x-1];
+				else if (y < rj.mp.maxY)
+				{
+					// the block in front is in another chunk; trust its opacity only if it's not special
+					BlockIdx bi = base + BlockIdx(x, z, y);
+					uint16_t blockIDF;
+					uint8_t blockDataF;
+					GETNEIGHBOR(blockIDF, blockDataF, BlockIdx(-1,1,1))
+					const BlockImages::BlockInfo& finfo = blockimages.getInfo(blockIDF, blockDataF);
+					h = (finfo.flags & BLOCKOPAQUE) && finfo.special == BlockImages::NORMAL;
+				}
+				else
+					h = false;
+				if (h || y > chunkdata->tops[z*16 + x])
+					continue;
+
+				BlockIdx bi = base + BlockIdx(x, z, y);
+				uint16_t blockID = chunkdata->id(bi);
+				uint8_t blockData = chunkdata->data(bi);
+				const BlockImages::BlockInfo& info = blockimages.getInfo(blockID, blockData);
+				if ((info.flags & BLOCKTRANSPARENT) && info.special == BlockImages::NORMAL)
+					continue;
+
+				SceneGraphNode node(0, 0, bi, info.offset);
+				uint8_t flags = info.flags;
+				if (info.special != BlockImages::NORMAL)
+				{
+					checkSpecial(node, info.special, blockID, blockData, ci, chunkdata, rj);
+					flags = blockimages.offsetFlags[node.bimgoffset];
+					if (flags & BLOCKTRANSPARENT)
+						continue;
+				}
+
+				int sflags = 0;
+				if (flags & BLOCKOPAQUE)
+				{
+					checkDropOff(node, ci, chunkdata, rj);
+					sflags |= (node.darkenEU ? SURFACEDARKENEU : 0) | (node.darkenSU ? SURFACEDARKENSU : 0) |
+					          (node.darkenND ? SURFACEDARKENND : 0) | (node.darkenWD ? SURFACEDARKENWD : 0);
+					h = true;
+				}
+				int wo = node.bimgoffset;
+				if (info.special == BlockImages::WATER && (wo == 8 || wo == 157 || wo == 178 || wo == 179))
+					sflags |= SURFACEWATERTOP;
+				if (wo == 157 && !(flags & BLOCKOPAQUE) && continuesWaterRun(bi, ci, chunkdata, rj))
+					sflags |= SURFACEWATERRUN;
+				surface->blocks.push_back(ChunkSurface::Block(x, z, y, wo, sflags));
+			}
+		copy(hidden, hidden + 256, hiddenabove);
+	}
+
+	// we went through the layers from the top down, so a stable sort leaves each pseudocolumn in order
+	stable_sort(surface->blocks.begin(), surface->blocks.end(), surfaceBlockLess);
+	vector<ChunkSurface::Block>(surface->blocks).swap(surface->blocks);
+	return surface;
+}
+
+// get a chunk's surface, building it if nobody has yet
+const ChunkSurface* getChunkSurface(const PosChunkIdx& ci, ChunkData *chunkdata, RenderJob& rj)
+{
+	// (chunks with nothing in them, including the blank data used for missing chunks, all share this)
+	static const ChunkSurface emptysurface;
+	if (chunkdata->maxtop < 0)
+		return &emptysurface;
+	if (chunkdata->surface != NULL)
+		return chunkdata->surface;
+	return rj.chunkcache->setSurface(chunkdata, buildChunkSurface(ci, chunkdata, rj));
+}
+
 //!!!!!! speed these up--lots of conditionals at the moment
 void darkenEUEdge(RGBAImage& img, int32_t xstart, int32_t ystart, int B)
 {
@@ -468,9 +666,43 @@ void darkenWDEdge(RGBAImage& img, int32_t xstart, int32_t ystart, int B)
 	}
 }
 
+// draw pixels [xbegin,xend) of one row of a block image at column xstart of an image row (source points to the
+//  start of the block image row, dest to the start of the image row)
+// ...xstart may be negative, so it's only ever added to indices that have already been clipped to the image
+inline void blitBlockRow(RGBAPixel *dest, int32_t xstart, const RGBAPixel *source, const BlockImages::Span *span, const BlockImages::Span *spanend,
+                         int32_t xbegin, int32_t xend)
+{
+	for (; span != spanend; span++)
+	{
+		int32_t start = max<int32_t>(span->start, xbegin), end = min<int32_t>(span->end, xend);
+		if (start >= end)
+			continue;
+		// (a plain loop here is faster than memcpy for these short runs)
+		if (span->opaque)
+			for (int32_t x = start; x < end; x++)
+				dest[xstart + x] = source[x];
+		else
+			blendRow(dest + (xstart + start), source + start, end - start);
+	}
+}
+
+// same as alphablit, but using the block image's spans
+void blitBlockImage(RGBAImage& img, int32_t xstart, int32_t ystart, int offset, const BlockImages& blockimages)
+{
+	ImageRect srect = blockimages.getRect(offset);
+	int32_t ybegin = max(0, -ystart), yend = min(blockimages.rectsize, img.h - ystart);
+	int32_t xbegin = max(0, -xstart), xend = min(blockimages.rectsize, img.w - xstart);
+	if (xbegin >= xend)
+		return;
+	const int *rowspans = blockimages.getRowSpans(offset);
+	const BlockImages::Span *spans = &blockimages.spans[0];
+	for (int32_t y = ybegin; y < yend; y++)
+		blitBlockRow(&img(0, ystart + y), xstart, &blockimages.img(srect.x, srect.y + y), spans + rowspans[y], spans + rowspans[y+1], xbegin, xend);
+}
+
 void drawNode(SceneGraphNode& node, RGBAImage& img, const BlockImages& blockimages)
 {
-	alphablit(blockimages.img, blockimages.getRect(node.bimgoffset), img, node.xstart, node.ystart);
+	blitBlockImage(img, node.xstart, node.ystart, node.bimgoffset, blockimages);
 	if (node.darkenEU)
 		darkenEUEdge(img, node.xstart, node.ystart, blockimages.rectsize / 4);
 	if (node.darkenSU)
@@ -507,13 +739,187 @@ void drawSubgraph(SceneGraph& sg, int rootnode, RGBAImage& img, const BlockImage
 	}
 }
 
-//!!!!!!!!!!!!! many opportunities for optimization in here
+// alternative to the DAG traversal: draw the nodes in order of depth, culling the ones that can't be seen
+// ...every block that a given block occludes is strictly deeper than it (see BlockIdx::depth), so back-to-front
+//  depth order is consistent with every edge the DAG would have had; blocks with no occlusion relation don't
+//  share any pixels, so their order doesn't matter, and we get exactly the same image as drawSubgraph
+// ...except when a block image sticks out past the hexagon (see BlockImages::protrudes): then it can overlap
+//  blocks it has no occlusion relation with, and the only order for those pixels is whichever one the DAG
+//  traversal happens to reach them in, so the caller must not use this on a scene with any such nodes
+// ...first pass goes front-to-back, keeping a coverage mask of the pixels that something opaque has already
+//  been found at; a node with no visible pixels outside the mask gets dropped, and for the others we remember
+//  which of their pixels were still uncovered
+// ...second pass goes back-to-front over the surviving nodes, blending just those pixels (or rather, the span
+//  of each row that contains them); blending must still be done in that direction (rather than front-to-back
+//  "under" blending) to get results identical to blend(), which rounds at each step
+// ...the edge darkening isn't clipped against the mask, but that's okay: any pixel it touches that is
+//  covered by something in front will be overwritten when that something is drawn
+
+// the coverage mask has a row of bits for each image row, with a word of padding on either side so that
+//  nodes hanging off the edge of the image can be handled without special cases; bits for pixels outside
+//  the image are always set, so they're never drawn
+struct CoverageMask
+{
+	vector<uint64_t>& bits;
+	int wordsperrow;
+
+	CoverageMask(vector<uint64_t>& b, int32_t w, int32_t h) : bits(b), wordsperrow((w + 63) / 64 + 2)
+	{
+		bits.assign(wordsperrow * h, ~(uint64_t)0);
+		for (int32_t y = 0; y < h; y++)
+		{
+			uint64_t *row = &bits[y * wordsperrow + 1];
+			fill(row, row + w / 64, 0);
+			if (w % 64 != 0)
+				row[w / 64] = ~(uint64_t)0 << (w % 64);
+		}
+	}
+
+	// get the word holding pixel [x,y] (x >= -64); the 64 bits starting at that pixel begin at bit shift(x)
+	//  of it, and run on into the next word
+	uint64_t *find(int32_t x, int32_t y) {return &bits[y * wordsperrow + (x + 64) / 64];}
+	static int shift(int32_t x) {return (x + 64) % 64;}
+};
+
+void drawFrontToBack(SceneGraph& sg, RGBAImage& img, const BlockImages& blockimages)
+{
+	// sort the nodes front-to-back; the depths in a tile only cover a few hundred values, so a counting
+	//  sort will do
+	int n = sg.nodes.size();
+	int64_t mindepth = sg.nodes[0].bi.depth(), maxdepth = mindepth;
+	for (int i = 1; i < n; i++)
+	{
+		int64_t depth = sg.nodes[i].bi.depth();
+		mindepth = min(mindepth, depth);
+		maxdepth = max(maxdepth, depth);
+	}
+	vector<int>& depthstart = sg.depthstart;
+	depthstart.assign(maxdepth - mindepth + 2, 0);
+	for (int i = 0; i < n; i++)
+		depthstart[maxdepth - sg.nodes[i].bi.depth() + 1]++;
+	for (int d = 1; d < (int)depthstart.size(); d++)
+		depthstart[d] += depthstart[d-1];
+	// (the passes below go all over the tile, so copy what they need from each node into the sorted array,
+	//  rather than jumping around in the nodes themselves)
+	vector<SceneGraph::DepthNode>& order = sg.depthorder;
+	order.resize(n);
+	for (int i = 0; i < n; i++)
+	{
+		const SceneGraphNode& node = sg.nodes[i];
+		order[depthstart[maxdepth - node.bi.depth()]++] = SceneGraph::DepthNode(node.xstart, node.ystart, node.bimgoffset, i,
+		                                                      node.darkenEU || node.darkenSU || node.darkenND || node.darkenWD);
+	}
+
+	CoverageMask coverage(sg.coverage, img.w, img.h);
+	vector<int>& drawlist = sg.drawlist;
+	drawlist.clear();
+	int32_t rectsize = blockimages.rectsize;
+	vector<uint64_t>& drawmasks = sg.drawmasks;
+	drawmasks.resize(n * rectsize);
+	for (int f = 0; f < n; f++)
+	{
+		const SceneGraph::DepthNode& node = order[f];
+		const uint64_t *opaquerows = blockimages.getOpaqueRows(node.bimgoffset);
+		const uint64_t *visiblerows = blockimages.getVisibleRows(node.bimgoffset);
+		uint64_t *masks = &drawmasks[drawlist.size() * rectsize];
+		// (nodes with darkened edges are always drawn; they're rare, and the edges could poke out
+		//  from under whatever covers the rest of the block)
+		bool visible = node.darkened;
+		int32_t ybegin = max(0, -node.ystart), yend = min(rectsize, img.h - node.ystart);
+		fill(masks, masks + rectsize, 0);
+		// (every node overlaps the image somewhere, so there's always at least one row; the shifts into the
+		//  second word are split in two so that they come out 0 instead of undefined when s is 0)
+		uint64_t *w = coverage.find(node.xstart, node.ystart + ybegin);
+		int s = CoverageMask::shift(node.xstart);
+		for (int32_t y = ybegin; y < yend; y++, w += coverage.wordsperrow)
+		{
+			masks[y] = visiblerows[y] & ~((w[0] >> s) | ((w[1] << 1) << (63 - s)));
+			visible |= masks[y] != 0;
+			w[0] |= opaquerows[y] << s;
+			w[1] |= (opaquerows[y] >> 1) >> (63 - s);
+		}
+		if (visible)
+			drawlist.push_back(f);
+	}
+
+	const BlockImages::Span *spans = &blockimages.spans[0];
+	for (int d = drawlist.size() - 1; d >= 0; d--)
+	{
+		const SceneGraph::DepthNode& node = order[drawlist[d]];
+		ImageRect srect = blockimages.getRect(node.bimgoffset);
+		const int *rowspans = blockimages.getRowSpans(node.bimgoffset);
+		const uint64_t *masks = &drawmasks[d * rectsize];
+		for (int32_t y = 0; y < rectsize; y++)
+		{
+			// draw from the first pixel that needs it to the last; the ones in between that didn't need it
+			//  are either transparent or will be overwritten later, and the spans do better whole
+			// (the mask is clear outside the image, so this doesn't need any more clipping)
+			if (masks[y] == 0)
+				continue;
+			int32_t first = __builtin_ctzll(masks[y]), last = 63 - __builtin_clzll(masks[y]);
+			blitBlockRow(&img(0, node.ystart + y), node.xstart, &blockimages.img(srect.x, srect.y + y), spans + rowspans[y], spans + rowspans[y+1], first, last + 1);
+		}
+		if (!node.darkened)
+			continue;
+		const SceneGraphNode& sgnode = sg.nodes[node.node];
+		if (sgnode.darkenEU)
+			darkenEUEdge(img, node.xstart, node.ystart, rectsize / 4);
+		if (sgnode.darkenSU)
+			darkenSUEdge(img, node.xstart, node.ystart, rectsize / 4);
+		if (sgnode.darkenND)
+			darkenNDEdge(img, node.xstart, node.ystart, rectsize / 4);
+		if (sgnode.darkenWD)
+			darkenWDEdge(img, node.xstart, node.ystart, rectsize / 4);
+	}
+}
+
+// after drawing a super tile, find which of its base tiles have any blocks in them (i.e. the ones drawTile
+//  would have found something to draw in), using the top node of each pseudocolumn
+// ...a base tile's pseudocolumns are the ones centered less than 2B-1 pixels outside of it (see TileBlockIterator)
+void findSuperTileNodes(RenderJob& rj, int span)
+{
+	rj.supertilenodes.assign(span * span, false);
+	const SceneGraph& sg = *rj.scenegraph;
+	int32_t size = rj.mp.tileSize(), B = rj.mp.B;
+	for (vector<int>::const_iterator it = sg.pcols.begin(); it != sg.pcols.end(); it++)
+	{
+		if (*it == -1)
+			continue;
+		// (node coords are for the top-left of the block bounding box; get the center)
+		int64_t cx = sg.nodes[*it].xstart + 2*B, cy = sg.nodes[*it].ystart + 2*B;
+		int64_t xbegin = max<int64_t>(floordiv(cx - 2*B + 1, size), 0), xend = min<int64_t>(floordiv(cx + 2*B - 1, size), span - 1);
+		int64_t ybegin = max<int64_t>(floordiv(cy - 2*B + 1, size), 0), yend = min<int64_t>(floordiv(cy + 2*B - 1, size), span - 1);
+		for (int64_t y = ybegin; y <= yend; y++)
+			for (int64_t x = xbegin; x <= xend; x++)
+				rj.supertilenodes[y * span + x] = true;
+	}
+}
+
+// copy a base tile out of the super tile that contains it; returns false if it has no blocks in it, just like
+//  drawTile (a tile whose blocks all came out transparent still gets saved, as it would have been without -s)
+bool cutSuperTile(const TileIdx& ti, RenderJob& rj, RGBAImage& tile)
+{
+	if (!rj.supertilenodes[(ti.y - rj.supertiley) * rj.supertilespan + (ti.x - rj.supertilex)])
+		return false;
+	PhaseTimer pt(&rj.stats.phases, PHASE_DRAW);
+	int32_t size = rj.mp.tileSize();
+	tile.create(size, size);
+	int32_t xstart = (ti.x - rj.supertilex) * size, ystart = (ti.y - rj.supertiley) * size;
+	for (int32_t y = 0; y < size; y++)
+		copy(&rj.supertile(xstart, ystart + y), &rj.supertile(xstart, ystart + y) + size, &tile(0, y));
+	return true;
+}
+
 bool renderTile(const TileIdx& ti, RenderJob& rj, RGBAImage& tile)
 {
 	// if this tile isn't required, abort
 	if (!rj.tiletable->isRequired(ti))
 		return false;
 
+	// let the prefetchers know we've gotten this far
+	if (rj.prefetcher != NULL)
+		rj.prefetcher->reached(rj.prefetchlane);
+
 	// if this tile doesn't fit in the Google map, skip it
 	string tilefile = rj.outputpath + "/" + ti.toFilePath(rj.mp);
 	if (tilefile.empty())
@@ -534,96 +940,171 @@ bool renderTile(const TileIdx& ti, RenderJob& rj, RGBAImage& tile)
 	// if we're in test mode, don't actually draw anything
 	if (rj.testmode)
 		return true;
+	TRACE_SCOPE("tile", "x,y", ti.x, ti.y);
 
+	// if we didn't find anything to draw--i.e. our final image will be fully transparent--then there's
+	//  no sense saving it to disk
+	// ...if this tile is part of a super tile, it's already been drawn, and we just need to cut it out
+	if (rj.supertilespan > 0)
+	{
+		if (!cutSuperTile(ti, rj, tile))
+			return false;
+	}
+	else if (!drawTile(ti, rj, tile))
+		return false;
+
+	// save the image to disk
+	rj.tilewriter->submit(tile, tilefile, rj.pngprofiles.get(rj.mp.baseZoom, rj.mp.baseZoom), &rj.stats.phases);
+	return true;
+}
+
+// add the scene graph edges between the pseudocolumn a TileBlockIterator is on and its N, E, and SE neighbors
+void linkPseudocolumn(SceneGraph& sg, const TileBlockIterator& tbit)
+{
+	if (tbit.nextN != -1)
+		buildDependencies(sg, tbit.nextN, tbit.pos, 4);
+	if (tbit.nextE != -1)
+		buildDependencies(sg, tbit.nextE, tbit.pos, 5);
+	if (tbit.nextSE != -1)
+		buildDependencies(sg, tbit.nextSE, tbit.pos, 6);
+}
+
+bool drawTile(const TileIdx& ti, RenderJob& rj, RGBAImage& tile)
+{
+	return drawArea(ti.getBBox(rj.mp), rj, tile);
+}
+
+//!!!!!!!!!!!!! many opportunities for optimization in here
+bool drawArea(const BBox& bbox, RenderJob& rj, RGBAImage& tile)
+{
 	SceneGraph& sg = *rj.scenegraph;
 	sg.clear();
-	tile.create(rj.mp.tileSize(), rj.mp.tileSize());
+	tile.create(bbox.bottomRight.x - bbox.topLeft.x, bbox.bottomRight.y - bbox.topLeft.y);
 	const BlockImages& blockimages = rj.blockimages;
 
 	// we'll be given block center pixels in absolute coords, but for blitting, we need the block bounding box
 	//  in tile image coords; compute the translation that gives us that
 	// (subtract the tile bounding box corner, then subtract another [2B,2B] to convert from block center to box)
-	BBox tilebb = ti.getBBox(rj.mp);
-	int64_t xoff = -tilebb.topLeft.x - 2*rj.mp.B;
-	int64_t yoff = -tilebb.topLeft.y - 2*rj.mp.B;
+	int64_t xoff = -bbox.topLeft.x - 2*rj.mp.B;
+	int64_t yoff = -bbox.topLeft.y - 2*rj.mp.B;
 
 	// step 1: build the scene graph
+	// ...if we're compositing front-to-back, the edges aren't needed, unless some block image sticks out past
+	//  its hexagon, in which case we'll go back and add them once we have all the nodes
+	PhaseTimer sgtimer(&rj.stats.phases, PHASE_SCENEGRAPH);
+	bool protrudes = false;
 	// ...we'll iterate through the pseudocolumn center pixels, starting in the top left of the image, moving down then
 	//  right; this means that by the time we reach a pseudocolumn, its N, E, and SE neighbors have already been done,
 	//  so we can add any necessary edges to or from those neighbors
-	for (TileBlockIterator tbit(ti, rj.mp); !tbit.end; tbit.advance())
+	for (TileBlockIterator tbit(bbox, rj.mp); !tbit.end; tbit.advance())
 	{
 		// we'll start at the top of the pseudocolumn and go down, adding any non-air blocks to the graph, stopping
 		//  at the first totally opaque block
 		sg.pcols.push_back(-1);
-		PosChunkIdx lastci(-1,-1);
-		ChunkData *chunkdata = NULL;
 		int prevnode = -1;
-		for (PseudocolumnIterator pcit(tbit.current, rj.mp); !pcit.end; pcit.advance())
+		// if prevnode is a run of water, how many blocks are in it, and the offset of its top block and the
+		//  position of its bottom one
+		int waterrun = 0, watertop = 0;
+		BlockIdx waterbottom(0,0,0);
+		// go through the pseudocolumn a chunk at a time, taking the blocks from each chunk's surface
+		bool done = false;
+		for (PseudocolumnIterator pcit(tbit.current, rj.mp); !pcit.end && !done;)
 		{
-			// look up chunk data (we might have it already)
 			PosChunkIdx ci = pcit.current.getChunkIdx();
-			if (ci != lastci)
-				chunkdata = rj.chunkcache->getData(ci);
-
-			// get block type and data
-			uint16_t blockID = chunkdata->id(pcit.current);
-			uint8_t blockData = chunkdata->data(pcit.current);
-			int initialoffset = blockimages.getOffset(blockID, blockData);  // we might use a different one after checkSpecial
-			
-			// if this is air, move on (we *always* consider air to be transparent; it has no block image)
-			if (blockID == 0)
-				continue;
-
-			// create a node for this block
-			SceneGraphNode node(tbit.current.x + xoff, tbit.current.y + yoff, pcit.current, initialoffset);
-
-			// check out neighboring blocks to see if we need to do anything special: set the darken-edge flags,
-			//  or change the offset to a special one (one not corresponding to a plain blockID/blockData combo)
-			checkSpecial(node, blockID, blockData, ci, chunkdata, rj);
-
-			// if this is not air, but is nonetheless transparent, move on
-			if (blockimages.isTransparent(node.bimgoffset))
-				continue;
-
-			// commit the node
-			int thisnode = sg.nodes.size();
-			sg.nodes.push_back(node);
+			ChunkData *chunkdata = rj.chunkcache->getData(ci);
+			const ChunkSurface *surface = getChunkSurface(ci, chunkdata, rj);
+			BlockOffset bo(pcit.current);
+			BlockIdx base = ci.toChunkIdx().originBlock();
+			// (each step is +1 in X and -1 in Z, so we leave the chunk when X reaches 16 or Z reaches -1)
+			int64_t steps = min(16 - bo.x, bo.z + 1);
+
+			const ChunkSurface::Block *begin, *end;
+			surface->getPCol(bo, begin, end);
+			for (const ChunkSurface::Block *b = begin; b != end; b++)
+			{
+				if (b->y > bo.y)
+					continue;
+				BlockIdx bi = base + BlockIdx(b->x(), b->z(), b->y);
+
+				// if this is interior water directly below a run of water, add it to the run instead of making a
+				//  new node (or if the run is already deep enough that nothing beneath its top face can be seen,
+				//  just drop it)
+				if (rj.waterruns && waterrun > 0 && (b->flags & SURFACEWATERRUN) && bi == waterbottom + BlockIdx(1,-1,-1) &&
+				    (waterrun < blockimages.maxWaterDepth || blockimages.waterSaturates))
+				{
+					waterrun++;
+					waterbottom = bi;
+					if (waterrun <= blockimages.maxWaterDepth)
+						sg.nodes[prevnode].bimgoffset = blockimages.getWaterOffset(watertop, waterrun);
+					continue;
+				}
 
-			// link our parent (the node above us in our own pseudocolumn) to us
-			if (prevnode != -1)
-				sg.nodes[prevnode].children[0] = thisnode;
-			// ...if we have no parent, then we're the top of this pcol
-			else
-				sg.pcols.back() = thisnode;
-			prevnode = thisnode;
+				// create a node for this block (its image and drop-off edges were worked out with the surface)
+				SceneGraphNode node(tbit.current.x + xoff, tbit.current.y + yoff, bi, b->offset);
+				node.darkenEU = b->flags & SURFACEDARKENEU;
+				node.darkenSU = b->flags & SURFACEDARKENSU;
+				node.darkenND = b->flags & SURFACEDARKENND;
+				node.darkenWD = b->flags & SURFACEDARKENWD;
+
+				// commit the node
+				int thisnode = sg.nodes.size();
+				sg.nodes.push_back(node);
+				if (blockimages.protrudes(b->offset))
+					protrudes = true;
+
+				// link our parent (the node above us in our own pseudocolumn) to us
+				if (prevnode != -1)
+					sg.nodes[prevnode].children[0] = thisnode;
+				// ...if we have no parent, then we're the top of this pcol
+				else
+					sg.pcols.back() = thisnode;
+				prevnode = thisnode;
+
+				// a water block starts a new run of water
+				if (b->flags & SURFACEWATERTOP)
+				{
+					waterrun = 1;
+					watertop = b->offset;
+					waterbottom = bi;
+				}
+				else
+					waterrun = 0;
 
-			// if this block is opaque, we're done with this pcol
-			if (blockimages.isOpaque(node.bimgoffset))
-				break;
+				// if this block is opaque, we're done with this pcol
+				if (blockimages.isOpaque(b->offset))
+				{
+					done = true;
+					break;
+				}
+			}
+			pcit.advance(steps);
 		}
 
 		// check dependencies with our N, E, and SE neighbors
-		if (tbit.nextN != -1)
-			buildDependencies(sg, tbit.nextN, tbit.pos, 4);
-		if (tbit.nextE != -1)
-			buildDependencies(sg, tbit.nextE, tbit.pos, 5);
-		if (tbit.nextSE != -1)
-			buildDependencies(sg, tbit.nextSE, tbit.pos, 6);
+		if (!rj.fronttoback)
+			linkPseudocolumn(sg, tbit);
 	}
-	
-	// if we didn't find anything to draw--i.e. our final image will be fully transparent--then there's
-	//  no sense saving it to disk
+	bool fronttoback = rj.fronttoback && !protrudes;
+	if (rj.fronttoback && protrudes)
+		for (TileBlockIterator tbit(bbox, rj.mp); !tbit.end; tbit.advance())
+			linkPseudocolumn(sg, tbit);
+
+	// we're done with the chunk data; let the shared cache have back whatever the next few tiles
+	//  aren't likely to need
+	rj.chunkcache->releaseOld();
+	rj.stats.pcols += sg.pcols.size();
+	rj.stats.nodes += sg.nodes.size();
+
 	if (sg.nodes.empty())
 		return false;
 
 	// step 2: traverse the graph and draw the image
-	for (int i = 0; i < (int)sg.nodes.size(); i++)
-		drawSubgraph(sg, i, tile, blockimages);
-
-	// save the image to disk
-	if (!tile.writePNG(tilefile))
-		cerr << "failed to write " << tilefile << endl;
+	PhaseTimer drawtimer(&rj.stats.phases, PHASE_DRAW);
+	if (fronttoback)
+		drawFrontToBack(sg, tile, blockimages);
+	else
+		for (int i = 0; i < (int)sg.nodes.size(); i++)
+			drawSubgraph(sg, i, tile, blockimages);
 	return true;
 }
 
@@ -638,6 +1119,27 @@ bool renderZoomTile(const ZoomTileIdx& zti, RenderJob& rj, RGBAImage& tile)
 	// see whether this entire tile can be rejected early
 	if (rj.tiletable->reject(zti, rj.mp))
 		return false;
+	TRACE_SCOPE("zoomtile", "x,y,zoom", zti.x, zti.y, zti.zoom);
+
+	// if we're using super tiles, and this is the biggest tile that fits in one (and isn't already part of
+	//  one), draw all of it now, with a single scene graph; the base tiles get cut out of it as we reach them
+	// ...unless most of its base tiles aren't required (e.g. on the edges of the map), in which case
+	//  drawing the whole area would be a waste; we'll try again with the subtiles
+	int span = 1 << (rj.mp.baseZoom - zti.zoom);
+	bool super = rj.supertilespan == 0 && span <= rj.supertiles && !rj.testmode &&
+	             2 * rj.tiletable->getNumRequired(zti, rj.mp) >= span * span;
+	if (super)
+	{
+		TRACE_SCOPE("supertile", "x,y,zoom", zti.x, zti.y, zti.zoom);
+		TileIdx ti = zti.toTileIdx(rj.mp);
+		BBox bbox = ti.getBBox(rj.mp);
+		bbox.bottomRight = bbox.topLeft + Pixel(span * rj.mp.tileSize(), span * rj.mp.tileSize());
+		drawArea(bbox, rj, rj.supertile);
+		findSuperTileNodes(rj, span);
+		rj.supertilespan = span;
+		rj.supertilex = ti.x;
+		rj.supertiley = ti.y;
+	}
 
 	// render the four subtiles (if they're needed)
 	TileCache::ZoomLevel& zlevel = rj.tilecache->levels[rj.mp.baseZoom - zti.zoom - 1];
@@ -646,6 +1148,8 @@ bool renderZoomTile(const ZoomTileIdx& zti, RenderJob& rj, RGBAImage& tile)
 	zlevel.used[1] = renderZoomTile(topleft.add(0,1), rj, zlevel.tiles[1]);
 	zlevel.used[2] = renderZoomTile(topleft.add(1,0), rj, zlevel.tiles[2]);
 	zlevel.used[3] = renderZoomTile(topleft.add(1,1), rj, zlevel.tiles[3]);
+	if (super)
+		rj.supertilespan = 0;
 
 	// if none of the subtiles are used, we have nothing to do
 	int usedcount = 0;
@@ -662,77 +1166,49 @@ bool renderZoomTile(const ZoomTileIdx& zti, RenderJob& rj, RGBAImage& tile)
 	// if some of the subtiles are unused and this is an incremental update, we need to
 	//  load the existing version of this tile (if there is one) to get the unchanged portions
 	string tilefile = rj.outputpath + "/" + zti.toFilePath();
-	if (usedcount < 4 && !rj.fullrender)
 	{
-		// if it doesn't read, no big deal (it may not exist anyway)
-		if (!tile.readPNG(tilefile) || tile.w != rj.mp.tileSize() || tile.h != rj.mp.tileSize())
+		PhaseTimer pt(&rj.stats.phases, PHASE_ZOOM);
+		if (usedcount < 4 && !rj.fullrender)
+		{
+			// if it doesn't read, no big deal (it may not exist anyway)
+			if (!tile.readPNG(tilefile) || tile.w != rj.mp.tileSize() || tile.h != rj.mp.tileSize())
+				tile.create(rj.mp.tileSize(), rj.mp.tileSize());
+		}
+		else
 			tile.create(rj.mp.tileSize(), rj.mp.tileSize());
+
+		// combine the four subtile images into this tile's image
+		int halfsize = rj.mp.tileSize() / 2;
+		if (zlevel.used[0])
+			reduceHalf(tile, ImageRect(0, 0, halfsize, halfsize), zlevel.tiles[0]);
+		if (zlevel.used[1])
+			reduceHalf(tile, ImageRect(0, halfsize, halfsize, halfsize), zlevel.tiles[1]);
+		if (zlevel.used[2])
+			reduceHalf(tile, ImageRect(halfsize, 0, halfsize, halfsize), zlevel.tiles[2]);
+		if (zlevel.used[3])
+			reduceHalf(tile, ImageRect(halfsize, halfsize, halfsize, halfsize), zlevel.tiles[3]);
 	}
-	else
-		tile.create(rj.mp.tileSize(), rj.mp.tileSize());
-
-	// combine the four subtile images into this tile's image
-	int halfsize = rj.mp.tileSize() / 2;
-	if (zlevel.used[0])
-		reduceHalf(tile, ImageRect(0, 0, halfsize, halfsize), zlevel.tiles[0]);
-	if (zlevel.used[1])
-		reduceHalf(tile, ImageRect(0, halfsize, halfsize, halfsize), zlevel.tiles[1]);
-	if (zlevel.used[2])
-		reduceHalf(tile, ImageRect(halfsize, 0, halfsize, halfsize), zlevel.tiles[2]);
-	if (zlevel.used[3])
-		reduceHalf(tile, ImageRect(halfsize, halfsize, halfsize, halfsize), zlevel.tiles[3]);
 
 	// save to disk
-	if (!tile.writePNG(tilefile))
-		cerr << "failed to write " << tilefile << endl;
+	rj.tilewriter->submit(tile, tilefile, rj.pngprofiles.get(zti.zoom, rj.mp.baseZoom), &rj.stats.phases);
 	return true;
 }
 
 
 
-bool renderZoomTile(const ZoomTileIdx& zti, RenderJob& rj, RGBAImage& tile, const ThreadOutputCache& tocache)
+// build a zoom tile above the ThreadOutputCache level from its four children, which must all be finished
+bool reduceZoomTile(const ZoomTileIdx& zti, RenderJob& rj, ThreadOutputCache& tocache)
 {
-	// if this is at or below the ThreadOutputCache level, abort
-	if (zti.zoom >= tocache.zoom)
-		return false;
-
-	// get the four subtiles: if we're one level above the ThreadOutputCache level, they're in the
-	//  cache; otherwise, we recurse
-	// ...we use the ZoomLevel::used bits either way
-	TileCache::ZoomLevel& zlevel = rj.tilecache->levels[rj.mp.baseZoom - zti.zoom - 1];
+	// get the four subtiles from the level below
 	ZoomTileIdx topleft = zti.toZoom(zti.zoom + 1);
-	const RGBAImage *tile0, *tile1, *tile2, *tile3;
-	if (zti.zoom == tocache.zoom - 1)
-	{
-		int idx = tocache.getIndex(topleft);
-		zlevel.used[0] = tocache.used[idx];
-		tile0 = &tocache.images[idx];
-		idx = tocache.getIndex(topleft.add(0,1));
-		zlevel.used[1] = tocache.used[idx];
-		tile1 = &tocache.images[idx];
-		idx = tocache.getIndex(topleft.add(1,0));
-		zlevel.used[2] = tocache.used[idx];
-		tile2 = &tocache.images[idx];
-		idx = tocache.getIndex(topleft.add(1,1));
-		zlevel.used[3] = tocache.used[idx];
-		tile3 = &tocache.images[idx];
-	}
-	else
-	{
-		zlevel.used[0] = renderZoomTile(topleft, rj, zlevel.tiles[0], tocache);
-		tile0 = &zlevel.tiles[0];
-		zlevel.used[1] = renderZoomTile(topleft.add(0,1), rj, zlevel.tiles[1], tocache);
-		tile1 = &zlevel.tiles[1];
-		zlevel.used[2] = renderZoomTile(topleft.add(1,0), rj, zlevel.tiles[2], tocache);
-		tile2 = &zlevel.tiles[2];
-		zlevel.used[3] = renderZoomTile(topleft.add(1,1), rj, zlevel.tiles[3], tocache);
-		tile3 = &zlevel.tiles[3];
-	}
+	vector<RGBAImage>& children = tocache.images[zti.zoom + 1];
+	vector<char>& childused = tocache.used[zti.zoom + 1];
+	int idxs[4] = {tocache.getIndex(topleft), tocache.getIndex(topleft.add(0,1)), tocache.getIndex(topleft.add(1,0)), tocache.getIndex(topleft.add(1,1))};
 
 	// if none of the subtiles are used, we have nothing to do
 	int usedcount = 0;
 	for (int i = 0; i < 4; i++)
-		if (zlevel.used[i])
+		if (childused[idxs[i]])
 			usedcount++;
 	if (usedcount == 0)
 		return false;
@@ -740,36 +1216,293 @@ bool renderZoomTile(const ZoomTileIdx& zti, RenderJob& rj, RGBAImage& tile, cons
 	// if we're in test mode, pretend we've successfully drawn
 	if (rj.testmode)
 		return true;
+	TRACE_SCOPE("zoomtile", "x,y,zoom", zti.x, zti.y, zti.zoom);
 
 	// if some of the subtiles are unused and this is an incremental update, we need to
 	//  load the existing version of this tile (if there is one) to get the unchanged portions
+	RGBAImage& tile = tocache.images[zti.zoom][tocache.getIndex(zti)];
 	string tilefile = rj.outputpath + "/" + zti.toFilePath();
-	if (usedcount < 4 && !rj.fullrender)
 	{
-		// if it doesn't read, no big deal (it may not exist anyway)
-		if (!tile.readPNG(tilefile) || tile.w != rj.mp.tileSize() || tile.h != rj.mp.tileSize())
+		PhaseTimer pt(&rj.stats.phases, PHASE_ZOOM);
+		if (usedcount < 4 && !rj.fullrender)
+		{
+			// if it doesn't read, no big deal (it may not exist anyway)
+			if (!tile.readPNG(tilefile) || tile.w != rj.mp.tileSize() || tile.h != rj.mp.tileSize())
+				tile.create(rj.mp.tileSize(), rj.mp.tileSize());
+		}
+		else
 			tile.create(rj.mp.tileSize(), rj.mp.tileSize());
+
+		// combine the four subtile images into this tile's image
+		int halfsize = rj.mp.tileSize() / 2;
+		if (childused[idxs[0]])
+			reduceHalf(tile, ImageRect(0, 0, halfsize, halfsize), children[idxs[0]]);
+		if (childused[idxs[1]])
+			reduceHalf(tile, ImageRect(0, halfsize, halfsize, halfsize), children[idxs[1]]);
+		if (childused[idxs[2]])
+			reduceHalf(tile, ImageRect(halfsize, 0, halfsize, halfsize), children[idxs[2]]);
+		if (childused[idxs[3]])
+			reduceHalf(tile, ImageRect(halfsize, halfsize, halfsize, halfsize), children[idxs[3]]);
 	}
-	else
-		tile.create(rj.mp.tileSize(), rj.mp.tileSize());
-
-	// combine the four subtile images into this tile's image
-	int halfsize = rj.mp.tileSize() / 2;
-	if (zlevel.used[0])
-		reduceHalf(tile, ImageRect(0, 0, halfsize, halfsize), *tile0);
-	if (zlevel.used[1])
-		reduceHalf(tile, ImageRect(0, halfsize, halfsize, halfsize), *tile1);
-	if (zlevel.used[2])
-		reduceHalf(tile, ImageRect(halfsize, 0, halfsize, halfsize), *tile2);
-	if (zlevel.used[3])
-		reduceHalf(tile, ImageRect(halfsize, halfsize, halfsize, halfsize), *tile3);
+
+	// the subtiles aren't needed anymore, so give their memory back
+	for (int i = 0; i < 4; i++)
+		vector<RGBAPixel>().swap(children[idxs[i]].data);
 
 	// save to disk
-	if (!tile.writePNG(tilefile))
-		cerr << "failed to write " << tilefile << endl;
+	rj.tilewriter->submit(tile, tilefile, rj.pngprofiles.get(zti.zoom, rj.mp.baseZoom), &rj.stats.phases);
 	return true;
 }
 
+void finishZoomTile(const ZoomTileIdx& zti, RenderJob& rj, ThreadOutputCache& tocache)
+{
+	// the atomic decrement also makes sure that the last thread sees the images the other threads
+	//  wrote for their tiles
+	for (ZoomTileIdx child = zti; child.zoom > 0; child = child.toZoom(child.zoom - 1))
+	{
+		ZoomTileIdx parent = child.toZoom(child.zoom - 1);
+		int idx = tocache.getIndex(parent);
+		if (__sync_sub_and_fetch(&tocache.pending[parent.zoom][idx], 1) != 0)
+			return;
+		tocache.used[parent.zoom][idx] = reduceZoomTile(parent, rj, tocache);
+	}
+}
+
+
+
+// list the required base tiles in a zoom tile, in the order renderZoomTile goes through them
+void listRequiredTiles(const ZoomTileIdx& zti, RenderJob& rj, vector<TileIdx>& tiles)
+{
+	if (zti.zoom == rj.mp.baseZoom)
+	{
+		TileIdx ti = zti.toTileIdx(rj.mp);
+		if (rj.tiletable->isRequired(ti))
+			tiles.push_back(ti);
+		return;
+	}
+	if (rj.tiletable->reject(zti, rj.mp))
+		return;
+	ZoomTileIdx topleft = zti.toZoom(zti.zoom + 1);
+	listRequiredTiles(topleft, rj, tiles);
+	listRequiredTiles(topleft.add(0,1), rj, tiles);
+	listRequiredTiles(topleft.add(1,0), rj, tiles);
+	listRequiredTiles(topleft.add(1,1), rj, tiles);
+}
+
+// get the chunks that a base tile is going to need into the shared cache, with their surfaces built, by going
+//  down (some of) its pseudocolumns the way drawArea does, until they hit something opaque
+void prefetchTile(const TileIdx& ti, RenderJob& rj)
+{
+	PhaseTimer pt(&rj.stats.phases, PHASE_SCENEGRAPH);
+	TRACE_SCOPE("prefetch", "x,y", ti.x, ti.y);
+	int64_t mask = PREFETCHSTRIDE - 1;
+	for (TileBlockIterator tbit(ti, rj.mp); !tbit.end; tbit.advance())
+	{
+		if ((floordiv(tbit.current.x, 2*rj.mp.B) & mask) != 0 || (floordiv(tbit.current.y, 2*rj.mp.B) & mask) != 0)
+			continue;
+		bool done = false;
+		for (PseudocolumnIterator pcit(tbit.current, rj.mp); !pcit.end && !done;)
+		{
+			PosChunkIdx ci = pcit.current.getChunkIdx();
+			const ChunkSurface *surface = getChunkSurface(ci, rj.chunkcache->getData(ci), rj);
+			BlockOffset bo(pcit.current);
+			const ChunkSurface::Block *begin, *end;
+			surface->getPCol(bo, begin, end);
+			for (const ChunkSurface::Block *b = begin; b != end && !done; b++)
+				if (b->y <= bo.y && rj.blockimages.isOpaque(b->offset))
+					done = true;
+			pcit.advance(min(16 - bo.x, bo.z + 1));
+		}
+	}
+	rj.chunkcache->releaseOld();
+}
+
+struct PrefetchThreadParams
+{
+	ChunkPrefetcher *prefetcher;
+	RenderJob *rj;
+
+	PrefetchThreadParams(ChunkPrefetcher *p, RenderJob *r) : prefetcher(p), rj(r) {}
+};
+
+void *runPrefetchThread(void *arg)
+{
+	PrefetchThreadParams *ptp = (PrefetchThreadParams*)arg;
+	ptp->prefetcher->run(*ptp->rj);
+	delete ptp;
+	return 0;
+}
+
+ChunkPrefetcher::ChunkPrefetcher(RenderJob& rj, int numlanes, ZoomTileScheduler *sched)
+	: lanes(numlanes), ahead(PREFETCHAHEAD + rj.supertiles * rj.supertiles), scheduler(sched),
+	  rjs(new RenderJob[rj.prefetchers]), pthrs(rj.prefetchers), done(false)
+{
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&work, NULL);
+
+	// the prefetch threads get their own copies of the tables, like the render threads
+	for (int i = 0; i < rj.prefetchers; i++)
+	{
+		rjs[i].testmode = rj.testmode;
+		rjs[i].fullrender = rj.fullrender;
+		rjs[i].regionformat = rj.regionformat;
+		rjs[i].mp = rj.mp;
+		rjs[i].inputpath = rj.inputpath;
+		rjs[i].blockimages = rj.blockimages;
+		rjs[i].chunktable.reset(new ChunkTable);
+		rjs[i].chunktable->copyFrom(*rj.chunktable);
+		rjs[i].tiletable.reset(new TileTable);
+		rjs[i].tiletable->copyFrom(*rj.tiletable);
+		rjs[i].chunkcache.reset(new ChunkCache(*rj.sharedchunkcache, *rjs[i].chunktable, *rj.regioncache, rjs[i].inputpath, rjs[i].fullrender, rjs[i].regionformat, rjs[i].stats.chunkcache, rjs[i].stats.regioncache, &rjs[i].stats.phases));
+	}
+	for (int i = 0; i < rj.prefetchers; i++)
+		if (0 != pthread_create(&pthrs[i], NULL, runPrefetchThread, (void*)new PrefetchThreadParams(this, &rjs[i])))
+		{
+			cerr << "failed to create prefetch thread!" << endl;
+			exit(-1);
+		}
+}
+
+ChunkPrefetcher::~ChunkPrefetcher()
+{
+	stop();
+	delete[] rjs;
+	pthread_cond_destroy(&work);
+	pthread_mutex_destroy(&mutex);
+}
+
+void ChunkPrefetcher::start(int lane, const ZoomTileIdx& zti)
+{
+	mutexLocker ml(&mutex);
+	Lane& l = lanes[lane];
+	// if we guessed this zoom tile, drop whatever came before it; otherwise, start the lane over
+	size_t k = 0;
+	while (k < l.segments.size() && l.segments[k].zti != zti)
+		k++;
+	if (k < l.segments.size())
+	{
+		size_t first = l.segments[k].start;
+		l.segments.erase(l.segments.begin(), l.segments.begin() + k);
+		for (deque<Segment>::iterator it = l.segments.begin(); it != l.segments.end(); it++)
+			it->start -= first;
+		l.tiles.erase(l.tiles.begin(), l.tiles.begin() + first);
+		l.next = max(l.next, first) - first;
+	}
+	else
+	{
+		l.segments.clear();
+		l.segments.push_back(Segment(zti, 0));
+		l.tiles.clear();
+		l.next = 0;
+		l.listing = false;
+		l.generation++;
+	}
+	l.reached = 0;
+	pthread_cond_broadcast(&work);
+}
+
+void ChunkPrefetcher::reached(int lane)
+{
+	mutexLocker ml(&mutex);
+	Lane& l = lanes[lane];
+	l.reached++;
+	// (no point prefetching a tile the render thread is already drawing)
+	l.next = max(l.next, l.reached);
+	pthread_cond_signal(&work);
+}
+
+void ChunkPrefetcher::stop()
+{
+	{
+		mutexLocker ml(&mutex);
+		if (done)
+			return;
+		done = true;
+		pthread_cond_broadcast(&work);
+	}
+	for (vector<pthread_t>::iterator it = pthrs.begin(); it != pthrs.end(); it++)
+		pthread_join(*it, NULL);
+}
+
+void ChunkPrefetcher::finish(RenderStats& stats)
+{
+	stop();
+	for (int i = 0; i < (int)pthrs.size(); i++)
+	{
+		stats.prefetchtiles += rjs[i].stats.prefetchtiles;
+		stats.prefetchcache += rjs[i].stats.chunkcache;
+		stats.regioncache += rjs[i].stats.regioncache;
+		stats.prefetchphases.push_back(rjs[i].stats.phases);
+	}
+}
+
+void ChunkPrefetcher::run(RenderJob& rj)
+{
+	uint64_t start = getNanoseconds();
+	TRACE_THREAD("prefetch " + tostring((int)(&rj - rjs)));
+	vector<TileIdx> list;
+	pthread_mutex_lock(&mutex);
+	while (!done)
+	{
+		// find the lane that's the least far ahead of its render thread, out of those we can do something for:
+		//  either prefetch its next tile, or list the tiles of a zoom tile it has started on (or probably will)
+		int best = -1;
+		for (int i = 0; i < (int)lanes.size(); i++)
+		{
+			Lane& l = lanes[i];
+			if (l.segments.empty())
+				continue;
+			// if the render thread is about to run out of tiles, look at what it has coming up next
+			if (scheduler != NULL && l.segments.back().listed && l.next >= l.tiles.size() && l.tiles.size() < l.reached + ahead)
+			{
+				ZoomTileScheduler::ThreadQueue& q = scheduler->queues[i];
+				mutexLocker ml(&q.mutex);
+				if (!q.tasks.empty() && q.tasks.front().zti != l.segments.back().zti)
+					l.segments.push_back(Segment(q.tasks.front().zti, l.tiles.size()));
+			}
+			bool canfetch = l.next < l.tiles.size() && l.next < l.reached + ahead;
+			bool canlist = !l.segments.back().listed && !l.listing;
+			if ((canfetch || canlist) && (best == -1 || l.next - l.reached < lanes[best].next - lanes[best].reached))
+				best = i;
+		}
+		if (best == -1)
+		{
+			pthread_cond_wait(&work, &mutex);
+			continue;
+		}
+
+		// do the work without holding the lock
+		Lane& l = lanes[best];
+		if (l.next < l.tiles.size() && l.next < l.reached + ahead)
+		{
+			TileIdx ti = l.tiles[l.next++];
+			pthread_mutex_unlock(&mutex);
+			prefetchTile(ti, rj);
+			rj.stats.prefetchtiles++;
+			pthread_mutex_lock(&mutex);
+		}
+		else
+		{
+			l.listing = true;
+			uint64_t generation = l.generation;
+			ZoomTileIdx zti = l.segments.back().zti;
+			pthread_mutex_unlock(&mutex);
+			list.clear();
+			listRequiredTiles(zti, rj, list);
+			pthread_mutex_lock(&mutex);
+			// (if the render thread has gone somewhere else in the meantime, the list is no use)
+			if (l.generation == generation)
+			{
+				l.tiles.insert(l.tiles.end(), list.begin(), list.end());
+				l.segments.back().listed = true;
+				l.listing = false;
+			}
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	rj.stats.phases.elapsed = getNanoseconds() - start;
+}
+
 
 
 
@@ -19,6 +19,8 @@
 #define RENDER_H
 
 #include <string>
+#include <vector>
+#include <deque>
 #include <stdint.h>
 
 #include "map.h"
@@ -35,48 +37,180 @@ struct RenderStats
 	uint64_t heapusage;  // estimated peak heap memory usage (if available)
 	ChunkCacheStats chunkcache;
 	RegionCacheStats regioncache;
-
-	RenderStats() : reqchunkcount(0), reqregioncount(0), reqtilecount(0), heapusage(0) {}
+	int64_t tileswritten, writestalls;  // tiles written to disk, and times a render thread had to wait for the TileWriter
+	// pseudocolumns walked and scene graph nodes built while drawing; the ones near the edges of a tile get done
+	//  again for the neighboring tiles, so these show how much drawing bigger areas at once (-s) saves
+	int64_t pcols, nodes;
+	// base tiles looked at by the prefetch threads, and their chunk cache stats (kept apart from the render
+	//  threads' ones above, which show how often the render threads still had to read chunks themselves)
+	int64_t prefetchtiles;
+	ChunkCacheStats prefetchcache;
+	// time this thread has spent in each phase of the render; and, collected in the main RenderJob at the
+	//  end, the phase times of every thread, by what they were doing
+	PhaseTimes phases;
+	std::vector<PhaseTimes> renderphases, prefetchphases, encoderphases;
+	// memory: peak resident set size of the whole process, and the most that the big users of it ever held
+	//  (the shared chunk cache, including chunk surfaces; the region cache; the tile images kept by the render
+	//  threads for building zoom levels and super tiles; the scene graphs; the block images; and the
+	//  TileWriter's buffers)
+	uint64_t peakrss;
+	int64_t chunkcachebytes, regioncachebytes, tileimagebytes, scenegraphbytes, blockimagebytes, writerbytes;
+
+	RenderStats() : reqchunkcount(0), reqregioncount(0), reqtilecount(0), heapusage(0), tileswritten(0), writestalls(0), pcols(0), nodes(0), prefetchtiles(0),
+	                peakrss(0), chunkcachebytes(0), regioncachebytes(0), tileimagebytes(0), scenegraphbytes(0), blockimagebytes(0), writerbytes(0) {}
 };
 
 
 struct SceneGraph;
 struct TileCache;
 struct ThreadOutputCache;
+struct TileWriter;
+struct ChunkPrefetcher;
+struct ZoomTileScheduler;
 
 struct RenderJob : private nocopy
 {
 	bool fullrender;  // whether we're doing the entire world, as opposed to an incremental update
 	bool regionformat;  // whether the world is in region format (chunk format assumed if not)
 	MapParams mp;
+	PNGProfileSet pngprofiles;  // parsed from mp.pngProfiles
 	std::string inputpath, outputpath;
 	BlockImages blockimages;
 	std::auto_ptr<ChunkTable> chunktable;
 	std::auto_ptr<ChunkCache> chunkcache;
 	std::auto_ptr<RegionTable> regiontable;
+	// the shared caches are owned by the main RenderJob; the worker threads' RenderJobs leave these empty
+	//  (their ChunkCaches point to the main RenderJob's)
+	std::auto_ptr<SharedChunkCache> sharedchunkcache;
 	std::auto_ptr<RegionCache> regioncache;
+	int64_t cachebudget;  // memory budget for the SharedChunkCache, in bytes
+	int cacheways;  // associativity of the SharedChunkCache
+	int64_t regionbudget;  // memory budget for the RegionCache, in bytes
 	std::auto_ptr<TileTable> tiletable;
 	std::auto_ptr<TileCache> tilecache;
 	std::auto_ptr<SceneGraph> scenegraph;  // reuse this for each tile to avoid reallocation
+	TileWriter *tilewriter;  // finished tiles go here to be written to disk; shared by all threads (not owned)
 	RenderStats stats;
+	// draw base tiles supertiles x supertiles at a time (a power of two), as one big image that gets cut up
+	//  into the individual tiles; while one of these is in progress, supertilespan is its size (in base tiles),
+	//  and supertilex/y is its top-left base tile, and supertilenodes says which of its base tiles have any
+	//  blocks in them (row by row)
+	int supertiles;
+	RGBAImage supertile;
+	int supertilespan;
+	int64_t supertilex, supertiley;
+	std::vector<bool> supertilenodes;
+	// fold runs of stacked water into single nodes with precomposited images (see BlockImages::getWaterOffset);
+	//  faster on watery maps, but the blending comes out slightly differently from drawing the blocks one by one
+	bool waterruns;
+	// composite base tiles front-to-back with a coverage mask (see drawFrontToBack) instead of traversing the
+	//  scene graph, unless they have blocks whose images stick out past the hexagon
+	bool fronttoback;
+	// number of threads to read chunks ahead of the render threads with (see ChunkPrefetcher); and for the
+	//  render threads, the prefetcher (if any) and which of its lanes is ours
+	int prefetchers;
+	ChunkPrefetcher *prefetcher;
+	int prefetchlane;
 
 	// don't actually draw anything or read chunks; just iterate through the data structures
-	// ...scenegraph, chunkcache, and regioncache are not required if in test mode
+	// ...scenegraph, chunkcache, sharedchunkcache, regioncache, and tilewriter are not required if in test mode
 	bool testmode;
+
+	RenderJob() : supertiles(1), supertilespan(0), supertilex(0), supertiley(0), waterruns(false), fronttoback(false), prefetchers(0), prefetcher(NULL), prefetchlane(0) {}
+	// the ChunkCache may still have chunks pinned in the SharedChunkCache, so it has to go first
+	~RenderJob() {chunkcache.reset();}
 };
 
-// render a base tile into an RGBAImage, and also write it to disk
+// render a base tile into an RGBAImage, and also send it to the TileWriter
 // ...do nothing and return false if the tile is not required or is out of range
 bool renderTile(const TileIdx& ti, RenderJob& rj, RGBAImage& tile);
 
+// just draw a base tile into an RGBAImage; doesn't check or update the TileTable, and doesn't write anything
+// ...returns false if the tile came out completely transparent
+bool drawTile(const TileIdx& ti, RenderJob& rj, RGBAImage& tile);
+
+// ...or draw any rectangle of the map the same way (with a single scene graph), into an image of its size
+bool drawArea(const BBox& bbox, RenderJob& rj, RGBAImage& img);
+
 // recursively render all the required tiles that a zoom tile depends on, and then the tile itself;
-//  stores the result into the supplied RGBAImage, and also writes it to disk
+//  stores the result into the supplied RGBAImage, and also sends it to the TileWriter
 // do nothing and return false if the tile is not required
 bool renderZoomTile(const ZoomTileIdx& zti, RenderJob& rj, RGBAImage& tile);
 
-// for second phase of multithreaded operation: recursively render all the required tiles that a zoom tile
-//  depends on, but stop recursing at the ThreadOutputCache level rather than the base tile level
-bool renderZoomTile(const ZoomTileIdx& zti, RenderJob& rj, RGBAImage& tile, const ThreadOutputCache& tocache);
+// for multithreaded operation: call when a zoom tile at the ThreadOutputCache level has been rendered (or
+//  turned out not to be needed); if it was the last of its siblings to finish, their parent is built from
+//  them and written out, and so on up the pyramid as far as possible
+// ...so whichever thread finishes last in each area does the zoom levels above it, while the other
+//  threads carry on rendering elsewhere
+void finishZoomTile(const ZoomTileIdx& zti, RenderJob& rj, ThreadOutputCache& tocache);
+
+
+
+// reads chunks (and builds their surfaces) on threads of its own, a little way ahead of the render threads, so
+//  that they mostly find what they need already in the shared chunk cache, instead of stopping to wait for the
+//  disk and zlib in the middle of building a scene graph
+// -each render thread has a lane: the required base tiles it's going to draw, in the order it'll draw them; the
+//  render thread says which zoom tile it's starting on, and moves its lane along as it reaches each base tile,
+//  while the prefetch threads work through the tiles just ahead of it
+// -when a lane runs dry, the prefetchers look at the front of the render thread's deque in the scheduler, since
+//  that's most likely the zoom tile it'll do next
+// ...this is all just a guess: if a render thread gets to a chunk first (or a prefetched chunk is trimmed from
+//  the cache before it's used), the render thread reads it itself, as it would have anyway
+struct ChunkPrefetcher : private nocopy
+{
+	struct Segment
+	{
+		ZoomTileIdx zti;
+		size_t start;  // index in the lane of its first base tile
+		bool listed;  // whether its base tiles have been added to the lane yet
+
+		Segment(const ZoomTileIdx& z, size_t s) : zti(z), start(s), listed(false) {}
+	};
+
+	struct Lane
+	{
+		std::deque<Segment> segments;  // the zoom tile being drawn, and maybe the one expected after it
+		std::vector<TileIdx> tiles;
+		size_t reached;  // number of tiles the render thread has started on
+		size_t next;  // index of the next tile to prefetch
+		bool listing;  // whether a prefetch thread is busy finding the last segment's tiles
+		uint64_t generation;  // incremented whenever the lane is started over
+
+		Lane() : reached(0), next(0), listing(false), generation(0) {}
+	};
+
+	pthread_mutex_t mutex;
+	pthread_cond_t work;  // signalled when a render thread moves along, or we're shutting down
+	std::vector<Lane> lanes;
+	size_t ahead;  // how many base tiles to stay ahead of each render thread
+	ZoomTileScheduler *scheduler;  // where to look for the render threads' next zoom tiles (may be NULL)
+	RenderJob *rjs;  // one for each prefetch thread, with its own ChunkCache, etc.
+	std::vector<pthread_t> pthrs;
+	bool done;
+
+	// start up the prefetch threads (rj.prefetchers of them), which share rj's caches and tables
+	ChunkPrefetcher(RenderJob& rj, int numlanes, ZoomTileScheduler *sched);
+	~ChunkPrefetcher();
+
+	// for the render threads: note that we're starting on a zoom tile, or a required base tile
+	void start(int lane, const ZoomTileIdx& zti);
+	void reached(int lane);
+
+	// stop the prefetch threads; or stop them and add their stats to some others
+	void stop();
+	void finish(RenderStats& stats);
+
+	// body of the prefetch threads
+	void run(RenderJob& rj);
+};
+
+// how many base tiles ahead of each render thread the prefetch threads try to be (plus the size of a super
+//  tile, which needs all its chunks before any of its base tiles are reached)
+#define PREFETCHAHEAD 16
+
+// to save time, the prefetchers only follow every PREFETCHSTRIDE-th pseudocolumn of a tile across and down (a
+//  power of two); chunks that only show up in the ones in between are left for the render threads
+#define PREFETCHSTRIDE 4
 
 
 
@@ -99,21 +233,32 @@ struct TileCache
 			for (int j = 0; j < 4; j++)
 				levels[i].tiles[j].create(mp.tileSize(), mp.tileSize());
 	}
+
+	int64_t bytes() const {return levels.empty() ? 0 : (int64_t)levels.size() * 4 * levels[0].tiles[0].data.capacity() * sizeof(RGBAPixel);}
 };
 
 
-// when rendering with multiple threads, the individual threads only go up to a certain zoom level, then
-//  the main thread does the last few levels on its own; the worker threads store their results in this
+// when rendering with multiple threads, the scheduler hands out zoom tiles at a certain level, and the threads
+//  store their results in this; pending counts how many children each tile above that level is still waiting
+//  for, and finishZoomTile counts them down, so that whichever thread finishes a tile's last child builds the
+//  tile itself, and so on up the pyramid to the top
 struct ThreadOutputCache
 {
     int zoom;  // which zoom level the threads are working at
 
-	std::vector<RGBAImage> images;  // use getIndex() to get index into this from zoom tile
-	std::vector<bool> used;  // which images actually have data
+	// these hold the zoom tiles at the threads' level, plus all the levels above it, which are built
+	//  up from the threads' tiles as they finish; indexed by zoom level, then by getIndex()
+	std::vector<std::vector<RGBAImage> > images;
+	std::vector<std::vector<char> > used;  // which images actually have data (not vector<bool>; different threads set neighboring entries)
+	std::vector<std::vector<int> > pending;  // how many of each tile's children have yet to be finished
+
+	int getIndex(const ZoomTileIdx& zti) const;  // get index into a level, or -1 if zoom is out of range
 
-	int getIndex(const ZoomTileIdx& zti) const;  // get index into images, or -1 if zoom is wrong
+	ThreadOutputCache(int z);
 
-	ThreadOutputCache(int z) : zoom(z), images((1 << zoom) * (1 << zoom)), used((1 << zoom) * (1 << zoom), false) {}
+	// note that a zoom tile at the threads' level is going to be rendered (and finishZoomTile called
+	//  for it); must be called for each such tile before the threads start
+	void expect(const ZoomTileIdx& zti);
 };
 
 
@@ -159,7 +304,32 @@ struct SceneGraph
 	// scratch space for use while traversing the DAG
 	std::vector<int> nodestack;
 
+	// scratch space for drawFrontToBack: the nodes sorted front-to-back (and the counts for sorting them), the
+	//  coverage mask, the nodes that survive culling, and for each of those, per-row bitmasks of the pixels to draw
+	struct DepthNode
+	{
+		int32_t xstart, ystart;
+		int bimgoffset;
+		int node;  // index into nodes
+		bool darkened;  // whether any of the node's edges are darkened
+
+		DepthNode() {}
+		DepthNode(int32_t x, int32_t y, int offset, int n, bool d) : xstart(x), ystart(y), bimgoffset(offset), node(n), darkened(d) {}
+	};
+	std::vector<DepthNode> depthorder;
+	std::vector<int> depthstart;
+	std::vector<uint64_t> coverage;
+	std::vector<int> drawlist;
+	std::vector<uint64_t> drawmasks;
+
 	SceneGraph() {nodes.reserve(2048);}
+
+	// memory held by all of the above
+	int64_t bytes() const
+	{
+		return nodes.capacity() * sizeof(SceneGraphNode) + depthorder.capacity() * sizeof(DepthNode) + (pcols.capacity() +
+		       nodestack.capacity() + depthstart.capacity() + drawlist.capacity()) * sizeof(int) + (coverage.capacity() + drawmasks.capacity()) * sizeof(uint64_t);
+	}
 };
 
 
@@ -176,7 +346,6 @@ struct TileBlockIterator
 	int nextN, nextE, nextSE;  // the sequence positions of the neighboring points; -1 if the neighbor isn't in the tile
 
 	const MapParams& mparams;
-	TileIdx tile;
 	// the tile's bounding box, expanded by half a block's bounding box, so that any block centered on a point
 	//  within this box will hit the tile
 	BBox expandedBBox;
@@ -184,6 +353,9 @@ struct TileBlockIterator
 
 	// constructor initializes to the upper-left grid point
 	TileBlockIterator(const TileIdx& ti, const MapParams& mp);
+	// ...or iterate over the points for some other area (such as a group of tiles)
+	TileBlockIterator(const BBox& bbox, const MapParams& mp);
+	void start(const BBox& bbox);
 
 	// movement goes down the columns, then rightward to the next column
 	void advance();
@@ -202,6 +374,8 @@ struct PseudocolumnIterator
 
 	// move to the next block (which is one step SED), or the end
 	void advance();
+	// ...or move that many steps at once
+	void advance(int64_t steps);
 };
 
 
@@ -18,6 +18,13 @@
 #include <png.h>
 #include <errno.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BLEND_X86 1
+#include <immintrin.h>
+#else
+#define BLEND_X86 0
+#endif
+
 #include "rgba.h"
 #include "utils.h"
 
@@ -129,7 +136,18 @@ bool RGBAImage::readPNG(const string& filename)
 	png_set_sig_bytes(png, 8);
 
 	png_read_info(png, info);
-	if (PNG_COLOR_TYPE_RGB_ALPHA != png_get_color_type(png, info) || 8 != png_get_bit_depth(png, info))
+	if (8 != png_get_bit_depth(png, info))
+		return false;
+	if (PNG_COLOR_TYPE_PALETTE == png_get_color_type(png, info))
+	{
+		// expand paletted images (which we may have written ourselves) to RGBA
+		png_set_palette_to_rgb(png);
+		if (png_get_valid(png, info, PNG_INFO_tRNS))
+			png_set_tRNS_to_alpha(png);
+		else
+			png_set_add_alpha(png, 0xff, PNG_FILLER_AFTER);
+	}
+	else if (PNG_COLOR_TYPE_RGB_ALPHA != png_get_color_type(png, info))
 		return false;
 	w = png_get_image_width(png, info);
 	h = png_get_image_height(png, info);
@@ -137,6 +155,8 @@ bool RGBAImage::readPNG(const string& filename)
 
 	png_set_interlace_handling(png);
 	png_read_update_info(png, info);
+	if (png_get_rowbytes(png, info) != (png_size_t)w * 4)
+		return false;
 
 	png_bytep *rowPointers = new png_bytep[h];
 	arrayDeleter<png_bytep> ad(rowPointers);
@@ -156,8 +176,63 @@ bool RGBAImage::readPNG(const string& filename)
 	return true;
 }
 
-bool RGBAImage::writePNG(const string& filename)
+// if an image has no more than 256 distinct colors, build a palette for it (with the translucent colors
+//  first, so the tRNS chunk can be as short as possible) and convert the pixels to palette indices;
+//  returns false if there are too many colors
+bool buildPalette(const RGBAImage& img, vector<RGBAPixel>& palette, vector<uint8_t>& indices)
+{
+	// find the colors with a little open-addressed hash table
+	const int HASHSIZE = 1024;
+	RGBAPixel colors[HASHSIZE];
+	int slots[HASHSIZE];
+	fill(slots, slots + HASHSIZE, -1);
+	palette.clear();
+	indices.resize(img.data.size());
+	for (size_t i = 0; i < img.data.size(); i++)
+	{
+		RGBAPixel p = img.data[i];
+		uint32_t h = (p * 2654435761U) >> 22;
+		while (slots[h] != -1 && colors[h] != p)
+			h = (h + 1) & (HASHSIZE - 1);
+		if (slots[h] == -1)
+		{
+			if (palette.size() == 256)
+				return false;
+			colors[h] = p;
+			slots[h] = palette.size();
+			palette.push_back(p);
+		}
+		indices[i] = slots[h];
+	}
+
+	// move the translucent colors to the front
+	uint8_t remap[256];
+	vector<RGBAPixel> sorted;
+	for (int pass = 0; pass < 2; pass++)
+		for (size_t i = 0; i < palette.size(); i++)
+			if ((ALPHA(palette[i]) == 255) == (pass == 1))
+			{
+				remap[i] = sorted.size();
+				sorted.push_back(palette[i]);
+			}
+	palette.swap(sorted);
+	for (vector<uint8_t>::iterator it = indices.begin(); it != indices.end(); it++)
+		*it = remap[*it];
+	return true;
+}
+
+bool RGBAImage::writePNG(const string& filename, const PNGProfile& profile, PhaseTimes *phases) const
 {
+	// compress the whole thing into memory first, then write it out in one go
+	TRACE_SCOPE("png", "w,h", w, h);
+	vector<uint8_t> buf;
+	{
+		PhaseTimer pt(phases, PHASE_ENCODE);
+		if (!encodePNG(buf, profile))
+			return false;
+	}
+
+	PhaseTimer pt(phases, PHASE_WRITE);
 	FILE *f = fopen(filename.c_str(), "wb");
 	if (f == NULL)
 	{
@@ -171,6 +246,26 @@ bool RGBAImage::writePNG(const string& filename)
 			return false;
 	}
 	fcloser fc(f);
+	if (fwrite(&buf[0], 1, buf.size(), f) != buf.size())
+		return false;
+	if (phases != NULL)
+		phases->bytes[PHASE_WRITE] += buf.size();
+	return true;
+}
+
+// libpng output functions for encoding into a vector
+void appendPNGData(png_structp png, png_bytep data, png_size_t length)
+{
+	vector<uint8_t> *buf = (vector<uint8_t>*)png_get_io_ptr(png);
+	buf->insert(buf->end(), data, data + length);
+}
+void flushPNGData(png_structp png) {}
+
+bool RGBAImage::encodePNG(vector<uint8_t>& buf, const PNGProfile& profile) const
+{
+	// (tiles usually compress to well under a quarter of their raw size)
+	buf.clear();
+	buf.reserve(w * h);
 
 	PNGWriteCleaner cleaner;
 
@@ -187,26 +282,150 @@ bool RGBAImage::writePNG(const string& filename)
 	if (setjmp(png_jmpbuf(png)))
 		return false;
 
-	png_init_io(png, f);
+	png_set_write_fn(png, &buf, appendPNGData, flushPNGData);
 
-	png_set_IHDR(png, info, w, h, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	// the default profile leaves libpng's settings alone
+	if (profile.speed == PNGProfile::FAST)
+	{
+		// (Z_RLE is faster still, but makes much bigger files from tile images)
+		png_set_compression_level(png, 1);
+		png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_SUB);
+	}
+	else if (profile.speed == PNGProfile::MAX)
+	{
+		png_set_compression_level(png, 9);
+		png_set_compression_mem_level(png, 9);
+		png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_ALL_FILTERS);
+	}
 
 	png_bytep *rowPointers = new png_bytep[h];
 	arrayDeleter<png_bytep> ad(rowPointers);
-	RGBAPixel *p = &data[0];
+
+	// if we're allowed to, and there are few enough colors, write a paletted image
+	vector<RGBAPixel> palette;
+	vector<uint8_t> indices;
+	if (profile.palette && buildPalette(*this, palette, indices))
+	{
+		png_set_IHDR(png, info, w, h, 8, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+		png_color plte[256];
+		png_byte trns[256];
+		int numtrns = 0;
+		for (size_t i = 0; i < palette.size(); i++)
+		{
+			plte[i].red = RED(palette[i]);
+			plte[i].green = GREEN(palette[i]);
+			plte[i].blue = BLUE(palette[i]);
+			trns[i] = ALPHA(palette[i]);
+			if (trns[i] != 255)
+				numtrns = i + 1;
+		}
+		png_set_PLTE(png, info, plte, palette.size());
+		if (numtrns > 0)
+			png_set_tRNS(png, info, trns, numtrns, NULL);
+		// filtering doesn't help palette indices
+		png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+		png_write_info(png, info);
+
+		uint8_t *p = &indices[0];
+		for (int32_t i = 0; i < h; i++, p += w)
+			rowPointers[i] = (png_bytep)p;
+		png_write_image(png, rowPointers);
+		png_write_end(png, info);
+		return true;
+	}
+
+	png_set_IHDR(png, info, w, h, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_write_info(png, info);
+	if (isBigEndian())
+	{
+		png_set_bgr(png);
+		png_set_swap_alpha(png);
+	}
+
+	const RGBAPixel *p = &data[0];
 	for (int32_t i = 0; i < h; i++, p += w)
 		rowPointers[i] = (png_bytep)p;
+	png_write_image(png, rowPointers);
+	png_write_end(png, info);
+	return true;
+}
 
-	png_set_rows(png, info, rowPointers);
 
-	if (isBigEndian())
-		png_write_png(png, info, PNG_TRANSFORM_BGR | PNG_TRANSFORM_SWAP_ALPHA, NULL);
+
+bool PNGProfile::fromString(const string& s)
+{
+	string name = s;
+	palette = false;
+	string::size_type plus = s.find('+');
+	if (plus != string::npos)
+	{
+		if (s.substr(plus + 1) != "palette")
+			return false;
+		palette = true;
+		name = s.substr(0, plus);
+	}
+	if (name == "fast")
+		speed = FAST;
+	else if (name == "default")
+		speed = DEFAULT;
+	else if (name == "max")
+		speed = MAX;
 	else
-		png_write_png(png, info, PNG_TRANSFORM_IDENTITY, NULL);
+		return false;
+	return true;
+}
+
+bool PNGProfileSet::fromString(const string& s)
+{
+	*this = PNGProfileSet();
+	vector<string> entries = tokenize(s, ',');
+	for (vector<string>::const_iterator it = entries.begin(); it != entries.end(); it++)
+	{
+		string::size_type colon = it->find(':');
+		PNGProfile profile;
+		if (!profile.fromString(colon == string::npos ? *it : it->substr(colon + 1)))
+			return false;
+		if (colon == string::npos)
+		{
+			all = profile;
+			continue;
+		}
 
+		string zoom = it->substr(0, colon);
+		if (zoom == "base")
+		{
+			base = profile;
+			hasbase = true;
+			continue;
+		}
+		int zmin, zmax;
+		string::size_type dash = zoom.find('-');
+		if (dash == string::npos)
+		{
+			if (!fromstring(zoom, zmin))
+				return false;
+			zmax = zmin;
+		}
+		else if (!fromstring(zoom.substr(0, dash), zmin) || !fromstring(zoom.substr(dash + 1), zmax))
+			return false;
+		if (zmin < 0 || zmax > 30 || zmin > zmax)
+			return false;
+		for (int z = zmin; z <= zmax; z++)
+			zooms[z] = profile;
+	}
 	return true;
 }
 
+const PNGProfile& PNGProfileSet::get(int zoom, int baseZoom) const
+{
+	map<int, PNGProfile>::const_iterator it = zooms.find(zoom);
+	if (it != zooms.end())
+		return it->second;
+	if (hasbase && zoom == baseZoom)
+		return base;
+	return all;
+}
+
 
 
 
@@ -264,15 +483,143 @@ void blend(RGBAPixel& dest, const RGBAPixel& source)
 		fullblend(dest, source);
 }
 
+void blendRowScalar(RGBAPixel *dest, const RGBAPixel *source, int32_t n)
+{
+	for (int32_t i = 0; i < n; i++)
+		blend(dest[i], source[i]);
+}
+
+// the vector versions compute fullblend() for every pixel, 16-bit lane by lane, and then patch up the
+//  one case where blend() doesn't agree with fullblend():
+// -RGB: s*sa + d*sainv can't exceed 255*257 = 0xffff, so it fits in an unsigned 16-bit lane
+// -alpha: sainv*dainv can be 0x10000 (when both alphas are 0), which wraps to 0; but then subtracting 1
+//  wraps back to 0xffff, so the result is the same
+// -if the source is transparent, the blend leaves the dest unchanged anyway; if the source is opaque,
+//  the blend gives exactly the source; but if the dest is transparent (and the source isn't), blend()
+//  copies the source, RGB and all, so that has to be selected separately
+// ...pixels are little-endian RGBA, so once unpacked to 16 bits, alpha is in lanes 3 and 7
+#if BLEND_X86
+
+#ifdef __SSE2__
+static inline __m128i blendVec(__m128i d, __m128i s)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i c256 = _mm_set1_epi16(256), c255 = _mm_set1_epi16(255), one = _mm_set1_epi16(1);
+	const __m128i alphalanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+	__m128i result[2];
+	for (int half = 0; half < 2; half++)
+	{
+		__m128i s16 = half ? _mm_unpackhi_epi8(s, zero) : _mm_unpacklo_epi8(s, zero);
+		__m128i d16 = half ? _mm_unpackhi_epi8(d, zero) : _mm_unpacklo_epi8(d, zero);
+		// spread each pixel's alpha across all four of its lanes
+		__m128i sa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s16, 0xff), 0xff);
+		__m128i da = _mm_shufflehi_epi16(_mm_shufflelo_epi16(d16, 0xff), 0xff);
+		__m128i sainv = _mm_sub_epi16(c256, sa);
+		__m128i rgb = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(s16, _mm_add_epi16(sa, one)), _mm_mullo_epi16(d16, sainv)), 8);
+		__m128i a = _mm_sub_epi16(c255, _mm_srli_epi16(_mm_sub_epi16(_mm_mullo_epi16(sainv, _mm_sub_epi16(c256, da)), one), 8));
+		result[half] = _mm_or_si128(_mm_andnot_si128(alphalanes, rgb), _mm_and_si128(alphalanes, a));
+	}
+	__m128i blended = _mm_packus_epi16(result[0], result[1]);
+	__m128i copy = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_srli_epi32(s, 24), zero), _mm_cmpeq_epi32(_mm_srli_epi32(d, 24), zero));
+	return _mm_or_si128(_mm_and_si128(copy, s), _mm_andnot_si128(copy, blended));
+}
+
+void blendRowSSE2(RGBAPixel *dest, const RGBAPixel *source, int32_t n)
+{
+	const __m128i zero = _mm_setzero_si128(), ones = _mm_cmpeq_epi32(zero, zero);
+	int32_t i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i*)(source + i));
+		__m128i sa = _mm_srli_epi32(s, 24);
+		// skip the work if all four source pixels are transparent, or just copy them if they're all opaque
+		//  (block images are mostly one or the other)
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa, zero)) == 0xffff)
+			continue;
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_srai_epi32(s, 24), ones)) == 0xffff)
+		{
+			_mm_storeu_si128((__m128i*)(dest + i), s);
+			continue;
+		}
+		__m128i d = _mm_loadu_si128((const __m128i*)(dest + i));
+		_mm_storeu_si128((__m128i*)(dest + i), blendVec(d, s));
+	}
+	blendRowScalar(dest + i, source + i, n - i);
+}
+#endif
+
+__attribute__((target("avx2"))) void blendRowAVX2(RGBAPixel *dest, const RGBAPixel *source, int32_t n)
+{
+	const __m256i zero = _mm256_setzero_si256(), ones = _mm256_cmpeq_epi32(zero, zero);
+	const __m256i c256 = _mm256_set1_epi16(256), c255 = _mm256_set1_epi16(255), one = _mm256_set1_epi16(1);
+	const __m256i alphalanes = _mm256_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0);
+	int32_t i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i*)(source + i));
+		__m256i sa32 = _mm256_srli_epi32(s, 24);
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(sa32, zero)) == -1)
+			continue;
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_srai_epi32(s, 24), ones)) == -1)
+		{
+			_mm256_storeu_si256((__m256i*)(dest + i), s);
+			continue;
+		}
+		__m256i d = _mm256_loadu_si256((const __m256i*)(dest + i));
+		// (the unpacks and the pack all work within 128-bit lanes, so the pixels come back out in order)
+		__m256i result[2];
+		for (int half = 0; half < 2; half++)
+		{
+			__m256i s16 = half ? _mm256_unpackhi_epi8(s, zero) : _mm256_unpacklo_epi8(s, zero);
+			__m256i d16 = half ? _mm256_unpackhi_epi8(d, zero) : _mm256_unpacklo_epi8(d, zero);
+			__m256i sa = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s16, 0xff), 0xff);
+			__m256i da = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(d16, 0xff), 0xff);
+			__m256i sainv = _mm256_sub_epi16(c256, sa);
+			__m256i rgb = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(s16, _mm256_add_epi16(sa, one)), _mm256_mullo_epi16(d16, sainv)), 8);
+			__m256i a = _mm256_sub_epi16(c255, _mm256_srli_epi16(_mm256_sub_epi16(_mm256_mullo_epi16(sainv, _mm256_sub_epi16(c256, da)), one), 8));
+			result[half] = _mm256_blendv_epi8(rgb, a, alphalanes);
+		}
+		__m256i blended = _mm256_packus_epi16(result[0], result[1]);
+		__m256i copy = _mm256_andnot_si256(_mm256_cmpeq_epi32(sa32, zero), _mm256_cmpeq_epi32(_mm256_srli_epi32(d, 24), zero));
+		_mm256_storeu_si256((__m256i*)(dest + i), _mm256_blendv_epi8(blended, s, copy));
+	}
+	blendRowScalar(dest + i, source + i, n - i);
+}
+
+#endif // BLEND_X86
+
+typedef void (*BlendRowFunc)(RGBAPixel*, const RGBAPixel*, int32_t);
+
+BlendRowFunc chooseBlendRow()
+{
+#if BLEND_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return blendRowAVX2;
+#ifdef __SSE2__
+	return blendRowSSE2;
+#endif
+#endif
+	return blendRowScalar;
+}
+
+static BlendRowFunc blendRowImpl = chooseBlendRow();
+
+void blendRow(RGBAPixel *dest, const RGBAPixel *source, int32_t n)
+{
+	blendRowImpl(dest, source, n);
+}
+
 void alphablit(const RGBAImage& source, const ImageRect& srect, RGBAImage& dest, int32_t dxstart, int32_t dystart)
 {
 	int32_t ybegin = max(0, max(-srect.y, -dystart));
 	int32_t yend = min(srect.h, min(source.h-srect.y, dest.h-dystart));
 	int32_t xbegin = max(0, max(-srect.x, -dxstart));
 	int32_t xend = min(srect.w, min(source.w-srect.x, dest.w-dxstart));
+	if (xbegin >= xend)
+		return;
 	for (int32_t yoff = ybegin, sy = srect.y + ybegin, dy = dystart + ybegin; yoff < yend; yoff++, sy++, dy++)
-		for (int32_t xoff = xbegin, sx = srect.x + xbegin, dx = dxstart + xbegin; xoff < xend; xoff++, sx++, dx++)
-			blend(dest(dx,dy), source(sx,sy));
+		blendRowImpl(&dest(dxstart + xbegin, dy), &source(srect.x + xbegin, sy), xend - xbegin);
 }
 
 void reduceHalf(RGBAImage& dest, const ImageRect& drect, const RGBAImage& source)
@@ -280,7 +627,27 @@ void reduceHalf(RGBAImage& dest, const ImageRect& drect, const RGBAImage& source
 	if (source.w != drect.w*2 || source.h != drect.h*2)
 		return;
 	for (int32_t dy = drect.y, sy = 0; sy < source.h; dy++, sy += 2)
-		for (int32_t dx = drect.x, sx = 0; sx < source.w; dx++, sx += 2)
+	{
+		int32_t dx = drect.x, sx = 0;
+#ifdef __SSE2__
+		// four destination pixels at a time: quarter all the channels, add the two rows together, then
+		//  split the even and odd columns apart and add those (each channel is at most 4*0x3f, so there's
+		//  no overflow, and the result is exactly the same as the scalar version's)
+		const __m128i mask = _mm_set1_epi32(0x3f3f3f3f);
+		const RGBAPixel *row1 = &source(0, sy), *row2 = &source(0, sy+1);
+		RGBAPixel *drow = &dest(0, dy);
+		for (; sx + 8 <= source.w; dx += 4, sx += 8)
+		{
+			__m128i a = _mm_add_epi8(_mm_and_si128(_mm_srli_epi32(_mm_loadu_si128((const __m128i*)(row1 + sx)), 2), mask),
+			                         _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128((const __m128i*)(row2 + sx)), 2), mask));
+			__m128i b = _mm_add_epi8(_mm_and_si128(_mm_srli_epi32(_mm_loadu_si128((const __m128i*)(row1 + sx + 4)), 2), mask),
+			                         _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128((const __m128i*)(row2 + sx + 4)), 2), mask));
+			__m128i even = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(2,0,2,0)));
+			__m128i odd = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(3,1,3,1)));
+			_mm_storeu_si128((__m128i*)(drow + dx), _mm_add_epi8(even, odd));
+		}
+#endif
+		for (; sx < source.w; dx++, sx += 2)
 		{
 			RGBAPixel p1 = (source(sx, sy) >> 2) & 0x3f3f3f3f;
 			RGBAPixel p2 = (source(sx+1, sy) >> 2) & 0x3f3f3f3f;
@@ -288,6 +655,7 @@ void reduceHalf(RGBAImage& dest, const ImageRect& drect, const RGBAImage& source
 			RGBAPixel p4 = (source(sx+1, sy+1) >> 2) & 0x3f3f3f3f;
 			dest(dx, dy) = p1 + p2 + p3 + p4;
 		}
+	}
 }
 
 
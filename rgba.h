@@ -20,8 +20,10 @@
 
 #include <vector>
 #include <string>
+#include <map>
 #include <stdint.h>
 
+struct PhaseTimes;
 
 typedef uint32_t RGBAPixel;
 #define ALPHA(x) ((x & 0xff000000) >> 24)
@@ -36,6 +38,46 @@ void setBlue(RGBAPixel& p, int b);
 void setGreen(RGBAPixel& p, int g);
 void setRed(RGBAPixel& p, int r);
 
+// settings for writing PNGs
+// -"default" is libpng's defaults: zlib level 6, adaptive filtering
+// -"fast" is zlib level 1 with the Sub filter on every row (instead of trying them all); the files are
+//  10-20% bigger, but encoding is three or four times faster
+// -"max" is zlib level 9 with adaptive filtering, for maps that are rendered once and served a lot
+// ...any of them may also use palette mode, where images with no more than 256 distinct colors are
+//  written as 8-bit paletted PNGs (which are usually a lot smaller)
+struct PNGProfile
+{
+	enum Speed {FAST, DEFAULT, MAX};
+	Speed speed;
+	bool palette;
+
+	PNGProfile() : speed(DEFAULT), palette(false) {}
+
+	// parse a profile name ("fast", "default", "max", optionally followed by "+palette"); returns
+	//  false if the name isn't recognized
+	bool fromString(const std::string& s);
+};
+
+// the PNG profiles to use for each zoom level, as given by a string like "max,base:fast+palette"
+// -the string is a comma-separated list of [zoom:]profile entries
+// -zoom may be a single zoom level, a range of them ("0-3"), or "base" for the base tiles
+// -an entry without a zoom sets the profile for all the levels that aren't otherwise mentioned
+// ...entries for specific zoom levels take precedence over "base", which takes precedence over the
+//  catch-all
+struct PNGProfileSet
+{
+	PNGProfile all, base;
+	bool hasbase;
+	std::map<int, PNGProfile> zooms;
+
+	PNGProfileSet() : hasbase(false) {}
+
+	// returns false if the string is malformed (an empty string means all defaults)
+	bool fromString(const std::string& s);
+
+	const PNGProfile& get(int zoom, int baseZoom) const;
+};
+
 struct RGBAImage
 {
 	std::vector<RGBAPixel> data;
@@ -48,8 +90,12 @@ struct RGBAImage
 	// resize data and initialize to 0 (clear out any existing data)
 	void create(int32_t ww, int32_t hh);
 
+	// (reads RGBA and 8-bit paletted PNGs)
 	bool readPNG(const std::string& filename);
-	bool writePNG(const std::string& filename);
+	// (the time taken is charged to the encode and write phases, if given somewhere to put it)
+	bool writePNG(const std::string& filename, const PNGProfile& profile = PNGProfile(), PhaseTimes *phases = NULL) const;
+	// just compress the image into a PNG in memory
+	bool encodePNG(std::vector<uint8_t>& buf, const PNGProfile& profile) const;
 };
 
 struct ImageRect
@@ -68,6 +114,10 @@ struct ImageRect
 //  opaque one, the result stays opaque
 void blend(RGBAPixel& dest, const RGBAPixel& source);
 
+// alpha-blend a row of n source pixels onto a row of n destination pixels; gives exactly the same
+//  results as calling blend() on each pair, but uses SSE2/AVX2 if the CPU has them
+void blendRow(RGBAPixel *dest, const RGBAPixel *source, int32_t n);
+
 // alpha-blend source rect onto destination rect of same size
 void alphablit(const RGBAImage& source, const ImageRect& srect, RGBAImage& dest, int32_t dxstart, int32_t dystart);
 
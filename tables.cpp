@@ -139,6 +139,18 @@ void RequiredChunkIterator::advance()
 
 
 
+bool TileSet::setRequired(const PosTileIdx& ti)
+{
+	size_t bi = bitIdx(ti);
+	bool rv = bits[bi];
+	if (!rv)
+	{
+		bits.set(bi);
+		counts.add(TTGETLEVEL1(ti.x), TTGETLEVEL1(ti.y));
+	}
+	return rv;
+}
+
 bool TileGroup::setRequired(const PosTileIdx& ti)
 {
 	int tsi = tileSetIdx(ti);
@@ -146,7 +158,10 @@ bool TileGroup::setRequired(const PosTileIdx& ti)
 		tilesets[tsi] = new TileSet;
 	bool prevset = tilesets[tsi]->setRequired(ti);
 	if (!prevset)
+	{
 		reqcount++;
+		counts.add(TTGETLEVEL2(ti.x), TTGETLEVEL2(ti.y));
+	}
 	return prevset;
 }
 
@@ -177,7 +192,10 @@ bool TileTable::setRequired(const PosTileIdx& ti)
 		tilegroups[tgi] = new TileGroup;
 	bool prevset = tilegroups[tgi]->setRequired(ti);
 	if (!prevset)
+	{
 		reqcount++;
+		counts.add(TTGETLEVEL3(ti.x), TTGETLEVEL3(ti.y));
+	}
 	return prevset;
 }
 
@@ -191,83 +209,94 @@ void TileTable::setDrawn(const PosTileIdx& ti)
 
 bool TileTable::reject(const ZoomTileIdx& zti, const MapParams& mp) const
 {
-	// if this zoom tile includes more than one TileGroup, we can't reject early
-	if (zti.zoom < mp.baseZoom - TTLEVEL1BITS - TTLEVEL2BITS)
-		return false;
-	// zoom tiles anywhere except level 0 have the property of not crossing TileSet/TileGroup
-	//  boundaries--either they're entirely inside a set/group, or they contain entire
-	//  sets/groups--but for 0, that's not the case, so we'd have to check multiple sets/groups;
-	//  instead, we just don't bother trying, since the tile at level 0 is going to have to be
-	//  drawn anyway
+	// the tile at level 0 is going to have to be drawn anyway
 	if (zti.zoom == 0)
 		return false;
-	TileIdx ti = zti.toTileIdx(mp);
-	// if this zoom tile is contained within a TileSet, see if the set is NULL
-	if (zti.zoom >= mp.baseZoom - TTLEVEL1BITS)
-		return getTileSet(ti) == NULL;
-	// otherwise, the tile is within a TileGroup, but covers more than one TileSet; see if the TileGroup is NULL
-	return getTileGroup(ti) == NULL;
+	return getNumRequired(zti, mp) == 0;
 }
 
 int64_t TileTable::getNumRequired(const ZoomTileIdx& zti, const MapParams& mp) const
 {
 	// if this is the very top level, we already know the answer
+	// ...zoom tiles anywhere except level 0 have the property of not crossing TileSet/TileGroup
+	//  boundaries--either they're entirely inside a set/group, or they contain entire sets/groups--but
+	//  for 0, that's not the case
 	if (zti.zoom == 0)
 		return reqcount;
-	// if this zoom tile is smaller than a TileSet, get its TileSet and check the tiles individually
-	if (zti.zoom > mp.baseZoom - TTLEVEL1BITS)
+	int level = mp.baseZoom - zti.zoom;
+	PosTileIdx topleft = zti.toTileIdx(mp);
+	// if this zoom tile is no bigger than a TileSet, the set has the count
+	if (level <= TTLEVEL1BITS)
 	{
-		TileIdx topleft = zti.toTileIdx(mp);
 		TileSet *ts = getTileSet(topleft);
 		if (ts == NULL)
 			return 0;
-		int64_t count = 0;
-		int64_t size = 1 << (mp.baseZoom - zti.zoom);
-		for (int64_t x = 0; x < size; x++)
-			for (int64_t y = 0; y < size; y++)
-				if (ts->isRequired(topleft + TileIdx(x, y)))
-					count++;
-		return count;
+		if (level == 0)
+			return ts->isRequired(topleft);
+		return ts->counts.get(level, TTGETLEVEL1(topleft.x), TTGETLEVEL1(topleft.y));
 	}
-	// if >= TileSet size, but < TileGroup size, get the TileGroup and check the sets individually
-	if (zti.zoom > mp.baseZoom - TTLEVEL1BITS - TTLEVEL2BITS)
+	// if it's no bigger than a TileGroup, the group has the count
+	if (level <= TTLEVEL1BITS + TTLEVEL2BITS)
 	{
-		TileIdx topleft = zti.toTileIdx(mp);
 		TileGroup *tg = getTileGroup(topleft);
 		if (tg == NULL)
 			return 0;
-		int64_t count = 0;
-		int64_t size = 1 << (mp.baseZoom - TTLEVEL1BITS - zti.zoom);
-		for (int64_t x = 0; x < size; x++)
-			for (int64_t y = 0; y < size; y++)
-			{
-				TileSet *ts = tg->getTileSet(topleft + TileIdx(x << TTLEVEL1BITS, y << TTLEVEL1BITS));
-				if (ts != NULL)
-					count += ts->bits.count();
-			}
-		return count;
+		return tg->counts.get(level - TTLEVEL1BITS, TTGETLEVEL2(topleft.x), TTGETLEVEL2(topleft.y));
 	}
-	// if >= TileGroup size, check the TileGroups individually
-	TileIdx topleft = zti.toTileIdx(mp);
-	int64_t count = 0;
-	int64_t size = 1 << (mp.baseZoom - TTLEVEL1BITS - TTLEVEL2BITS - zti.zoom);
-	for (int64_t x = 0; x < size; x++)
-		for (int64_t y = 0; y < size; y++)
+	// otherwise, the table has the count
+	if (level <= TTLEVEL1BITS + TTLEVEL2BITS + TTLEVEL3BITS)
+		return counts.get(level - TTLEVEL1BITS - TTLEVEL2BITS, TTGETLEVEL3(topleft.x), TTGETLEVEL3(topleft.y));
+	// (if the zoom tile is bigger than the whole table--only possible when baseZoom is bigger than the table
+	//  can actually hold--then the zoom tile boundaries that cross the table all go through the middle of it,
+	//  so it contains some of the four quarters of the table, and none of the rest)
+	int64_t size = (int64_t)1 << level, count = 0;
+	for (int64_t qy = 0; qy < 2; qy++)
+		for (int64_t qx = 0; qx < 2; qx++)
 		{
-			TileGroup *tg = getTileGroup(topleft + TileIdx(x << (TTLEVEL1BITS + TTLEVEL2BITS), y << (TTLEVEL1BITS + TTLEVEL2BITS)));
-			if (tg != NULL)
-				count += tg->reqcount;
+			int64_t x = qx * TTTOTALSIZE/2, y = qy * TTTOTALSIZE/2;
+			if (x >= topleft.x && x < topleft.x + size && y >= topleft.y && y < topleft.y + size)
+				count += counts.get(TTLEVEL3BITS - 1, qx * TTLEVEL3SIZE/2, qy * TTLEVEL3SIZE/2);
 		}
 	return count;
 }
 
+void TileTable::getRequiredZoomTiles(int zoom, const MapParams& mp, vector<ZoomTileIdx>& tiles) const
+{
+	tiles.clear();
+	addRequiredZoomTiles(ZoomTileIdx(0,0,1), zoom, mp, tiles);
+	addRequiredZoomTiles(ZoomTileIdx(0,1,1), zoom, mp, tiles);
+	addRequiredZoomTiles(ZoomTileIdx(1,0,1), zoom, mp, tiles);
+	addRequiredZoomTiles(ZoomTileIdx(1,1,1), zoom, mp, tiles);
+}
+
+void TileTable::addRequiredZoomTiles(const ZoomTileIdx& zti, int zoom, const MapParams& mp, vector<ZoomTileIdx>& tiles) const
+{
+	if (getNumRequired(zti, mp) == 0)
+		return;
+	if (zti.zoom == zoom)
+	{
+		tiles.push_back(zti);
+		return;
+	}
+	// (the subtiles in Z-order)
+	ZoomTileIdx topleft = zti.toZoom(zti.zoom + 1);
+	addRequiredZoomTiles(topleft, zoom, mp, tiles);
+	addRequiredZoomTiles(topleft.add(0,1), zoom, mp, tiles);
+	addRequiredZoomTiles(topleft.add(1,0), zoom, mp, tiles);
+	addRequiredZoomTiles(topleft.add(1,1), zoom, mp, tiles);
+}
+
 void TileTable::copyFrom(const TileTable& ttable)
 {
+	reqcount = ttable.reqcount;
+	counts = ttable.counts;
 	for (int tgi = 0; tgi < TTLEVEL3SIZE*TTLEVEL3SIZE; tgi++)
 	{
 		if (ttable.tilegroups[tgi] != NULL)
 		{
 			tilegroups[tgi] = new TileGroup;
+			tilegroups[tgi]->reqcount = ttable.tilegroups[tgi]->reqcount;
+			tilegroups[tgi]->counts = ttable.tilegroups[tgi]->counts;
 			for (int tsi = 0; tsi < TTLEVEL2SIZE*TTLEVEL2SIZE; tsi++)
 			{
 				if (ttable.tilegroups[tgi]->tilesets[tsi] != NULL)
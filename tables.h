@@ -19,6 +19,8 @@
 #define TABLES_H
 
 #include <bitset>
+#include <vector>
+#include <algorithm>
 #include <stdint.h>
 
 #include "map.h"
@@ -184,6 +186,28 @@ struct PosTileIdx
 	bool operator!=(const PosTileIdx& ti) const {return !operator==(ti);}
 };
 
+// the number of required tiles in each aligned 2x2, 4x4, etc. block of a square grid of cells (where a cell is
+//  a tile, a TileSet, or a TileGroup), up to the whole grid; these are kept up to date as tiles are set
+//  required, so that the count for any zoom tile can be looked up instead of added up
+// ...the grid is 2^BITS cells on a side, and T must be big enough to hold the count for the whole grid; there's
+//  one of these in every TileSet, so the small ones should stay small
+template <int BITS, class T> struct RequiredCounts
+{
+	// level 1 (2x2 blocks) first, then level 2, etc., up to the whole grid; each level is row-major
+	T counts[(((size_t)1 << (2*BITS)) - 1) / 3];
+
+	RequiredCounts() {std::fill(counts, counts + sizeof(counts) / sizeof(T), 0);}
+
+	// a tile in cell [x,y] has become required
+	void add(int64_t x, int64_t y) {for (int level = 1; level <= BITS; level++) counts[index(level, x, y)]++;}
+	// get the count for the block at some level (1 to BITS) that contains cell [x,y]
+	int64_t get(int level, int64_t x, int64_t y) const {return counts[index(level, x, y)];}
+
+	// where a level starts in counts (level 1 starts at 0, and each level is a quarter the size of the last)
+	static size_t offset(int level) {return (((size_t)1 << (2*BITS)) - ((size_t)1 << (2*(BITS - level + 1)))) / 3;}
+	static size_t index(int level, int64_t x, int64_t y) {return offset(level) + ((y >> level) << (BITS - level)) + (x >> level);}
+};
+
 // structure to hold information about a 16x16 set of tiles: for each tile, whether it's been drawn yet
 struct TileSet
 {
@@ -195,8 +219,13 @@ struct TileSet
 	// assumes that ti actually belongs to this set
 	bool isRequired(const PosTileIdx& ti) const {return bits[bitIdx(ti)];}
 
+	// required tiles in each block of the set (the whole set is the top level)
+	RequiredCounts<TTLEVEL1BITS, uint16_t> counts;
+
+	int64_t reqcount() const {return counts.get(TTLEVEL1BITS, 0, 0);}
+
 	// set tile's required bit and return previous state of bit
-	bool setRequired(const PosTileIdx& ti) {size_t bi = bitIdx(ti); bool rv = bits[bi]; bits.set(bi); return rv;}
+	bool setRequired(const PosTileIdx& ti);
 	void setDrawn(const PosTileIdx& ti) {bits.set(bitIdx(ti)+1);}
 };
 
@@ -206,8 +235,9 @@ struct TileGroup
 	// pointers to TileSets with the data, or NULL for 16x16 sets that aren't used
 	TileSet *tilesets[TTLEVEL2SIZE*TTLEVEL2SIZE];
 
-	// number of tiles in this group that have been set to required
+	// number of tiles in this group that have been set to required, and in each block of TileSets
 	int64_t reqcount;
+	RequiredCounts<TTLEVEL2BITS, uint32_t> counts;
 
 	TileGroup() : reqcount(0) {for (int i = 0; i < TTLEVEL2SIZE*TTLEVEL2SIZE; i++) tilesets[i] = NULL;}
 	~TileGroup() {for (int i = 0; i < TTLEVEL2SIZE*TTLEVEL2SIZE; i++) if (tilesets[i] != NULL) delete tilesets[i];}
@@ -225,6 +255,7 @@ struct TileTable : private nocopy
 	TileGroup *tilegroups[TTLEVEL3SIZE*TTLEVEL3SIZE];
 
 	int64_t reqcount;
+	RequiredCounts<TTLEVEL3BITS, int64_t> counts;  // required tiles in each block of TileGroups
 
 	TileTable() : reqcount(0) {for (int i = 0; i < TTLEVEL3SIZE*TTLEVEL3SIZE; i++) tilegroups[i] = NULL;}
 	~TileTable() {for (int i = 0; i < TTLEVEL3SIZE*TTLEVEL3SIZE; i++) if (tilegroups[i] != NULL) delete tilegroups[i];}
@@ -242,12 +273,18 @@ struct TileTable : private nocopy
 	bool setRequired(const PosTileIdx& ti);  // set tile's required bit and return previous state of bit
 	void setDrawn(const PosTileIdx& ti);
 
-	// see if an entire zoom tile can be rejected because its TileGroup or TileSet is NULL
+	// see if an entire zoom tile can be rejected because it has no required tiles in it
 	bool reject(const ZoomTileIdx& zti, const MapParams& mp) const;
 
-	// get the total number of base tiles required to draw a zoom tile
+	// get the total number of base tiles required to draw a zoom tile (without counting them; this is just
+	//  a lookup in the TileSet, TileGroup, or TileTable counts)
 	int64_t getNumRequired(const ZoomTileIdx& zti, const MapParams& mp) const;
 
+	// get the zoom tiles at some level (at least 1) that have any required tiles, in Z-order; only the
+	//  parts of the map that have something in them are looked at
+	void getRequiredZoomTiles(int zoom, const MapParams& mp, std::vector<ZoomTileIdx>& tiles) const;
+	void addRequiredZoomTiles(const ZoomTileIdx& zti, int zoom, const MapParams& mp, std::vector<ZoomTileIdx>& tiles) const;
+
 	void copyFrom(const TileTable& ttable);
 };
 
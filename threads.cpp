@@ -0,0 +1,218 @@
+// Copyright 2010-2012 Michael J. Nelson
+//
+// This file is part of pigmap.
+//
+// pigmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// pigmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with pigmap.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <iostream>
+#include <stdlib.h>
+
+#include "threads.h"
+
+using namespace std;
+
+
+
+void ZoomTileScheduler::assign(const vector<Task>& tasks)
+{
+	int64_t total = 0;
+	for (vector<Task>::const_iterator it = tasks.begin(); it != tasks.end(); it++)
+		total += it->cost;
+
+	// hand out contiguous runs of tasks, moving on to the next thread whenever the current one has
+	//  its fair share of the total cost
+	int64_t sofar = 0;
+	int thread = 0;
+	for (vector<Task>::const_iterator it = tasks.begin(); it != tasks.end(); it++)
+	{
+		queues[thread].tasks.push_back(*it);
+		queues[thread].remaining += it->cost;
+		sofar += it->cost;
+		while (thread < threads - 1 && sofar * threads >= total * (thread + 1))
+			thread++;
+	}
+}
+
+bool ZoomTileScheduler::next(int thread, ZoomTileIdx& zti)
+{
+	// try our own deque first
+	{
+		ThreadQueue& q = queues[thread];
+		mutexLocker ml(&q.mutex);
+		if (!q.tasks.empty())
+		{
+			zti = q.tasks.front().zti;
+			q.remaining -= q.tasks.front().cost;
+			q.taken += q.tasks.front().cost;
+			q.tasks.pop_front();
+			return true;
+		}
+	}
+
+	// ours is empty, so find a victim: the thread with the most work left
+	// ...each count is read under its own queue's lock, but they can change again as soon as we let
+	//  go, so if the victim's deque has emptied out by the time we lock it again, just look again
+	while (true)
+	{
+		int victim = -1;
+		int64_t most = 0;
+		for (int i = 0; i < threads; i++)
+		{
+			if (i == thread)
+				continue;
+			int64_t remaining;
+			{
+				mutexLocker ml(&queues[i].mutex);
+				remaining = queues[i].remaining;
+			}
+			if (remaining > most)
+			{
+				victim = i;
+				most = remaining;
+			}
+		}
+		if (victim == -1)
+			return false;
+
+		ThreadQueue& vq = queues[victim];
+		int64_t cost;
+		{
+			mutexLocker ml(&vq.mutex);
+			if (vq.tasks.empty())
+				continue;
+			// take from the back, which is the part of the victim's area that it won't get to for a while
+			zti = vq.tasks.back().zti;
+			cost = vq.tasks.back().cost;
+			vq.remaining -= cost;
+			vq.tasks.pop_back();
+		}
+		ThreadQueue& q = queues[thread];
+		mutexLocker ml(&q.mutex);
+		q.taken += cost;
+		q.stolen++;
+		return true;
+	}
+}
+
+
+
+void *runEncoderThread(void *arg)
+{
+	((TileWriter*)arg)->runEncoder();
+	return 0;
+}
+
+TileWriter::TileWriter(int encoders) : buffers(TILEWRITERBUFFERS * encoders), pthrs(encoders), done(false), written(0), stalls(0)
+{
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&jobready, NULL);
+	pthread_cond_init(&bufferfree, NULL);
+	for (vector<RGBAImage*>::iterator it = buffers.begin(); it != buffers.end(); it++)
+		*it = new RGBAImage;
+	freebuffers = buffers;
+	for (vector<pthread_t>::iterator it = pthrs.begin(); it != pthrs.end(); it++)
+		if (0 != pthread_create(&*it, NULL, runEncoderThread, (void*)this))
+		{
+			cerr << "failed to create encoder thread!" << endl;
+			exit(-1);
+		}
+}
+
+TileWriter::~TileWriter()
+{
+	finish();
+	for (vector<RGBAImage*>::iterator it = buffers.begin(); it != buffers.end(); it++)
+		delete *it;
+	pthread_cond_destroy(&bufferfree);
+	pthread_cond_destroy(&jobready);
+	pthread_mutex_destroy(&mutex);
+}
+
+void TileWriter::submit(const RGBAImage& img, const string& filename, const PNGProfile& profile, PhaseTimes *phases)
+{
+	// if there are no encoders, do it ourselves (but several render threads may be doing the same, so
+	//  the count still needs the lock)
+	if (pthrs.empty())
+	{
+		if (!img.writePNG(filename, profile, phases))
+			cerr << "failed to write " << filename << endl;
+		mutexLocker ml(&mutex);
+		written++;
+		return;
+	}
+
+	// get a buffer, waiting for one if necessary
+	RGBAImage *buf;
+	{
+		mutexLocker ml(&mutex);
+		if (freebuffers.empty())
+		{
+			TRACE_SCOPE("stall");
+			stalls++;
+			while (freebuffers.empty())
+				pthread_cond_wait(&bufferfree, &mutex);
+		}
+		buf = freebuffers.back();
+		freebuffers.pop_back();
+	}
+
+	// copy the image without holding the lock, then queue it up
+	*buf = img;
+	mutexLocker ml(&mutex);
+	queue.push_back(Job(buf, filename, profile));
+	pthread_cond_signal(&jobready);
+}
+
+void TileWriter::finish()
+{
+	{
+		mutexLocker ml(&mutex);
+		if (done)
+			return;
+		done = true;
+		pthread_cond_broadcast(&jobready);
+	}
+	for (vector<pthread_t>::iterator it = pthrs.begin(); it != pthrs.end(); it++)
+		pthread_join(*it, NULL);
+}
+
+void TileWriter::runEncoder()
+{
+	PhaseTimes phases;
+	uint64_t start = getNanoseconds();
+	TRACE_THREAD("encoder");
+	pthread_mutex_lock(&mutex);
+	while (true)
+	{
+		while (queue.empty() && !done)
+			pthread_cond_wait(&jobready, &mutex);
+		if (queue.empty())
+			break;
+		Job job = queue.front();
+		queue.pop_front();
+
+		// do the actual writing without holding the lock
+		pthread_mutex_unlock(&mutex);
+		if (!job.img->writePNG(job.filename, job.profile, &phases))
+			cerr << "failed to write " << job.filename << endl;
+		pthread_mutex_lock(&mutex);
+
+		freebuffers.push_back(job.img);
+		written++;
+		pthread_cond_signal(&bufferfree);
+	}
+	phases.elapsed = getNanoseconds() - start;
+	encoderphases.push_back(phases);
+	pthread_mutex_unlock(&mutex);
+}
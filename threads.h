@@ -0,0 +1,135 @@
+// Copyright 2010-2012 Michael J. Nelson
+//
+// This file is part of pigmap.
+//
+// pigmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// pigmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with pigmap.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef THREADS_H
+#define THREADS_H
+
+#include <deque>
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "map.h"
+#include "rgba.h"
+#include "utils.h"
+
+
+// hold a mutex for the lifetime of this object
+struct mutexLocker
+{
+	pthread_mutex_t *mutex;
+	mutexLocker(pthread_mutex_t *m) : mutex(m) {pthread_mutex_lock(mutex);}
+	~mutexLocker() {pthread_mutex_unlock(mutex);}
+};
+
+
+
+// hands out zoom tiles (each one representing the whole subtree of tiles below it) to the worker threads
+// -each thread has its own deque of zoom tiles, which starts out holding a contiguous (in Z-order) run of
+//  tiles; the thread takes work from the front of its own deque, so it moves through a compact area of the
+//  map and keeps its caches warm
+// -when a thread's deque runs dry, it steals from the back of the deque of whichever thread has the most
+//  work left, so no thread sits idle while there's still work to do
+// -a steal always takes a whole zoom tile from the deque; the tiles aren't split into their subtrees,
+//  because the ThreadOutputCache is built around the level the tasks start at
+// ...the costs are just estimates (number of required base tiles); they decide the initial split and
+//  which thread gets robbed, but the actual load balancing happens at run time
+struct ZoomTileScheduler : private nocopy
+{
+	struct Task
+	{
+		ZoomTileIdx zti;
+		int64_t cost;
+
+		Task(const ZoomTileIdx& z, int64_t c) : zti(z), cost(c) {}
+	};
+
+	struct ThreadQueue
+	{
+		pthread_mutex_t mutex;
+		std::deque<Task> tasks;
+		int64_t remaining;  // total cost of the tasks still in the deque
+		int64_t taken, stolen;  // stats: total cost of tasks this thread has taken (including stolen ones), number of steals
+
+		ThreadQueue() : remaining(0), taken(0), stolen(0) {pthread_mutex_init(&mutex, NULL);}
+		~ThreadQueue() {pthread_mutex_destroy(&mutex);}
+	};
+
+	int threads;
+	ThreadQueue *queues;
+
+	ZoomTileScheduler(int t) : threads(t), queues(new ThreadQueue[t]) {}
+	~ZoomTileScheduler() {delete[] queues;}
+
+	// split a list of tasks among the threads; the tasks should all be at the same zoom level
+	// (not synchronized; must be called before the threads start)
+	void assign(const std::vector<Task>& tasks);
+
+	// get the next task for a thread, stealing one from another thread if necessary; returns false
+	//  when there's no work left anywhere
+	bool next(int thread, ZoomTileIdx& zti);
+};
+
+
+
+// writes finished tiles to disk on a pool of encoder threads, so the render threads can go on to the next
+//  tile instead of waiting for PNG compression and file I/O
+// ...the tiles are copied into a fixed set of buffers; when they're all waiting to be written, submit()
+//  blocks until an encoder frees one up, so memory use stays bounded
+// ...with zero encoder threads, submit() just writes the tile itself
+struct TileWriter : private nocopy
+{
+	struct Job
+	{
+		RGBAImage *img;
+		std::string filename;
+		PNGProfile profile;
+
+		Job(RGBAImage *i, const std::string& f, const PNGProfile& p) : img(i), filename(f), profile(p) {}
+	};
+
+	pthread_mutex_t mutex;
+	pthread_cond_t jobready;  // signalled when a job is added to the queue (or we're shutting down)
+	pthread_cond_t bufferfree;  // signalled when an encoder is done with a buffer
+	std::deque<Job> queue;
+	std::vector<RGBAImage*> buffers, freebuffers;
+	std::vector<pthread_t> pthrs;
+	bool done;  // set when no more jobs will be submitted
+	int64_t written, stalls;  // stats: tiles written, number of times submit() had to wait for a buffer
+	std::vector<PhaseTimes> encoderphases;  // stats: phase times of each encoder thread (added as they exit)
+
+	TileWriter(int encoders);
+	~TileWriter();
+
+	// write an image to a file, or queue it to be written (in which case the image is copied, so the caller
+	//  may do whatever it likes with it afterwards)
+	// ...if we write it ourselves, the time is charged to the caller's phases (which may be NULL)
+	void submit(const RGBAImage& img, const std::string& filename, const PNGProfile& profile, PhaseTimes *phases);
+
+	// wait for all queued tiles to be written, and shut down the encoder threads
+	void finish();
+
+	// body of the encoder threads
+	void runEncoder();
+};
+
+// how many tile buffers to give the TileWriter for each encoder thread
+#define TILEWRITERBUFFERS 4
+
+
+#endif // THREADS_H
@@ -23,7 +23,9 @@
 #include <fstream>
 #include <iostream>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "utils.h"
 
@@ -31,6 +33,15 @@
 #include <malloc.h>
 #endif
 
+#if USE_LIBDEFLATE
+#include <pthread.h>
+#include <libdeflate.h>
+#endif
+
+#if USE_TRACING
+#include <pthread.h>
+#endif
+
 using namespace std;
 
 
@@ -110,6 +121,119 @@ uint64_t getHeapUsage()
 #endif
 }
 
+uint64_t getPeakRSS()
+{
+	struct rusage usage;
+	if (0 != getrusage(RUSAGE_SELF, &usage))
+		return 0;
+	return (uint64_t)usage.ru_maxrss * 1024;  // (Linux gives it in kilobytes)
+}
+
+uint64_t getNanoseconds()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+const char *phaseName(int phase)
+{
+	static const char *names[NUMPHASES] = {"read", "inflate", "parse", "scenegraph", "draw", "encode", "write", "zoom"};
+	return names[phase];
+}
+
+PhaseTimes& PhaseTimes::operator+=(const PhaseTimes& pt)
+{
+	for (int i = 0; i < NUMPHASES; i++)
+	{
+		ns[i] += pt.ns[i];
+		count[i] += pt.count[i];
+		bytes[i] += pt.bytes[i];
+	}
+	elapsed += pt.elapsed;
+	return *this;
+}
+
+#if USE_TRACING
+
+bool tracing = false;
+uint64_t traceStart;
+pthread_key_t traceKey;
+// every thread's buffer, in order of creation (the index is the thread's ID in the trace); the mutex is only
+//  taken when a thread records its first event
+pthread_mutex_t traceMutex = PTHREAD_MUTEX_INITIALIZER;
+vector<TraceBuffer*> traceBuffers;
+
+void startTracing()
+{
+	pthread_key_create(&traceKey, NULL);
+	traceStart = getNanoseconds();
+	tracing = true;
+}
+
+TraceBuffer* getTraceBuffer()
+{
+	if (!tracing)
+		return NULL;
+	TraceBuffer *buf = (TraceBuffer*)pthread_getspecific(traceKey);
+	if (buf == NULL)
+	{
+		pthread_mutex_lock(&traceMutex);
+		buf = new TraceBuffer(traceBuffers.size());
+		traceBuffers.push_back(buf);
+		pthread_mutex_unlock(&traceMutex);
+		pthread_setspecific(traceKey, buf);
+	}
+	return buf;
+}
+
+void traceThreadName(const string& name)
+{
+	TraceBuffer *buf = getTraceBuffer();
+	if (buf != NULL)
+		buf->threadname = name;
+}
+
+bool writeTrace(const string& filename)
+{
+	ofstream out(filename.c_str());
+	if (out.fail())
+		return false;
+	// (times are in microseconds since we started tracing)
+	out.setf(ios::fixed);
+	out.precision(3);
+	out << "{\"traceEvents\": [" << endl;
+	out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"pigmap\"}}";
+	uint64_t dropped = 0;
+	for (vector<TraceBuffer*>::const_iterator it = traceBuffers.begin(); it != traceBuffers.end(); it++)
+	{
+		const TraceBuffer& buf = **it;
+		out << "," << endl << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << buf.tid
+		    << ", \"args\": {\"name\": \"" << buf.threadname << "\"}}";
+		uint64_t first = buf.recorded > TRACEBUFFERSIZE ? buf.recorded - TRACEBUFFERSIZE : 0;
+		dropped += first;
+		for (uint64_t i = first; i < buf.recorded; i++)
+		{
+			const TraceEvent& ev = buf.events[i % TRACEBUFFERSIZE];
+			out << "," << endl << "{\"name\": \"" << ev.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buf.tid
+			    << ", \"ts\": " << (ev.start - traceStart) / 1000.0 << ", \"dur\": " << (ev.end - ev.start) / 1000.0;
+			vector<string> argnames = tokenize(ev.argnames, ',');
+			if (!argnames.empty())
+			{
+				out << ", \"args\": {";
+				for (int j = 0; j < (int)argnames.size() && j < 3; j++)
+					out << (j == 0 ? "" : ", ") << "\"" << argnames[j] << "\": " << ev.args[j];
+				out << "}";
+			}
+			out << "}";
+		}
+	}
+	out << endl << "]," << endl << "\"displayTimeUnit\": \"ms\", \"otherData\": {\"dropped\": " << dropped << "}}" << endl;
+	return !out.fail();
+}
+
+#endif
+
 
 struct gzCloser
 {
@@ -167,6 +291,15 @@ struct inflateEnder
 };
 
 bool readGzOrZlib(uint8_t *inbuf, size_t size, vector<uint8_t>& data)
+{
+#if USE_LIBDEFLATE
+	return inflateWithLibdeflate(inbuf, size, data);
+#else
+	return inflateWithZlib(inbuf, size, data);
+#endif
+}
+
+bool inflateWithZlib(uint8_t *inbuf, size_t size, vector<uint8_t>& data)
 {
 	// start by resizing vector to entire capacity; we'll shrink back down to the
 	//  proper size later
@@ -209,6 +342,65 @@ bool readGzOrZlib(uint8_t *inbuf, size_t size, vector<uint8_t>& data)
 	return true;
 }
 
+#if USE_LIBDEFLATE
+
+// a libdeflate decompressor can't be used by more than one thread at once, so each thread gets its own
+pthread_key_t decompressorKey;
+pthread_once_t decompressorKeyOnce = PTHREAD_ONCE_INIT;
+
+void freeDecompressor(void *d)
+{
+	libdeflate_free_decompressor((libdeflate_decompressor*)d);
+}
+
+void makeDecompressorKey()
+{
+	pthread_key_create(&decompressorKey, freeDecompressor);
+}
+
+bool inflateWithLibdeflate(uint8_t *inbuf, size_t size, vector<uint8_t>& data)
+{
+	pthread_once(&decompressorKeyOnce, makeDecompressorKey);
+	libdeflate_decompressor *decompressor = (libdeflate_decompressor*)pthread_getspecific(decompressorKey);
+	if (decompressor == NULL)
+	{
+		decompressor = libdeflate_alloc_decompressor();
+		if (decompressor == NULL)
+			return false;
+		pthread_setspecific(decompressorKey, decompressor);
+	}
+
+	// libdeflate wants to be told which format it's getting
+	bool gzip = size >= 2 && inbuf[0] == 0x1f && inbuf[1] == 0x8b;
+
+	// libdeflate can't stop partway and continue, so if the output doesn't fit, we have to grow the
+	//  buffer and start over
+	// ...we start with whatever size the buffer already has (the last chunk's), since growing it means
+	//  zero-filling the new part; the first time that's too small, it goes up to its full capacity (the
+	//  biggest chunk so far), and only after that do we double it
+	if (data.empty())
+		data.resize(max(data.capacity(), (size_t)131072));
+	while (true)
+	{
+		size_t outsize;
+		libdeflate_result result;
+		if (gzip)
+			result = libdeflate_gzip_decompress(decompressor, inbuf, size, &(data[0]), data.size(), &outsize);
+		else
+			result = libdeflate_zlib_decompress(decompressor, inbuf, size, &(data[0]), data.size(), &outsize);
+		if (result == LIBDEFLATE_SUCCESS)
+		{
+			data.resize(outsize);
+			return true;
+		}
+		if (result != LIBDEFLATE_INSUFFICIENT_SPACE || data.size() >= 268435456)
+			return false;
+		data.resize((data.size() < data.capacity()) ? data.capacity() : data.size() * 2);
+	}
+}
+
+#endif
+
 
 
 uint32_t fromBigEndian(uint32_t i)
@@ -443,45 +635,3 @@ vector<string> tokenize(const string& instr, char separator)
 }
 
 
-
-pair<int64_t, double> schedule(const vector<int64_t>& costs, vector<int>& assignments, int threads)
-{
-	// simple scheduler: go through the costs in descending order, assigning
-	//  each to the thread with the lowest cost so far
-
-	// sort costs
-	vector<pair<int64_t, int> > sortedcosts;  // first is cost, second is index in original vector
-	for (int i = 0; i < costs.size(); i++)
-		sortedcosts.push_back(make_pair(costs[i], i));
-	sort(sortedcosts.begin(), sortedcosts.end(), greater<pair<int64_t, int> >());
-
-	vector<int64_t> totals(threads, 0);
-	assignments.resize(costs.size(), -1);
-
-	// go through sorted costs
-	int next = 0;
-	for (vector<pair<int64_t, int> >::const_iterator it = sortedcosts.begin(); it != sortedcosts.end(); it++)
-	{
-		// assign to waiting (min-cost) thread
-		assignments[it->second] = next;
-		totals[next] += it->first;
-		// find the new min-cost thread
-		for (int i = 0; i < threads; i++)
-			if (totals[i] < totals[next])
-				next = i;
-	}
-
-	// compute error fraction
-	int mintotal = totals[0], maxtotal = totals[0];
-	for (int i = 1; i < threads; i++)
-	{
-		if (totals[i] < mintotal)
-			mintotal = totals[i];
-		else if (totals[i] > maxtotal)
-			maxtotal = totals[i];
-	}
-	return make_pair(maxtotal - mintotal, (double)(maxtotal - mintotal) / (double)maxtotal);
-}
-
-
-
@@ -45,13 +45,31 @@ int readGzFile(const std::string& filename, std::vector<uint8_t>& data);
 // extract gzip- or zlib-compressed data into a vector, overwriting its contents, and
 //  expanding it if necessary
 // (inbuf is not const only because zlib won't take const pointers for input)
+// ...this uses libdeflate if USE_LIBDEFLATE is set, zlib otherwise
 bool readGzOrZlib(uint8_t* inbuf, size_t size, std::vector<uint8_t>& data);
 
+// set this to 1 to decompress region chunks with libdeflate, which decodes the whole buffer in one shot
+//  and is a good deal faster than zlib's streaming inflate (requires libdeflate; add "-l deflate" to the
+//  link line in the Makefile)
+#define USE_LIBDEFLATE 0
+
+// the individual decompression backends behind readGzOrZlib (for benchmarking)
+bool inflateWithZlib(uint8_t* inbuf, size_t size, std::vector<uint8_t>& data);
+#if USE_LIBDEFLATE
+bool inflateWithLibdeflate(uint8_t* inbuf, size_t size, std::vector<uint8_t>& data);
+#endif
+
 
 #define USE_MALLINFO 0
 
 uint64_t getHeapUsage();
 
+// peak resident set size of the process so far, in bytes (or 0 if it can't be found out)
+uint64_t getPeakRSS();
+
+// a monotonic clock, in nanoseconds
+uint64_t getNanoseconds();
+
 
 // convert a big-endian int into whatever the current platform endianness is
 uint32_t fromBigEndian(uint32_t i);
@@ -98,12 +116,6 @@ bool replace(std::string& text, const std::string& oldstr, const std::string& ne
 std::vector<std::string> tokenize(const std::string& instr, char separator);
 
 
-// find an assignment of costs to threads that attempts to minimize the difference
-//  between the min and max total thread costs; return the difference by itself, and
-//  also as a fraction of the max thread cost
-std::pair<int64_t, double> schedule(const std::vector<int64_t>& costs, std::vector<int>& assignments, int threads);
-
-
 class nocopy
 {
 protected:
@@ -131,6 +143,147 @@ template <class T> struct stackPusher
 };
 
 
+// the phases of a render whose running times we keep track of (see PhaseTimes)
+#define PHASE_READ 0  // reading region files (or, for chunk-format worlds, reading and inflating chunk files)
+#define PHASE_INFLATE 1  // decompressing chunks out of region files
+#define PHASE_PARSE 2  // picking the block data out of decompressed chunks
+#define PHASE_SCENEGRAPH 3  // walking pseudocolumns (and building chunk surfaces) to make scene graphs
+#define PHASE_DRAW 4  // compositing block images into base tiles
+#define PHASE_ENCODE 5  // PNG compression
+#define PHASE_WRITE 6  // writing PNG files to disk
+#define PHASE_ZOOM 7  // shrinking tiles to build the zoom levels above them
+#define NUMPHASES 8
+
+// the name of a phase, as used in the stats and the render report
+const char *phaseName(int phase);
+
+// time spent by a single thread in each phase, number of times it entered each one, and the bytes it handled in
+//  the phases where that means something (region/chunk file bytes read, chunk bytes inflated, PNG bytes written);
+//  also its total running time (filled in by whoever started the thread), so that the time spent outside the
+//  phases can be found
+// ...phases nest (reading a chunk happens in the middle of building a scene graph, for example), but the time
+//  is only ever charged to the innermost one, so the phase times of a thread never add up to more than its
+//  running time
+struct PhaseTimes
+{
+	uint64_t ns[NUMPHASES], count[NUMPHASES], bytes[NUMPHASES];
+	uint64_t elapsed;
+	int current;  // phase we're in right now, or -1
+	uint64_t since;  // when we last charged anything to the current phase
+
+	PhaseTimes() : elapsed(0), current(-1), since(0) {for (int i = 0; i < NUMPHASES; i++) ns[i] = count[i] = bytes[i] = 0;}
+
+	uint64_t total() const {uint64_t t = 0; for (int i = 0; i < NUMPHASES; i++) t += ns[i]; return t;}
+
+	PhaseTimes& operator+=(const PhaseTimes& pt);
+};
+
+// charge the time from construction to destruction to a phase (or do nothing, if given NULL)
+// ...costs two clock reads, so it's fine for things on the scale of chunks and tiles, but not blocks
+struct PhaseTimer : private nocopy
+{
+	PhaseTimes *times;
+	int outer;  // the phase we interrupted
+
+	PhaseTimer(PhaseTimes *pt, int phase) : times(pt)
+	{
+		if (times == NULL)
+			return;
+		uint64_t now = getNanoseconds();
+		if (times->current != -1)
+			times->ns[times->current] += now - times->since;
+		outer = times->current;
+		times->current = phase;
+		times->count[phase]++;
+		times->since = now;
+	}
+	~PhaseTimer()
+	{
+		if (times == NULL)
+			return;
+		uint64_t now = getNanoseconds();
+		times->ns[times->current] += now - times->since;
+		times->current = outer;
+		times->since = now;
+	}
+};
+
+
+// set this to 1 to compile in the event tracer, which records when each thread started and finished each
+//  tile, zoom tile, region load, PNG write, etc., and saves it all in Chrome's trace format (see -t), to be
+//  looked at with chrome://tracing or Perfetto; when it's 0, the TRACE macros compile to nothing
+#define USE_TRACING 0
+
+#if USE_TRACING
+
+// a span of time on one thread (a "complete" event, in trace-format terms), with up to three numbers attached
+struct TraceEvent
+{
+	const char *name;
+	const char *argnames;  // comma-separated names of the args that are used (e.g. "x,y"), or ""
+	int64_t args[3];
+	uint64_t start, end;
+};
+
+// each thread records its events into its own ring buffer, so there's no locking (the buffers are only read
+//  once the threads are done); a thread that records more than TRACEBUFFERSIZE events loses the oldest ones
+#define TRACEBUFFERSIZE 65536
+struct TraceBuffer
+{
+	int tid;
+	std::string threadname;
+	std::vector<TraceEvent> events;
+	uint64_t recorded;  // events ever recorded; the next one goes at recorded % TRACEBUFFERSIZE
+
+	TraceBuffer(int t) : tid(t), threadname("thread " + tostring(t)), events(TRACEBUFFERSIZE), recorded(0) {}
+};
+
+// start recording events (before starting any of the threads to be traced)
+void startTracing();
+// the calling thread's buffer (created the first time it's asked for), or NULL if we're not tracing
+TraceBuffer* getTraceBuffer();
+// give the calling thread a name in the trace
+void traceThreadName(const std::string& name);
+// write everything recorded so far as Chrome trace-event JSON (the threads that recorded it must be finished)
+bool writeTrace(const std::string& filename);
+
+// record the time from construction to destruction as an event
+struct TraceScope : private nocopy
+{
+	TraceBuffer *buf;
+	TraceEvent ev;
+
+	TraceScope(const char *name, const char *argnames = "", int64_t a0 = 0, int64_t a1 = 0, int64_t a2 = 0) : buf(getTraceBuffer())
+	{
+		if (buf == NULL)
+			return;
+		ev.name = name;
+		ev.argnames = argnames;
+		ev.args[0] = a0;
+		ev.args[1] = a1;
+		ev.args[2] = a2;
+		ev.start = getNanoseconds();
+	}
+	~TraceScope()
+	{
+		if (buf == NULL)
+			return;
+		ev.end = getNanoseconds();
+		buf->events[buf->recorded++ % TRACEBUFFERSIZE] = ev;
+	}
+};
+
+#define TRACE_SCOPE(...) TraceScope tracescope(__VA_ARGS__)
+#define TRACE_THREAD(name) traceThreadName(name)
+
+#else
+
+#define TRACE_SCOPE(...)
+#define TRACE_THREAD(name)
+
+#endif
+
+
 // fast version for dividing by 16 (important for BlockIdx::getChunkIdx, which is called very very frequently)
 inline int64_t floordiv16(int64_t a)
 {
@@ -17,10 +17,18 @@
 
 #include <iostream>
 #include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <fstream>
+#include <set>
+#include <map>
+#include <memory>
+#include <zlib.h>
 
 #include "world.h"
 #include "region.h"
+#include "chunk.h"
 
 using namespace std;
 
@@ -36,7 +44,7 @@ bool detectRegionFormat(const string& inputdir)
 
 
 
-bool makeAllRegionsRequired(const string& topdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int64_t& reqregioncount)
+bool makeAllRegionsRequired(const string& topdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int64_t& reqregioncount, ChunkIndex *chunkindex, RegionSnapshots *snapshots)
 {
 	bool findBaseZoom = mp.baseZoom == -1;
 	// if finding the baseZoom, we'll just start from 0 and increase it whenever we hit a tile that's out of bounds
@@ -62,15 +70,19 @@ bool makeAllRegionsRequired(const string& topdir, ChunkTable& chunktable, TileTa
 			// we might have found this region already, if the world data contains both .mca and .mcr files
 			if (regiontable.isRequired(pri))
 				continue;
-			// get the chunks that currently exist in this region; if there aren't any, ignore it
+			// get the chunks that currently exist in this region (recording them in the index, if we're
+			//  keeping one); if there aren't any, ignore it
 			vector<ChunkIdx> chunks;
-			if (0 != rfreader.getContainedChunks(ri, string84(topdir), chunks))
+			int result = (chunkindex == NULL) ? rfreader.getContainedChunks(ri, string84(topdir), chunks) : chunkindex->update(ri, topdir, rfreader, chunks);
+			if (0 != result)
 			{
 				cerr << "can't open region " << *it << " to list chunks" << endl;
 				continue;
 			}
 			if (chunks.empty())
 				continue;
+			if (snapshots != NULL && chunkindex != NULL && !snapshots->stage(ri, rfreader))
+				cerr << "failed to write snapshot of region " << *it << endl;
 			// mark the region required
 			regiontable.setRequired(pri);
 			reqregioncount++;
@@ -129,7 +141,47 @@ bool makeAllRegionsRequired(const string& topdir, ChunkTable& chunktable, TileTa
 	return true;
 }
 
-int readRegionlist(const string& regionlist, const string& inputdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, const MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int64_t& reqregioncount)
+// load a chunk out of a region that's already in memory; returns false if it's missing or corrupt
+bool loadChunkFromRegion(const RegionFileReader& rfreader, const ChunkIdx& ci, ChunkData& data, vector<uint8_t>& readbuf, vector<uint8_t>& buf)
+{
+	if (0 != rfreader.decompressChunk(ci, readbuf, buf))
+		return false;
+	return rfreader.anvil ? data.loadFromAnvilFile(buf) : data.loadFromOldFile(buf);
+}
+
+// compare a chunk with its snapshot and get the tiles that any changed block (or any of its neighbors, since
+//  checkSpecial looks at those, and any block whose water run test in continuesWaterRun looks at it) touches;
+//  returns false if the comparison can't be done, in which case the
+//  caller should fall back to the tiles of the whole chunk
+bool getChangedBlockTiles(const ChunkIdx& ci, const RegionFileReader& rfreader, const RegionFileReader& snapreader, ChunkData& olddata, ChunkData& newdata, vector<uint8_t>& readbuf, vector<uint8_t>& buf, const MapParams& mp, RegionSnapshots& snapshots, vector<TileIdx>& tiles)
+{
+	if (rfreader.anvil != snapreader.anvil || !snapreader.containsChunk(ci))
+		return false;
+	if (!loadChunkFromRegion(snapreader, ci, olddata, readbuf, buf) || !loadChunkFromRegion(rfreader, ci, newdata, readbuf, buf))
+		return false;
+	vector<BlockIdx> changed;
+	findChangedBlocks(ci, olddata, newdata, changed);
+	snapshots.chunksdiffed++;
+	snapshots.blocksdiffed += changed.size();
+
+	// (continuesWaterRun looks at [-1,1,0], [-1,0,1], and [0,1,1], so a change there affects the blocks at the
+	//  opposite offsets)
+	static const BlockIdx neighbors[10] = {BlockIdx(0,0,0), BlockIdx(-1,0,0), BlockIdx(1,0,0), BlockIdx(0,-1,0), BlockIdx(0,1,0), BlockIdx(0,0,-1), BlockIdx(0,0,1),
+	                                       BlockIdx(1,-1,0), BlockIdx(1,0,-1), BlockIdx(0,-1,-1)};
+	set<pair<int64_t, int64_t> > seen;
+	tiles.clear();
+	for (vector<BlockIdx>::const_iterator it = changed.begin(); it != changed.end(); it++)
+		for (int n = 0; n < 10; n++)
+		{
+			vector<TileIdx> blocktiles = (*it + neighbors[n]).getTiles(mp);
+			for (vector<TileIdx>::const_iterator tile = blocktiles.begin(); tile != blocktiles.end(); tile++)
+				if (seen.insert(make_pair(tile->x, tile->y)).second)
+					tiles.push_back(*tile);
+		}
+	return true;
+}
+
+int readRegionlist(const string& regionlist, const string& inputdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, const MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int64_t& reqregioncount, ChunkIndex *chunkindex, RegionSnapshots *snapshots)
 {
 	ifstream infile(regionlist.c_str());
 	if (infile.fail())
@@ -138,7 +190,9 @@ int readRegionlist(const string& regionlist, const string& inputdir, ChunkTable&
 		return -2;
 	}
 	reqregioncount = 0;
-	RegionFileReader rfreader;
+	RegionFileReader rfreader, snapreader;
+	ChunkData olddata, newdata;  // for comparing chunks with their snapshots (the block arrays are shared until loaded)
+	vector<uint8_t> readbuf, buf;
 	while (!infile.eof() && !infile.fail())
 	{
 		string regionfile;
@@ -156,14 +210,27 @@ int readRegionlist(const string& regionlist, const string& inputdir, ChunkTable&
 			}
 			if (regiontable.isRequired(pri))
 				continue;
+			// if we're keeping a chunk index, only the chunks that have changed since the last render
+			//  are required
+			// ...and if we're keeping snapshots, too, we can compare each changed chunk with its snapshot to
+			//  find exactly which tiles it affects (but only if the region was already in the index, since
+			//  otherwise its snapshot isn't known to be from the last render)
 			vector<ChunkIdx> chunks;
-			if (0 != rfreader.getContainedChunks(ri, string84(inputdir), chunks))
+			bool diff = snapshots != NULL && chunkindex != NULL && chunkindex->regions.count(make_pair(ri.x, ri.z)) != 0;
+			int result = (chunkindex == NULL) ? rfreader.getContainedChunks(ri, string84(inputdir), chunks) : chunkindex->update(ri, inputdir, rfreader, chunks);
+			if (0 != result)
 			{
 				cerr << "can't open region " << regionfile << " to list chunks" << endl;
 				continue;
 			}
 			if (chunks.empty())
 				continue;
+			if (snapshots != NULL && chunkindex != NULL)
+			{
+				if (!snapshots->stage(ri, rfreader))
+					cerr << "failed to write snapshot of region " << regionfile << endl;
+				diff = diff && 0 == snapshots->load(ri, snapreader);
+			}
 			regiontable.setRequired(pri);
 			reqregioncount++;
 			for (vector<ChunkIdx>::const_iterator chunk = chunks.begin(); chunk != chunks.end(); chunk++)
@@ -179,7 +246,9 @@ int readRegionlist(const string& regionlist, const string& inputdir, ChunkTable&
 					cerr << "ignoring extremely-distant chunk " << chunk->toFileName() << " (world may be corrupt)" << endl;
 					continue;
 				}
-				vector<TileIdx> tiles = chunk->getTiles(mp);
+				vector<TileIdx> tiles;
+				if (!diff || !getChangedBlockTiles(*chunk, rfreader, snapreader, olddata, newdata, readbuf, buf, mp, *snapshots, tiles))
+					tiles = chunk->getTiles(mp);
 				for (vector<TileIdx>::const_iterator tile = tiles.begin(); tile != tiles.end(); tile++)
 				{
 					PosTileIdx pti(*tile);
@@ -339,55 +408,48 @@ int readChunklist(const string& chunklist, ChunkTable& chunktable, TileTable& ti
 	return 0;
 }
 
-void makeTestWorld(int size, ChunkTable& chunktable, TileTable& tiletable, MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount)
+void getTestWorldChunks(int size, vector<ChunkIdx>& chunks)
 {
-	bool findBaseZoom = mp.baseZoom == -1;
-	// if finding the baseZoom, we'll just start from 0 and increase it whenever we hit a tile that's out of bounds
-	if (findBaseZoom)
-		mp.baseZoom = 0;
-	reqchunkcount = 0;
 	// we'll start by putting 95% of the chunks in a solid block at the center
 	int size2 = (int)(sqrt((double)size * 0.95) / 2.0);
 	ChunkIdx ci(0,0);
 	for (ci.x = -size2; ci.x < size2; ci.x++)
 		for (ci.z = -size2; ci.z < size2; ci.z++)
-		{
-			chunktable.setRequired(ci);
-			reqchunkcount++;
-			vector<TileIdx> tiles = ci.getTiles(mp);
-			for (vector<TileIdx>::const_iterator tile = tiles.begin(); tile != tiles.end(); tile++)
-			{
-				tiletable.setRequired(*tile);
-				while (findBaseZoom && !tile->valid(mp))
-					mp.baseZoom++;
-			}
-		}
+			chunks.push_back(ci);
 	// now add some circles of required chunks with radii up to four times the (minimum) radius of the
 	//  center block
 	for (int m = 2; m <= 4; m++)
 	{
 		double rad = (double)size2 * (double)m;
 		for (double t = -3.14159; t < 3.14159; t += 0.002)
-		{
-			ChunkIdx ci((int)(cos(t) * rad), (int)(sin(t) * rad));
-			chunktable.setRequired(ci);
-			reqchunkcount++;
-			vector<TileIdx> tiles = ci.getTiles(mp);
-			for (vector<TileIdx>::const_iterator tile = tiles.begin(); tile != tiles.end(); tile++)
-			{
-				tiletable.setRequired(*tile);
-				while (findBaseZoom && !tile->valid(mp))
-					mp.baseZoom++;
-			}
-		}
+			chunks.push_back(ChunkIdx((int)(cos(t) * rad), (int)(sin(t) * rad)));
 	}
 	// now add some spokes going from the center out to the circle
 	int irad = size2 * 4;
 	for (ci.x = 0, ci.z = -irad; ci.z < irad; ci.z++)
+		chunks.push_back(ci);
+	for (ci.x = -irad, ci.z = 0; ci.x < irad; ci.x++)
+		chunks.push_back(ci);
+	for (ci.x = -irad, ci.z = -irad; ci.z < irad; ci.x++, ci.z++)
+		chunks.push_back(ci);
+	for (ci.x = irad, ci.z = -irad; ci.z < irad; ci.x--, ci.z++)
+		chunks.push_back(ci);
+}
+
+void makeTestWorld(int size, ChunkTable& chunktable, TileTable& tiletable, MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount)
+{
+	bool findBaseZoom = mp.baseZoom == -1;
+	// if finding the baseZoom, we'll just start from 0 and increase it whenever we hit a tile that's out of bounds
+	if (findBaseZoom)
+		mp.baseZoom = 0;
+	reqchunkcount = 0;
+	vector<ChunkIdx> chunks;
+	getTestWorldChunks(size, chunks);
+	for (vector<ChunkIdx>::const_iterator ci = chunks.begin(); ci != chunks.end(); ci++)
 	{
-		chunktable.setRequired(ci);
+		chunktable.setRequired(*ci);
 		reqchunkcount++;
-		vector<TileIdx> tiles = ci.getTiles(mp);
+		vector<TileIdx> tiles = ci->getTiles(mp);
 		for (vector<TileIdx>::const_iterator tile = tiles.begin(); tile != tiles.end(); tile++)
 		{
 			tiletable.setRequired(*tile);
@@ -395,45 +457,615 @@ void makeTestWorld(int size, ChunkTable& chunktable, TileTable& tiletable, MapPa
 				mp.baseZoom++;
 		}
 	}
-	for (ci.x = -irad, ci.z = 0; ci.x < irad; ci.x++)
+	reqtilecount = tiletable.reqcount;
+	if (findBaseZoom)
+		cout << "baseZoom set to " << mp.baseZoom << endl;
+}
+
+
+
+//-------------------------------------------------------------------------------------------------------------------
+
+bool TerrainProfile::fromString(const string& s)
+{
+	if (s == "flat")
+		type = FLAT;
+	else if (s == "ocean")
+		type = OCEAN;
+	else if (s == "mountains")
+		type = MOUNTAINS;
+	else if (s == "caves")
+		type = CAVES;
+	else if (s == "builds")
+		type = BUILDS;
+	else
+		return false;
+	return true;
+}
+
+string TerrainProfile::toString() const
+{
+	const char *names[] = {"flat", "ocean", "mountains", "caves", "builds"};
+	return names[type];
+}
+
+// hash some coordinates into 32 pseudorandom bits; the same coordinates always give the same bits, so the
+//  terrain doesn't depend on the order the chunks are generated in, and every run makes the same world
+uint32_t terrainHash(int64_t x, int64_t y, int64_t z, uint32_t seed)
+{
+	uint64_t h = (uint64_t)seed * 0x9e3779b97f4a7c15ULL;
+	h = (h ^ (uint64_t)x) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 31) ^ (uint64_t)y) * 0x94d049bb133111ebULL;
+	h = (h ^ (h >> 29) ^ (uint64_t)z) * 0xbf58476d1ce4e5b9ULL;
+	return (uint32_t)((h ^ (h >> 32)) & 0xffffffff);
+}
+
+// the same, as a double in [0,1)
+double terrainRandom(int64_t x, int64_t y, int64_t z, uint32_t seed)
+{
+	return (double)terrainHash(x, y, z, seed) / 4294967296.0;
+}
+
+// value noise in [0,1): random values at the integer lattice points, smoothly interpolated in between
+double valueNoise(double x, double y, double z, uint32_t seed)
+{
+	double fx = floor(x), fy = floor(y), fz = floor(z);
+	int64_t ix = (int64_t)fx, iy = (int64_t)fy, iz = (int64_t)fz;
+	double tx = x - fx, ty = y - fy, tz = z - fz;
+	tx = tx * tx * (3.0 - 2.0 * tx);
+	ty = ty * ty * (3.0 - 2.0 * ty);
+	tz = tz * tz * (3.0 - 2.0 * tz);
+	double c[2][2];
+	for (int dy = 0; dy < 2; dy++)
+		for (int dz = 0; dz < 2; dz++)
+		{
+			double c0 = terrainRandom(ix, iy + dy, iz + dz, seed), c1 = terrainRandom(ix + 1, iy + dy, iz + dz, seed);
+			c[dy][dz] = c0 + (c1 - c0) * tx;
+		}
+	double c0 = c[0][0] + (c[0][1] - c[0][0]) * tz, c1 = c[1][0] + (c[1][1] - c[1][0]) * tz;
+	return c0 + (c1 - c0) * ty;
+}
+
+// 2D value noise with several octaves (each one twice the frequency and half the amplitude of the last),
+//  scaled back into [0,1)
+double fractalNoise(double x, double z, int octaves, uint32_t seed)
+{
+	double sum = 0.0, amp = 1.0, norm = 0.0;
+	for (int i = 0; i < octaves; i++)
 	{
-		chunktable.setRequired(ci);
-		reqchunkcount++;
-		vector<TileIdx> tiles = ci.getTiles(mp);
-		for (vector<TileIdx>::const_iterator tile = tiles.begin(); tile != tiles.end(); tile++)
+		sum += valueNoise(x, 0.0, z, seed + i) * amp;
+		norm += amp;
+		amp *= 0.5;
+		x *= 2.0;
+		z *= 2.0;
+	}
+	return sum / norm;
+}
+
+#define SEALEVEL 62
+
+// the blocks of a chunk being generated, indexed like the Anvil sections (YZX)
+struct SyntheticChunk
+{
+	ChunkIdx ci;
+	std::vector<uint8_t> ids, data;  // (the data values are one per byte here, and only packed into nibbles on output)
+	uint8_t biome;
+
+	SyntheticChunk(const ChunkIdx& c) : ci(c), ids(65536, 0), data(65536, 0), biome(1) {}
+
+	static int index(int x, int y, int z) {return (y * 16 + z) * 16 + x;}
+	void set(int x, int y, int z, uint8_t id, uint8_t d = 0)
+	{
+		if (x >= 0 && x < 16 && z >= 0 && z < 16 && y >= 0 && y < 256)
 		{
-			tiletable.setRequired(*tile);
-			while (findBaseZoom && !tile->valid(mp))
-				mp.baseZoom++;
+			ids[index(x, y, z)] = id;
+			data[index(x, y, z)] = d;
 		}
 	}
-	for (ci.x = -irad, ci.z = -irad; ci.z < irad; ci.x++, ci.z++)
+	uint8_t get(int x, int y, int z) const {return ids[index(x, y, z)];}
+
+	// world coords of a block in the chunk
+	int64_t wx(int x) const {return ci.x * 16 + x;}
+	int64_t wz(int z) const {return ci.z * 16 + z;}
+
+	// fill a column with bedrock and stone, then depth blocks of "under", then "top" at the given height
+	void fillColumn(int x, int z, int height, uint8_t top, uint8_t under, int depth)
 	{
-		chunktable.setRequired(ci);
-		reqchunkcount++;
-		vector<TileIdx> tiles = ci.getTiles(mp);
-		for (vector<TileIdx>::const_iterator tile = tiles.begin(); tile != tiles.end(); tile++)
+		set(x, 0, z, 7);
+		for (int y = 1; y < height; y++)
+			set(x, y, z, (y < height - depth) ? 1 : under);
+		set(x, height, z, top);
+	}
+
+	// fill a column with water from just above the given height up to sea level
+	void fillWater(int x, int z, int height)
+	{
+		for (int y = height + 1; y <= SEALEVEL; y++)
+			set(x, y, z, 9);
+	}
+
+	// a tree with its trunk starting at y; the leaves are cut off at the chunk edges
+	void plantTree(int x, int y, int z, int trunk, uint8_t wood)
+	{
+		for (int dy = trunk - 3; dy <= trunk; dy++)
 		{
-			tiletable.setRequired(*tile);
-			while (findBaseZoom && !tile->valid(mp))
-				mp.baseZoom++;
+			int r = (dy < trunk - 1) ? 2 : 1;
+			for (int dx = -r; dx <= r; dx++)
+				for (int dz = -r; dz <= r; dz++)
+					if ((abs(dx) != r || abs(dz) != r || r == 1) && x + dx >= 0 && x + dx < 16 && z + dz >= 0 && z + dz < 16)
+						set(x + dx, y + dy, z + dz, 18, wood);
 		}
+		for (int dy = 0; dy < trunk; dy++)
+			set(x, y + dy, z, 17, wood);
 	}
-	for (ci.x = irad, ci.z = -irad; ci.z < irad; ci.x--, ci.z++)
+};
+
+// grassland at a fixed height, with the odd flower
+void generateFlat(SyntheticChunk& sc)
+{
+	for (int x = 0; x < 16; x++)
+		for (int z = 0; z < 16; z++)
+		{
+			sc.fillColumn(x, z, 60, 2, 3, 3);
+			double r = terrainRandom(sc.wx(x), 0, sc.wz(z), 1);
+			if (r < 0.08)
+				sc.set(x, 61, z, 31, 1);
+			else if (r < 0.10)
+				sc.set(x, 61, z, (r < 0.09) ? 37 : 38);
+		}
+}
+
+// mostly deep water over sand and gravel, with a few wooded islands
+void generateOcean(SyntheticChunk& sc)
+{
+	sc.biome = 0;
+	for (int x = 0; x < 16; x++)
+		for (int z = 0; z < 16; z++)
+		{
+			double n = fractalNoise(sc.wx(x) / 96.0, sc.wz(z) / 96.0, 4, 10);
+			int h = 20 + (int)(n * n * 80.0);
+			if (h < SEALEVEL - 1)
+			{
+				double bed = valueNoise(sc.wx(x) / 12.0, 0.0, sc.wz(z) / 12.0, 11);
+				uint8_t floor = (bed < 0.3) ? 13 : ((bed > 0.8) ? 82 : 12);
+				sc.fillColumn(x, z, h, floor, floor, 3);
+				sc.fillWater(x, z, h);
+			}
+			else if (h <= SEALEVEL + 1)
+			{
+				sc.fillColumn(x, z, h, 12, 12, 4);
+				sc.fillWater(x, z, h);
+			}
+			else
+			{
+				sc.fillColumn(x, z, h, 2, 3, 3);
+				if (x >= 2 && x < 14 && z >= 2 && z < 14 && terrainRandom(sc.wx(x), h, sc.wz(z), 12) < 0.03)
+					sc.plantTree(x, h + 1, z, 5, 0);
+			}
+		}
+}
+
+// high, steep peaks with bare stone and snow on top, and forests and lakes down in the valleys
+void generateMountains(SyntheticChunk& sc)
+{
+	sc.biome = 3;
+	for (int x = 0; x < 16; x++)
+		for (int z = 0; z < 16; z++)
+		{
+			double n = fractalNoise(sc.wx(x) / 128.0, sc.wz(z) / 128.0, 5, 20);
+			double ridge = 1.0 - fabs(fractalNoise(sc.wx(x) / 48.0, sc.wz(z) / 48.0, 3, 21) * 2.0 - 1.0);
+			int h = min(50 + (int)(n * n * 170.0 + ridge * ridge * 40.0), 250);
+			if (h > 165)
+			{
+				sc.fillColumn(x, z, h, 80, 1, 1);
+				sc.set(x, h + 1, z, 78);
+			}
+			else if (h > 120)
+				sc.fillColumn(x, z, h, (terrainRandom(sc.wx(x), h, sc.wz(z), 22) < 0.2) ? 13 : 1, 1, 1);
+			else if (h < SEALEVEL)
+			{
+				sc.fillColumn(x, z, h, 12, 3, 3);
+				sc.fillWater(x, z, h);
+			}
+			else
+			{
+				sc.fillColumn(x, z, h, 2, 3, 3);
+				if (h < 100 && x >= 2 && x < 14 && z >= 2 && z < 14 && terrainRandom(sc.wx(x), h, sc.wz(z), 23) < 0.04)
+					sc.plantTree(x, h + 1, z, 6, 1);
+			}
+		}
+}
+
+// rolling hills riddled with tunnels and caverns (lava at the bottom), ore, and gravel pockets
+void generateCaves(SyntheticChunk& sc)
+{
+	for (int x = 0; x < 16; x++)
+		for (int z = 0; z < 16; z++)
+		{
+			int64_t wx = sc.wx(x), wz = sc.wz(z);
+			int h = 60 + (int)(fractalNoise(wx / 48.0, wz / 48.0, 4, 30) * 24.0);
+			sc.fillColumn(x, z, h, 2, 3, 4);
+			for (int y = 1; y < 5; y++)
+				if (terrainRandom(wx, y, wz, 31) < 0.5)
+					sc.set(x, y, z, 7);
+			for (int y = 5; y < h - 4; y++)
+			{
+				double r = terrainRandom(wx, y, wz, 32);
+				if (r < 0.012)
+					sc.set(x, y, z, 16);
+				else if (r < 0.018 && y < 64)
+					sc.set(x, y, z, 15);
+				else if (r < 0.0205 && y < 32)
+					sc.set(x, y, z, 14);
+				else if (r < 0.024 && y < 16)
+					sc.set(x, y, z, 73);
+				else if (r < 0.0255 && y < 16)
+					sc.set(x, y, z, 56);
+				else if (valueNoise(wx / 6.0, y / 6.0, wz / 6.0, 33) > 0.82)
+					sc.set(x, y, z, 13);
+			}
+			// tunnels follow the places where two noise fields both cross 0.5; caverns are where a third
+			//  one is high; both are allowed to break through the surface now and then
+			for (int y = 5; y <= h; y++)
+			{
+				double a = valueNoise(wx / 20.0, y / 12.0, wz / 20.0, 34), b = valueNoise(wx / 20.0, y / 12.0, wz / 20.0, 35);
+				bool tunnel = fabs(a - 0.5) < 0.05 && fabs(b - 0.5) < 0.05;
+				if (tunnel || valueNoise(wx / 32.0, y / 16.0, wz / 32.0, 36) > 0.78)
+					sc.set(x, y, z, (y < 11) ? 11 : 0);
+			}
+		}
+}
+
+// a house in the middle of a lot
+void buildHouse(SyntheticChunk& sc, uint32_t h)
+{
+	const uint8_t walls[] = {4, 5, 45, 98};
+	uint8_t wall = walls[h % 4], walldata = (wall == 5) ? (h >> 2) % 4 : 0;
+	int x0 = 4, x1 = 11, z0 = 4, z1 = 11, wh = 3 + (h >> 4) % 3;
+	for (int x = x0; x <= x1; x++)
+		for (int z = z0; z <= z1; z++)
+		{
+			sc.set(x, 63, z, 5, walldata);
+			bool edgex = x == x0 || x == x1, edgez = z == z0 || z == z1;
+			for (int y = 64; y < 64 + wh && (edgex || edgez); y++)
+			{
+				if (edgex && edgez)
+					sc.set(x, y, z, 17);
+				else if (y == 65 && (x + z) % 3 == 0)
+					sc.set(x, y, z, 102);
+				else
+					sc.set(x, y, z, wall, walldata);
+			}
+		}
+	// the roof: stairs around the edge, planks and then slabs on top
+	int ry = 64 + wh;
+	for (int x = x0 - 1; x <= x1 + 1; x++)
+		for (int z = z0 - 1; z <= z1 + 1; z++)
+		{
+			if (x == x0 - 1)
+				sc.set(x, ry, z, 53, 0);
+			else if (x == x1 + 1)
+				sc.set(x, ry, z, 53, 1);
+			else if (z == z0 - 1)
+				sc.set(x, ry, z, 53, 2);
+			else if (z == z1 + 1)
+				sc.set(x, ry, z, 53, 3);
+			else
+			{
+				sc.set(x, ry, z, 5, walldata);
+				if (x > x0 && x < x1 && z > z0 && z < z1)
+					sc.set(x, ry + 1, z, 44, 2);
+			}
+		}
+	// the door, and the furniture
+	int dx = (x0 + x1) / 2;
+	sc.set(dx, 64, z0, 64, 1);
+	sc.set(dx, 65, z0, 64, 8);
+	sc.set(x0 + 1, 64, z1 - 1, 54, 2);
+	sc.set(x0 + 2, 64, z1 - 1, 54, 2);
+	sc.set(x1 - 1, 64, z1 - 1, 58);
+	sc.set(x1 - 1, 64, z1 - 2, 61, 4);
+	for (int z = z0 + 2; z < z1 - 2; z++)
+		for (int y = 64; y < 64 + min(wh, 3); y++)
+			sc.set(x0 + 1, y, z, 47);
+	sc.set(x1 - 1, 64, z0 + 1, 50, 5);
+	// a pool and some wheat in the yard
+	for (int x = 13; x <= 14; x++)
+		for (int z = 12; z <= 14; z++)
+			sc.set(x, 63, z, 9);
+	for (int z = 4; z <= 10; z++)
 	{
-		chunktable.setRequired(ci);
-		reqchunkcount++;
-		vector<TileIdx> tiles = ci.getTiles(mp);
-		for (vector<TileIdx>::const_iterator tile = tiles.begin(); tile != tiles.end(); tile++)
+		sc.set(13, 63, z, 60, 7);
+		sc.set(13, 64, z, 59, terrainHash(sc.ci.x, z, sc.ci.z, 41) % 8);
+		sc.set(14, 63, z, 9);
+	}
+}
+
+// rows of wheat with irrigation ditches between them
+void buildFarm(SyntheticChunk& sc)
+{
+	for (int x = 3; x <= 14; x++)
+		for (int z = 3; z <= 14; z++)
 		{
-			tiletable.setRequired(*tile);
-			while (findBaseZoom && !tile->valid(mp))
-				mp.baseZoom++;
+			if (x % 4 == 0)
+				sc.set(x, 63, z, 9);
+			else
+			{
+				sc.set(x, 63, z, 60, 7);
+				sc.set(x, 64, z, 59, terrainHash(sc.wx(x), 64, sc.wz(z), 42) % 8);
+			}
+		}
+}
+
+// a paved square with a fountain and lamp posts
+void buildPlaza(SyntheticChunk& sc)
+{
+	for (int x = 3; x <= 14; x++)
+		for (int z = 3; z <= 14; z++)
+		{
+			sc.set(x, 63, z, (x + z) % 2 ? 98 : 4);
+			bool rim = (x == 6 || x == 11) || (z == 6 || z == 11);
+			if (x >= 6 && x <= 11 && z >= 6 && z <= 11)
+				sc.set(x, 64, z, rim ? 98 : 9);
 		}
+	for (int y = 64; y <= 66; y++)
+		for (int x = 8; x <= 9; x++)
+			for (int z = 8; z <= 9; z++)
+				sc.set(x, y, z, 98);
+	for (int x = 8; x <= 9; x++)
+		for (int z = 8; z <= 9; z++)
+			sc.set(x, 67, z, 9);
+	for (int i = 0; i < 4; i++)
+	{
+		int x = (i & 1) ? 13 : 4, z = (i & 2) ? 13 : 4;
+		for (int y = 64; y <= 66; y++)
+			sc.set(x, y, z, 85);
+		sc.set(x, 67, z, 89);
 	}
-	reqtilecount = tiletable.reqcount;
-	if (findBaseZoom)
-		cout << "baseZoom set to " << mp.baseZoom << endl;
+	sc.set(4, 64, 8, 54, 5);
+}
+
+// a tall stone tower, with windows and a ladder inside
+void buildTower(SyntheticChunk& sc, uint32_t h)
+{
+	int top = 80 + (h >> 8) % 24;
+	for (int x = 5; x <= 10; x++)
+		for (int z = 5; z <= 10; z++)
+		{
+			sc.set(x, 63, z, 98);
+			bool edge = x == 5 || x == 10 || z == 5 || z == 10;
+			for (int y = 64; y < top && edge; y++)
+			{
+				bool window = (y % 4 == 2) && (x == 7 || x == 8 || z == 7 || z == 8);
+				sc.set(x, y, z, window ? ((y % 8 == 2) ? 20 : 101) : 98);
+			}
+			if (edge && (x + z) % 2 == 0)
+				sc.set(x, top, z, 98);
+			if (!edge)
+				sc.set(x, top - 1, z, 5);
+		}
+	for (int y = 64; y < top - 1; y++)
+		sc.set(6, y, 6, 65, 3);
+	sc.set(6, top - 1, 6, 0);
+}
+
+// a town: roads along the chunk edges, and each chunk a fenced-in lot holding a house, a farm, a plaza, or
+//  a tower (mostly houses)
+void generateBuilds(SyntheticChunk& sc)
+{
+	for (int x = 0; x < 16; x++)
+		for (int z = 0; z < 16; z++)
+			sc.fillColumn(x, z, 63, (x < 2 || z < 2) ? 13 : 2, 3, 3);
+	uint32_t h = terrainHash(sc.ci.x, 0, sc.ci.z, 40);
+	double r = (double)(h >> 16) / 65536.0;
+	if (r < 0.65)
+		buildHouse(sc, h);
+	else if (r < 0.8)
+		buildFarm(sc);
+	else if (r < 0.9)
+		buildPlaza(sc);
+	else
+		buildTower(sc, h);
+	// the fence around the lot, with a gate facing the road and torches on the corners
+	for (int i = 2; i < 16; i++)
+	{
+		sc.set(i, 64, 2, (i == 7 || i == 8) ? 107 : 85);
+		sc.set(i, 64, 15, 85);
+		sc.set(2, 64, i, 85);
+		sc.set(15, 64, i, 85);
+	}
+	sc.set(2, 65, 2, 50, 5);
+	sc.set(15, 65, 2, 50, 5);
+	sc.set(2, 65, 15, 50, 5);
+	sc.set(15, 65, 15, 50, 5);
+}
+
+// just enough of an NBT writer for the chunks we generate
+struct NBTWriter
+{
+	std::vector<uint8_t>& out;
+
+	NBTWriter(std::vector<uint8_t>& o) : out(o) {}
+
+	void writeByte(uint8_t b) {out.push_back(b);}
+	void writeShort(uint16_t s) {writeByte(s >> 8); writeByte(s & 0xff);}
+	void writeInt(uint32_t i) {writeShort(i >> 16); writeShort(i & 0xffff);}
+	void writeName(uint8_t type, const char *name)
+	{
+		writeByte(type);
+		uint16_t len = strlen(name);
+		writeShort(len);
+		out.insert(out.end(), name, name + len);
+	}
+
+	void tagByte(const char *name, uint8_t b) {writeName(1, name); writeByte(b);}
+	void tagInt(const char *name, int32_t i) {writeName(3, name); writeInt(i);}
+	void tagLong(const char *name, int64_t l) {writeName(4, name); writeInt((uint64_t)l >> 32); writeInt(l & 0xffffffff);}
+	void tagByteArray(const char *name, const uint8_t *data, uint32_t len) {writeName(7, name); writeInt(len); out.insert(out.end(), data, data + len);}
+	void tagIntArray(const char *name, const int32_t *data, uint32_t len) {writeName(11, name); writeInt(len); for (uint32_t i = 0; i < len; i++) writeInt(data[i]);}
+	void beginCompound(const char *name) {writeName(10, name);}
+	void beginList(const char *name, uint8_t type, uint32_t len) {writeName(9, name); writeByte(type); writeInt(len);}
+	// ends a compound tag, or one of the compounds on a list
+	void end() {writeByte(0);}
+};
+
+// write a chunk out the way Minecraft would: the "Level" compound holding the coords, the heightmap and biomes,
+//  and the non-empty sections, with their block IDs, data, and (made-up) lighting
+void writeChunkNBT(const SyntheticChunk& sc, std::vector<uint8_t>& out)
+{
+	NBTWriter nbt(out);
+	nbt.beginCompound("");
+	nbt.beginCompound("Level");
+	nbt.tagInt("xPos", sc.ci.x);
+	nbt.tagInt("zPos", sc.ci.z);
+	nbt.tagLong("LastUpdate", 0);
+	nbt.tagByte("TerrainPopulated", 1);
+	std::vector<int32_t> heights(256, 0);
+	std::vector<uint8_t> biomes(256, sc.biome);
+	for (int x = 0; x < 16; x++)
+		for (int z = 0; z < 16; z++)
+			for (int y = 255; y >= 0 && heights[z * 16 + x] == 0; y--)
+				if (sc.get(x, y, z) != 0)
+					heights[z * 16 + x] = y + 1;
+	nbt.tagIntArray("HeightMap", &heights[0], 256);
+	nbt.tagByteArray("Biomes", &biomes[0], 256);
+
+	int nsections = 0;
+	bool used[16];
+	for (int s = 0; s < 16; s++)
+	{
+		used[s] = false;
+		for (int i = s * 4096; i < (s + 1) * 4096 && !used[s]; i++)
+			used[s] = sc.ids[i] != 0;
+		if (used[s])
+			nsections++;
+	}
+	std::vector<uint8_t> nibbles(2048), blocklight(2048, 0), skylight(2048, 0xff);
+	nbt.beginList("Sections", 10, nsections);
+	for (int s = 0; s < 16; s++)
+	{
+		if (!used[s])
+			continue;
+		for (int i = 0; i < 2048; i++)
+			nibbles[i] = sc.data[s * 4096 + i * 2] | (sc.data[s * 4096 + i * 2 + 1] << 4);
+		nbt.tagByte("Y", s);
+		nbt.tagByteArray("Blocks", &sc.ids[s * 4096], 4096);
+		nbt.tagByteArray("Data", &nibbles[0], 2048);
+		nbt.tagByteArray("BlockLight", &blocklight[0], 2048);
+		nbt.tagByteArray("SkyLight", &skylight[0], 2048);
+		nbt.end();
+	}
+	nbt.beginList("Entities", 0, 0);
+	nbt.beginList("TileEntities", 0, 0);
+	nbt.end();
+	nbt.end();
+}
+
+// generate and write out one region file, given the chunks in it; returns the size of the file, or -1 on error
+int64_t writeSyntheticRegion(const RegionIdx& ri, const std::vector<ChunkIdx>& chunks, const TerrainProfile& profile, const string& regiondir)
+{
+	// the header: a sector of chunk offsets and sizes, then a sector of timestamps (all big-endian)
+	std::vector<uint8_t> file(8192, 0), nbt, compressed;
+	for (std::vector<ChunkIdx>::const_iterator ci = chunks.begin(); ci != chunks.end(); ci++)
+	{
+		SyntheticChunk sc(*ci);
+		switch (profile.type)
+		{
+			case TerrainProfile::FLAT: generateFlat(sc); break;
+			case TerrainProfile::OCEAN: generateOcean(sc); break;
+			case TerrainProfile::MOUNTAINS: generateMountains(sc); break;
+			case TerrainProfile::CAVES: generateCaves(sc); break;
+			case TerrainProfile::BUILDS: generateBuilds(sc); break;
+		}
+		nbt.clear();
+		writeChunkNBT(sc, nbt);
+		uLongf complen = compressBound(nbt.size());
+		compressed.resize(complen);
+		if (Z_OK != compress2(&compressed[0], &complen, &nbt[0], nbt.size(), Z_DEFAULT_COMPRESSION))
+			return -1;
+
+		// each chunk is its length, a version byte (2 for zlib), and the compressed data, padded out to
+		//  a whole number of sectors
+		uint32_t sector = file.size() / 4096, length = complen + 1, nsectors = (length + 4 + 4095) / 4096;
+		if (nsectors > 255)
+			return -1;
+		int idx = RegionFileReader::getIdx(ChunkOffset(*ci));
+		uint32_t loc = (sector << 8) | nsectors, timestamp = 1300000000;
+		for (int i = 0; i < 4; i++)
+		{
+			file[idx * 4 + i] = (loc >> (24 - i * 8)) & 0xff;
+			file[4096 + idx * 4 + i] = (timestamp >> (24 - i * 8)) & 0xff;
+		}
+		for (int i = 0; i < 4; i++)
+			file.push_back((length >> (24 - i * 8)) & 0xff);
+		file.push_back(2);
+		file.insert(file.end(), compressed.begin(), compressed.begin() + complen);
+		file.resize((sector + nsectors) * 4096, 0);
+	}
+
+	ofstream outfile((regiondir + "/" + ri.toAnvilFileName()).c_str(), ios::out | ios::binary);
+	outfile.write((const char*)&file[0], file.size());
+	if (!outfile.good())
+		return -1;
+	return file.size();
+}
+
+bool makeSyntheticWorld(const string& outputdir, int size, const TerrainProfile& profile, int64_t& worldbytes)
+{
+	// don't clobber a real world: the region directory must be new, or left over from an earlier synthetic world
+	string regiondir = outputdir + "/region", marker = outputdir + "/pigmap.synthetic";
+	if (dirExists(regiondir))
+	{
+		ifstream infile(marker.c_str());
+		if (infile.fail())
+		{
+			cerr << outputdir << " already holds a world that pigmap didn't generate; won't overwrite it" << endl;
+			return false;
+		}
+		vector<string> oldregions;
+		listEntries(regiondir, oldregions);
+		for (vector<string>::const_iterator it = oldregions.begin(); it != oldregions.end(); it++)
+			remove(it->c_str());
+	}
+	makePath(regiondir);
+	ofstream markerfile(marker.c_str());
+	markerfile << profile.toString() << " " << size << endl;
+	if (!markerfile.good())
+	{
+		cerr << "can't write " << marker << endl;
+		return false;
+	}
+
+	// use the same chunks as the test world, sorted out by region
+	vector<ChunkIdx> chunks;
+	getTestWorldChunks(size, chunks);
+	map<pair<int64_t, int64_t>, set<pair<int64_t, int64_t> > > regions;
+	for (vector<ChunkIdx>::const_iterator ci = chunks.begin(); ci != chunks.end(); ci++)
+	{
+		RegionIdx ri = ci->getRegionIdx();
+		regions[make_pair(ri.x, ri.z)].insert(make_pair(ci->x, ci->z));
+	}
+
+	worldbytes = 0;
+	int64_t chunkcount = 0;
+	for (map<pair<int64_t, int64_t>, set<pair<int64_t, int64_t> > >::const_iterator it = regions.begin(); it != regions.end(); it++)
+	{
+		vector<ChunkIdx> regionchunks;
+		for (set<pair<int64_t, int64_t> >::const_iterator cit = it->second.begin(); cit != it->second.end(); cit++)
+			regionchunks.push_back(ChunkIdx(cit->first, cit->second));
+		RegionIdx ri(it->first.first, it->first.second);
+		int64_t bytes = writeSyntheticRegion(ri, regionchunks, profile, regiondir);
+		if (bytes < 0)
+		{
+			cerr << "failed to write region " << ri.toAnvilFileName() << endl;
+			return false;
+		}
+		worldbytes += bytes;
+		chunkcount += regionchunks.size();
+	}
+	cout << "generated " << profile.toString() << " world: " << chunkcount << " chunks in " << regions.size() << " regions   "
+	     << worldbytes / 1048576 << " MB" << endl;
+	return true;
 }
 
 
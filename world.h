@@ -23,6 +23,8 @@
 #include "map.h"
 #include "tables.h"
 
+struct ChunkIndex;
+struct RegionSnapshots;
 
 // see whether the input world is in region format
 bool detectRegionFormat(const std::string& inputdir);
@@ -33,16 +35,23 @@ bool detectRegionFormat(const std::string& inputdir);
 // returns false if the world is too big to fit in one of the tables
 // if mp.baseZoom is set to -1 coming in, then this function will set it to the smallest zoom
 //  that can fit everything
-bool makeAllRegionsRequired(const std::string& inputdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int64_t& reqregioncount);
+// if chunkindex is non-NULL, the state of every chunk is recorded in it (which means reading all the region
+//  files, not just their headers); if snapshots is also non-NULL, a copy of every region is staged there
+bool makeAllRegionsRequired(const std::string& inputdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int64_t& reqregioncount, ChunkIndex *chunkindex, RegionSnapshots *snapshots);
 
 // read a list of region filenames from a file; set the regions to required in the RegionTable; set the chunks they
 //  contain to required in the ChunkTable; set all tiles touched by those chunks to required in the TileTable
 // the region filenames can be either old-style (".mcr") or Anvil (".mca"), but only the coordinates from the filename
 //  will be considered--when rendering is actually performed, Anvil regions will be preferred to old-style regions
 //  even if ".mcr" was used in this regionlist
+// if chunkindex is non-NULL, it's updated with the current state of the listed regions, and only chunks
+//  that differ from what it had recorded are set to required (regions with no changed chunks are ignored)
+// if snapshots is also non-NULL, each region with changed chunks is staged there, and the changed chunks
+//  are compared block by block with the old snapshot (when there is one), so that only the tiles touched
+//  by the changed blocks and their neighbors are set to required
 // returns 0 on success, -1 if baseZoom is too small, -2 for other errors (can't read regionlist, world too big
 //  for our internal data structures, etc.)
-int readRegionlist(const std::string& regionlist, const std::string& inputdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, const MapParams& mp, int64_t& reqrchunkcount, int64_t& reqtilecount, int64_t& reqregioncount);
+int readRegionlist(const std::string& regionlist, const std::string& inputdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, const MapParams& mp, int64_t& reqrchunkcount, int64_t& reqtilecount, int64_t& reqregioncount, ChunkIndex *chunkindex, RegionSnapshots *snapshots);
 
 
 // find all chunks on disk, set them to required in the ChunkTable, and set all tiles they
@@ -65,6 +74,32 @@ int readChunklist(const std::string& chunklist, ChunkTable& chunktable, TileTabl
 // if mp.baseZoom is set to -1 coming in, it will be set to the smallest zoom that can fit everything
 void makeTestWorld(int size, ChunkTable& chunktable, TileTable& tiletable, MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount);
 
+// get the chunks of a test world of approximately size chunks: a solid square in the middle, and some rings
+//  and spokes around it (some chunks are listed more than once, where the rings and spokes cross)
+void getTestWorldChunks(int size, std::vector<ChunkIdx>& chunks);
+
+// the kinds of terrain makeSyntheticWorld can fill a world with
+struct TerrainProfile
+{
+	enum Type {FLAT, OCEAN, MOUNTAINS, CAVES, BUILDS};
+	Type type;
+
+	TerrainProfile() : type(FLAT) {}
+
+	// parse a profile name ("flat", "ocean", "mountains", "caves", "builds"); returns false if the name isn't
+	//  recognized
+	bool fromString(const std::string& s);
+	std::string toString() const;
+};
+
+// write a world of Anvil region files into outputdir, with the same chunks as the test world of the given size,
+//  but real terrain in them (generated the same way every time, so renders of it can be compared); it's small
+//  enough to carry around as a command line, and exercises the whole render
+// ...refuses to touch outputdir if it already holds a world that wasn't made this way (there's a
+//  "pigmap.synthetic" file to mark the ones that were); otherwise, any old region files are replaced
+// returns false on error; worldbytes is set to the total size of the region files
+bool makeSyntheticWorld(const std::string& outputdir, int size, const TerrainProfile& profile, int64_t& worldbytes);
+
 // get the filepaths of all chunks on disk (used only for testing)
 void findAllChunks(const std::string& inputdir, std::vector<std::string>& chunkpaths);
 